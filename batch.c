@@ -0,0 +1,460 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    batch.c
+*/
+
+
+#include <string.h>
+
+
+#include "batch.h"
+
+
+#if defined(__GNUC__)
+// a block of lanes of one register in host vector registers (GCC vector 
+// extensions), floats take two vectors per block
+typedef uint16_t lanes_t __attribute__((vector_size(BATCH_BLOCK * sizeof(uint16_t))));
+typedef int16_t hmask_t __attribute__((vector_size(BATCH_BLOCK / 2 * sizeof(uint16_t))));
+typedef float flanes_t __attribute__((vector_size(BATCH_BLOCK / 2 * sizeof(float))));
+typedef int32_t fmask_t __attribute__((vector_size(BATCH_BLOCK / 2 * sizeof(float))));
+#define BATCH_SIMD 1
+#else
+#define BATCH_SIMD 0
+#endif
+
+// lockstep kernels built for AVX2 and the baseline, chosen at load time
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__) && !defined(__clang__)
+#define BATCH_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define BATCH_CLONES
+#endif
+
+
+// Allocates a zeroed array of lane values aligned to a host vector.
+void* batch_alloc(size_t size) {
+    size = (size + 63) & ~(size_t) 63;
+    void *p = aligned_alloc(64, size);
+    if (p) {
+        memset(p, 0, size);
+    }
+    return p;
+}
+
+
+// Allocates a batch of lanes running a program encoded with a decode table, 
+// each lane on its own system memory (the read only block of the first one is
+// decoded for all of them). The lanes start reset.
+batch_t* batch_init(const instr_table_t *itab, sysmem_t **smem, uint16_t n) {
+    if (n == 0) {
+        return NULL;
+    }
+    batch_t *b = calloc(1, sizeof(batch_t));
+    if (!b) {
+        return NULL;
+    }
+    b->n = n;
+    b->stride = (uint16_t) ((n + BATCH_BLOCK - 1) / BATCH_BLOCK * BATCH_BLOCK);
+    b->iregs = batch_alloc(sizeof(uint16_t) * 8 * b->stride);
+    b->fregs = batch_alloc(sizeof(float) * 5 * b->stride);
+    b->rcmp = batch_alloc(sizeof(uint16_t) * b->stride);
+    b->stc = batch_alloc(sizeof(uint16_t) * b->stride);
+    b->fault_pc = batch_alloc(sizeof(uint16_t) * b->stride);
+    b->smem = malloc(sizeof(sysmem_t*) * n);
+    b->icache = icache_build(itab, smem[0], 0);
+    b->core = core_init(0, smem[0]);
+    if (!b->iregs || !b->fregs || !b->rcmp || !b->stc || !b->fault_pc || !b->smem || !b->icache || !b->core) {
+        batch_delete(b);
+        return NULL;
+    }
+    memcpy(b->smem, smem, sizeof(sysmem_t*) * n);
+    b->core->itab = itab;
+    b->core->icache = b->icache;
+    b->min_lanes = BATCH_MINLANES;
+    batch_reset(b);
+    return b;
+}
+
+
+// Frees a batch and its instruction cache (not the lane memories).
+void batch_delete(batch_t *b) {
+    if (b->icache) {
+        icache_delete(b->icache);
+    }
+    if (b->core) {
+        core_delete(b->core);
+    }
+    free(b->iregs);
+    free(b->fregs);
+    free(b->rcmp);
+    free(b->stc);
+    free(b->fault_pc);
+    free(b->smem);
+    free(b);
+}
+
+
+// Puts every lane back at the start of the read only block with cleared 
+// registers, an empty stack and no status.
+void batch_reset(batch_t *b) {
+    memset(b->iregs, 0, sizeof(uint16_t) * 8 * b->stride);
+    memset(b->fregs, 0, sizeof(float) * 5 * b->stride);
+    memset(b->fault_pc, 0, sizeof(uint16_t) * b->stride);
+    for (uint16_t l = 0; l < b->stride; l++) {
+        b->iregs[RSP * b->stride + l] = b->core->stack_base;
+        b->rcmp[l] = NA;
+        // padding lanes never run
+        b->stc[l] = l < b->n ? NO_ERR : ERR_HALT;
+    }
+}
+
+
+// Copy the state of a lane into a core (registers, status, fault_pc and 
+// memory).
+void batch_load_core(const batch_t *b, uint16_t lane, core_t *core) {
+    for (uint8_t r = 0; r < 8; r++) {
+        core->iregs[r] = b->iregs[r * b->stride + lane];
+    }
+    for (uint8_t r = 0; r < 5; r++) {
+        core->fregs[r] = b->fregs[r * b->stride + lane];
+    }
+    core->rcmp = (cmpres_t) b->rcmp[lane];
+    core->stc = (errcode_t) b->stc[lane];
+    core->fault_pc = b->fault_pc[lane];
+    core->smem = b->smem[lane];
+}
+
+
+// Copy the state of a core back into a lane.
+void batch_store_core(batch_t *b, uint16_t lane, const core_t *core) {
+    for (uint8_t r = 0; r < 8; r++) {
+        b->iregs[r * b->stride + lane] = core->iregs[r];
+    }
+    for (uint8_t r = 0; r < 5; r++) {
+        b->fregs[r * b->stride + lane] = core->fregs[r];
+    }
+    b->rcmp[lane] = core->rcmp;
+    b->stc[lane] = core->stc;
+    b->fault_pc[lane] = core->fault_pc;
+}
+
+
+// Execute an instruction one lane at a time for the lanes still running at pc.
+void batch_step_scalar(batch_t *b, uint16_t pc, const instr_t *in) {
+    for (uint16_t l = 0; l < b->n; l++) {
+        if (b->stc[l] == NO_ERR && b->iregs[RPC * b->stride + l] == pc) {
+            batch_load_core(b, l, b->core);
+            b->core->iregs[RPC] = in->next;
+            execute_instr(b->core, in);
+            if (b->core->stc != NO_ERR) {
+                b->core->fault_pc = pc;
+            }
+            batch_store_core(b, l, b->core);
+        }
+    }
+    b->n_scalar_steps++;
+}
+
+
+// Run the lanes still running at pc to completion one at a time (core_run 
+// leaves the address that stopped a lane in fault_pc).
+void batch_run_scalar(batch_t *b, uint16_t pc) {
+    for (uint16_t l = 0; l < b->n; l++) {
+        if (b->stc[l] == NO_ERR && b->iregs[RPC * b->stride + l] == pc) {
+            batch_load_core(b, l, b->core);
+            core_run(b->core);
+            batch_store_core(b, l, b->core);
+            b->n_scalar_runs++;
+        }
+    }
+}
+
+
+// Returns 1 if an instruction can execute in lockstep: the errors it may raise
+// depend on the lane (the rest raise the same error in every lane and go 
+// through the scalar handlers).
+uint8_t batch_lockstep_ok(const instr_t *in) {
+    switch (in->opcode) {
+        case NOOP:
+        case HALT:
+        case CMPI:
+            return 1;
+        case SETI:
+            return (CORE_WR_GP >> in->reg[0]) & 1;
+        case INCI:
+        case DECI:
+            return (CORE_WR_GPR >> in->reg[0]) & 1;
+        case MOVI:
+        case MEQI:
+        case MNEI:
+        case MGTI:
+        case MGEI:
+        case MLTI:
+        case MLEI:
+        case ADDI:
+        case SUBI:
+            return (CORE_WR_GPR >> in->reg[1]) & 1;
+        case LEAI:
+            return (in->reg[2] == 1 || in->reg[2] == 2 || in->reg[2] == 4) 
+                   && ((CORE_WR_GPR >> in->reg[3]) & 1);
+        case SETF:
+            return in->reg[0] <= FRV;
+        case MOVF:
+        case ADDF:
+        case SUBF:
+        case MULF:
+        case DIVF:
+            return in->reg[0] <= FRV && in->reg[1] <= FRV;
+        default:
+            return 0;
+    }
+}
+
+
+#if BATCH_SIMD
+// lanes where m is set get a, the others b
+#define SEL(m, a, b) (((a) & (m)) | ((b) & ~(m)))
+#define FSEL(m, a, b) ((flanes_t) SEL((m), (fmask_t) (a), (fmask_t) (b)))
+
+
+// the lane arrays are allocated aligned to whole blocks
+typedef lanes_t lanes_mem_t __attribute__((may_alias));
+typedef flanes_t flanes_mem_t __attribute__((may_alias));
+#define LANES(p) (*(lanes_mem_t*) (p))
+#define FLANES(p) (*(flanes_mem_t*) (p))
+
+
+// Returns 1 if any lane of a mask is set.
+static inline uint8_t lanes_any(const lanes_t *v) {
+    uint64_t w[sizeof(lanes_t) / 8];
+    memcpy(w, v, sizeof(lanes_t));
+    uint64_t x = 0;
+    for (size_t i = 0; i < sizeof(lanes_t) / 8; i++) {
+        x |= w[i];
+    }
+    return x != 0;
+}
+
+
+// Float register op over half h of a block: b = a op b, masked (the lanes of 
+// a float register are 32 bits wide, so a block of lanes takes two vectors).
+#define FLOAT_HALVES(STMT) \
+    for (uint8_t h = 0; h < 2; h++) { \
+        hmask_t mh; \
+        memcpy(&mh, (const uint8_t*) &m + h * sizeof(mh), sizeof(mh)); \
+        fmask_t fm = __builtin_convertvector(mh, fmask_t); \
+        float *pa = b->fregs + in->reg[0] * s + l + h * BATCH_BLOCK / 2; \
+        float *pb = b->fregs + in->reg[1] * s + l + h * BATCH_BLOCK / 2; \
+        flanes_t fa = FLANES(pa), fb = FLANES(pb), fr; \
+        STMT; \
+        FLANES(pb) = FSEL(fm, fr, fb); \
+    }
+
+
+// Execute an instruction in lockstep for the lanes still running at pc (see 
+// batch_lockstep_ok for the instructions that can).
+BATCH_CLONES void batch_step(batch_t *b, uint16_t pc, const instr_t *in) {
+    const uint16_t s = b->stride;
+    uint16_t *R = b->iregs;
+    for (uint32_t l = 0; l < s; l += BATCH_BLOCK) {
+        lanes_t stc = LANES(b->stc + l);
+        lanes_t rpc = LANES(R + RPC * s + l);
+        lanes_t m = (lanes_t) ((stc == 0) & (rpc == pc));
+        if (!lanes_any(&m)) {
+            continue;
+        }
+        // rpc already points at the next instruction while this one executes
+        LANES(R + RPC * s + l) = SEL(m, rpc - rpc + in->next, rpc);
+        lanes_t err = { 0 };
+        uint16_t *r0 = R + in->reg[0] * s + l;
+        uint16_t *r1 = R + in->reg[1] * s + l;
+        switch (in->opcode) {
+            case HALT:
+                err += ERR_HALT;
+                break;
+            case SETI: {
+                lanes_t d = LANES(r0);
+                LANES(r0) = SEL(m, d - d + in->imm.u, d);
+                break;
+            }
+            case MOVI: {
+                lanes_t a = LANES(r0), d = LANES(r1);
+                LANES(r1) = SEL(m, a, d);
+                break;
+            }
+            case CMPI: {
+                lanes_t a = LANES(r0), c = LANES(r1), res = { 0 };
+                res = SEL((lanes_t) (a == c), res + EQ, SEL((lanes_t) (a < c), res + LT, res + GT));
+                lanes_t rc = LANES(b->rcmp + l);
+                LANES(b->rcmp + l) = SEL(m, res, rc);
+                break;
+            }
+            case MEQI:
+            case MNEI:
+            case MGTI:
+            case MGEI:
+            case MLTI:
+            case MLEI: {
+                lanes_t rc = LANES(b->rcmp + l);
+                lanes_t eq = (lanes_t) (rc == EQ), gt = (lanes_t) (rc == GT), lt = (lanes_t) (rc == LT);
+                lanes_t cond = in->opcode == MEQI ? eq : in->opcode == MNEI ? (gt | lt) 
+                             : in->opcode == MGTI ? gt : in->opcode == MGEI ? (gt | eq)
+                             : in->opcode == MLTI ? lt : (lt | eq);
+                err = SEL((lanes_t) (rc == NA), err + ERR_RCMPNOTINIT, err);
+                lanes_t a = LANES(r0), d = LANES(r1);
+                LANES(r1) = SEL(m & cond, a, d);
+                LANES(b->rcmp + l) = SEL(m, rc - rc + NA, rc);
+                break;
+            }
+            case INCI: {
+                lanes_t d = LANES(r0);
+                LANES(r0) = SEL(m, d + 1, d);
+                break;
+            }
+            case DECI: {
+                lanes_t d = LANES(r0), z = (lanes_t) (d == 0);
+                err = SEL(z, err + ERR_DECRZERO, err);
+                LANES(r0) = SEL(m & ~z, d - 1, d);
+                break;
+            }
+            case ADDI: {
+                lanes_t a = LANES(r0), d = LANES(r1);
+                lanes_t sum = a + d, max = SEL((lanes_t) (a > d), a, d);
+                lanes_t of = (lanes_t) (sum < max);
+                err = SEL(of, err + ERR_IREGOVERFLOW, err);
+                LANES(r1) = SEL(m & ~of, sum, d);
+                break;
+            }
+            case SUBI: {
+                lanes_t a = LANES(r0), d = LANES(r1);
+                lanes_t diff = d - a, uf = (lanes_t) (diff > d);
+                err = SEL(uf, err + ERR_IREGUNDERFLOW, err);
+                LANES(r1) = SEL(m & ~uf, diff, d);
+                break;
+            }
+            case LEAI: {
+                uint16_t *r3 = R + in->reg[3] * s + l;
+                lanes_t base = LANES(r0), off = LANES(r1), d = LANES(r3);
+                LANES(r3) = SEL(m, base + (off << (in->reg[2] / 2)), d);
+                break;
+            }
+            case SETF:
+                for (uint8_t h = 0; h < 2; h++) {
+                    hmask_t mh;
+                    memcpy(&mh, (const uint8_t*) &m + h * sizeof(mh), sizeof(mh));
+                    fmask_t fm = __builtin_convertvector(mh, fmask_t);
+                    float *pd = b->fregs + in->reg[0] * s + l + h * BATCH_BLOCK / 2;
+                    flanes_t fd = FLANES(pd), fr;
+                    for (uint8_t i = 0; i < BATCH_BLOCK / 2; i++) {
+                        fr[i] = in->imm.f;
+                    }
+                    FLANES(pd) = FSEL(fm, fr, fd);
+                }
+                break;
+            case MOVF:
+                FLOAT_HALVES(fr = fa)
+                break;
+            case ADDF:
+                FLOAT_HALVES(fr = fa + fb)
+                break;
+            case SUBF:
+                FLOAT_HALVES(fr = fb - fa)
+                break;
+            case MULF:
+                FLOAT_HALVES(fr = fa * fb)
+                break;
+            case DIVF:
+                FLOAT_HALVES(fr = fb / fa)
+                break;
+            default:
+                break;
+        }
+        lanes_t fault = (lanes_t) ((err & m) != 0);
+        LANES(b->fault_pc + l) = SEL(fault, rpc - rpc + pc, LANES(b->fault_pc + l));
+        LANES(b->stc + l) = stc | (err & m);
+    }
+    b->n_steps++;
+}
+
+
+// Finds the lowest rpc of the lanes still running and the number of lanes at
+// it (0 if every lane has stopped).
+BATCH_CLONES uint32_t batch_next_pc(const batch_t *b, uint16_t *pc) {
+    const uint16_t s = b->stride;
+    lanes_t lo = { 0 }, live = { 0 };
+    lo -= 1;
+    for (uint32_t l = 0; l < s; l += BATCH_BLOCK) {
+        lanes_t m = (lanes_t) (LANES(b->stc + l) == 0);
+        lanes_t rpc = SEL(m, LANES(b->iregs + RPC * s + l), lo - lo - 1);
+        lo = SEL((lanes_t) (rpc < lo), rpc, lo);
+        live |= m;
+    }
+    if (!lanes_any(&live)) {
+        return 0;
+    }
+    uint16_t min = 0xFFFF;
+    for (uint8_t i = 0; i < BATCH_BLOCK; i++) {
+        min = lo[i] < min ? lo[i] : min;
+    }
+    lanes_t count = { 0 };
+    for (uint32_t l = 0; l < s; l += BATCH_BLOCK) {
+        lanes_t m = (lanes_t) ((LANES(b->stc + l) == 0) & (LANES(b->iregs + RPC * s + l) == min));
+        count -= m;
+    }
+    uint32_t n = 0;
+    for (uint8_t i = 0; i < BATCH_BLOCK; i++) {
+        n += count[i];
+    }
+    *pc = min;
+    return n;
+}
+#else
+// Without vector extensions every instruction takes the scalar path.
+void batch_step(batch_t *b, uint16_t pc, const instr_t *in) {
+    batch_step_scalar(b, pc, in);
+}
+
+
+uint32_t batch_next_pc(const batch_t *b, uint16_t *pc) {
+    uint32_t n = 0;
+    for (uint16_t l = 0; l < b->n; l++) {
+        uint16_t rpc = b->iregs[RPC * b->stride + l];
+        if (b->stc[l] != NO_ERR) {
+            continue;
+        }
+        if (n == 0 || rpc < *pc) {
+            *pc = rpc;
+            n = 1;
+        } else if (rpc == *pc) {
+            n++;
+        }
+    }
+    return n;
+}
+#endif
+
+
+// Runs every lane until it has set its status code.
+void batch_run(batch_t *b) {
+    uint16_t pc;
+    uint32_t n;
+    while ((n = batch_next_pc(b, &pc))) {
+        if (pc >= INSTR_ROMBITS || n < b->min_lanes) {
+            // left the read only block (core_run raises the error) or too few
+            // lanes left together to be worth a lockstep step
+            batch_run_scalar(b, pc);
+            continue;
+        }
+        instr_t in = b->icache->ops[icache_lookup(b->icache, pc)].in;
+        if (batch_lockstep_ok(&in)) {
+            batch_step(b, pc, &in);
+            b->n_lane_instrs += n;
+        } else {
+            batch_step_scalar(b, pc, &in);
+        }
+    }
+}
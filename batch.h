@@ -0,0 +1,97 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    batch.h
+*/
+
+
+#ifndef BATCH_H
+#define BATCH_H
+
+
+#include <stdlib.h>
+#include <stdint.h>
+
+
+#include "memory.h"
+#include "cpu.h"
+#include "icache.h"
+
+
+/*
+A batch runs the same program on many instances (lanes) at once, each with its
+own system memory (e.g. a different input in the read/write block) but the
+same read only block. The registers of all lanes are stored as arrays, one per
+register (structure of arrays), so one decoded instruction is applied to a 
+whole block of BATCH_BLOCK lanes with host vector instructions (AVX2 where 
+available).
+
+Lanes run in lockstep as long as they are at the same rpc. Once they diverge
+(a conditional move into rpc that only some lanes take) the batch always steps
+the lanes at the lowest rpc, masking out the others, so lanes that took a 
+branch forward wait for the rest and meet up with them again. Lanes that 
+raise an error (or halt) are masked out from then on.
+
+Register arithmetic, compares and conditional moves execute across the block.
+Everything that touches memory or the stack, and instructions that raise the 
+same error in every lane (e.g. a register that may not be written), execute
+one lane at a time through the scalar handlers. When fewer than min_lanes 
+lanes are left at the lowest rpc they are run to completion one at a time 
+with core_run instead. Every lane ends up in the same state a core running
+the program on its own would.
+*/
+#define BATCH_BLOCK     16      // lanes per host vector (16 x 16 bits = 256)
+#define BATCH_MINLANES  2       // default min_lanes
+
+
+// batch of lanes running the same program
+typedef struct batch {
+    uint16_t n;                 // number of lanes
+    uint16_t stride;            // n rounded up to whole blocks
+    uint16_t *iregs;            // iregs[reg * stride + lane]
+    float *fregs;               // fregs[reg * stride + lane]
+    uint16_t *rcmp;             // cmpres_t of each lane
+    uint16_t *stc;              // errcode_t of each lane (padding lanes halted)
+    uint16_t *fault_pc;         // bit address that set the stc of each lane
+    sysmem_t **smem;            // memory of each lane
+    icache_t *icache;           // decoded program, shared by every lane
+    core_t *core;               // scratch core for the scalar path
+    uint16_t min_lanes;         // fewer lanes than this at rpc run scalar
+    // statistics
+    uint64_t n_steps;           // instructions executed in lockstep
+    uint64_t n_lane_instrs;     // lane instructions executed in lockstep
+    uint64_t n_scalar_steps;    // instructions stepped one lane at a time
+    uint64_t n_scalar_runs;     // lanes run to completion on their own
+} batch_t;
+
+
+// Allocates a batch of lanes running a program encoded with a decode table, 
+// each lane on its own system memory (the read only block of the first one is
+// decoded for all of them). The lanes start reset.
+batch_t* batch_init(const instr_table_t*, sysmem_t**, uint16_t);
+
+
+// Frees a batch and its instruction cache (not the lane memories).
+void batch_delete(batch_t*);
+
+
+// Puts every lane back at the start of the read only block with cleared 
+// registers, an empty stack and no status.
+void batch_reset(batch_t*);
+
+
+// Runs every lane until it has set its status code.
+void batch_run(batch_t*);
+
+
+// Copy the state of a lane into a core (registers, status, fault_pc and 
+// memory) and back.
+void batch_load_core(const batch_t*, uint16_t, core_t*);
+void batch_store_core(batch_t*, uint16_t, const core_t*);
+
+
+#endif
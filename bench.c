@@ -0,0 +1,2137 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    bench.c
+*/
+
+
+#define _POSIX_C_SOURCE 200809L
+
+
+#include "cpu.h"
+#include "jit.h"
+#include "vm.h"
+#include "pool.h"
+#include "image.h"
+#include "batch.h"
+#include "stats.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// number of times each benchmark runs over its input
+#define BENCH_REPS 200
+
+
+// current time in nanoseconds
+double bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+// number of correctness checks that failed, the exit status of the run
+int bench_failures = 0;
+
+
+// Report a failed correctness check (printed with the results, counted for 
+// the exit status).
+void bench_fail(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    bench_failures++;
+}
+
+
+// Opcode mix used for the encoding benchmarks, roughly what our guest
+// programs execute: register moves, compares and integer arithmetic dominate
+// and halt/call/retn are rare.
+const uint64_t bench_profile[N_OPCODES] = {
+    [NOOP] = 2,  [HALT] = 1,  [RETN] = 40, [CALL] = 40,
+    [LODI] = 300, [LODF] = 120, [INCI] = 400, [DECI] = 250,
+    [SETF] = 60, [LEAI] = 150, [PSHI] = 80, [POPI] = 80,
+    [PSHF] = 20, [POPF] = 20, [SETI] = 500, [CMPI] = 900,
+    [STOI] = 200, [STOF] = 90, [MOVI] = 1200, [MOVF] = 150,
+    [MEQI] = 200, [MNEI] = 150, [ADDI] = 800, [SUBI] = 300,
+    [MGTI] = 150, [MGEI] = 100, [MLTI] = 200, [MLEI] = 100,
+    [ADDF] = 250, [SUBF] = 100, [MULF] = 250, [DIVF] = 40
+};
+
+
+// Pick an opcode at random, weighted by a profile (uniform if NULL).
+opcode_t bench_rand_opcode(const uint64_t *profile) {
+    if (!profile) {
+        return NOOP + rand() % (N_OPCODES - NOOP);
+    }
+    uint64_t total = 0;
+    for (opcode_t op = NOOP; op < N_OPCODES; op++) {
+        total += profile[op];
+    }
+    uint64_t x = (uint64_t) rand() % total;
+    opcode_t op = NOOP;
+    while (x >= profile[op]) {
+        x -= profile[op];
+        op++;
+    }
+    return op;
+}
+
+
+// Fill the read only block with randomly chosen opcodes (codes only, no 
+// operands), returns the number of opcodes written.
+uint16_t bench_fill_opcodes(sysmem_t *smem, instr_table_t *itab, const uint64_t *profile) {
+    uint16_t addr = 0, n = 0;
+    srand(16);
+    for (;;) {
+        opcode_t op = bench_rand_opcode(profile);
+        instr_code_t c = itab->code[op];
+        if (addr + c.len > MEMORY_RWBLKMIN * 8) {
+            break;
+        }
+        instr_put_bits(smem->mem, addr, c.bits, c.len);
+        addr += c.len;
+        n++;
+    }
+    return n;
+}
+
+
+// Decode the opcode stream by walking the instruction tree vs. with the table
+// driven decoder.
+void bench_decode(const char *name, instr_node_t *instr_tree, instr_table_t *itab, sysmem_t *smem, const uint64_t *profile) {
+    uint16_t n = bench_fill_opcodes(smem, itab, profile);
+    volatile uint32_t sink = 0;
+
+    // check that both decoders agree before timing anything
+    instr_reader_t r;
+    instr_reader_init(&r, smem->mem, 0);
+    for (uint16_t i = 0; i < n; i++) {
+        uint16_t addr = r.pos;
+        opcode_t op = instr_reader_opcode(itab, &r);
+        if (op != instr_decode(instr_tree, smem, addr) || r.pos != addr + itab->code[op].len) {
+            bench_fail("decode mismatch at bit 0x%04X\n", addr);
+            return;
+        }
+    }
+
+    double t0 = bench_now_ns();
+    for (int rep = 0; rep < BENCH_REPS; rep++) {
+        uint16_t addr = 0;
+        for (uint16_t i = 0; i < n; i++) {
+            opcode_t op = instr_decode(instr_tree, smem, addr);
+            addr += itab->code[op].len;
+            sink += op;
+        }
+    }
+    double t1 = bench_now_ns();
+    for (int rep = 0; rep < BENCH_REPS; rep++) {
+        instr_reader_init(&r, smem->mem, 0);
+        for (uint16_t i = 0; i < n; i++) {
+            sink += instr_reader_opcode(itab, &r);
+        }
+    }
+    double t2 = bench_now_ns();
+
+    double ops = (double) n * BENCH_REPS;
+    printf("decode/%s/tree   %8.2f ns/op\n", name, (t1 - t0) / ops);
+    printf("decode/%s/table  %8.2f ns/op\n", name, (t2 - t1) / ops);
+}
+
+
+// Compare the enum order tree against a Huffman tree built from the profile:
+// bits per opcode and the size of the serialized tree.
+void bench_encoding(instr_table_t *itab, sysmem_t *smem) {
+    instr_node_t *htree = instr_build_tree_counts(bench_profile);
+    instr_table_t *htab = instr_build_table(htree);
+
+    // the tree has to survive the trip through the image header descriptor
+    uint8_t desc[INSTR_TREEDESC_MAX];
+    uint16_t len = instr_write_tree(htree, desc);
+    instr_node_t *rtree = instr_read_tree(desc, len);
+    instr_table_t *rtab = instr_build_table(rtree);
+    if (memcmp(rtab->code, htab->code, sizeof(htab->code))) {
+        bench_fail("tree descriptor round trip mismatch\n");
+    }
+    // a descriptor that is a single leaf would give its opcode no code
+    const uint8_t leaf = HALT;
+    instr_node_t *ltree = instr_read_tree(&leaf, 1);
+    if (ltree) {
+        bench_fail("tree descriptor of a single leaf accepted\n");
+    }
+    instr_delete_tree(ltree);
+
+    printf("encoding/default  %6.3f bits/op\n", instr_mean_code_len(itab, bench_profile));
+    printf("encoding/huffman  %6.3f bits/op  (descriptor %u bytes)\n", 
+           instr_mean_code_len(htab, bench_profile), len);
+    bench_decode("profiled", rtree, rtab, smem, bench_profile);
+
+    instr_delete_table(rtab);
+    instr_delete_tree(rtree);
+    instr_delete_table(htab);
+    instr_delete_tree(htree);
+}
+
+
+// Assembler state for building benchmark programs in the read only block.
+typedef struct bench_asm {
+    const instr_table_t *itab;
+    sysmem_t *smem;
+    uint16_t pc;
+} bench_asm_t;
+
+
+// Append an instruction with up to two register operands and an immediate.
+uint16_t emit(bench_asm_t *a, opcode_t op, uint8_t r0, uint8_t r1, uint16_t imm) {
+    instr_t in = { .opcode = op, .reg = { r0, r1 }, .imm.u = imm };
+    uint16_t at = a->pc;
+    a->pc = instr_encode(a->itab, a->smem->mem, a->pc, &in);
+    return at;
+}
+
+
+// Append an instruction with three register operands.
+uint16_t emitr(bench_asm_t *a, opcode_t op, uint8_t r0, uint8_t r1, uint8_t r2) {
+    instr_t in = { .opcode = op, .reg = { r0, r1, r2 } };
+    uint16_t at = a->pc;
+    a->pc = instr_encode(a->itab, a->smem->mem, a->pc, &in);
+    return at;
+}
+
+
+// Append a setf instruction.
+uint16_t emitf(bench_asm_t *a, freg_t reg, float val) {
+    instr_t in = { .opcode = SETF, .reg = { reg }, .imm.f = val };
+    uint16_t at = a->pc;
+    a->pc = instr_encode(a->itab, a->smem->mem, a->pc, &in);
+    return at;
+}
+
+
+// Append a relative jump (or loop) to a bit address. Forward jumps can be 
+// emitted with any target and emitted again at the same address once the 
+// target is known.
+uint16_t emitj(bench_asm_t *a, opcode_t op, uint8_t r0, uint16_t target) {
+    uint16_t at = emit(a, op, r0, 0, 0);
+    uint16_t next = a->pc;
+    a->pc = at;
+    emit(a, op, r0, 0, target - next);
+    return at;
+}
+
+
+// Assemble a counted loop of integer and float arithmetic, returns the number
+// of instructions it retires. Control flow uses a conditional move into rpc.
+uint32_t bench_loop_program(const instr_table_t *itab, sysmem_t *smem, uint16_t iters) {
+    bench_asm_t a = { itab, smem, 0 };
+    emit(&a, SETI, IR0, 0, iters);
+    emit(&a, SETI, IR2, 0, 0);
+    emitf(&a, FR1, 1.0f);
+    // loop start is known once the seti that loads it has been emitted
+    uint16_t set_loop = emit(&a, SETI, IR1, 0, 0);
+    uint16_t loop = a.pc;
+    emit(&a, SETI, IR3, 0, 3);
+    emit(&a, MOVI, IR3, IRV, 0);
+    emit(&a, ADDI, IR3, IRV, 0);
+    emit(&a, ADDF, FR1, FR0, 0);
+    emit(&a, INCI, IR3, 0, 0);
+    emit(&a, DECI, IR0, 0, 0);
+    emit(&a, CMPI, IR0, IR2, 0);
+    emit(&a, MNEI, IR1, RPC, 0);
+    emit(&a, HALT, 0, 0, 0);
+    a.pc = set_loop;
+    emit(&a, SETI, IR1, 0, loop);
+    return 4 + 8 * (uint32_t) iters + 1;
+}
+
+
+// Assemble a loop that calls a short subroutine every iteration, returns the
+// number of instructions it retires. The subroutine is made of the idioms the
+// superinstructions target and only changes ir3 and irv, so it can also be 
+// called as a leaf (lcal/lret).
+uint32_t bench_call_program(const instr_table_t *itab, sysmem_t *smem, uint16_t iters, int leaf) {
+    opcode_t call_op = leaf ? LCAL : CALL, retn_op = leaf ? LRET : RETN;
+    bench_asm_t a = { itab, smem, 0 };
+    emit(&a, SETI, IR0, 0, iters);
+    emit(&a, SETI, IR2, 0, 0);
+    uint16_t set_loop = emit(&a, SETI, IR1, 0, 0);
+    uint16_t loop = a.pc;
+    uint16_t call = emit(&a, call_op, 0, 0, 0);
+    emit(&a, DECI, IR0, 0, 0);
+    emit(&a, CMPI, IR0, IR2, 0);
+    emit(&a, MNEI, IR1, RPC, 0);
+    emit(&a, HALT, 0, 0, 0);
+    uint16_t sub = a.pc;
+    emit(&a, SETI, IR3, 0, 7);
+    emit(&a, MOVI, IR3, IRV, 0);
+    emit(&a, SETI, IR3, 0, 5);
+    emit(&a, ADDI, IR3, IRV, 0);
+    emit(&a, CMPI, IRV, IR3, 0);
+    emit(&a, MGTI, IRV, IR3, 0);
+    emit(&a, retn_op, 0, 0, 0);
+    a.pc = set_loop;
+    emit(&a, SETI, IR1, 0, loop);
+    a.pc = call;
+    emit(&a, call_op, 0, 0, sub);
+    return 3 + 11 * (uint32_t) iters + 1;
+}
+
+
+// Assemble a counted loop (fr0 += 1, irv = ir0, ir3 += 1 for ir0 = iters down
+// to 1) closed by a conditional move into rpc (branch 0), by jne (1) or by 
+// loop (2), returns the number of instructions it retires.
+uint32_t bench_branch_program(const instr_table_t *itab, sysmem_t *smem, uint16_t iters, int branch) {
+    bench_asm_t a = { itab, smem, 0 };
+    emit(&a, SETI, IR0, 0, iters);
+    emit(&a, SETI, IR2, 0, 0);
+    emit(&a, SETI, IR3, 0, 0);
+    emitf(&a, FR1, 1.0f);
+    uint16_t set_loop = emit(&a, SETI, IR1, 0, 0);
+    uint16_t loop = a.pc;
+    emit(&a, ADDF, FR1, FR0, 0);
+    emit(&a, MOVI, IR0, IRV, 0);
+    emit(&a, INCI, IR3, 0, 0);
+    switch (branch) {
+        case 0:
+            emit(&a, DECI, IR0, 0, 0);
+            emit(&a, CMPI, IR0, IR2, 0);
+            emit(&a, MNEI, IR1, RPC, 0);
+            break;
+        case 1:
+            emit(&a, DECI, IR0, 0, 0);
+            emit(&a, CMPI, IR0, IR2, 0);
+            emitj(&a, JNE, 0, loop);
+            break;
+        default:
+            emitj(&a, LOOP, IR0, loop);
+            break;
+    }
+    emit(&a, HALT, 0, 0, 0);
+    a.pc = set_loop;
+    emit(&a, SETI, IR1, 0, loop);
+    return 5 + (branch < 2 ? 6 : 4) * (uint32_t) iters + 1;
+}
+
+
+// Assemble a loop that sums (i * 7) % 10 into ir3 for i = iters down to 1, 
+// either with muli and modi or the way guests had to without them: the 
+// product as a loop of adds and the remainder as a loop of subtracts.
+void bench_alu_program(const instr_table_t *itab, sysmem_t *smem, uint16_t iters, int emulate) {
+    bench_asm_t a = { itab, smem, 0 };
+    emit(&a, SETI, IR0, 0, iters);
+    emit(&a, SETI, IR1, 0, 7);
+    emit(&a, SETI, IR2, 0, 10);
+    emit(&a, SETI, IR3, 0, 0);
+    uint16_t loop = a.pc;
+    if (emulate) {
+        emit(&a, SUBI, IRV, IRV, 0);
+        emit(&a, SETI, IR1, 0, 7);
+        uint16_t mul = emit(&a, ADDI, IR0, IRV, 0);
+        emitj(&a, LOOP, IR1, mul);
+        uint16_t mod = emit(&a, CMPI, IRV, IR2, 0);
+        uint16_t jlt = emitj(&a, JLT, 0, a.pc);
+        emit(&a, SUBI, IR2, IRV, 0);
+        emitj(&a, JMPR, 0, mod);
+        uint16_t done = a.pc;
+        a.pc = jlt;
+        emitj(&a, JLT, 0, done);
+        a.pc = done;
+    } else {
+        emit(&a, MOVI, IR0, IRV, 0);
+        emit(&a, MULI, IR1, IRV, 0);
+        emit(&a, MODI, IR2, IRV, 0);
+    }
+    emit(&a, ADDI, IRV, IR3, 0);
+    emitj(&a, LOOP, IR0, loop);
+    emit(&a, HALT, 0, 0, 0);
+}
+
+
+// Mix a hash in ir3 with shifts and rotates by every count from 0 to 31 and
+// the bitwise instructions, for the JIT. Returns the number of instructions
+// it retires.
+uint32_t bench_bits_program(const instr_table_t *itab, sysmem_t *smem) {
+    const uint16_t iters = 20000;
+    bench_asm_t a = { itab, smem, 0 };
+    emit(&a, SETI, IR0, 0, iters);
+    emit(&a, SETI, IR2, 0, 0);
+    emit(&a, SETI, IR3, 0, 0x1234);
+    uint16_t loop = emit(&a, INCI, IR2, 0, 0);
+    emit(&a, MOVI, IR2, IRV, 0);
+    emit(&a, SETI, IR1, 0, 31);
+    emit(&a, ANDI, IR1, IRV, 0);
+    emit(&a, MOVI, IR3, IR1, 0);
+    emit(&a, SHLI, IRV, IR1, 0);
+    emit(&a, XORI, IR1, IR3, 0);
+    emit(&a, MOVI, IR3, IR1, 0);
+    emit(&a, SHRI, IRV, IR1, 0);
+    emit(&a, XORI, IR1, IR3, 0);
+    emit(&a, ROTL, IRV, IR3, 0);
+    emit(&a, SETI, IR1, 0, 3);
+    emit(&a, MULI, IRV, IR1, 0);
+    emit(&a, ORI, IR1, IR3, 0);
+    emitj(&a, LOOP, IR0, loop);
+    emit(&a, HALT, 0, 0, 0);
+    return 3 + 15 * (uint32_t) iters + 1;
+}
+
+
+// The counted loop closed by loop, for the JIT.
+uint32_t bench_loop_opcode_program(const instr_table_t *itab, sysmem_t *smem) {
+    return bench_branch_program(itab, smem, 50000, 2);
+}
+
+
+// Reset a core to run a program from the start.
+void bench_reset_core(core_t *core) {
+    core->iregs[RPC] = 0;
+    core->iregs[RSP] = MEMORY_RWBLKMAX;
+    core->rcmp = NA;
+    core->stc = NO_ERR;
+    core->fregs[FR0] = 0.0f;
+}
+
+
+// Step the core one instruction at a time, decoding with the table and
+// dispatching through a switch on the function pointers.
+void bench_run_naive(core_t *core) {
+    while (core->stc == NO_ERR) {
+        core_execute(core, core->smem, core->iregs[RPC] >> 3, core->iregs[RPC] & 7);
+    }
+}
+
+
+// Run with the pre-decoded instruction cache.
+void bench_run_cached(core_t *core) {
+    core_run(core);
+}
+
+
+// Instructions per second of the run loops on the counted loop program.
+void bench_dispatch(instr_table_t *itab, sysmem_t *smem) {
+    const uint16_t iters = 50000;
+    uint32_t n = bench_loop_program(itab, smem, iters);
+    core_t *core = core_init(0, smem);
+    core->itab = itab;
+
+    double t0 = bench_now_ns();
+    icache_t *icache = icache_build(itab, smem, 0);
+    printf("icache/build  %8.2f us  (%u records)\n", (bench_now_ns() - t0) / 1e3, icache->n_ops);
+
+    struct { const char *name; void (*run)(core_t*); icache_t *icache; } loops[] = {
+        { "naive", &bench_run_naive, NULL },
+        { "switch", &core_run_switch, NULL },
+        { "threaded", &core_run, NULL },
+        { "cached", &bench_run_cached, icache }
+    };
+    for (size_t i = 0; i < sizeof(loops) / sizeof(loops[0]); i++) {
+        core->icache = loops[i].icache;
+        double t0 = bench_now_ns();
+        for (int rep = 0; rep < BENCH_REPS / 10; rep++) {
+            bench_reset_core(core);
+            loops[i].run(core);
+        }
+        double t1 = bench_now_ns();
+        if (core->stc != ERR_HALT || core->iregs[IRV] != 6 || core->fregs[FR0] != (float) iters) {
+            bench_fail("dispatch/%s: wrong result (stc %d)\n", loops[i].name, core->stc);
+        }
+        double secs = (t1 - t0) / 1e9;
+        printf("dispatch/%-8s %8.2f Minstr/s\n", loops[i].name, 
+               (double) n * (BENCH_REPS / 10) / secs / 1e6);
+    }
+    core_delete(core);
+}
+
+
+// Superinstruction fusion on the call-heavy loop, with the patterns chosen
+// from a profiling run.
+void bench_fusion(instr_table_t *itab, sysmem_t *smem) {
+    const uint16_t iters = 20000;
+    uint32_t n = bench_call_program(itab, smem, iters, 0);
+    core_t *core = core_init(0, smem);
+    core->itab = itab;
+
+    static uint64_t counts[N_OPCODES], pairs[N_OPCODES * N_OPCODES];
+    bench_reset_core(core);
+    core_run_profile(core, counts, pairs);
+    uint32_t fusions = icache_choose_fusions(counts, pairs, 0.02);
+    printf("fusion/chosen  ");
+    for (uint8_t f = 0; f < icache_n_fusions; f++) {
+        if (fusions & (1u << f)) {
+            printf(" %u", f);
+        }
+    }
+    printf("\n");
+
+    uint32_t masks[] = { 0, fusions };
+    const char *names[] = { "unfused", "fused" };
+    double rate[2];
+    for (int i = 0; i < 2; i++) {
+        core->icache = icache_build(itab, smem, masks[i]);
+        double t0 = bench_now_ns();
+        for (int rep = 0; rep < BENCH_REPS / 10; rep++) {
+            bench_reset_core(core);
+            core_run(core);
+        }
+        double t1 = bench_now_ns();
+        if (core->stc != ERR_HALT || core->iregs[IRV] != 12 || core->iregs[RSP] != MEMORY_RWBLKMAX) {
+            bench_fail("fusion/%s: wrong result (stc %d)\n", names[i], core->stc);
+        }
+        rate[i] = (double) n * (BENCH_REPS / 10) / ((t1 - t0) / 1e9) / 1e6;
+        printf("fusion/%-8s %8.2f Minstr/s\n", names[i], rate[i]);
+        icache_delete(core->icache);
+    }
+    printf("fusion/speedup  %8.2fx\n", rate[1] / rate[0]);
+    core_delete(core);
+}
+
+
+// Assemble a loop that adds 1 to ir0 until it overflows, returns the number
+// of instructions it retires.
+uint32_t bench_overflow_program(const instr_table_t *itab, sysmem_t *smem) {
+    bench_asm_t a = { itab, smem, 0 };
+    emit(&a, SETI, IR0, 0, 1);
+    emit(&a, SETI, IR1, 0, 1);
+    uint16_t set_loop = emit(&a, SETI, IR2, 0, 0);
+    uint16_t loop = a.pc;
+    emit(&a, ADDI, IR1, IR0, 0);
+    emit(&a, CMPI, IR0, IR1, 0);
+    emit(&a, MGTI, IR2, RPC, 0);
+    a.pc = set_loop;
+    emit(&a, SETI, IR2, 0, loop);
+    return 3 + 3 * 65534 + 1;
+}
+
+
+// Native code for hot blocks against the instruction cache alone. Also checks
+// that a block that stops on an error leaves the core exactly as the 
+// interpreter does.
+void bench_jit(instr_table_t *itab, sysmem_t *smem) {
+    struct {
+        const char *name;
+        uint32_t (*build)(const instr_table_t*, sysmem_t*);
+    } progs[] = {
+        { "loop", NULL },
+        { "overflow", &bench_overflow_program },
+        { "loopop", &bench_loop_opcode_program },
+        { "bits", &bench_bits_program }
+    };
+    for (int p = 0; p < 4; p++) {
+        memset(smem->mem, 0, MEMORY_RWBLKMIN);
+        uint32_t n = progs[p].build ? progs[p].build(itab, smem) : bench_loop_program(itab, smem, 50000);
+        core_t *cores[2];
+        for (int i = 0; i < 2; i++) {
+            cores[i] = core_init(0, smem);
+            cores[i]->itab = itab;
+            cores[i]->icache = icache_build(itab, smem, 0);
+        }
+        cores[1]->icache->jit = jit_init(16);
+        if (!cores[1]->icache->jit) {
+            printf("jit/%s: not supported on this host\n", progs[p].name);
+        }
+        double ns[2];
+        for (int i = 0; i < 2; i++) {
+            double t0 = bench_now_ns();
+            for (int rep = 0; rep < BENCH_REPS / 10; rep++) {
+                bench_reset_core(cores[i]);
+                core_run(cores[i]);
+            }
+            ns[i] = bench_now_ns() - t0;
+        }
+        core_t *c0 = cores[0], *c1 = cores[1];
+        if (c0->stc != c1->stc || c0->iregs[RPC] != c1->iregs[RPC] || c0->iregs[RSP] != c1->iregs[RSP] || c0->rcmp != c1->rcmp
+            || c0->iregs[IR0] != c1->iregs[IR0] || c0->iregs[IR1] != c1->iregs[IR1] || c0->iregs[IR2] != c1->iregs[IR2] || c0->iregs[IR3] != c1->iregs[IR3] || c0->iregs[IRV] != c1->iregs[IRV]
+            || c0->fregs[FR0] != c1->fregs[FR0] || c0->fregs[FR1] != c1->fregs[FR1]) {
+            bench_fail("jit/%s: state differs from the interpreter\n", progs[p].name);
+        }
+        printf("jit/%-8s cached %8.2f Minstr/s  native %8.2f Minstr/s\n", progs[p].name,
+               (double) n * (BENCH_REPS / 10) / (ns[0] / 1e9) / 1e6,
+               (double) n * (BENCH_REPS / 10) / (ns[1] / 1e9) / 1e6);
+        for (int i = 0; i < 2; i++) {
+            icache_delete(cores[i]->icache);
+            core_delete(cores[i]);
+        }
+    }
+
+    // cores of a VM compile their blocks on their own threads at the same time
+    vm_t *vm = vm_init(4, itab);
+    bench_loop_program(itab, vm->smem, 5000);
+    for (int rep = 0; rep < 50; rep++) {
+        for (uint8_t i = 0; i < vm->n_cores; i++) {
+            icache_delete(vm->cores[i]->icache);
+            vm->cores[i]->icache = icache_build(itab, vm->smem, 0);
+            vm->cores[i]->icache->jit = jit_init(1);
+        }
+        vm_reset(vm);
+        vm_run(vm);
+        for (uint8_t i = 0; i < vm->n_cores; i++) {
+            core_t *core = vm->cores[i];
+            if (core->stc != ERR_HALT || core->iregs[IRV] != 6 || core->fregs[FR0] != 5000.0f) {
+                bench_fail("jit/threads: wrong result on core %u\n", i);
+                rep = 50;
+            }
+        }
+    }
+    vm_delete(vm);
+}
+
+
+// Copying a buffer in the read/write block the way guest programs used to (a
+// lodi/stoi pair per word, fully unrolled) against one bcpy, then checking it
+// with bcmp.
+void bench_blockcopy(instr_table_t *itab, sysmem_t *smem) {
+    const uint16_t src = 0x2000, dst = 0x3000, len = 1024;
+    for (uint16_t i = 0; i < len; i++) {
+        smem->mem[src + i] = (uint8_t) (i * 7);
+    }
+    double mbps[2];
+    for (int block = 0; block < 2; block++) {
+        memset(smem->mem, 0, MEMORY_RWBLKMIN);
+        bench_asm_t a = { itab, smem, 0 };
+        if (block) {
+            emit(&a, SETI, IR0, 0, src);
+            emit(&a, SETI, IR1, 0, dst);
+            emit(&a, SETI, IR2, 0, len);
+            emitr(&a, BCPY, IR0, IR1, IR2);
+            emitr(&a, BCMP, IR0, IR1, IR2);
+        } else {
+            for (uint16_t i = 0; i < len; i += 2) {
+                emit(&a, LODI, IR0, 0, src + i);
+                emit(&a, STOI, IR0, 0, dst + i);
+            }
+        }
+        emit(&a, HALT, 0, 0, 0);
+        core_t *core = core_init(0, smem);
+        core->itab = itab;
+        core->icache = icache_build(itab, smem, 0);
+        double t0 = bench_now_ns();
+        for (int rep = 0; rep < BENCH_REPS * 10; rep++) {
+            memset(smem->mem + dst, 0, len);
+            bench_reset_core(core);
+            core_run(core);
+        }
+        double t1 = bench_now_ns();
+        if (core->stc != ERR_HALT || memcmp(smem->mem + src, smem->mem + dst, len) 
+            || (block && core->rcmp != EQ)) {
+            bench_fail("blockcopy: wrong result (stc %d)\n", core->stc);
+        }
+        mbps[block] = (double) len * BENCH_REPS * 10 / ((t1 - t0) / 1e9) / 1e6;
+        icache_delete(core->icache);
+        core_delete(core);
+    }
+    printf("blockcopy/words  %8.2f MB/s\n", mbps[0]);
+    printf("blockcopy/bcpy   %8.2f MB/s\n", mbps[1]);
+}
+
+
+// Append an instruction with four register operands.
+uint16_t emitv(bench_asm_t *a, opcode_t op, uint8_t r0, uint8_t r1, uint8_t r2, uint8_t r3) {
+    instr_t in = { .opcode = op, .reg = { r0, r1, r2, r3 } };
+    uint16_t at = a->pc;
+    a->pc = instr_encode(a->itab, a->smem->mem, a->pc, &in);
+    return at;
+}
+
+
+// Assemble a dot product (fr2 = sum of x[i] * y[i]) and an axpy (y[i] += fr3 *
+// x[i]) over n floats, either as fully unrolled scalar code or with the vector
+// instructions. The scalar dot product adds the products in order, so x and y 
+// hold small integers for the sums to come out exact either way.
+void bench_vector_program(const instr_table_t *itab, sysmem_t *smem, uint16_t x, uint16_t y, uint16_t n, int vector) {
+    bench_asm_t a = { itab, smem, 0 };
+    emitf(&a, FR2, 0.0f);
+    emitf(&a, FR3, 0.5f);
+    if (vector) {
+        emit(&a, SETI, IR0, 0, x);
+        emit(&a, SETI, IR1, 0, y);
+        emit(&a, SETI, IR2, 0, n);
+        emitv(&a, VDTF, IR0, IR1, IR2, FR2);
+        emitv(&a, VFMF, IR0, IR1, IR2, FR3);
+    } else {
+        for (uint16_t i = 0; i < n; i++) {
+            emit(&a, LODF, FR0, 0, x + 4 * i);
+            emit(&a, LODF, FR1, 0, y + 4 * i);
+            emit(&a, MULF, FR0, FR1, 0);
+            emit(&a, ADDF, FR1, FR2, 0);
+        }
+        for (uint16_t i = 0; i < n; i++) {
+            emit(&a, LODF, FR0, 0, x + 4 * i);
+            emit(&a, MULF, FR3, FR0, 0);
+            emit(&a, LODF, FR1, 0, y + 4 * i);
+            emit(&a, ADDF, FR0, FR1, 0);
+            emit(&a, STOF, FR1, 0, y + 4 * i);
+        }
+    }
+    emit(&a, HALT, 0, 0, 0);
+}
+
+
+// The same dot product and axpy as scalar guest code against the packed vector
+// instructions (SIMD on the host, one bounds check per vector), checking that
+// both give the same results. Also checks the word instructions against plain
+// C on a few lengths that are not whole blocks.
+void bench_vector(instr_table_t *itab, sysmem_t *smem) {
+    const uint16_t x = 0x2000, y = 0x3000, n = 256;
+    float dot[2] = { 0 };
+    double ns[2];
+    uint8_t out[2][256 * sizeof(float)];
+    for (int vector = 0; vector < 2; vector++) {
+        memset(smem->mem, 0, MEMORY_RWBLKMIN);
+        bench_vector_program(itab, smem, x, y, n, vector);
+        core_t *core = core_init(0, smem);
+        core->itab = itab;
+        core->icache = icache_build(itab, smem, 0);
+        double t = 0.0;
+        for (int rep = 0; rep < BENCH_REPS * 10; rep++) {
+            for (uint16_t i = 0; i < n; i++) {
+                mem_set_float(smem, x + 4 * i, (float) (i % 7));
+                mem_set_float(smem, y + 4 * i, (float) (i % 5) - 2.0f);
+            }
+            bench_reset_core(core);
+            double t0 = bench_now_ns();
+            core_run(core);
+            t += bench_now_ns() - t0;
+        }
+        if (core->stc != ERR_HALT) {
+            bench_fail("vector: program stopped with stc %d\n", core->stc);
+        }
+        dot[vector] = core->fregs[FR2];
+        memcpy(out[vector], smem->mem + y, sizeof(out[vector]));
+        ns[vector] = t / ((double) BENCH_REPS * 10 * n);
+        icache_delete(core->icache);
+        core_delete(core);
+    }
+    if (dot[0] != dot[1] || memcmp(out[0], out[1], sizeof(out[0]))) {
+        bench_fail("vector: results differ (dot %g vs %g)\n", dot[0], dot[1]);
+    }
+    printf("vector/scalar    %8.2f ns/element\n", ns[0]);
+    printf("vector/packed    %8.2f ns/element\n", ns[1]);
+
+    // word instructions, including an out of bounds vector
+    core_t *core = core_init(0, smem);
+    const uint16_t lens[] = { 0, 1, 7, 8, 9, 100 };
+    for (size_t k = 0; k < sizeof(lens) / sizeof(lens[0]); k++) {
+        uint16_t m = lens[k], sum = 0;
+        for (uint16_t i = 0; i < m; i++) {
+            mem_set_uint16(smem, x + 2 * i, (uint16_t) (i * 40503u));
+            mem_set_uint16(smem, y + 2 * i, (uint16_t) (i * 7 + 60000u));
+        }
+        bench_reset_core(core);
+        core->iregs[IR0] = x;
+        core->iregs[IR1] = y;
+        core->iregs[IR2] = m;
+        core->ops->vadi(core, IR0, IR1, IR2);
+        core->ops->vmni(core, IR0, IR1, IR2);
+        core->ops->vrdi(core, IR1, IR2, IRV);
+        for (uint16_t i = 0; i < m; i++) {
+            uint16_t a = (uint16_t) (i * 40503u), b = (uint16_t) (i * 7 + 60000u);
+            b = (uint16_t) (a + b);
+            sum += a < b ? a : b;
+        }
+        if (core->stc != NO_ERR || core->iregs[IRV] != sum) {
+            bench_fail("vector: word sum of %d wrong (%d vs %d)\n", m, core->iregs[IRV], sum);
+        }
+    }
+    core->iregs[IR1] = MEMORY_RWBLKMAX - 8;
+    core->iregs[IR2] = 5;
+    core->ops->vadf(core, IR0, IR1, IR2);
+    if (core->stc != ERR_MEMACCRWBLK) {
+        bench_fail("vector: access outside the read/write block not caught\n");
+    }
+    core_delete(core);
+}
+
+
+// Assemble a loop whose trip count is read from the read/write block, so that
+// instances with different inputs diverge at the end of it. Leaves 6 in irv
+// and the trip count in fr0 (also stored after the input).
+void bench_batch_program(const instr_table_t *itab, sysmem_t *smem, uint16_t input) {
+    bench_asm_t a = { itab, smem, 0 };
+    emit(&a, LODI, IR0, 0, input);
+    emit(&a, SETI, IR2, 0, 0);
+    emitf(&a, FR1, 1.0f);
+    uint16_t set_loop = emit(&a, SETI, IR1, 0, 0);
+    uint16_t loop = a.pc;
+    emit(&a, SETI, IR3, 0, 3);
+    emit(&a, MOVI, IR3, IRV, 0);
+    emit(&a, ADDI, IR3, IRV, 0);
+    emit(&a, ADDF, FR1, FR0, 0);
+    emit(&a, INCI, IR3, 0, 0);
+    emit(&a, DECI, IR0, 0, 0);
+    emit(&a, CMPI, IR0, IR2, 0);
+    emit(&a, MNEI, IR1, RPC, 0);
+    emit(&a, STOF, FR0, 0, input + 2);
+    emit(&a, HALT, 0, 0, 0);
+    a.pc = set_loop;
+    emit(&a, SETI, IR1, 0, loop);
+}
+
+
+// The same program over many inputs, one core after another vs. all of them in
+// lockstep as a batch, checking that every lane ends up where its core did, 
+// fault_pc included (one input of 0 makes its lane fail on deci).
+void bench_batch(instr_table_t *itab) {
+    const uint16_t n = 256, input = 0x2000, iters = 2000;
+    sysmem_t *smem[256];
+    for (uint16_t i = 0; i < n; i++) {
+        smem[i] = sysmem_init(1);
+        bench_batch_program(itab, smem[i], input);
+    }
+    uint16_t count[256];
+    uint64_t n_instr = 0;
+    for (uint16_t i = 0; i < n; i++) {
+        count[i] = i == 5 ? 0 : iters + i % 8;
+        n_instr += 5 + 8 * (uint64_t) count[i] + 2;
+    }
+
+    core_t *core = core_init(0, smem[0]);
+    core->itab = itab;
+    core->icache = icache_build(itab, smem[0], 0);
+    core_t expect[256];
+    double t0 = bench_now_ns();
+    for (int rep = 0; rep < BENCH_REPS / 20; rep++) {
+        for (uint16_t i = 0; i < n; i++) {
+            mem_set_uint16(smem[i], input, count[i]);
+            core->smem = smem[i];
+            core_reset(core);
+            core_run(core);
+            expect[i] = *core;
+        }
+    }
+    double t1 = bench_now_ns();
+    batch_t *b = batch_init(itab, smem, n);
+    for (int rep = 0; rep < BENCH_REPS / 20; rep++) {
+        for (uint16_t i = 0; i < n; i++) {
+            mem_set_uint16(smem[i], input, count[i]);
+        }
+        batch_reset(b);
+        batch_run(b);
+    }
+    double t2 = bench_now_ns();
+
+    for (uint16_t i = 0; i < n; i++) {
+        batch_load_core(b, i, core);
+        if (memcmp(core->iregs, expect[i].iregs, sizeof(core->iregs)) 
+            || memcmp(core->fregs, expect[i].fregs, sizeof(core->fregs))
+            || core->rcmp != expect[i].rcmp || core->stc != expect[i].stc
+            || core->fault_pc != expect[i].fault_pc
+            || (i != 5 && mem_get_float(smem[i], input + 2) != (float) count[i])) {
+            bench_fail("batch: lane %u differs from its core (stc %d vs %d)\n", i, core->stc, expect[i].stc);
+        }
+    }
+    double reps = BENCH_REPS / 20;
+    printf("batch/cores      %8.2f Minstr/s\n", n_instr * reps / ((t1 - t0) / 1e3));
+    printf("batch/lockstep   %8.2f Minstr/s  (%.1f lanes/step, %llu scalar steps, %llu scalar runs)\n", 
+           n_instr * reps / ((t2 - t1) / 1e3), (double) b->n_lane_instrs / (b->n_steps ? b->n_steps : 1),
+           (unsigned long long) b->n_scalar_steps, (unsigned long long) b->n_scalar_runs);
+
+    batch_delete(b);
+    icache_delete(core->icache);
+    core_delete(core);
+    for (uint16_t i = 0; i < n; i++) {
+        sysmem_delete(smem[i]);
+    }
+}
+
+
+// Cost of running with execution counters on the call program, checking the 
+// counters against what the program is known to execute and exporting them.
+void bench_stats(instr_table_t *itab, sysmem_t *smem) {
+    const uint16_t iters = 10000;
+    memset(smem->mem, 0, MEMORY_RWBLKMIN);
+    uint32_t n_instr = bench_call_program(itab, smem, iters, 0);
+    core_t *core = core_init(0, smem);
+    core->itab = itab;
+    core->icache = icache_build(itab, smem, 0);
+    double rate[2];
+    for (int counted = 0; counted < 2; counted++) {
+        if (counted) {
+            stats_enable(core);
+        }
+        double t0 = bench_now_ns();
+        for (int rep = 0; rep < BENCH_REPS / 20; rep++) {
+            bench_reset_core(core);
+            core_run(core);
+        }
+        rate[counted] = (double) n_instr * (BENCH_REPS / 20) / ((bench_now_ns() - t0) / 1e3);
+    }
+    core_stats_t *st = core->stats;
+    uint64_t total = 0;
+    for (int op = 0; op < N_OPCODES; op++) {
+        total += st->retired[op];
+    }
+    if (total != (uint64_t) n_instr * (BENCH_REPS / 20) || st->retired[CALL] != st->retired[RETN]
+        || st->stores != st->retired[CALL] * 10 || st->stack_hwm != 28 
+        || st->errors[ERR_HALT] != BENCH_REPS / 20) {
+        bench_fail("stats: wrong counters (%llu instructions, hwm %u)\n", (unsigned long long) total, st->stack_hwm);
+    }
+    char buf[8192];
+    FILE *f = fmemopen(buf, sizeof(buf), "w");
+    if (!f || stats_write_json(f, &core, 1) || stats_write_prometheus(f, &core, 1)) {
+        bench_fail("stats: export failed\n");
+    }
+    if (f) {
+        fclose(f);
+    }
+    printf("stats/off        %8.2f Minstr/s\n", rate[0]);
+    printf("stats/on         %8.2f Minstr/s\n", rate[1]);
+    stats_disable(core);
+    icache_delete(core->icache);
+    core_delete(core);
+}
+
+
+// Cost of tracing every instruction on the counted loop program (decoded and
+// cached), then checks the dump a failing program leaves behind.
+void bench_trace(instr_table_t *itab, sysmem_t *smem) {
+    const uint16_t iters = 20000;
+    memset(smem->mem, 0, MEMORY_RWBLKMIN);
+    uint32_t n_instr = bench_loop_program(itab, smem, iters);
+    core_t *core = core_init(0, smem);
+    core->itab = itab;
+    trace_t *tr = trace_init(4096);
+    for (int cached = 0; cached < 2; cached++) {
+        core->icache = cached ? icache_build(itab, smem, 0) : NULL;
+        double rate[2];
+        for (int traced = 0; traced < 2; traced++) {
+            core->trace = traced ? tr : NULL;
+            double t0 = bench_now_ns();
+            for (int rep = 0; rep < BENCH_REPS / 20; rep++) {
+                bench_reset_core(core);
+                core_run(core);
+            }
+            rate[traced] = (double) n_instr * (BENCH_REPS / 20) / ((bench_now_ns() - t0) / 1e3);
+        }
+        const char *name = cached ? "cached" : "decoded";
+        printf("trace/%-7s/off %8.2f Minstr/s\n", name, rate[0]);
+        printf("trace/%-7s/on  %8.2f Minstr/s  (%.1f%% overhead)\n", name, rate[1], 
+               100.0 * (rate[0] / rate[1] - 1.0));
+        icache_delete(core->icache);
+    }
+    core->icache = NULL;
+
+    // the dump is written when the program fails and ends with the failure
+    memset(smem->mem, 0, MEMORY_RWBLKMIN);
+    bench_overflow_program(itab, smem);
+    trace_delete(tr);
+    core->trace = tr = trace_init(1000);
+    tr->dump = tmpfile();
+    bench_reset_core(core);
+    core_run(core);
+    rewind(tr->dump);
+    uint8_t cid;
+    uint64_t first;
+    uint32_t n;
+    trace_rec_t *recs = trace_load(tr->dump, &cid, &first, &n);
+    if (!recs || n != 1000 || first + n != 3 + 3 * 65534 + 1 || recs[n - 1].opcode != ADDI 
+        || recs[n - 1].stc != ERR_IREGOVERFLOW || recs[n - 2].opcode != MGTI) {
+        bench_fail("trace: wrong dump after the program failed\n");
+    }
+    free(recs);
+    fclose(tr->dump);
+    trace_delete(tr);
+    core_delete(core);
+}
+
+
+// Assemble one of the programs that stop with an error after some straight 
+// line code: decrement of 0, a float register that does not exist, a write 
+// to rsp, a load outside the read/write block, an addition that overflows 
+// in a loop, a jump out of the read only block, a call to itself that runs
+// out of stack, a division by zero or a multiplication that overflows in a 
+// loop.
+void bench_fault_program(const instr_table_t *itab, sysmem_t *smem, int which) {
+    bench_asm_t a = { itab, smem, 0 };
+    emit(&a, SETI, IR0, 0, 5);
+    emitf(&a, FR0, 1.5f);
+    emit(&a, STOI, IR0, 0, 0x2000);
+    emit(&a, CMPI, IR0, IR1, 0);
+    uint16_t set_loop = emit(&a, SETI, IR1, 0, 0);
+    uint16_t loop = a.pc;
+    switch (which) {
+        case 0: emit(&a, DECI, IR3, 0, 0); break;
+        case 1: emit(&a, ADDF, FR0, FRV + 2, 0); break;
+        case 2: emit(&a, SETI, RSP, 0, 0); break;
+        case 3: emit(&a, LODI, IR2, 0, 0x0100); break;
+        case 5: emit(&a, JMPA, 0, 0, INSTR_ROMBITS); break;
+        case 6: emit(&a, CALL, 0, 0, loop); break;
+        case 7: emit(&a, DIVI, IR3, IR0, 0); break;
+        case 8:
+            emit(&a, MULI, IR0, IR0, 0);
+            emit(&a, MOVI, IR1, RPC, 0);
+            break;
+        default:
+            emit(&a, SETI, IR3, 0, 0x0FFF);
+            emit(&a, ADDI, IR3, IR0, 0);
+            emit(&a, MOVI, IR1, RPC, 0);
+            break;
+    }
+    emit(&a, SETI, IR2, 0, 9);
+    emit(&a, HALT, 0, 0, 0);
+    a.pc = set_loop;
+    emit(&a, SETI, IR1, 0, loop);
+}
+
+
+// Errors stop every run loop at the same instruction with the same state, 
+// whether or not the status code is checked after each instruction.
+void bench_faults(instr_table_t *itab, sysmem_t *smem) {
+    const char *const names[] = { 
+        "decr0", "freg", "regnotalwd", "memacc", "overflow", "jump", "stack", "divzero", "mulovf" 
+    };
+    for (int which = 0; which < 9; which++) {
+        memset(smem->mem, 0, MEMORY_SIZE);
+        bench_fault_program(itab, smem, which);
+        core_t ref;
+        for (int mode = 0; mode < 4; mode++) {
+            core_t *core = core_init(0, smem);
+            core->itab = itab;
+            core->icache = mode >= 2 ? icache_build(itab, smem, mode == 2 ? 0 : ICACHE_ALLFUSIONS) : NULL;
+            mem_set_uint16(smem, 0x2000, 0);
+            bench_reset_core(core);
+            if (mode == 0) {
+                core_run_switch(core);
+                ref = *core;
+            } else {
+                core_run(core);
+            }
+            if (core->stc != ref.stc || core->fault_pc != ref.fault_pc 
+                || memcmp(core->iregs, ref.iregs, sizeof(ref.iregs)) 
+                || memcmp(core->fregs, ref.fregs, sizeof(ref.fregs)) 
+                || mem_get_uint16(smem, 0x2000) != 5) {
+                bench_fail("faults/%s: run loop %d differs (stc %d at %u)\n", names[which], mode, core->stc, core->fault_pc);
+            }
+            icache_delete(core->icache);
+            core_delete(core);
+        }
+        printf("faults/%-10s  stc %2d at bit %u\n", names[which], ref.stc, ref.fault_pc);
+    }
+}
+
+
+// Runs a program on a vm_t with its own layout: the default stack space is 
+// data, the stacks are moved to 0x8000 and the page at 0x3000 is read only.
+// Every core stores to the old stack space, pushes to its new stack and stops
+// at a store to the read only page.
+void bench_layout(instr_table_t *itab) {
+    sysmem_t *smem = sysmem_init(2);
+    sysmem_protect(smem, MEMORY_RWBLKMAX, MEMORY_SIZE - MEMORY_RWBLKMAX, MEM_R | MEM_W);
+    sysmem_protect(smem, 0x8000, 0x0800, MEM_S);
+    sysmem_protect(smem, 0x3000, MEMORY_PAGESIZE, MEM_R);
+    vm_t *vm = vm_wrap(smem, itab);
+    bench_asm_t a = { itab, smem, 0 };
+    emit(&a, SETI, IR0, 0, 77);
+    emit(&a, STOI, IR0, 0, 0xF100);
+    emit(&a, LODI, IR1, 0, 0x3000);
+    emit(&a, PSHI, IR0, 0, 0);
+    uint16_t fault = emit(&a, STOI, IR0, 0, 0x3000);
+    emit(&a, HALT, 0, 0, 0);
+    vm_run(vm);
+    for (uint8_t i = 0; i < vm->n_cores; i++) {
+        core_t *core = vm->cores[i];
+        if (core->stc != ERR_MEMACCRWBLK || core->fault_pc != fault || core->stack_base != 0x8000 + i * 0x0400
+            || mem_get_uint16(smem, core->stack_base) != 77 || mem_get_uint16(smem, 0xF100) != 77) {
+            bench_fail("layout: wrong result on core %u (stc %d)\n", i, core->stc);
+        }
+    }
+    printf("layout  stacks at 0x%04X + %u bytes per core\n", smem->stack_start, smem->stack_size);
+    vm_delete(vm);
+}
+
+
+// Runs the counted loop program on 1 to N cores of a vm_t at once (N at least
+// the number of host CPUs), reporting aggregate instructions per second and
+// the speedup over one core. Also checks that every core overflows its own 
+// slice of the stack space and no other.
+void bench_vm(instr_table_t *itab) {
+    const uint16_t iters = 50000;
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint8_t max_cores = n_cpus < 2 ? 2 : (n_cpus > 64 ? 64 : (uint8_t) n_cpus);
+    double base = 0.0;
+    for (uint8_t n = 1; ; n = n * 2 > max_cores ? max_cores : n * 2) {
+        vm_t *vm = vm_init(n, itab);
+        vm->pin = 1;
+        uint32_t n_instr = bench_loop_program(itab, vm->smem, iters);
+        for (uint8_t i = 0; i < n; i++) {
+            vm->cores[i]->icache = icache_build(itab, vm->smem, 0);
+        }
+        double t0 = bench_now_ns();
+        for (int rep = 0; rep < BENCH_REPS / 20; rep++) {
+            vm_reset(vm);
+            vm_run(vm);
+        }
+        double secs = (bench_now_ns() - t0) / 1e9;
+        for (uint8_t i = 0; i < n; i++) {
+            core_t *core = vm->cores[i];
+            if (core->stc != ERR_HALT || core->iregs[IRV] != 6 || core->fregs[FR0] != (float) iters) {
+                bench_fail("vm/%u: wrong result on core %u (stc %d)\n", n, i, core->stc);
+            }
+        }
+        double rate = (double) n_instr * n * (BENCH_REPS / 20) / secs / 1e6;
+        base = n == 1 ? rate : base;
+        printf("vm/cores=%-3u  %8.2f Minstr/s  speedup %5.2f\n", n, rate, rate / base);
+
+        // push until the stack overflows
+        memset(vm->smem->mem, 0, MEMORY_RWBLKMIN);
+        bench_asm_t a = { itab, vm->smem, 0 };
+        uint16_t set_loop = emit(&a, SETI, IR1, 0, 0);
+        uint16_t loop = a.pc;
+        emit(&a, PSHI, IR0, 0, 0);
+        emit(&a, MOVI, IR1, RPC, 0);
+        a.pc = set_loop;
+        emit(&a, SETI, IR1, 0, loop);
+        vm_reset(vm);
+        for (uint8_t i = 0; i < n; i++) {
+            icache_delete(vm->cores[i]->icache);
+            vm->cores[i]->icache = NULL;
+            vm->cores[i]->iregs[IR0] = i;
+        }
+        vm_run(vm);
+        for (uint8_t i = 0; i < n; i++) {
+            core_t *core = vm->cores[i];
+            uint16_t last = core->iregs[RSP] - 2;
+            if (core->stc != ERR_STACKOVERFLOW || core->iregs[RSP] + 2 < core->stack_limit - 2 
+                || mem_get_uint16(vm->smem, last) != i || mem_get_uint16(vm->smem, core->stack_base) != i) {
+                bench_fail("vm/%u: core %u overflowed outside its stack (rsp 0x%04X)\n", n, i, core->iregs[RSP]);
+            }
+        }
+        vm_delete(vm);
+        if (n == max_cores) {
+            break;
+        }
+    }
+}
+
+
+// Assemble a loop that increments the shared word at an address a number of
+// times, either with one fadi or with a lodi/casi retry loop.
+void bench_counter_program(const instr_table_t *itab, sysmem_t *smem, uint16_t addr, uint16_t iters, int cas) {
+    memset(smem->mem, 0, MEMORY_RWBLKMIN);
+    bench_asm_t a = { itab, smem, 0 };
+    emit(&a, SETI, IR0, 0, addr);
+    emit(&a, SETI, IR2, 0, iters);
+    emit(&a, SETI, IR3, 0, 0);
+    uint16_t set_loop = emit(&a, SETI, IR1, 0, 0);
+    emit(&a, MOVI, IR1, RBP, 0);
+    emit(&a, SETI, IR1, 0, 1);
+    uint16_t loop = a.pc;
+    if (cas) {
+        // expected = current word, new = expected + 1, start over on failure
+        emit(&a, LODI, IRV, 0, addr);
+        emit(&a, MOVI, IRV, IR1, 0);
+        emit(&a, INCI, IR1, 0, 0);
+        emitr(&a, CASI, IR0, IRV, IR1);
+        emit(&a, MNEI, RBP, RPC, 0);
+    } else {
+        emitr(&a, FADI, IR0, IR1, IRV);
+    }
+    emit(&a, DECI, IR2, 0, 0);
+    emit(&a, CMPI, IR2, IR3, 0);
+    emit(&a, MNEI, RBP, RPC, 0);
+    emit(&a, HALT, 0, 0, 0);
+    a.pc = set_loop;
+    emit(&a, SETI, IR1, 0, loop);
+}
+
+
+// Every core of a vm_t increments one shared counter, reporting aggregate 
+// increments per second for 1 to N cores. The final count must be exact.
+void bench_atomics(instr_table_t *itab) {
+    const uint16_t iters = 20000, addr = 0x2000;
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint8_t max_cores = n_cpus < 4 ? 4 : (n_cpus > 64 ? 64 : (uint8_t) n_cpus);
+    const char *names[] = { "fadi", "casi" };
+    for (int cas = 0; cas < 2; cas++) {
+        for (uint8_t n = 1; ; n = n * 2 > max_cores ? max_cores : n * 2) {
+            vm_t *vm = vm_init(n, itab);
+            bench_counter_program(itab, vm->smem, addr, iters, cas);
+            for (uint8_t i = 0; i < n; i++) {
+                vm->cores[i]->icache = icache_build(itab, vm->smem, 0);
+            }
+            double ns = 0.0;
+            for (int rep = 0; rep < BENCH_REPS / 20; rep++) {
+                mem_set_uint16(vm->smem, addr, 0);
+                vm_reset(vm);
+                double t0 = bench_now_ns();
+                vm_run(vm);
+                ns += bench_now_ns() - t0;
+                for (uint8_t i = 0; i < n; i++) {
+                    if (vm->cores[i]->stc != ERR_HALT) {
+                        bench_fail("atomic/%s: core %u stopped with stc %d\n", names[cas], i, vm->cores[i]->stc);
+                    }
+                }
+                if (mem_get_uint16(vm->smem, addr) != (uint16_t) (n * iters)) {
+                    bench_fail("atomic/%s: lost updates (%u of %u)\n", names[cas], 
+                               mem_get_uint16(vm->smem, addr), (uint16_t) (n * iters));
+                }
+            }
+            printf("atomic/%s/cores=%-3u %8.2f Mincr/s\n", names[cas], n, 
+                   (double) n * iters * (BENCH_REPS / 20) / (ns / 1e9) / 1e6);
+            vm_delete(vm);
+            if (n == max_cores) {
+                break;
+            }
+        }
+    }
+}
+
+
+// Many short programs (the counted loop program with a few iterations): one
+// fresh sysmem_t/core_t per program on a single thread, against a pool of 
+// workers that recycle theirs.
+void bench_pool(instr_table_t *itab) {
+    const uint32_t n_jobs = 20000;
+    const uint16_t iters = 50;
+    sysmem_t *img = sysmem_init(1);
+    uint32_t n_instr = bench_loop_program(itab, img, iters);
+    uint16_t size = MEMORY_RWBLKMIN;
+    while (size && !img->mem[size - 1]) {
+        size--;
+    }
+    pool_job_t *jobs = calloc(n_jobs, sizeof(pool_job_t));
+    for (uint32_t i = 0; i < n_jobs; i++) {
+        jobs[i].itab = itab;
+        jobs[i].image = img->mem;
+        jobs[i].size = size;
+    }
+
+    double t0 = bench_now_ns();
+    for (uint32_t i = 0; i < n_jobs; i++) {
+        sysmem_t *smem = sysmem_init(1);
+        memcpy(smem->mem, img->mem, size);
+        core_t *core = core_init(0, smem);
+        core->itab = itab;
+        core_run(core);
+        jobs[i].stc = core->stc;
+        core_delete(core);
+        sysmem_delete(smem);
+    }
+    double secs = (bench_now_ns() - t0) / 1e9;
+    printf("pool/alloc       %10.0f programs/s  (%u instr each)\n", n_jobs / secs, n_instr);
+
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t n_workers = n_cpus < 2 ? 2 : (uint32_t) n_cpus;
+    pool_t *pool = pool_init(n_workers);
+    for (int round = 0; round < 3; round++) {
+        // first round warms up the workers, the second submits everything at 
+        // once (throughput), the third a few jobs per worker at a time so the 
+        // latency is not just time spent queued
+        uint32_t batch = round == 2 ? 4 * n_workers : n_jobs;
+        for (uint32_t i = 0; i < n_jobs; i += batch) {
+            for (uint32_t j = i; j < n_jobs && j < i + batch; j++) {
+                pool_submit(pool, &jobs[j]);
+            }
+            pool_wait(pool);
+        }
+        pool_stats_t st;
+        pool_stats(pool, jobs, n_jobs, &st);
+        for (uint32_t i = 0; i < n_jobs; i++) {
+            if (jobs[i].stc != ERR_HALT || jobs[i].irv != 6) {
+                bench_fail("pool: wrong result for job %u (stc %d)\n", i, jobs[i].stc);
+                break;
+            }
+        }
+        if (round) {
+            printf("pool/workers=%-3u %s %10.0f programs/s  latency p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f us  (%lu steals)\n",
+                   n_workers, round == 1 ? "all    " : "batched", st.jobs_per_sec, st.p50_ns / 1e3, st.p90_ns / 1e3, st.p99_ns / 1e3,
+                   st.p999_ns / 1e3, st.max_ns / 1e3, (unsigned long) st.n_steals);
+        }
+    }
+    pool_delete(pool);
+    free(jobs);
+    sysmem_delete(img);
+}
+
+
+// A machine that spends a while initializing its read/write block, then a
+// short phase that differs between runs: the cost of starting each run from
+// the warm state by copying the memory against forking a snapshot of it.
+void bench_fork(instr_table_t *itab) {
+    const int n_children = 2000;
+    vm_t *parent = vm_init(1, itab);
+    bench_asm_t a = { itab, parent->smem, 0 };
+    // initialization: fill most of the read/write block, then halt
+    emit(&a, SETI, IR0, 0, 0xA5);
+    emit(&a, SETI, IR1, 0, MEMORY_RWBLKMIN);
+    emit(&a, SETI, IR2, 0, 0xC000);
+    emitr(&a, BFIL, IR0, IR1, IR2);
+    emit(&a, HALT, 0, 0, 0);
+    // the part each child runs: store its own ir3 at one address
+    emit(&a, STOI, IR3, 0, 0x4000);
+    emit(&a, HALT, 0, 0, 0);
+    core_run(parent->cores[0]);
+    vm_snapshot_t *snap = vm_snapshot(parent);
+
+    for (int cow = 0; cow < 2; cow++) {
+        double t_fork = 0.0, t0 = bench_now_ns();
+        for (int i = 0; i < n_children; i++) {
+            double f0 = bench_now_ns();
+            vm_t *child;
+            if (cow) {
+                child = vm_fork(snap);
+            } else {
+                child = vm_init(1, itab);
+                memcpy(child->smem->mem, parent->smem->mem, MEMORY_MAPSIZE);
+                *child->cores[0] = *parent->cores[0];
+                child->cores[0]->smem = child->smem;
+            }
+            t_fork += bench_now_ns() - f0;
+            core_t *core = child->cores[0];
+            core->iregs[IR3] = (uint16_t) i;
+            core->stc = NO_ERR;
+            core_run(core);
+            if (core->stc != ERR_HALT || mem_get_uint16(child->smem, 0x4000) != (uint16_t) i
+                || child->smem->mem[0xDF00] != 0xA5 || parent->smem->mem[0x4000] != 0xA5) {
+                bench_fail("fork: child %d does not see its own copy of memory\n", i);
+                break;
+            }
+            vm_delete(child);
+        }
+        double t1 = bench_now_ns();
+        printf("fork/%-5s %8.2f us/fork  %8.2f us/child (fork, run, free)\n", cow ? "cow" : "copy",
+               t_fork / n_children / 1e3, (t1 - t0) / n_children / 1e3);
+    }
+    vm_snapshot_delete(snap);
+    vm_delete(parent);
+}
+
+
+// Cold start of a batch of programs from image files on disk: the counted 
+// loop program plus 32 kB of initial data, loaded by mapping the image into
+// the memory vs. copying it. Then building the instruction cache for a full
+// read only block from the pre-decoded instructions vs. decoding it.
+void bench_image(instr_node_t *tree, instr_table_t *itab) {
+    const int n_images = 200;
+    const uint16_t rw_size = 0x8000;
+    char dir[] = "/tmp/c16imgXXXXXX";
+    if (!mkdtemp(dir)) {
+        bench_fail("image: cannot create a temporary directory\n");
+        return;
+    }
+    char path[64];
+    sysmem_t *src = sysmem_init(1);
+    bench_loop_program(itab, src, 100);
+    for (uint32_t i = 0; i < rw_size; i++) {
+        src->mem[MEMORY_RWBLKMIN + i] = (uint8_t) (i * 13);
+    }
+    for (int i = 0; i < n_images; i++) {
+        snprintf(path, sizeof(path), "%s/%d.c16", dir, i);
+        image_write(path, tree, src, 0, 64, rw_size, 0);
+    }
+
+    for (int map = 1; map >= 0; map--) {
+        int n_mapped = 0;
+        double t0 = bench_now_ns();
+        for (int i = 0; i < n_images; i++) {
+            snprintf(path, sizeof(path), "%s/%d.c16", dir, i);
+            image_t *img = image_open(path);
+            sysmem_t *smem = sysmem_init(1);
+            // the loader only maps into memory it may replace
+            uint8_t kind = smem->mem_kind;
+            smem->mem_kind = map ? kind : SYSMEM_EXTERNAL;
+            n_mapped += image_load(img, smem);
+            smem->mem_kind = kind;
+            core_t *core = core_init(0, smem);
+            image_start(img, core);
+            core_run(core);
+            if (!img || core->stc != ERR_HALT || core->iregs[IRV] != 6 
+                || smem->mem[MEMORY_RWBLKMIN + rw_size - 1] != (uint8_t) ((rw_size - 1) * 13)) {
+                bench_fail("image: wrong result for %s\n", path);
+            }
+            core_delete(core);
+            sysmem_delete(smem);
+            image_close(img);
+        }
+        printf("image/%-4s   %8.2f us/program  (%d of %d mapped)\n", map ? "map" : "copy",
+               (bench_now_ns() - t0) / n_images / 1e3, n_mapped, n_images);
+    }
+
+    // rewriting an image that is still mapped into a memory leaves that 
+    // memory as it was loaded
+    snprintf(path, sizeof(path), "%s/0.c16", dir);
+    image_t *img = image_open(path);
+    sysmem_t *smem = sysmem_init(1);
+    int mapped = img && image_load(img, smem);
+    image_close(img);
+    image_write(path, tree, src, 0, 64, 0, 0);
+    if (mapped && smem->mem[MEMORY_RWBLKMIN + rw_size - 1] != (uint8_t) ((rw_size - 1) * 13)) {
+        bench_fail("image: mapped memory changed by rewriting its file\n");
+    }
+    // its read only block takes host stores again once the layout makes it 
+    // writable or it is loaded again by copying (a trailing byte keeps the
+    // image from being mapped)
+    sysmem_protect(smem, 0, MEMORY_PAGESIZE, MEM_R | MEM_W);
+    mem_set_uint16(smem, 0, 0xC16);
+    image_write(path, tree, src, 0, 64, rw_size, 0);
+    FILE *f = fopen(path, "ab");
+    if (f) {
+        fputc(0, f);
+        fclose(f);
+    }
+    img = image_open(path);
+    if (!img || image_load(img, smem) || mem_get_uint16(smem, 0) != mem_get_uint16(src, 0)) {
+        bench_fail("image: mapped memory not loaded again by copying\n");
+    }
+    image_close(img);
+    sysmem_delete(smem);
+    for (int i = 0; i < n_images; i++) {
+        snprintf(path, sizeof(path), "%s/%d.c16", dir, i);
+        remove(path);
+    }
+
+    // a full read only block, with and without pre-decoded instructions
+    bench_fill_opcodes(src, itab, bench_profile);
+    for (int decoded = 0; decoded < 2; decoded++) {
+        snprintf(path, sizeof(path), "%s/full.c16", dir);
+        image_write(path, tree, src, 0, MEMORY_RWBLKMIN, 0, decoded);
+        image_t *img = image_open(path);
+        sysmem_t *smem = sysmem_init(1);
+        image_load(img, smem);
+        double t0 = bench_now_ns();
+        icache_t *cache = image_icache(img, smem, ICACHE_ALLFUSIONS);
+        double t1 = bench_now_ns();
+        icache_t *check = icache_build(img->itab, smem, ICACHE_ALLFUSIONS);
+        if (cache->n_ops != check->n_ops || memcmp(&cache->ops[cache->n_ops / 2].in, &check->ops[check->n_ops / 2].in, sizeof(instr_t))) {
+            bench_fail("image: pre-decoded cache differs from decoding\n");
+        }
+        printf("image/icache/%-7s %8.2f us  (%u records)\n", decoded ? "decoded" : "decode", (t1 - t0) / 1e3, cache->n_ops);
+        icache_delete(check);
+        icache_delete(cache);
+        sysmem_delete(smem);
+        image_close(img);
+        remove(path);
+    }
+
+    // pre-decoded instructions the decoder could not have produced are refused
+    memset(src->mem, 0, MEMORY_RWBLKMIN);
+    bench_asm_t a = { itab, src, 0 };
+    emit(&a, SETI, IR0, 0, 1);
+    emit(&a, ADDI, IR0, IR1, 0);
+    instr_t ins[2];
+    instr_fetch(itab, src->mem, instr_fetch(itab, src->mem, 0, &ins[0]), &ins[1]);
+    for (int bad = 0; bad < 3; bad++) {
+        instr_t copy[2] = { ins[0], ins[1] };
+        copy[1].reg[1] += bad == 1 ? 8 : 0;
+        copy[1].next += bad == 2;
+        icache_t *cache = icache_build_decoded(itab, src, 0, copy, 2);
+        if (!cache != (bad > 0)) {
+            bench_fail("image: pre-decoded record %s\n", bad ? "out of range accepted" : "refused");
+        }
+        icache_delete(cache);
+    }
+    rmdir(dir);
+    sysmem_delete(src);
+}
+
+
+// Checkpoint and restore of a 2 core machine stopped halfway through its 
+// program, with 12 kB of repetitive data and a page of noise in memory: file 
+// size and the time to save and restore it, raw (restored by mapping) vs. 
+// compressed. The restored machine has to match and finish the same way.
+void bench_checkpoint(instr_table_t *itab) {
+    const int n_reps = 200;
+    char dir[] = "/tmp/c16ckptXXXXXX";
+    if (!mkdtemp(dir)) {
+        bench_fail("checkpoint: cannot create a temporary directory\n");
+        return;
+    }
+    char path[64];
+    vm_t *vm = vm_init(2, itab);
+    bench_asm_t a = { itab, vm->smem, 0 };
+    // first part: fill memory, leave state in every kind of register, halt
+    emit(&a, SETI, IR0, 0, 0xA5);
+    emit(&a, SETI, IR1, 0, MEMORY_RWBLKMIN);
+    emit(&a, SETI, IR2, 0, 0x3000);
+    emitr(&a, BFIL, IR0, IR1, IR2);
+    emit(&a, SETI, IR3, 0, 7);
+    emitf(&a, FR1, 2.5f);
+    emitr(&a, CMPI, IR3, IR0, 0);
+    emit(&a, PSHI, IR3, 0, 0);
+    emit(&a, HALT, 0, 0, 0);
+    // second part: depends on all of it
+    emit(&a, STOI, IR3, 0, 0x4000);
+    emit(&a, POPI, IR1, 0, 0);
+    emit(&a, MLTI, IR3, IR2, 0);
+    emit(&a, ADDF, FR1, FR1, 0);
+    emit(&a, HALT, 0, 0, 0);
+    for (uint32_t i = 0; i < 0x1000; i++) {
+        vm->smem->mem[0x8000 + i] = (uint8_t) (i * 2654435761u >> 13);
+    }
+    vm_run(vm);
+
+    for (int compress = 0; compress < 2; compress++) {
+        snprintf(path, sizeof(path), "%s/%d.c16s", dir, compress);
+        double t0 = bench_now_ns();
+        for (int i = 0; i < n_reps; i++) {
+            vm_save(vm, path, compress);
+        }
+        double t1 = bench_now_ns();
+        vm_t *copy = NULL;
+        for (int i = 0; i < n_reps; i++) {
+            vm_delete(copy);
+            copy = vm_restore(path, itab);
+        }
+        double t2 = bench_now_ns();
+        FILE *f = fopen(path, "rb");
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        fclose(f);
+
+        int same = copy && !memcmp(copy->smem->mem, vm->smem->mem, MEMORY_MAPSIZE) 
+                   && !memcmp(copy->smem->pages, vm->smem->pages, sizeof(vm->smem->pages));
+        for (uint8_t i = 0; same && i < vm->n_cores; i++) {
+            const core_t *x = vm->cores[i], *y = copy->cores[i];
+            same = !memcmp(x->iregs, y->iregs, sizeof(x->iregs)) && !memcmp(x->fregs, y->fregs, sizeof(x->fregs))
+                   && x->rcmp == y->rcmp && x->stc == y->stc && x->fault_pc == y->fault_pc 
+                   && x->stack_base == y->stack_base && x->stack_limit == y->stack_limit;
+        }
+        if (!same) {
+            bench_fail("checkpoint: restored state differs from the saved machine\n");
+        } else {
+            // both finish the program from where it was saved
+            vm_t *vms[2] = { copy, vm_restore(path, itab) };
+            for (int v = 0; v < 2; v++) {
+                for (uint8_t i = 0; i < vms[v]->n_cores; i++) {
+                    vms[v]->cores[i]->stc = NO_ERR;
+                }
+                vm_run(vms[v]);
+            }
+            for (uint8_t i = 0; i < copy->n_cores; i++) {
+                const core_t *y = copy->cores[i];
+                if (y->stc != ERR_HALT || y->iregs[IR1] != 7 || y->iregs[IR2] != 7 || y->fregs[FR1] != 5.0f
+                    || mem_get_uint16(copy->smem, 0x4000) != 7 || vm->smem->mem[0x4000] != 0xA5) {
+                    bench_fail("checkpoint: wrong result on core %u of the restored machine\n", i);
+                }
+            }
+            // checkpoint again to the path the other one was restored (and 
+            // still maps its memory) from
+            int saved = vm_save(copy, path, compress) == 0;
+            vm_t *again = vm_restore(path, itab);
+            if (!saved || !again || memcmp(vms[1]->smem->mem, copy->smem->mem, MEMORY_MAPSIZE)
+                || memcmp(again->smem->mem, copy->smem->mem, MEMORY_MAPSIZE)) {
+                bench_fail("checkpoint: saving over the file of a restored machine failed\n");
+            }
+            vm_delete(again);
+            vm_delete(vms[1]);
+        }
+        printf("checkpoint/%-4s save %8.2f us  restore %8.2f us  %6ld bytes\n", compress ? "pack" : "raw",
+               (t1 - t0) / n_reps / 1e3, (t2 - t1) / n_reps / 1e3, size);
+        vm_delete(copy);
+        remove(path);
+    }
+
+    // run ends are recomputed (a run end past the last page is not used), and
+    // files with a page table or stack bounds that do not hold together are
+    // rejected: a guard entry that is not 0, a stack layout other than the 
+    // table gives, a stack outside of it and rsp outside of its stack
+    snprintf(path, sizeof(path), "%s/bad.c16s", dir);
+    vm_save(vm, path, 0);
+    FILE *f = fopen(path, "rb");
+    uint8_t good[VM_CKPT_HEADERSIZE + 2 * VM_CKPT_CORESIZE];
+    size_t got = fread(good, 1, sizeof(good), f);
+    fclose(f);
+    const uint32_t bad_at[5] = { 0x10 + 2 * 0x100, 0x10 + 2 * MEMORY_NPAGES, 0x0E, VM_CKPT_HEADERSIZE + 0x2A,
+                                 VM_CKPT_HEADERSIZE + 2 * RSP };
+    for (int b = 0; b < 5 && got == sizeof(good); b++) {
+        uint8_t h[sizeof(good)];
+        uint16_t v = 0xFFF0 | (good[bad_at[b]] & 0x0F);
+        memcpy(h, good, sizeof(good));
+        memcpy(h + bad_at[b], &v, 2);
+        f = fopen(path, "r+b");
+        fwrite(h, 1, sizeof(h), f);
+        fclose(f);
+        vm_t *bad = vm_restore(path, itab);
+        if (b == 0 ? !bad || bad->smem->pages[0x100] != vm->smem->pages[0x100] : bad != NULL) {
+            bench_fail("checkpoint: invalid file %d was restored as is\n", b);
+        }
+        vm_delete(bad);
+    }
+    remove(path);
+    rmdir(dir);
+    vm_delete(vm);
+}
+
+
+/*
+Sampled suite: every result is measured BENCH_SAMPLES times after a warm-up 
+run and reported as one line with the median, the spread and the unit, so that
+runs on different commits can be compared line by line:
+    <name> <median> <unit> mean <mean> sd <stddev> min <min> max <max> n <samples>
+or, with -json, as one JSON object per line with the same fields.
+*/
+#define BENCH_SAMPLES 7
+
+
+// output format of the sampled suite
+int bench_json = 0;
+
+
+// Sort helper for the median.
+int bench_cmp_double(const void *a, const void *b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+
+// Report the samples of one result.
+void bench_report(const char *name, const char *unit, const double *samples, int n) {
+    double sorted[BENCH_SAMPLES];
+    double mean = 0.0, var = 0.0;
+    for (int i = 0; i < n; i++) {
+        sorted[i] = samples[i];
+        mean += samples[i] / n;
+    }
+    for (int i = 0; i < n; i++) {
+        var += (samples[i] - mean) * (samples[i] - mean) / (n > 1 ? n - 1 : 1);
+    }
+    qsort(sorted, n, sizeof(double), bench_cmp_double);
+    double median = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2.0;
+    if (bench_json) {
+        printf("{\"name\": \"%s\", \"unit\": \"%s\", \"median\": %.4f, \"mean\": %.4f, \"stddev\": %.4f, "
+               "\"min\": %.4f, \"max\": %.4f, \"samples\": %d}\n",
+               name, unit, median, mean, sqrt(var), sorted[0], sorted[n - 1], n);
+    } else {
+        printf("%-28s %12.3f %-9s mean %12.3f sd %10.3f min %12.3f max %12.3f n %d\n",
+               name, median, unit, mean, sqrt(var), sorted[0], sorted[n - 1], n);
+    }
+}
+
+
+// A core running a program from its instruction cache, reps times per sample.
+typedef struct bench_run {
+    core_t *core;
+    int reps;
+} bench_run_t;
+
+
+void bench_run_reps(void *arg) {
+    bench_run_t *r = arg;
+    for (int rep = 0; rep < r->reps; rep++) {
+        bench_reset_core(r->core);
+        core_run(r->core);
+    }
+}
+
+
+// Time a function that performs a number of operations, returns samples in 
+// nanoseconds per operation (after one run to warm up).
+void bench_sample(void (*fn)(void*), void *arg, double ops, double *samples) {
+    fn(arg);
+    for (int s = 0; s < BENCH_SAMPLES; s++) {
+        double t0 = bench_now_ns();
+        fn(arg);
+        samples[s] = (bench_now_ns() - t0) / ops;
+    }
+}
+
+
+// Turn samples in ns per operation into millions of operations per second.
+void bench_to_rate(double *samples, double scale) {
+    for (int s = 0; s < BENCH_SAMPLES; s++) {
+        samples[s] = scale * 1e3 / samples[s];
+    }
+}
+
+
+// Instructions a core retires running its program once (counted).
+uint64_t bench_count_instrs(core_t *core) {
+    stats_enable(core);
+    bench_reset_core(core);
+    core_run(core);
+    uint64_t n = 0;
+    for (int op = 0; op < N_OPCODES; op++) {
+        n += core->stats->retired[op];
+    }
+    stats_disable(core);
+    return n;
+}
+
+
+// Microbenchmark bodies: one or two instructions that can be repeated any
+// number of times after the prologue below without raising an error.
+typedef struct bench_op {
+    const char *name;
+    uint8_t n;
+    instr_t body[2];
+} bench_op_t;
+
+#define B1(op, ...) { .opcode = op, __VA_ARGS__ }
+const bench_op_t bench_ops[] = {
+    { "noop", 1, { B1(NOOP) } },
+    { "seti", 1, { B1(SETI, .reg = { IR3 }, .imm.u = 7) } },
+    { "movi", 1, { B1(MOVI, .reg = { IR2, IR3 }) } },
+    { "cmpi", 1, { B1(CMPI, .reg = { IR0, IR1 }) } },
+    { "cmpi+meqi", 2, { B1(CMPI, .reg = { IR0, IR1 }), B1(MEQI, .reg = { IR2, IR3 }) } },
+    { "cmpi+mnei", 2, { B1(CMPI, .reg = { IR0, IR1 }), B1(MNEI, .reg = { IR2, IR3 }) } },
+    { "cmpi+mgti", 2, { B1(CMPI, .reg = { IR0, IR1 }), B1(MGTI, .reg = { IR2, IR3 }) } },
+    { "cmpi+mgei", 2, { B1(CMPI, .reg = { IR0, IR1 }), B1(MGEI, .reg = { IR2, IR3 }) } },
+    { "cmpi+mlti", 2, { B1(CMPI, .reg = { IR0, IR1 }), B1(MLTI, .reg = { IR2, IR3 }) } },
+    { "cmpi+mlei", 2, { B1(CMPI, .reg = { IR0, IR1 }), B1(MLEI, .reg = { IR2, IR3 }) } },
+    { "inci", 1, { B1(INCI, .reg = { IR3 }) } },
+    { "deci", 1, { B1(DECI, .reg = { IR0 }) } },
+    { "addi", 1, { B1(ADDI, .reg = { IR3, IR2 }) } },
+    { "subi", 1, { B1(SUBI, .reg = { IR3, IR2 }) } },
+    { "muli", 1, { B1(MULI, .reg = { IR2, IR3 }) } },
+    { "divi", 1, { B1(DIVI, .reg = { IR2, IR3 }) } },
+    { "modi", 1, { B1(MODI, .reg = { IR2, IR3 }) } },
+    { "andi", 1, { B1(ANDI, .reg = { IR2, IR3 }) } },
+    { "ori", 1, { B1(ORI, .reg = { IR2, IR3 }) } },
+    { "xori", 1, { B1(XORI, .reg = { IR2, IR3 }) } },
+    { "shli", 1, { B1(SHLI, .reg = { IR3, IR2 }) } },
+    { "shri", 1, { B1(SHRI, .reg = { IR3, IR2 }) } },
+    { "rotl", 1, { B1(ROTL, .reg = { IR3, IR2 }) } },
+    { "leai", 1, { B1(LEAI, .reg = { IR0, IR2, 2, IR3 }) } },
+    { "lodi", 1, { B1(LODI, .reg = { IR3 }, .imm.u = 0x2000) } },
+    { "stoi", 1, { B1(STOI, .reg = { IR3 }, .imm.u = 0x2000) } },
+    { "pshi+popi", 2, { B1(PSHI, .reg = { IR0 }), B1(POPI, .reg = { IR3 }) } },
+    { "call+retn", 2, { B1(CALL), B1(RETN) } },
+    { "lcal+lret", 2, { B1(LCAL), B1(LRET) } },
+    { "calm+retm/ir0", 2, { B1(CALM, .reg = { 0x01 }), B1(RETM) } },
+    { "jmpr", 1, { B1(JMPR) } },
+    { "cmpi+jlt", 2, { B1(CMPI, .reg = { IR0, IR1 }), B1(JLT) } },
+    { "setf", 1, { B1(SETF, .reg = { FR0 }, .imm.f = 1.5f) } },
+    { "movf", 1, { B1(MOVF, .reg = { FR1, FR0 }) } },
+    { "lodf", 1, { B1(LODF, .reg = { FR0 }, .imm.u = 0x2000) } },
+    { "stof", 1, { B1(STOF, .reg = { FR0 }, .imm.u = 0x2000) } },
+    { "pshf+popf", 2, { B1(PSHF, .reg = { FR1 }), B1(POPF, .reg = { FR0 }) } },
+    { "addf", 1, { B1(ADDF, .reg = { FR1, FR0 }) } },
+    { "subf", 1, { B1(SUBF, .reg = { FR1, FR0 }) } },
+    { "mulf", 1, { B1(MULF, .reg = { FR1, FR0 }) } },
+    { "divf", 1, { B1(DIVF, .reg = { FR1, FR0 }) } },
+    { "bcpy/64", 1, { B1(BCPY, .reg = { IR0, IR1, IR2 }) } },
+    { "bfil/64", 1, { B1(BFIL, .reg = { IR3, IR1, IR2 }) } },
+    { "bcmp/64", 1, { B1(BCMP, .reg = { IR0, IR1, IR2 }) } },
+    { "casi", 1, { B1(CASI, .reg = { IR0, IR3, IR3 }) } },
+    { "fadi", 1, { B1(FADI, .reg = { IR0, IR3, IR3 }) } },
+    { "xchi", 1, { B1(XCHI, .reg = { IR0, IR3, IR3 }) } },
+    { "vadf/64", 1, { B1(VADF, .reg = { IR0, IR1, IR2 }) } },
+    { "vmlf/64", 1, { B1(VMLF, .reg = { IR0, IR1, IR2 }) } },
+    { "vmnf/64", 1, { B1(VMNF, .reg = { IR0, IR1, IR2 }) } },
+    { "vmxf/64", 1, { B1(VMXF, .reg = { IR0, IR1, IR2 }) } },
+    { "vfmf/64", 1, { B1(VFMF, .reg = { IR0, IR1, IR2, FR3 }) } },
+    { "vrdf/64", 1, { B1(VRDF, .reg = { IR0, IR2, FR0 }) } },
+    { "vdtf/64", 1, { B1(VDTF, .reg = { IR0, IR1, IR2, FR0 }) } },
+    { "vadi/64", 1, { B1(VADI, .reg = { IR0, IR1, IR2 }) } },
+    { "vmli/64", 1, { B1(VMLI, .reg = { IR0, IR1, IR2 }) } },
+    { "vmni/64", 1, { B1(VMNI, .reg = { IR0, IR1, IR2 }) } },
+    { "vmxi/64", 1, { B1(VMXI, .reg = { IR0, IR1, IR2 }) } },
+    { "vrdi/64", 1, { B1(VRDI, .reg = { IR0, IR2, IR3 }) } },
+};
+#undef B1
+
+
+// Assemble the prologue (ir0 = 0x2000, ir1 = 0x3000, ir2 = 64, ir3 = 0, 
+// fr1 = 1, fr3 = 0.5), n copies of a body and halt. A body that starts with a
+// call is a call and its return: the calls are repeated and all go to the 
+// return, placed after the halt.
+void bench_op_program(const instr_table_t *itab, sysmem_t *smem, const bench_op_t *b, uint16_t n) {
+    opcode_t first = b->body[0].opcode;
+    int call = first == CALL || first == LCAL || first == CALM;
+    bench_asm_t a = { itab, smem, 0 };
+    emit(&a, SETI, IR0, 0, 0x2000);
+    emit(&a, SETI, IR1, 0, 0x3000);
+    emit(&a, SETI, IR2, 0, 64);
+    emit(&a, SETI, IR3, 0, 0);
+    emitf(&a, FR1, 1.0f);
+    emitf(&a, FR3, 0.5f);
+    uint16_t body = a.pc;
+    for (uint16_t i = 0; i < n; i++) {
+        for (uint8_t k = 0; k < (call ? 1 : b->n); k++) {
+            a.pc = instr_encode(itab, smem->mem, a.pc, &b->body[k]);
+        }
+    }
+    emit(&a, HALT, 0, 0, 0);
+    if (call) {
+        // point every call at the return that follows the halt
+        instr_t in = b->body[0];
+        in.imm.u = a.pc;
+        a.pc = instr_encode(itab, smem->mem, a.pc, &b->body[1]);
+        a.pc = body;
+        for (uint16_t i = 0; i < n; i++) {
+            a.pc = instr_encode(itab, smem->mem, a.pc, &in);
+        }
+    }
+}
+
+
+// Every instruction on its own (run from the instruction cache without 
+// superinstructions), the decoder and the memory accessors, in ns per 
+// operation.
+void bench_micro(instr_table_t *itab, sysmem_t *smem) {
+    const uint16_t n = 400;
+    double samples[BENCH_SAMPLES];
+    char name[64];
+    for (size_t i = 0; i < sizeof(bench_ops) / sizeof(bench_ops[0]); i++) {
+        memset(smem->mem, 0, MEMORY_SIZE);
+        bench_op_program(itab, smem, &bench_ops[i], n);
+        core_t *core = core_init(0, smem);
+        core->itab = itab;
+        core->icache = icache_build(itab, smem, 0);
+        bench_run_t run = { core, 200 };
+        bench_sample(bench_run_reps, &run, (double) n * run.reps, samples);
+        if (core->stc != ERR_HALT) {
+            bench_fail("micro/%s: program stopped with stc %d\n", bench_ops[i].name, core->stc);
+        }
+        snprintf(name, sizeof(name), "micro/op/%s", bench_ops[i].name);
+        bench_report(name, "ns/op", samples, BENCH_SAMPLES);
+        icache_delete(core->icache);
+        core_delete(core);
+    }
+
+    // decode complete instructions (random opcodes, operands all 0)
+    memset(smem->mem, 0, MEMORY_SIZE);
+    srand(16);
+    uint32_t n_instr = 0;
+    for (uint16_t pc = 0; ; n_instr++) {
+        instr_t in = { .opcode = bench_rand_opcode(bench_profile) };
+        uint8_t bits = itab->code[in.opcode].len;
+        for (const uint8_t *k = instr_operands[in.opcode]; *k != OPND_NONE; k++) {
+            bits += instr_opnd_bits[*k];
+        }
+        if (pc + bits > INSTR_ROMBITS) {
+            break;
+        }
+        pc = instr_encode(itab, smem->mem, pc, &in);
+    }
+    for (int s = -1; s < BENCH_SAMPLES; s++) {
+        volatile uint32_t sink = 0;
+        double t0 = bench_now_ns();
+        for (int rep = 0; rep < BENCH_REPS / 10; rep++) {
+            instr_t in;
+            uint16_t pc = 0;
+            for (uint32_t i = 0; i < n_instr; i++) {
+                pc = instr_fetch(itab, smem->mem, pc, &in);
+                sink += in.opcode;
+            }
+        }
+        if (s >= 0) {
+            samples[s] = (bench_now_ns() - t0) / ((double) n_instr * (BENCH_REPS / 10));
+        }
+    }
+    bench_report("micro/decode/fetch", "ns/op", samples, BENCH_SAMPLES);
+
+    // memory accessors over the read/write block
+    const uint32_t n_acc = 1 << 20;
+    for (int kind = 0; kind < 5; kind++) {
+        static const char *const names[] = { 
+            "micro/mem/get_uint8", "micro/mem/get_uint16", "micro/mem/set_uint16", 
+            "micro/mem/get_float", "micro/mem/set_float" 
+        };
+        for (int s = -1; s < BENCH_SAMPLES; s++) {
+            volatile uint32_t isink = 0;
+            volatile float fsink = 0.0f;
+            uint16_t addr = MEMORY_RWBLKMIN;
+            double t0 = bench_now_ns();
+            for (uint32_t i = 0; i < n_acc; i++) {
+                switch (kind) {
+                    case 0: isink += mem_get_uint8(smem, addr); break;
+                    case 1: isink += mem_get_uint16(smem, addr); break;
+                    case 2: mem_set_uint16(smem, addr, (uint16_t) i); break;
+                    case 3: fsink += mem_get_float(smem, addr); break;
+                    default: mem_set_float(smem, addr, (float) i); break;
+                }
+                addr = addr + 6 >= MEMORY_RWBLKMAX - 4 ? MEMORY_RWBLKMIN : addr + 6;
+            }
+            if (s >= 0) {
+                samples[s] = (bench_now_ns() - t0) / n_acc;
+            }
+        }
+        bench_report(names[kind], "ns/op", samples, BENCH_SAMPLES);
+    }
+}
+
+
+// Assemble a recursive fib(n) (result in irv) made of call and retn, or of 
+// calm and retm saving only ir0 and ir3 (all fib needs after a call).
+void bench_fib_program(const instr_table_t *itab, sysmem_t *smem, uint16_t n, int calm) {
+    opcode_t call_op = calm ? CALM : CALL, retn_op = calm ? RETM : RETN;
+    uint8_t mask = calm ? 0x09 : 0;
+    bench_asm_t a = { itab, smem, 0 };
+    emit(&a, SETI, IR0, 0, n);
+    uint16_t call_main = emit(&a, call_op, mask, 0, 0);
+    emit(&a, HALT, 0, 0, 0);
+    // fib: irv = n if n < 2, otherwise fib(n - 1) + fib(n - 2)
+    uint16_t fib = a.pc;
+    emit(&a, SETI, IR1, 0, 2);
+    emit(&a, CMPI, IR0, IR1, 0);
+    uint16_t set_rec = emit(&a, SETI, IR2, 0, 0);
+    emit(&a, MGEI, IR2, RPC, 0);
+    emit(&a, MOVI, IR0, IRV, 0);
+    emit(&a, retn_op, 0, 0, 0);
+    uint16_t rec = a.pc;
+    emit(&a, DECI, IR0, 0, 0);
+    uint16_t call_a = emit(&a, call_op, mask, 0, 0);
+    emit(&a, MOVI, IRV, IR3, 0);
+    emit(&a, DECI, IR0, 0, 0);
+    uint16_t call_b = emit(&a, call_op, mask, 0, 0);
+    emit(&a, ADDI, IR3, IRV, 0);
+    emit(&a, retn_op, 0, 0, 0);
+    a.pc = call_main;
+    emit(&a, call_op, mask, 0, fib);
+    a.pc = call_a;
+    emit(&a, call_op, mask, 0, fib);
+    a.pc = call_b;
+    emit(&a, call_op, mask, 0, fib);
+    a.pc = set_rec;
+    emit(&a, SETI, IR2, 0, rec);
+}
+
+
+// Assemble a loop evaluating a degree 8 polynomial at fr0 by Horner's rule
+// (fr1), iters times.
+void bench_horner_program(const instr_table_t *itab, sysmem_t *smem, uint16_t iters) {
+    bench_asm_t a = { itab, smem, 0 };
+    emit(&a, SETI, IR0, 0, iters);
+    emit(&a, SETI, IR2, 0, 0);
+    emitf(&a, FR0, 0.75f);
+    uint16_t set_loop = emit(&a, SETI, IR1, 0, 0);
+    uint16_t loop = a.pc;
+    emitf(&a, FR1, 1.0f);
+    for (int k = 0; k < 8; k++) {
+        emit(&a, MULF, FR0, FR1, 0);
+        emitf(&a, FR2, 1.0f / (k + 2));
+        emit(&a, ADDF, FR2, FR1, 0);
+    }
+    emit(&a, DECI, IR0, 0, 0);
+    emit(&a, CMPI, IR0, IR2, 0);
+    emit(&a, MNEI, IR1, RPC, 0);
+    emit(&a, HALT, 0, 0, 0);
+    a.pc = set_loop;
+    emit(&a, SETI, IR1, 0, loop);
+}
+
+
+// Assemble a loop that moves 16 words spread over the read/write block 
+// (lodi/stoi), or copies an 8 KB block with bcpy, iters times.
+void bench_memory_program(const instr_table_t *itab, sysmem_t *smem, uint16_t iters, int block) {
+    bench_asm_t a = { itab, smem, 0 };
+    emit(&a, SETI, IR0, 0, iters);
+    emit(&a, SETI, IR2, 0, 0);
+    // the block starts at its own length, so source and length share ir3
+    emit(&a, SETI, IR3, 0, 0x2000);
+    uint16_t set_loop = emit(&a, SETI, IR1, 0, 0);
+    emit(&a, MOVI, IR1, IRV, 0);
+    emit(&a, SETI, IR1, 0, 0x4000);
+    uint16_t loop = a.pc;
+    if (block) {
+        emitr(&a, BCPY, IR3, IR1, IR3);
+    } else {
+        for (uint16_t k = 0; k < 16; k++) {
+            emit(&a, LODI, IR3, 0, 0x2000 + k * 0x0A02);
+            emit(&a, STOI, IR3, 0, 0x2100 + k * 0x0A02);
+        }
+    }
+    emit(&a, DECI, IR0, 0, 0);
+    emit(&a, CMPI, IR0, IR2, 0);
+    emit(&a, MNEI, IRV, RPC, 0);
+    emit(&a, HALT, 0, 0, 0);
+    a.pc = set_loop;
+    emit(&a, SETI, IR1, 0, loop);
+}
+
+
+// Whole programs: recursive calls, a float kernel, memory-bound loops, the
+// same counted loop closed by each kind of branch, the recursive calls saving
+// only what they need, a leaf subroutine called either way and every host CPU
+// running the counted loop at once.
+void bench_macro(instr_table_t *itab, sysmem_t *smem) {
+    double samples[BENCH_SAMPLES];
+    for (int w = 0; w < 12; w++) {
+        static const char *const names[] = { 
+            "macro/calls/fib20", "macro/float/horner", "macro/memory/words", "macro/memory/bcpy",
+            "macro/loop/mnei", "macro/loop/jne", "macro/loop/loop",
+            "macro/calls/fib20-calm", "macro/calls/leaf-call", "macro/calls/leaf-lcal",
+            "macro/alu/muli+modi", "macro/alu/emulated"
+        };
+        memset(smem->mem, 0, MEMORY_SIZE);
+        switch (w) {
+            case 0: bench_fib_program(itab, smem, 20, 0); break;
+            case 1: bench_horner_program(itab, smem, 5000); break;
+            case 2: bench_memory_program(itab, smem, 5000, 0); break;
+            case 3: bench_memory_program(itab, smem, 200, 1); break;
+            case 4: case 5: case 6: bench_branch_program(itab, smem, 20000, w - 4); break;
+            case 7: bench_fib_program(itab, smem, 20, 1); break;
+            case 8: case 9: bench_call_program(itab, smem, 5000, w == 9); break;
+            default: bench_alu_program(itab, smem, 2000, w == 11); break;
+        }
+        core_t *core = core_init(0, smem);
+        core->itab = itab;
+        core->icache = icache_build(itab, smem, ICACHE_ALLFUSIONS);
+        uint64_t n_instr = bench_count_instrs(core);
+        bench_run_t run = { core, 4 };
+        bench_sample(bench_run_reps, &run, (double) n_instr * run.reps, samples);
+        if (core->stc != ERR_HALT || ((w == 0 || w == 7) && core->iregs[IRV] != 6765)
+            || (w >= 4 && w <= 6 && (core->iregs[IR3] != 20000 || core->iregs[IRV] != 1 || core->fregs[FR0] != 20000.0f))
+            || ((w == 8 || w == 9) && core->iregs[IRV] != 12) || (w >= 10 && core->iregs[IR3] != 9000)
+            || core->iregs[RSP] != MEMORY_RWBLKMAX) {
+            bench_fail("%s: wrong result (stc %d)\n", names[w], core->stc);
+        }
+        if (w == 3) {
+            // bytes copied per second rather than instructions
+            bench_to_rate(samples, 200.0 * 0x2000 / n_instr);
+            bench_report(names[w], "MB/s", samples, BENCH_SAMPLES);
+        } else if ((w >= 4 && w <= 6) || w >= 10) {
+            // loop iterations, the variants retire different numbers of 
+            // instructions
+            bench_to_rate(samples, (w >= 10 ? 2000.0 : 20000.0) / n_instr);
+            bench_report(names[w], "Miter/s", samples, BENCH_SAMPLES);
+        } else {
+            bench_to_rate(samples, 1.0);
+            bench_report(names[w], "Minstr/s", samples, BENCH_SAMPLES);
+        }
+        icache_delete(core->icache);
+        core_delete(core);
+    }
+
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint8_t n = n_cpus < 2 ? 2 : (n_cpus > 64 ? 64 : (uint8_t) n_cpus);
+    vm_t *vm = vm_init(n, itab);
+    vm->pin = 1;
+    uint32_t n_instr = bench_loop_program(itab, vm->smem, 20000);
+    for (uint8_t i = 0; i < n; i++) {
+        vm->cores[i]->icache = icache_build(itab, vm->smem, ICACHE_ALLFUSIONS);
+    }
+    for (int s = -1; s < BENCH_SAMPLES; s++) {
+        double t0 = bench_now_ns();
+        vm_reset(vm);
+        vm_run(vm);
+        if (s >= 0) {
+            samples[s] = (double) n_instr * n / ((bench_now_ns() - t0) / 1e3);
+        }
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "macro/vm/cores=%u", n);
+    bench_report(name, "Minstr/s", samples, BENCH_SAMPLES);
+    vm_delete(vm);
+}
+
+
+// Programs run from the instruction cache with verified records on their 
+// handlers without operand checks against the same cache with every record
+// checked (no superinstructions, so that every record is its own 
+// instruction). Both have to end in the same state.
+void bench_verify(instr_table_t *itab, sysmem_t *smem) {
+    static const char *const names[] = { "loop", "fib20", "alu", "bits", "jne" };
+    double samples[BENCH_SAMPLES];
+    char name[64];
+    for (int p = 0; p < 5; p++) {
+        memset(smem->mem, 0, MEMORY_SIZE);
+        switch (p) {
+            case 0: bench_loop_program(itab, smem, 20000); break;
+            case 1: bench_fib_program(itab, smem, 20, 0); break;
+            case 2: bench_alu_program(itab, smem, 2000, 0); break;
+            case 3: bench_bits_program(itab, smem); break;
+            default: bench_branch_program(itab, smem, 20000, 1); break;
+        }
+        core_t *cores[2];
+        for (int i = 0; i < 2; i++) {
+            cores[i] = core_init(0, smem);
+            cores[i]->itab = itab;
+            cores[i]->icache = icache_build(itab, smem, 0);
+        }
+        icache_t *checked = cores[1]->icache;
+        for (uint32_t r = 0; r < checked->n_ops; r++) {
+            checked->ops[r].flags &= ~UOP_VERIFIED;
+        }
+        uint64_t n_instr = bench_count_instrs(cores[0]);
+        for (int i = 0; i < 2; i++) {
+            bench_run_t run = { cores[i], 4 };
+            bench_sample(bench_run_reps, &run, (double) n_instr * run.reps, samples);
+            bench_to_rate(samples, 1.0);
+            snprintf(name, sizeof(name), "verify/%s/%s", names[p], i ? "checked" : "verified");
+            bench_report(name, "Minstr/s", samples, BENCH_SAMPLES);
+        }
+        core_t *c0 = cores[0], *c1 = cores[1];
+        if (c0->stc != c1->stc || c0->stc != ERR_HALT || c0->rcmp != c1->rcmp
+            || memcmp(c0->iregs, c1->iregs, sizeof(c0->iregs)) || memcmp(c0->fregs, c1->fregs, sizeof(c0->fregs))) {
+            bench_fail("verify/%s: state differs from the checked handlers\n", names[p]);
+        }
+        for (int i = 0; i < 2; i++) {
+            icache_delete(cores[i]->icache);
+            core_delete(cores[i]);
+        }
+    }
+
+    // a loop counting in rpc jumps to an address that is only known when it
+    // runs, so it keeps its checks
+    memset(smem->mem, 0, MEMORY_SIZE);
+    bench_asm_t a = { itab, smem, 0 };
+    emit(&a, LOOP, RPC, 0, 0);
+    icache_t *cache = icache_build(itab, smem, 0);
+    if (cache->ops[cache->index[0]].flags & UOP_VERIFIED) {
+        bench_fail("verify: loop on rpc runs without its checks\n");
+    }
+    icache_delete(cache);
+}
+
+
+// Runs every section, or only the ones named on the command line (e.g. 
+// "./bench.exe -json micro macro" for the sampled suite as JSON lines).
+// Exits with 1 if any correctness check failed.
+int bench_selected(int argc, char **argv, const char *name) {
+    int any = 0;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-') {
+            any = 1;
+            if (!strcmp(argv[i], name)) {
+                return 1;
+            }
+        }
+    }
+    return !any;
+}
+
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        bench_json |= !strcmp(argv[i], "-json");
+    }
+    sysmem_t *smem = sysmem_init(1);
+    instr_node_t *instr_tree = instr_build_tree();
+    instr_table_t *itab = instr_build_table(instr_tree);
+
+#define SECTION(name) if (bench_selected(argc, argv, name))
+    SECTION("decode") bench_decode("uniform", instr_tree, itab, smem, NULL);
+    SECTION("encoding") bench_encoding(itab, smem);
+    memset(smem->mem, 0, MEMORY_RWBLKMIN);
+    SECTION("dispatch") bench_dispatch(itab, smem);
+    memset(smem->mem, 0, MEMORY_RWBLKMIN);
+    SECTION("fusion") bench_fusion(itab, smem);
+    SECTION("jit") bench_jit(itab, smem);
+    SECTION("blockcopy") bench_blockcopy(itab, smem);
+    SECTION("vector") bench_vector(itab, smem);
+    SECTION("batch") bench_batch(itab);
+    SECTION("stats") bench_stats(itab, smem);
+    SECTION("trace") bench_trace(itab, smem);
+    SECTION("faults") bench_faults(itab, smem);
+    SECTION("verify") bench_verify(itab, smem);
+    SECTION("layout") bench_layout(itab);
+    SECTION("vm") bench_vm(itab);
+    SECTION("atomics") bench_atomics(itab);
+    SECTION("pool") bench_pool(itab);
+    SECTION("fork") bench_fork(itab);
+    SECTION("image") bench_image(instr_tree, itab);
+    SECTION("checkpoint") bench_checkpoint(itab);
+    SECTION("micro") bench_micro(itab, smem);
+    SECTION("macro") bench_macro(itab, smem);
+#undef SECTION
+
+    instr_delete_table(itab);
+    instr_delete_tree(instr_tree);
+    sysmem_delete(smem);
+    if (bench_failures) {
+        fprintf(stderr, "%d correctness checks failed\n", bench_failures);
+    }
+    return bench_failures ? 1 : 0;
+}
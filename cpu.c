@@ -9,149 +9,75 @@
 */
 
 
+#include <stddef.h>
+
+
 #include "cpu.h"
+#include "jit.h"
+#include "vector.h"
+#include "stats.h"
+#include "trace.h"
 
 
 // Get the value of an integer register.
 uint16_t get_ireg_val(core_t *core, ireg_t reg) {
-    switch (reg) {
-        case RPC:
-            return core->rpc;
-        case RSP:
-            return core->rsp;
-        case RBP:
-            return core->rbp;
-        case IR0:
-            return core->ir0;
-        case IR1:
-            return core->ir1;
-        case IR2:
-            return core->ir2;
-        case IR3:
-            return core->ir3;
-        case IRV:
-            return core->irv;
-        default:
-            // ERROR -- register unrecognized
-            core->stc = ERR_REGUNREC;
-            break;
+    if (reg > IRV) {
+        // ERROR -- register unrecognized
+        core->stc = ERR_REGUNREC;
+        return 0;
     }
+    return core->iregs[reg];
 }
 
 
 /* There are different functions for setting register values based on which 
    registers are allowed to be set.
    _gpr = general purpose integer registers or return value register
-   _gp  = general purpose integer registers */ 
+   _gp  = general purpose integer registers 
+   Each one is a bitmask of the registers it may write (CORE_WR_*). */ 
+
+// Set the value of an integer register if its bit is set in a write mask.
+void set_ireg_val(core_t *core, ireg_t reg, uint16_t val, uint8_t mask) {
+    if (reg > IRV) {
+        // ERROR -- register unrecognized
+        core->stc = ERR_REGUNREC;
+    } else if (!(mask & (1 << reg))) {
+        // ERROR -- register not allowed
+        core->stc = ERR_REGNOTALWD;
+    } else {
+        core->iregs[reg] = val;
+    }
+}
 
 // Set the value of an integer register (general purpose integer register).
 void set_ireg_val_gp(core_t *core, ireg_t reg, uint16_t val) {
-    switch (reg) {
-        case RPC:
-        case RSP:
-        case RBP:
-        case IRV:
-            // ERROR -- register not allowed
-            core->stc = ERR_REGNOTALWD;
-            break;
-        case IR0:
-            core->ir0 = val;
-            break;
-        case IR1:
-            core->ir1 = val;
-            break;
-        case IR2:
-            core->ir2 = val;
-            break;
-        case IR3:
-            core->ir3 = val;
-            break;
-        default:
-            // ERROR -- register unrecognized
-            core->stc = ERR_REGUNREC;
-            break;
-    }
+    set_ireg_val(core, reg, val, CORE_WR_GP);
 }
 
 // Set the value of an integer register (general purpose integer register
 // or return value register).
 void set_ireg_val_gpr(core_t *core, ireg_t reg, uint16_t val) {
-    switch (reg) {
-        case RPC:
-            core->rpc = val;
-            break;
-        case RBP:
-            core->rbp = val;
-            break;
-        case RSP:
-            // ERROR -- register not allowed
-            core->stc = ERR_REGNOTALWD;
-            break;
-        case IR0:
-            core->ir0 = val;
-            break;
-        case IR1:
-            core->ir1 = val;
-            break;
-        case IR2:
-            core->ir2 = val;
-            break;
-        case IR3:
-            core->ir3 = val;
-            break;
-        case IRV:
-            core->irv = val;
-            break;
-        default:
-            // ERROR -- register unrecognized
-            core->stc = ERR_REGUNREC;
-            break;
-    }
+    set_ireg_val(core, reg, val, CORE_WR_GPR);
 }
 
 
 // Get the value of a float register.
 float get_freg_val(core_t *core, freg_t reg) {
-    switch (reg) {
-        case FR0:
-            return core->fr0;
-        case FR1:
-            return core->fr1;
-        case FR2:
-            return core->fr2;
-        case FR3:
-            return core->fr3;
-        case FRV:
-            return core->frv;
-        default:
-            // ERROR -- register unrecognized
-            core->stc = ERR_REGUNREC;
-            break;
+    if (reg > FRV) {
+        // ERROR -- register unrecognized
+        core->stc = ERR_REGUNREC;
+        return 0.0f;
     }
+    return core->fregs[reg];
 }
 
 
 void set_freg_val(core_t *core, freg_t reg, float val) {
-    switch (reg) {
-        case FR0:
-            core->fr0 = val;
-            break;
-        case FR1:
-            core->fr1 = val;
-            break;
-        case FR2:
-            core->fr2 = val;
-            break;
-        case FR3:
-            core->fr3 = val;
-            break;
-        case FRV:
-            core->frv = val;
-            break;
-        default:
-            // ERROR -- register unrecognized
-            core->stc = ERR_REGUNREC;
-            break;
+    if (reg > FRV) {
+        // ERROR -- register unrecognized
+        core->stc = ERR_REGUNREC;
+    } else {
+        core->fregs[reg] = val;
     }
 }
 
@@ -333,13 +259,13 @@ void _core_mlti(core_t *core, ireg_t src, ireg_t dst) {
 // Push a value onto the stack (general purpose integer registers or return
 // value register). Stack grows toward increasing addresses.
 void _core_pshi(core_t *core, ireg_t reg) {
-    if (core->rsp >= MEMORY_MAXADDR - 2) {
+    if (core->iregs[RSP] >= core->stack_limit - 2) {
         // ERROR -- stack overflow
         core->stc = ERR_STACKOVERFLOW;
     } else {
-        core->smem->set_uint16(core->smem, core->rsp, get_ireg_val(core, reg));
+        mem_set_uint16(core->smem, core->iregs[RSP], get_ireg_val(core, reg));
         // increment the stack pointer
-        core->rsp += 2;
+        core->iregs[RSP] += 2;
     }
 }
 
@@ -347,13 +273,13 @@ void _core_pshi(core_t *core, ireg_t reg) {
 // Pop a value off of the stack (general purpose integer registers or return
 // value register).
 void _core_popi(core_t *core, ireg_t reg) {
-    if (core->rsp <= MEMORY_RWBLKMAX) {
+    if (core->iregs[RSP] <= core->stack_base) {
         // ERROR -- stack underflow
         core->stc = ERR_STACKUNDERFLOW;
     } else {
         // decrement the stack pointer
-        core->rsp -= 2;
-        set_ireg_val_gpr(core, reg, core->smem->get_uint16(core->smem, core->rsp));
+        core->iregs[RSP] -= 2;
+        set_ireg_val_gpr(core, reg, mem_get_uint16(core->smem, core->iregs[RSP]));
     }
 }
 
@@ -361,12 +287,12 @@ void _core_popi(core_t *core, ireg_t reg) {
 // Load an integer value from memory into an integer register (general purpose 
 // integer registers or return value register).
 void _core_lodi(core_t *core, uint16_t addr, ireg_t reg) {
-    // memory address bounds checking
-    if (addr < MEMORY_RWBLKMIN || addr > MEMORY_RWBLKMAX - 2) {
+    // memory address permission checking
+    if (!mem_check(core->smem, addr, 2, MEM_R)) {
         // ERROR -- memory access out of read/write block
         core->stc = ERR_MEMACCRWBLK;
     } else {
-        set_ireg_val_gpr(core, reg, core->smem->get_uint16(core->smem, addr));
+        set_ireg_val_gpr(core, reg, mem_get_uint16(core->smem, addr));
     }
 }
 
@@ -374,12 +300,12 @@ void _core_lodi(core_t *core, uint16_t addr, ireg_t reg) {
 // Store an integer value from an integer register in memory (general purpose 
 // integer registers or return value register)
 void _core_stoi(core_t *core, ireg_t reg, uint16_t addr) {
-    // memory address bounds checking
-    if (addr < MEMORY_RWBLKMIN || addr > MEMORY_RWBLKMAX - 2) {
+    // memory address permission checking
+    if (!mem_check(core->smem, addr, 2, MEM_W)) {
         // ERROR -- memory access out of read/write block
         core->stc = ERR_MEMACCRWBLK;
     } else {
-        core->smem->set_uint16(core->smem, addr, get_ireg_val(core, reg));
+        mem_set_uint16(core->smem, addr, get_ireg_val(core, reg));
     }
 }
 
@@ -403,13 +329,13 @@ void _core_leai (core_t *core, ireg_t base, ireg_t off, uint8_t mult, ireg_t des
 // Push a value onto the stack (general purpose float registers or return
 // value register). Stack grows toward increasing addresses.
 void _core_pshf(core_t *core, freg_t reg) {
-    if (core->rsp >= MEMORY_MAXADDR - 4) {
+    if (core->iregs[RSP] >= core->stack_limit - 4) {
         // ERROR -- stack overflow
         core->stc = ERR_STACKOVERFLOW;
     } else {
-        core->smem->set_float(core->smem, core->rsp, get_freg_val(core, reg));
+        mem_set_float(core->smem, core->iregs[RSP], get_freg_val(core, reg));
         // increment the stack pointer
-        core->rsp += 4;
+        core->iregs[RSP] += 4;
     }
 }
 
@@ -417,20 +343,37 @@ void _core_pshf(core_t *core, freg_t reg) {
 // Pop a value off of the stack (general purpose float registers or return
 // value register).
 void _core_popf(core_t *core, freg_t reg) {
-    if (core->rsp <= MEMORY_RWBLKMAX) {
+    if (core->iregs[RSP] <= core->stack_base) {
         // ERROR -- stack underflow
         core->stc = ERR_STACKUNDERFLOW;
     } else {
         // decrement the stack pointer
-        core->rsp -= 4;
-        set_freg_val(core, reg, core->smem->get_float(core->smem, core->rsp));
+        core->iregs[RSP] -= 4;
+        set_freg_val(core, reg, mem_get_float(core->smem, core->iregs[RSP]));
     }
 }
 
 
+// bytes pushed by call: rpc, rbp, ir0-ir3, fr0-fr3
+#define CALL_FRAME 28
+
+
 // Execute a subroutine starting at a memory address. Preserve general purpose
-// register values but not the return value registers.
+// register values but not the return value registers. The frame is written 
+// with one copy after a single stack check; if it does not fit (or the 
+// address is not executable) the registers are pushed one at a time instead,
+// so that the error and what is left on the stack are the same as for 
+// separate pushes.
 void _core_call(core_t *core, uint16_t addr) {
+    if (core->iregs[RSP] < core->stack_limit - CALL_FRAME && mem_check(core->smem, addr >> 3, 1, MEM_X)) {
+        uint8_t *sp = core->smem->mem + core->iregs[RSP];
+        memcpy(sp, &core->iregs[RPC], 2);
+        memcpy(sp + 2, &core->iregs[RBP], 10);     // rbp, ir0-ir3
+        memcpy(sp + 12, &core->fregs[FR0], 16);    // fr0-fr3
+        core->iregs[RSP] += CALL_FRAME;
+        core->iregs[RPC] = addr;
+        return;
+    }
     // preserve program counter, base pointer, and all general purpose registers
     // push rpc, rbp, ir0-ir3, fr0-fr3 to stack in that order
     _core_pshi(core, RPC);
@@ -444,16 +387,27 @@ void _core_call(core_t *core, uint16_t addr) {
     _core_pshf(core, FR2);
     _core_pshf(core, FR3);
     // set the program counter to the subroutine address
-    if (addr > MEMORY_RWBLKMIN) {
-        // if the address is outside the read-only block that is an error
+    if (!mem_check(core->smem, addr >> 3, 1, MEM_X)) {
+        // if the address is not executable that is an error
         core->stc = ERR_EXECOUTOFROBLK;
     } else {
-        core->rpc = addr;
+        core->iregs[RPC] = addr;
     }
 }
 
 
+// Return from a subroutine, restoring what call pushed. The frame is read 
+// with one copy if the last pop (rpc) would still find the stack non-empty, 
+// otherwise the registers are popped one at a time.
 void _core_retn(core_t *core) {
+    if (core->iregs[RSP] > core->stack_base + CALL_FRAME - 2) {
+        core->iregs[RSP] -= CALL_FRAME;
+        const uint8_t *sp = core->smem->mem + core->iregs[RSP];
+        memcpy(&core->iregs[RPC], sp, 2);
+        memcpy(&core->iregs[RBP], sp + 2, 10);     // rbp, ir0-ir3
+        memcpy(&core->fregs[FR0], sp + 12, 16);    // fr0-fr3
+        return;
+    }
     // restore registers in reverse order
     _core_popf(core, FR3);
     _core_popf(core, FR2);
@@ -465,7 +419,200 @@ void _core_retn(core_t *core) {
     _core_popi(core, IR0);
     _core_popi(core, RBP);
     _core_popi(core, RPC);
+}
+
+
+// Leaf call: push only rpc and execute a subroutine that returns with lret
+// (every other register is left to the callee to preserve). Nothing changes
+// if rpc does not fit on the stack or the address is not executable.
+void _core_lcal(core_t *core, uint16_t addr) {
+    if (core->iregs[RSP] >= core->stack_limit - 2) {
+        // ERROR -- stack overflow
+        core->stc = ERR_STACKOVERFLOW;
+    } else if (!mem_check(core->smem, addr >> 3, 1, MEM_X)) {
+        // ERROR -- subroutine is not executable
+        core->stc = ERR_EXECOUTOFROBLK;
+    } else {
+        mem_set_uint16(core->smem, core->iregs[RSP], core->iregs[RPC]);
+        core->iregs[RSP] += 2;
+        core->iregs[RPC] = addr;
+    }
+}
+
+
+// Return from a leaf call (pops rpc, checking only the stack bounds).
+void _core_lret(core_t *core) {
+    if (core->iregs[RSP] <= core->stack_base) {
+        // ERROR -- stack underflow
+        core->stc = ERR_STACKUNDERFLOW;
+    } else {
+        core->iregs[RSP] -= 2;
+        core->iregs[RPC] = mem_get_uint16(core->smem, core->iregs[RSP]);
+    }
+}
+
+
+// Size of the frame calm pushes for a register save mask: rpc, rbp, ir0-ir3
+// and the mask, plus fr0-fr3 if the mask names any of them.
+uint8_t calm_frame_size(uint8_t mask) {
+    return mask >> 4 ? 30 : 14;
+}
+
+
+// largest calm frame
+#define CALM_FRAME_MAX 30
+
+
+// Push a calm frame and jump, once the checks are done. The integer registers
+// are copied whatever the mask (cheaper than picking them out), in the same 
+// pieces retm reads them back in; only retm looks at the mask.
+void calm_push(core_t *core, uint8_t mask, uint16_t addr) {
+    uint16_t rsp = core->iregs[RSP];
+    uint8_t *sp = core->smem->mem + rsp;
+    uint16_t word = mask;
+    memcpy(sp, &core->iregs[RPC], 2);
+    memcpy(sp + 2, &core->iregs[RBP], 8);          // rbp, ir0-ir2
+    memcpy(sp + 10, &core->iregs[IR3], 2);
+    if (mask >> 4) {
+        memcpy(sp + 12, &core->fregs[FR0], 16);    // fr0-fr3
+        memcpy(sp + 28, &word, 2);
+        core->iregs[RSP] = rsp + 30;
+    } else {
+        memcpy(sp + 12, &word, 2);
+        core->iregs[RSP] = rsp + 14;
+    }
+    core->iregs[RPC] = addr;
+}
+
+
+// Pop a calm frame for a mask off the top of the stack, once the checks are 
+// done. Only rbp and the registers the mask names are restored, each part of
+// the frame is read with one copy and merged into the registers.
+void retm_pop(core_t *core, uint8_t mask) {
+    // rbp, ir0-ir2 lanes kept for each combination of ir0-ir2
+    static const uint16_t lanes[8][4] = {
+        { 0xFFFF, 0, 0, 0 },
+        { 0xFFFF, 0xFFFF, 0, 0 },
+        { 0xFFFF, 0, 0xFFFF, 0 },
+        { 0xFFFF, 0xFFFF, 0xFFFF, 0 },
+        { 0xFFFF, 0, 0, 0xFFFF },
+        { 0xFFFF, 0xFFFF, 0, 0xFFFF },
+        { 0xFFFF, 0, 0xFFFF, 0xFFFF },
+        { 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF },
+    };
+    const uint8_t *mem = core->smem->mem;
+    uint16_t rsp = core->iregs[RSP];
+    if (mask >> 4) {
+        float saved[4];
+        rsp -= 30;
+        memcpy(saved, mem + rsp + 12, 16);
+        for (uint8_t i = 0; i < 4; i++) {
+            core->fregs[FR0 + i] = mask & (0x10 << i) ? saved[i] : core->fregs[FR0 + i];
+        }
+    } else {
+        rsp -= 14;
+    }
+    uint64_t saved, regs, keep;
+    memcpy(&keep, lanes[mask & 0x07], 8);
+    memcpy(&saved, mem + rsp + 2, 8);
+    memcpy(&regs, &core->iregs[RBP], 8);
+    regs = (regs & ~keep) | (saved & keep);
+    memcpy(&core->iregs[RBP], &regs, 8);
+    if (mask & 0x08) {
+        memcpy(&core->iregs[IR3], mem + rsp + 10, 2);
+    }
+    memcpy(&core->iregs[RPC], mem + rsp, 2);
+    core->iregs[RSP] = rsp;
+}
+
+
+// Execute a subroutine saving only the registers the caller needs (bit i of 
+// the mask for ir0 + i, bit 4 + i for fr0 + i). The frame is rpc, rbp, 
+// ir0-ir3, fr0-fr3 if the mask names any of them and then the mask itself, 
+// so that retm knows what to restore. The size of the frame is known from 
+// the mask, so it is checked once; nothing changes if it does not fit on the 
+// stack or the address is not executable.
+void _core_calm(core_t *core, uint8_t mask, uint16_t addr) {
+    if (core->iregs[RSP] >= core->stack_limit - calm_frame_size(mask)) {
+        // ERROR -- stack overflow
+        core->stc = ERR_STACKOVERFLOW;
+    } else if (!mem_check(core->smem, addr >> 3, 1, MEM_X)) {
+        // ERROR -- subroutine is not executable
+        core->stc = ERR_EXECOUTOFROBLK;
+    } else {
+        calm_push(core, mask, addr);
+    }
+}
+
+
+// Return from calm, restoring the registers named by the mask on top of the
+// stack. Nothing changes if the whole frame is not on the stack.
+void _core_retm(core_t *core) {
+    uint16_t rsp = core->iregs[RSP];
+    uint8_t mask = rsp >= core->stack_base + 2 ? core->smem->mem[(uint16_t) (rsp - 2)] : 0;
+    uint8_t size = calm_frame_size(mask);
+    if (rsp < core->stack_base + size) {
+        // ERROR -- stack underflow
+        core->stc = ERR_STACKUNDERFLOW;
+    } else {
+        retm_pop(core, mask);
+    }
+}
+
+
+// Jump to a bit address, which must be in an executable page.
+void _core_jmpa(core_t *core, uint16_t addr) {
+    if (!mem_check(core->smem, addr >> 3, 1, MEM_X)) {
+        // ERROR -- jump target is not executable
+        core->stc = ERR_EXECOUTOFROBLK;
+    } else {
+        core->iregs[RPC] = addr;
+    }
+}
+
+
+// Jump by an offset (in bits, wrapping around) from the next instruction.
+void _core_jmpr(core_t *core, uint16_t off) {
+    _core_jmpa(core, core->iregs[RPC] + off);
+}
+
+
+// Jump by an offset if rcmp holds one of the results in a mask (bit 
+// 1 << cmpres_t for each). Must follow a cmpi instruction, rcmp is set to NA
+// whether or not the jump is taken (as for the conditional moves).
+void jump_if(core_t *core, uint16_t off, uint8_t mask) {
+    if (core->rcmp == NA) {
+        // ERROR -- conditional operation with uninitialized rcmp
+        core->stc = ERR_RCMPNOTINIT;
+    } else if (mask & (1 << core->rcmp)) {
+        _core_jmpr(core, off);
+    }
+    core->rcmp = NA;
+}
+
+
+void _core_jeq(core_t *core, uint16_t off) { jump_if(core, off, 1 << EQ); }
+void _core_jne(core_t *core, uint16_t off) { jump_if(core, off, (1 << GT) | (1 << LT)); }
+void _core_jgt(core_t *core, uint16_t off) { jump_if(core, off, 1 << GT); }
+void _core_jge(core_t *core, uint16_t off) { jump_if(core, off, (1 << GT) | (1 << EQ)); }
+void _core_jlt(core_t *core, uint16_t off) { jump_if(core, off, 1 << LT); }
+void _core_jle(core_t *core, uint16_t off) { jump_if(core, off, (1 << LT) | (1 << EQ)); }
 
+
+// Counted loop: decrement a register and jump by an offset unless it has 
+// reached 0, so a body that ends in loop runs as many times as the register
+// held when it was entered. Decrementing 0 is an error as for deci.
+void _core_loop(core_t *core, ireg_t reg, uint16_t off) {
+    uint16_t val = get_ireg_val(core, reg);
+    if (val == 0) {
+        // ERROR: decrement 0
+        core->stc = ERR_DECRZERO;
+    } else {
+        set_ireg_val_gpr(core, reg, val - 1);
+        if (val > 1 && core->stc == NO_ERR) {
+            _core_jmpr(core, off);
+        }
+    }
 }
 
 
@@ -483,13 +630,23 @@ void _core_movf(core_t *core, freg_t src, freg_t dst) {
 
 // Load a floating point value from a memory address into a float register.
 void _core_lodf(core_t *core, uint16_t addr, freg_t reg) {
-    set_freg_val(core, reg, core->smem->get_float(core->smem, addr));
+    if (!mem_check(core->smem, addr, 4, MEM_R)) {
+        // ERROR -- memory access out of read/write block
+        core->stc = ERR_MEMACCRWBLK;
+    } else {
+        set_freg_val(core, reg, mem_get_float(core->smem, addr));
+    }
 }
 
 
 // Store a floating point value from a float register at an address in memory
 void _core_stof(core_t *core, freg_t reg, uint16_t addr) {
-    core->smem->set_float(core->smem, addr, get_freg_val(core, reg));
+    if (!mem_check(core->smem, addr, 4, MEM_W)) {
+        // ERROR -- memory access out of read/write block
+        core->stc = ERR_MEMACCRWBLK;
+    } else {
+        mem_set_float(core->smem, addr, get_freg_val(core, reg));
+    }
 }
 
 
@@ -540,6 +697,82 @@ void _core_subi(core_t *core, ireg_t rega, ireg_t regb) {
 }
 
 
+// multiply an int register B by another A (store result in B)
+void _core_muli(core_t *core, ireg_t rega, ireg_t regb) {
+    uint32_t prod = (uint32_t) get_ireg_val(core, rega) * get_ireg_val(core, regb);
+    if (prod > 0xFFFF) {
+        // ERROR: integer register overflow
+        core->stc = ERR_IREGOVERFLOW;
+    } else {
+        set_ireg_val_gpr(core, regb, prod);
+    }
+}
+
+
+// divide an int register B by another A (store the quotient in B)
+void _core_divi(core_t *core, ireg_t rega, ireg_t regb) {
+    uint16_t a = get_ireg_val(core, rega);
+    uint16_t b = get_ireg_val(core, regb);
+    if (a == 0) {
+        // ERROR: divide by zero
+        core->stc = ERR_DIVZERO;
+    } else {
+        set_ireg_val_gpr(core, regb, b / a);
+    }
+}
+
+
+// divide an int register B by another A (store the remainder in B)
+void _core_modi(core_t *core, ireg_t rega, ireg_t regb) {
+    uint16_t a = get_ireg_val(core, rega);
+    uint16_t b = get_ireg_val(core, regb);
+    if (a == 0) {
+        // ERROR: divide by zero
+        core->stc = ERR_DIVZERO;
+    } else {
+        set_ireg_val_gpr(core, regb, b % a);
+    }
+}
+
+
+// bitwise and/or/xor an int register A into another B (store result in B)
+void _core_andi(core_t *core, ireg_t rega, ireg_t regb) {
+    set_ireg_val_gpr(core, regb, get_ireg_val(core, rega) & get_ireg_val(core, regb));
+}
+
+void _core_ori(core_t *core, ireg_t rega, ireg_t regb) {
+    set_ireg_val_gpr(core, regb, get_ireg_val(core, rega) | get_ireg_val(core, regb));
+}
+
+void _core_xori(core_t *core, ireg_t rega, ireg_t regb) {
+    set_ireg_val_gpr(core, regb, get_ireg_val(core, rega) ^ get_ireg_val(core, regb));
+}
+
+
+// shift an int register B left/right by the number of bits in another A 
+// (store result in B), shifting by 16 or more gives 0
+void _core_shli(core_t *core, ireg_t rega, ireg_t regb) {
+    uint16_t a = get_ireg_val(core, rega);
+    uint16_t b = get_ireg_val(core, regb);
+    set_ireg_val_gpr(core, regb, a < 16 ? (uint16_t) (b << a) : 0);
+}
+
+void _core_shri(core_t *core, ireg_t rega, ireg_t regb) {
+    uint16_t a = get_ireg_val(core, rega);
+    uint16_t b = get_ireg_val(core, regb);
+    set_ireg_val_gpr(core, regb, a < 16 ? b >> a : 0);
+}
+
+
+// rotate an int register B left by the number of bits in another A, modulo
+// 16 (store result in B)
+void _core_rotl(core_t *core, ireg_t rega, ireg_t regb) {
+    uint16_t a = get_ireg_val(core, rega) & 15;
+    uint16_t b = get_ireg_val(core, regb);
+    set_ireg_val_gpr(core, regb, (uint16_t) ((b << a) | (b >> (16 - a))));
+}
+
+
 // Add float register A into another B, store result in B
 void _core_addf(core_t *core, freg_t rega, freg_t regb) {
     float a = get_freg_val(core, rega);
@@ -572,62 +805,1308 @@ void _core_divf(core_t *core, freg_t rega, freg_t regb) {
 }
 
 
-// Allocates memory for a new CPU core structure and returns a pointer to it.
-core_t* core_init(uint8_t cid, sysmem_t *smem) {
-    // allocate (zeroed) memory
-    core_t *core = calloc(1, sizeof(core_t));
+// Copy a block of len bytes from the address in src to the address in dst 
+// (both ranges in the read/write block, they may overlap).
+void _core_bcpy(core_t *core, ireg_t src, ireg_t dst, ireg_t len) {
+    uint16_t s = get_ireg_val(core, src);
+    uint16_t d = get_ireg_val(core, dst);
+    uint16_t n = get_ireg_val(core, len);
+    if (!mem_check(core->smem, s, n, MEM_R) || !mem_check(core->smem, d, n, MEM_W)) {
+        // ERROR -- memory access out of read/write block
+        core->stc = ERR_MEMACCRWBLK;
+    } else {
+        mem_copy(core->smem, s, d, n);
+    }
+}
+
+
+// Fill a block of len bytes at the address in dst with the low byte of val.
+void _core_bfil(core_t *core, ireg_t val, ireg_t dst, ireg_t len) {
+    uint16_t v = get_ireg_val(core, val);
+    uint16_t d = get_ireg_val(core, dst);
+    uint16_t n = get_ireg_val(core, len);
+    if (!mem_check(core->smem, d, n, MEM_W)) {
+        // ERROR -- memory access out of read/write block
+        core->stc = ERR_MEMACCRWBLK;
+    } else {
+        mem_fill(core->smem, d, (uint8_t) v, n);
+    }
+}
+
+
+// Compare blocks of len bytes at the addresses in a and b, store the result 
+// (first differing byte of a vs. b) in the rcmp register.
+void _core_bcmp(core_t *core, ireg_t rega, ireg_t regb, ireg_t len) {
+    uint16_t a = get_ireg_val(core, rega);
+    uint16_t b = get_ireg_val(core, regb);
+    uint16_t n = get_ireg_val(core, len);
+    if (!mem_check(core->smem, a, n, MEM_R) || !mem_check(core->smem, b, n, MEM_R)) {
+        // ERROR -- memory access out of read/write block
+        core->stc = ERR_MEMACCRWBLK;
+    } else {
+        int c = mem_compare(core->smem, a, b, n);
+        core->rcmp = c == 0 ? EQ : (c < 0 ? LT : GT);
+    }
+}
+
+
+// Check the address of an atomic operation (readable, writable and even), sets
+// the status code and returns 0 if it is not valid.
+uint8_t check_atomic_addr(core_t *core, uint16_t addr) {
+    if (!mem_check(core->smem, addr, 2, MEM_R | MEM_W)) {
+        // ERROR -- memory access out of read/write block
+        core->stc = ERR_MEMACCRWBLK;
+        return 0;
+    }
+    if (addr & 1) {
+        // ERROR -- atomic access to an odd address
+        core->stc = ERR_MEMALIGN;
+        return 0;
+    }
+    return 1;
+}
+
+
+// Atomically replace the word at the address in addr with the value of new if
+// it equals the value of exp. rcmp is set to EQ if the word was replaced, 
+// otherwise to the comparison of the word with exp (GT or LT) and exp is set to
+// the word (general purpose integer registers or return value register).
+void _core_casi(core_t *core, ireg_t addr, ireg_t exp, ireg_t new) {
+    uint16_t a = get_ireg_val(core, addr);
+    uint16_t e = get_ireg_val(core, exp);
+    uint16_t n = get_ireg_val(core, new);
+    if (check_atomic_addr(core, a)) {
+        uint16_t seen = e;
+        if (mem_cas_uint16(core->smem, a, &seen, n)) {
+            core->rcmp = EQ;
+        } else {
+            core->rcmp = seen > e ? GT : LT;
+            set_ireg_val_gpr(core, exp, seen);
+        }
+    }
+}
+
+
+// Atomically add the value of val to the word at the address in addr (wrapping
+// around, no overflow error), the old word is stored in dst (general purpose 
+// integer registers or return value register).
+void _core_fadi(core_t *core, ireg_t addr, ireg_t val, ireg_t dst) {
+    uint16_t a = get_ireg_val(core, addr);
+    uint16_t v = get_ireg_val(core, val);
+    if (check_atomic_addr(core, a)) {
+        set_ireg_val_gpr(core, dst, mem_fetch_add_uint16(core->smem, a, v));
+    }
+}
+
+
+// Atomically replace the word at the address in addr with the value of val, 
+// the old word is stored in dst (general purpose integer registers or return 
+// value register).
+void _core_xchi(core_t *core, ireg_t addr, ireg_t val, ireg_t dst) {
+    uint16_t a = get_ireg_val(core, addr);
+    uint16_t v = get_ireg_val(core, val);
+    if (check_atomic_addr(core, a)) {
+        set_ireg_val_gpr(core, dst, mem_exchange_uint16(core->smem, a, v));
+    }
+}
+
+
+// Returns a pointer to an array of n elements of a given size at an address 
+// on pages with the permissions in perm, or sets the status code and returns
+// NULL if it is not (checked once for the whole vector).
+uint8_t* vec_operand(core_t *core, uint16_t addr, uint16_t n, uint8_t size, uint8_t perm) {
+    if (!mem_check(core->smem, addr, (uint32_t) n * size, perm)) {
+        // ERROR -- memory access out of read/write block
+        core->stc = ERR_MEMACCRWBLK;
+        return NULL;
+    }
+    return core->smem->mem + addr;
+}
+
+
+// Elementwise float vector operations on the arrays of n floats at the 
+// addresses in src and dst, the result is stored in dst: add, multiply, 
+// minimum, maximum (a NaN in src leaves dst unchanged).
+void _core_vadf(core_t *core, ireg_t src, ireg_t dst, ireg_t len) {
+    uint16_t n = get_ireg_val(core, len);
+    const uint8_t *s = vec_operand(core, get_ireg_val(core, src), n, sizeof(float), MEM_R);
+    uint8_t *d = vec_operand(core, get_ireg_val(core, dst), n, sizeof(float), MEM_R | MEM_W);
+    if (s && d) {
+        vec_add_f32(d, s, n);
+    }
+}
+
+
+void _core_vmlf(core_t *core, ireg_t src, ireg_t dst, ireg_t len) {
+    uint16_t n = get_ireg_val(core, len);
+    const uint8_t *s = vec_operand(core, get_ireg_val(core, src), n, sizeof(float), MEM_R);
+    uint8_t *d = vec_operand(core, get_ireg_val(core, dst), n, sizeof(float), MEM_R | MEM_W);
+    if (s && d) {
+        vec_mul_f32(d, s, n);
+    }
+}
+
+
+void _core_vmnf(core_t *core, ireg_t src, ireg_t dst, ireg_t len) {
+    uint16_t n = get_ireg_val(core, len);
+    const uint8_t *s = vec_operand(core, get_ireg_val(core, src), n, sizeof(float), MEM_R);
+    uint8_t *d = vec_operand(core, get_ireg_val(core, dst), n, sizeof(float), MEM_R | MEM_W);
+    if (s && d) {
+        vec_min_f32(d, s, n);
+    }
+}
+
+
+void _core_vmxf(core_t *core, ireg_t src, ireg_t dst, ireg_t len) {
+    uint16_t n = get_ireg_val(core, len);
+    const uint8_t *s = vec_operand(core, get_ireg_val(core, src), n, sizeof(float), MEM_R);
+    uint8_t *d = vec_operand(core, get_ireg_val(core, dst), n, sizeof(float), MEM_R | MEM_W);
+    if (s && d) {
+        vec_max_f32(d, s, n);
+    }
+}
+
+
+// Multiply the array of n floats at the address in src by the float register 
+// scale and add it to the array at the address in dst.
+void _core_vfmf(core_t *core, ireg_t src, ireg_t dst, ireg_t len, freg_t scale) {
+    uint16_t n = get_ireg_val(core, len);
+    float k = get_freg_val(core, scale);
+    const uint8_t *s = vec_operand(core, get_ireg_val(core, src), n, sizeof(float), MEM_R);
+    uint8_t *d = vec_operand(core, get_ireg_val(core, dst), n, sizeof(float), MEM_R | MEM_W);
+    if (s && d && core->stc == NO_ERR) {
+        vec_madd_f32(d, s, n, k);
+    }
+}
+
+
+// Sum the array of n floats at the address in addr into a float register.
+void _core_vrdf(core_t *core, ireg_t addr, ireg_t len, freg_t dst) {
+    uint16_t n = get_ireg_val(core, len);
+    const uint8_t *a = vec_operand(core, get_ireg_val(core, addr), n, sizeof(float), MEM_R);
+    if (a) {
+        set_freg_val(core, dst, vec_sum_f32(a, n));
+    }
+}
+
+
+// Dot product of the arrays of n floats at the addresses in rega and regb, 
+// stored in a float register.
+void _core_vdtf(core_t *core, ireg_t rega, ireg_t regb, ireg_t len, freg_t dst) {
+    uint16_t n = get_ireg_val(core, len);
+    const uint8_t *a = vec_operand(core, get_ireg_val(core, rega), n, sizeof(float), MEM_R);
+    const uint8_t *b = vec_operand(core, get_ireg_val(core, regb), n, sizeof(float), MEM_R);
+    if (a && b) {
+        set_freg_val(core, dst, vec_dot_f32(a, b, n));
+    }
+}
+
+
+// Elementwise integer vector operations on the arrays of n words at the 
+// addresses in src and dst, the result is stored in dst: add, multiply 
+// (wrapping around, no overflow error), minimum, maximum.
+void _core_vadi(core_t *core, ireg_t src, ireg_t dst, ireg_t len) {
+    uint16_t n = get_ireg_val(core, len);
+    const uint8_t *s = vec_operand(core, get_ireg_val(core, src), n, sizeof(uint16_t), MEM_R);
+    uint8_t *d = vec_operand(core, get_ireg_val(core, dst), n, sizeof(uint16_t), MEM_R | MEM_W);
+    if (s && d) {
+        vec_add_u16(d, s, n);
+    }
+}
+
+
+void _core_vmli(core_t *core, ireg_t src, ireg_t dst, ireg_t len) {
+    uint16_t n = get_ireg_val(core, len);
+    const uint8_t *s = vec_operand(core, get_ireg_val(core, src), n, sizeof(uint16_t), MEM_R);
+    uint8_t *d = vec_operand(core, get_ireg_val(core, dst), n, sizeof(uint16_t), MEM_R | MEM_W);
+    if (s && d) {
+        vec_mul_u16(d, s, n);
+    }
+}
+
+
+void _core_vmni(core_t *core, ireg_t src, ireg_t dst, ireg_t len) {
+    uint16_t n = get_ireg_val(core, len);
+    const uint8_t *s = vec_operand(core, get_ireg_val(core, src), n, sizeof(uint16_t), MEM_R);
+    uint8_t *d = vec_operand(core, get_ireg_val(core, dst), n, sizeof(uint16_t), MEM_R | MEM_W);
+    if (s && d) {
+        vec_min_u16(d, s, n);
+    }
+}
+
+
+void _core_vmxi(core_t *core, ireg_t src, ireg_t dst, ireg_t len) {
+    uint16_t n = get_ireg_val(core, len);
+    const uint8_t *s = vec_operand(core, get_ireg_val(core, src), n, sizeof(uint16_t), MEM_R);
+    uint8_t *d = vec_operand(core, get_ireg_val(core, dst), n, sizeof(uint16_t), MEM_R | MEM_W);
+    if (s && d) {
+        vec_max_u16(d, s, n);
+    }
+}
+
+
+// Sum the array of n words at the address in addr (wrapping around) into dst 
+// (general purpose integer registers or return value register).
+void _core_vrdi(core_t *core, ireg_t addr, ireg_t len, ireg_t dst) {
+    uint16_t n = get_ireg_val(core, len);
+    const uint8_t *a = vec_operand(core, get_ireg_val(core, addr), n, sizeof(uint16_t), MEM_R);
+    if (a) {
+        set_ireg_val_gpr(core, dst, vec_sum_u16(a, n));
+    }
+}
+
+
+// Superinstruction: compare two integer registers and move src to dst if the
+// result is one of those in a mask (bit 1 << cmpres_t). The result never goes
+// through rcmp since the conditional move would reset it to NA right away.
+void fused_cmpmov(core_t *core, ireg_t reg_a, ireg_t reg_b, ireg_t src, ireg_t dst, uint8_t mask) {
+    uint16_t val_a = get_ireg_val(core, reg_a);
+    uint16_t val_b = get_ireg_val(core, reg_b);
+    cmpres_t res = val_a == val_b ? EQ : (val_a < val_b ? LT : GT);
+    if (mask & (1 << res)) {
+        _core_movi(core, src, dst);
+    }
+    core->rcmp = NA;
+}
+
+
+/* Handlers for records whose operands have been verified by the instruction
+   cache (see icache.h): the same as the _core_ functions without the checks
+   on registers, leai multipliers, fixed addresses and jump targets. */
+
+// Decrement an integer register.
+void verified_deci(core_t *core, ireg_t reg) {
+    if (core->iregs[reg] == 0) {
+        // ERROR: decrement 0
+        core->stc = ERR_DECRZERO;
+    } else {
+        core->iregs[reg]--;
+    }
+}
+
+
+// Add/subtract/multiply an int register A into another B.
+void verified_addi(core_t *core, ireg_t rega, ireg_t regb) {
+    uint32_t sum = (uint32_t) core->iregs[rega] + core->iregs[regb];
+    if (sum > 0xFFFF) {
+        // ERROR: integer register overflow
+        core->stc = ERR_IREGOVERFLOW;
+    } else {
+        core->iregs[regb] = sum;
+    }
+}
+
+void verified_subi(core_t *core, ireg_t rega, ireg_t regb) {
+    if (core->iregs[rega] > core->iregs[regb]) {
+        // ERROR: integer register underflow
+        core->stc = ERR_IREGUNDERFLOW;
+    } else {
+        core->iregs[regb] -= core->iregs[rega];
+    }
+}
+
+void verified_muli(core_t *core, ireg_t rega, ireg_t regb) {
+    uint32_t prod = (uint32_t) core->iregs[rega] * core->iregs[regb];
+    if (prod > 0xFFFF) {
+        // ERROR: integer register overflow
+        core->stc = ERR_IREGOVERFLOW;
+    } else {
+        core->iregs[regb] = prod;
+    }
+}
+
+
+// Push/pop an integer register.
+void verified_pshi(core_t *core, ireg_t reg) {
+    if (core->iregs[RSP] >= core->stack_limit - 2) {
+        // ERROR -- stack overflow
+        core->stc = ERR_STACKOVERFLOW;
+    } else {
+        mem_set_uint16(core->smem, core->iregs[RSP], core->iregs[reg]);
+        core->iregs[RSP] += 2;
+    }
+}
+
+void verified_popi(core_t *core, ireg_t reg) {
+    if (core->iregs[RSP] <= core->stack_base) {
+        // ERROR -- stack underflow
+        core->stc = ERR_STACKUNDERFLOW;
+    } else {
+        core->iregs[RSP] -= 2;
+        core->iregs[reg] = mem_get_uint16(core->smem, core->iregs[RSP]);
+    }
+}
+
+
+// Move src to dst if rcmp holds one of the results in a mask.
+void verified_cmov(core_t *core, ireg_t src, ireg_t dst, uint8_t mask) {
+    if (core->rcmp == NA) {
+        // ERROR -- conditional operation with uninitialized rcmp
+        core->stc = ERR_RCMPNOTINIT;
+    } else if (mask & (1 << core->rcmp)) {
+        core->iregs[dst] = core->iregs[src];
+    }
+    core->rcmp = NA;
+}
+
+
+// Compare two registers and move if the result is in a mask (cmpi + a 
+// conditional move), leaving rcmp NA like the move.
+void verified_cmpmov(core_t *core, ireg_t reg_a, ireg_t reg_b, ireg_t src, ireg_t dst, uint8_t mask) {
+    uint16_t a = core->iregs[reg_a], b = core->iregs[reg_b];
+    cmpres_t res = a == b ? EQ : (a < b ? LT : GT);
+    if (mask & (1 << res)) {
+        core->iregs[dst] = core->iregs[src];
+    }
+    core->rcmp = NA;
+}
+
+
+// Jump by an offset if rcmp holds one of the results in a mask.
+void verified_jump_if(core_t *core, uint16_t off, uint8_t mask) {
+    if (core->rcmp == NA) {
+        // ERROR -- conditional operation with uninitialized rcmp
+        core->stc = ERR_RCMPNOTINIT;
+    } else if (mask & (1 << core->rcmp)) {
+        core->iregs[RPC] += off;
+    }
+    core->rcmp = NA;
+}
+
+
+// Counted loop.
+void verified_loop(core_t *core, ireg_t reg, uint16_t off) {
+    uint16_t val = core->iregs[reg];
+    if (val == 0) {
+        // ERROR: decrement 0
+        core->stc = ERR_DECRZERO;
+    } else {
+        core->iregs[reg] = val - 1;
+        if (val > 1) {
+            core->iregs[RPC] += off;
+        }
+    }
+}
+
+
+// Call, only the stack bounds are left to check (the fallback pushes the 
+// registers one at a time like _core_call).
+void verified_call(core_t *core, uint16_t addr) {
+    if (core->iregs[RSP] < core->stack_limit - CALL_FRAME) {
+        uint8_t *sp = core->smem->mem + core->iregs[RSP];
+        memcpy(sp, &core->iregs[RPC], 2);
+        memcpy(sp + 2, &core->iregs[RBP], 10);     // rbp, ir0-ir3
+        memcpy(sp + 12, &core->fregs[FR0], 16);    // fr0-fr3
+        core->iregs[RSP] += CALL_FRAME;
+        core->iregs[RPC] = addr;
+    } else {
+        _core_call(core, addr);
+    }
+}
+
+
+// Leaf call, only the stack bound is left to check.
+void verified_lcal(core_t *core, uint16_t addr) {
+    uint16_t rsp = core->iregs[RSP];
+    if (rsp >= core->stack_limit - 2) {
+        // ERROR -- stack overflow
+        core->stc = ERR_STACKOVERFLOW;
+    } else {
+        mem_set_uint16(core->smem, rsp, core->iregs[RPC]);
+        core->iregs[RSP] = rsp + 2;
+        core->iregs[RPC] = addr;
+    }
+}
+
+
+// Calm, only the stack bound is left to check. A stack with room for the 
+// largest frame needs no frame size.
+void verified_calm(core_t *core, uint8_t mask, uint16_t addr) {
+    if (core->iregs[RSP] < core->stack_limit - CALM_FRAME_MAX) {
+        calm_push(core, mask, addr);
+    } else {
+        _core_calm(core, mask, addr);
+    }
+}
+
+
+// Retm, the same for a stack that holds the largest frame.
+void verified_retm(core_t *core) {
+    if (core->iregs[RSP] >= core->stack_base + CALM_FRAME_MAX) {
+        retm_pop(core, core->smem->mem[(uint16_t) (core->iregs[RSP] - 2)]);
+    } else {
+        _core_retm(core);
+    }
+}
+
+
+// the registers and everything else an instruction touches stay in one line
+_Static_assert(offsetof(core_t, cid) <= CORE_ALIGN, "hot core state spans cache lines");
+
+
+// handlers shared by every core
+const core_ops_t core_ops = {
+    .noop = &_core_noop,
+    .halt = &_core_halt,
+    .cmpi = &_core_cmpi,
+    .seti = &_core_seti,
+    .movi = &_core_movi,
+    .meqi = &_core_meqi,
+    .mnei = &_core_mnei,
+    .mgei = &_core_mgei,
+    .mgti = &_core_mgti,
+    .mlei = &_core_mlei,
+    .mlti = &_core_mlti,
+    .pshi = &_core_pshi,
+    .popi = &_core_popi,
+    .lodi = &_core_lodi,
+    .stoi = &_core_stoi,
+    .leai = &_core_leai,
+    .pshf = &_core_pshf,
+    .popf = &_core_popf,
+    .call = &_core_call,
+    .retn = &_core_retn,
+    .setf = &_core_setf,
+    .movf = &_core_movf,
+    .lodf = &_core_lodf,
+    .stof = &_core_stof,
+    .inci = &_core_inci,
+    .deci = &_core_deci,
+    .addi = &_core_addi,
+    .subi = &_core_subi,
+    .muli = &_core_muli,
+    .divi = &_core_divi,
+    .modi = &_core_modi,
+    .andi = &_core_andi,
+    .ori = &_core_ori,
+    .xori = &_core_xori,
+    .shli = &_core_shli,
+    .shri = &_core_shri,
+    .rotl = &_core_rotl,
+    .addf = &_core_addf,
+    .subf = &_core_subf,
+    .mulf = &_core_mulf,
+    .divf = &_core_divf,
+    .bcpy = &_core_bcpy,
+    .bfil = &_core_bfil,
+    .bcmp = &_core_bcmp,
+    .casi = &_core_casi,
+    .fadi = &_core_fadi,
+    .xchi = &_core_xchi,
+    .vadf = &_core_vadf,
+    .vmlf = &_core_vmlf,
+    .vmnf = &_core_vmnf,
+    .vmxf = &_core_vmxf,
+    .vfmf = &_core_vfmf,
+    .vrdf = &_core_vrdf,
+    .vdtf = &_core_vdtf,
+    .vadi = &_core_vadi,
+    .vmli = &_core_vmli,
+    .vmni = &_core_vmni,
+    .vmxi = &_core_vmxi,
+    .vrdi = &_core_vrdi,
+    .jmpa = &_core_jmpa,
+    .jmpr = &_core_jmpr,
+    .jeq = &_core_jeq,
+    .jne = &_core_jne,
+    .jgt = &_core_jgt,
+    .jge = &_core_jge,
+    .jlt = &_core_jlt,
+    .jle = &_core_jle,
+    .loop = &_core_loop,
+    .lcal = &_core_lcal,
+    .lret = &_core_lret,
+    .calm = &_core_calm,
+    .retm = &_core_retm,
+};
+
+
+// Initializes a CPU core structure in place (e.g. in an arena of cores).
+void core_setup(core_t *core, uint8_t cid, sysmem_t *smem) {
+    memset(core, 0, sizeof(core_t));
     // initialize data structure values
     core->cid  = cid;
-    core->rsp  = MEMORY_RWBLKMAX; // rsp starts at bottom of stack space
+    // a core on its own gets the whole stack space, a vm_t narrows it down
+    core->stack_base  = smem ? smem->stack_start : MEMORY_RWBLKMAX;
+    core->stack_limit = MEMORY_MAXADDR;
+    core->iregs[RSP] = core->stack_base; // rsp starts at bottom of stack space
     core->smem = smem;
     core->rcmp = NA;
     core->stc  = NO_ERR;
-    // set all of the function pointers
-    core->noop = &_core_noop;
-    core->halt = &_core_halt;
-    core->cmpi = &_core_cmpi;
-    core->seti = &_core_seti;
-    core->movi = &_core_movi;
-    core->meqi = &_core_meqi;
-    core->mnei = &_core_mnei;
-    core->mgei = &_core_mgei;
-    core->mgti = &_core_mgti;
-    core->mlei = &_core_mlei;
-    core->mlti = &_core_mlti;
-    core->pshi = &_core_pshi;
-    core->popi = &_core_popi;
-    core->lodi = &_core_lodi;
-    core->stoi = &_core_stoi;
-    core->leai = &_core_leai;
-    core->pshf = &_core_pshf;
-    core->popf = &_core_popf;
-    core->call = &_core_call;
-    core->retn = &_core_retn;
-    core->setf = &_core_setf;
-    core->movf = &_core_movf;
-    core->lodf = &_core_lodf;
-    core->stof = &_core_stof;
-    core->inci = &_core_inci;
-    core->deci = &_core_deci;
-    core->addi = &_core_addi;
-    core->subi = &_core_subi;
-    core->addf = &_core_addf;
-    core->subf = &_core_subf;
-    core->mulf = &_core_mulf;
-    core->divf = &_core_divf;
+    core->ops  = &core_ops;
+}
+
+
+// Allocates memory for a new CPU core structure and returns a pointer to it.
+core_t* core_init(uint8_t cid, sysmem_t *smem) {
+    // allocate memory, aligned so the hot registers share one line
+    core_t *core = aligned_alloc(CORE_ALIGN, sizeof(core_t));
+    if (!core) {
+        return NULL;
+    }
+    core_setup(core, cid, smem);
     return core;
 }
 
 
+// Clears the registers and status of a core so it runs a program from the
+// start of the read only block with an empty stack.
+void core_reset(core_t *core) {
+    memset(core->iregs, 0, sizeof(core->iregs));
+    memset(core->fregs, 0, sizeof(core->fregs));
+    core->iregs[RSP] = core->stack_base;
+    core->rcmp = NA;
+    core->stc  = NO_ERR;
+}
+
+
 // Frees memory associated with CPU core structure to de-initialize.
 void core_delete(core_t *core) {
     free(core);
 }
 
 
-// Decodes an instruction at a specified memory address and executes it.
-void core_decode(core_t *core, sysmem_t *smem, uint16_t addr, uint8_t bit_offset) {
-    // decode the byte at the specified memory address bit by bit, starting at
-    // the offset 
+// Executes a decoded instruction through the core's function pointers.
+void execute_instr(core_t *core, const instr_t *in) {
+    switch (in->opcode) {
+        case NOOP: core->ops->noop(core); break;
+        case HALT: core->ops->halt(core); break;
+        case RETN: core->ops->retn(core); break;
+        case CALL: core->ops->call(core, in->imm.u); break;
+        case LODI: core->ops->lodi(core, in->imm.u, in->reg[0]); break;
+        case LODF: core->ops->lodf(core, in->imm.u, in->reg[0]); break;
+        case INCI: core->ops->inci(core, in->reg[0]); break;
+        case DECI: core->ops->deci(core, in->reg[0]); break;
+        case SETF: core->ops->setf(core, in->reg[0], in->imm.f); break;
+        case LEAI: core->ops->leai(core, in->reg[0], in->reg[1], in->reg[2], in->reg[3]); break;
+        case PSHI: core->ops->pshi(core, in->reg[0]); break;
+        case POPI: core->ops->popi(core, in->reg[0]); break;
+        case PSHF: core->ops->pshf(core, in->reg[0]); break;
+        case POPF: core->ops->popf(core, in->reg[0]); break;
+        case SETI: core->ops->seti(core, in->reg[0], in->imm.u); break;
+        case CMPI: core->ops->cmpi(core, in->reg[0], in->reg[1]); break;
+        case STOI: core->ops->stoi(core, in->reg[0], in->imm.u); break;
+        case STOF: core->ops->stof(core, in->reg[0], in->imm.u); break;
+        case MOVI: core->ops->movi(core, in->reg[0], in->reg[1]); break;
+        case MOVF: core->ops->movf(core, in->reg[0], in->reg[1]); break;
+        case MEQI: core->ops->meqi(core, in->reg[0], in->reg[1]); break;
+        case MNEI: core->ops->mnei(core, in->reg[0], in->reg[1]); break;
+        case ADDI: core->ops->addi(core, in->reg[0], in->reg[1]); break;
+        case SUBI: core->ops->subi(core, in->reg[0], in->reg[1]); break;
+        case MGTI: core->ops->mgti(core, in->reg[0], in->reg[1]); break;
+        case MGEI: core->ops->mgei(core, in->reg[0], in->reg[1]); break;
+        case MLTI: core->ops->mlti(core, in->reg[0], in->reg[1]); break;
+        case MLEI: core->ops->mlei(core, in->reg[0], in->reg[1]); break;
+        case ADDF: core->ops->addf(core, in->reg[0], in->reg[1]); break;
+        case SUBF: core->ops->subf(core, in->reg[0], in->reg[1]); break;
+        case MULF: core->ops->mulf(core, in->reg[0], in->reg[1]); break;
+        case DIVF: core->ops->divf(core, in->reg[0], in->reg[1]); break;
+        case BCPY: core->ops->bcpy(core, in->reg[0], in->reg[1], in->reg[2]); break;
+        case BFIL: core->ops->bfil(core, in->reg[0], in->reg[1], in->reg[2]); break;
+        case BCMP: core->ops->bcmp(core, in->reg[0], in->reg[1], in->reg[2]); break;
+        case CASI: core->ops->casi(core, in->reg[0], in->reg[1], in->reg[2]); break;
+        case FADI: core->ops->fadi(core, in->reg[0], in->reg[1], in->reg[2]); break;
+        case XCHI: core->ops->xchi(core, in->reg[0], in->reg[1], in->reg[2]); break;
+        case VADF: core->ops->vadf(core, in->reg[0], in->reg[1], in->reg[2]); break;
+        case VMLF: core->ops->vmlf(core, in->reg[0], in->reg[1], in->reg[2]); break;
+        case VMNF: core->ops->vmnf(core, in->reg[0], in->reg[1], in->reg[2]); break;
+        case VMXF: core->ops->vmxf(core, in->reg[0], in->reg[1], in->reg[2]); break;
+        case VFMF: core->ops->vfmf(core, in->reg[0], in->reg[1], in->reg[2], in->reg[3]); break;
+        case VRDF: core->ops->vrdf(core, in->reg[0], in->reg[1], in->reg[2]); break;
+        case VDTF: core->ops->vdtf(core, in->reg[0], in->reg[1], in->reg[2], in->reg[3]); break;
+        case VADI: core->ops->vadi(core, in->reg[0], in->reg[1], in->reg[2]); break;
+        case VMLI: core->ops->vmli(core, in->reg[0], in->reg[1], in->reg[2]); break;
+        case VMNI: core->ops->vmni(core, in->reg[0], in->reg[1], in->reg[2]); break;
+        case VMXI: core->ops->vmxi(core, in->reg[0], in->reg[1], in->reg[2]); break;
+        case VRDI: core->ops->vrdi(core, in->reg[0], in->reg[1], in->reg[2]); break;
+        case JMPA: core->ops->jmpa(core, in->imm.u); break;
+        case JMPR: core->ops->jmpr(core, in->imm.u); break;
+        case JEQ: core->ops->jeq(core, in->imm.u); break;
+        case JNE: core->ops->jne(core, in->imm.u); break;
+        case JGT: core->ops->jgt(core, in->imm.u); break;
+        case JGE: core->ops->jge(core, in->imm.u); break;
+        case JLT: core->ops->jlt(core, in->imm.u); break;
+        case JLE: core->ops->jle(core, in->imm.u); break;
+        case LOOP: core->ops->loop(core, in->reg[0], in->imm.u); break;
+        case LCAL: core->ops->lcal(core, in->imm.u); break;
+        case LRET: core->ops->lret(core); break;
+        case CALM: core->ops->calm(core, in->reg[0], in->imm.u); break;
+        case RETM: core->ops->retm(core); break;
+        case MULI: core->ops->muli(core, in->reg[0], in->reg[1]); break;
+        case DIVI: core->ops->divi(core, in->reg[0], in->reg[1]); break;
+        case MODI: core->ops->modi(core, in->reg[0], in->reg[1]); break;
+        case ANDI: core->ops->andi(core, in->reg[0], in->reg[1]); break;
+        case ORI: core->ops->ori(core, in->reg[0], in->reg[1]); break;
+        case XORI: core->ops->xori(core, in->reg[0], in->reg[1]); break;
+        case SHLI: core->ops->shli(core, in->reg[0], in->reg[1]); break;
+        case SHRI: core->ops->shri(core, in->reg[0], in->reg[1]); break;
+        case ROTL: core->ops->rotl(core, in->reg[0], in->reg[1]); break;
+        default:
+            // ERROR -- not an instruction
+            core->stc = ERR_INSTRUNREC;
+            break;
+    }
+}
+
+
+// Decodes an instruction at a specified memory address (and bit offset within
+// that byte) and executes it.
+void core_execute(core_t *core, sysmem_t *smem, uint16_t addr, uint8_t bit_offset) {
+    instr_t in;
+    uint16_t pc = addr * 8 + bit_offset;
+    if (pc >= INSTR_ROMBITS) {
+        // ERROR -- execute code from outside of RO memory block
+        core->stc = ERR_EXECOUTOFROBLK;
+        core->fault_pc = pc;
+        return;
+    }
+    // rpc already points at the next instruction while this one executes
+    core->iregs[RPC] = instr_fetch(core->itab, smem->mem, pc, &in);
+    execute_instr(core, &in);
+    if (core->stc != NO_ERR) {
+        core->fault_pc = pc;
+    }
+}
+
+
+/* The run loops call the handlers directly rather than through the function
+   pointers so that they can be inlined. Each entry is the opcode and the 
+   statement that executes the decoded instruction IN. */
+#define CORE_HANDLERS(H) \
+    H(NOOP, _core_noop(core)) \
+    H(HALT, _core_halt(core)) \
+    H(RETN, _core_retn(core)) \
+    H(CALL, _core_call(core, IN.imm.u)) \
+    H(LODI, _core_lodi(core, IN.imm.u, IN.reg[0])) \
+    H(LODF, _core_lodf(core, IN.imm.u, IN.reg[0])) \
+    H(INCI, _core_inci(core, IN.reg[0])) \
+    H(DECI, _core_deci(core, IN.reg[0])) \
+    H(SETF, _core_setf(core, IN.reg[0], IN.imm.f)) \
+    H(LEAI, _core_leai(core, IN.reg[0], IN.reg[1], IN.reg[2], IN.reg[3])) \
+    H(PSHI, _core_pshi(core, IN.reg[0])) \
+    H(POPI, _core_popi(core, IN.reg[0])) \
+    H(PSHF, _core_pshf(core, IN.reg[0])) \
+    H(POPF, _core_popf(core, IN.reg[0])) \
+    H(SETI, _core_seti(core, IN.reg[0], IN.imm.u)) \
+    H(CMPI, _core_cmpi(core, IN.reg[0], IN.reg[1])) \
+    H(STOI, _core_stoi(core, IN.reg[0], IN.imm.u)) \
+    H(STOF, _core_stof(core, IN.reg[0], IN.imm.u)) \
+    H(MOVI, _core_movi(core, IN.reg[0], IN.reg[1])) \
+    H(MOVF, _core_movf(core, IN.reg[0], IN.reg[1])) \
+    H(MEQI, _core_meqi(core, IN.reg[0], IN.reg[1])) \
+    H(MNEI, _core_mnei(core, IN.reg[0], IN.reg[1])) \
+    H(ADDI, _core_addi(core, IN.reg[0], IN.reg[1])) \
+    H(SUBI, _core_subi(core, IN.reg[0], IN.reg[1])) \
+    H(MGTI, _core_mgti(core, IN.reg[0], IN.reg[1])) \
+    H(MGEI, _core_mgei(core, IN.reg[0], IN.reg[1])) \
+    H(MLTI, _core_mlti(core, IN.reg[0], IN.reg[1])) \
+    H(MLEI, _core_mlei(core, IN.reg[0], IN.reg[1])) \
+    H(ADDF, _core_addf(core, IN.reg[0], IN.reg[1])) \
+    H(SUBF, _core_subf(core, IN.reg[0], IN.reg[1])) \
+    H(MULF, _core_mulf(core, IN.reg[0], IN.reg[1])) \
+    H(DIVF, _core_divf(core, IN.reg[0], IN.reg[1])) \
+    H(BCPY, _core_bcpy(core, IN.reg[0], IN.reg[1], IN.reg[2])) \
+    H(BFIL, _core_bfil(core, IN.reg[0], IN.reg[1], IN.reg[2])) \
+    H(BCMP, _core_bcmp(core, IN.reg[0], IN.reg[1], IN.reg[2])) \
+    H(CASI, _core_casi(core, IN.reg[0], IN.reg[1], IN.reg[2])) \
+    H(FADI, _core_fadi(core, IN.reg[0], IN.reg[1], IN.reg[2])) \
+    H(XCHI, _core_xchi(core, IN.reg[0], IN.reg[1], IN.reg[2])) \
+    H(VADF, _core_vadf(core, IN.reg[0], IN.reg[1], IN.reg[2])) \
+    H(VMLF, _core_vmlf(core, IN.reg[0], IN.reg[1], IN.reg[2])) \
+    H(VMNF, _core_vmnf(core, IN.reg[0], IN.reg[1], IN.reg[2])) \
+    H(VMXF, _core_vmxf(core, IN.reg[0], IN.reg[1], IN.reg[2])) \
+    H(VFMF, _core_vfmf(core, IN.reg[0], IN.reg[1], IN.reg[2], IN.reg[3])) \
+    H(VRDF, _core_vrdf(core, IN.reg[0], IN.reg[1], IN.reg[2])) \
+    H(VDTF, _core_vdtf(core, IN.reg[0], IN.reg[1], IN.reg[2], IN.reg[3])) \
+    H(VADI, _core_vadi(core, IN.reg[0], IN.reg[1], IN.reg[2])) \
+    H(VMLI, _core_vmli(core, IN.reg[0], IN.reg[1], IN.reg[2])) \
+    H(VMNI, _core_vmni(core, IN.reg[0], IN.reg[1], IN.reg[2])) \
+    H(VMXI, _core_vmxi(core, IN.reg[0], IN.reg[1], IN.reg[2])) \
+    H(VRDI, _core_vrdi(core, IN.reg[0], IN.reg[1], IN.reg[2])) \
+    H(JMPA, _core_jmpa(core, IN.imm.u)) \
+    H(JMPR, _core_jmpr(core, IN.imm.u)) \
+    H(JEQ, _core_jeq(core, IN.imm.u)) \
+    H(JNE, _core_jne(core, IN.imm.u)) \
+    H(JGT, _core_jgt(core, IN.imm.u)) \
+    H(JGE, _core_jge(core, IN.imm.u)) \
+    H(JLT, _core_jlt(core, IN.imm.u)) \
+    H(JLE, _core_jle(core, IN.imm.u)) \
+    H(LOOP, _core_loop(core, IN.reg[0], IN.imm.u)) \
+    H(LCAL, _core_lcal(core, IN.imm.u)) \
+    H(LRET, _core_lret(core)) \
+    H(CALM, _core_calm(core, IN.reg[0], IN.imm.u)) \
+    H(RETM, _core_retm(core)) \
+    H(MULI, _core_muli(core, IN.reg[0], IN.reg[1])) \
+    H(DIVI, _core_divi(core, IN.reg[0], IN.reg[1])) \
+    H(MODI, _core_modi(core, IN.reg[0], IN.reg[1])) \
+    H(ANDI, _core_andi(core, IN.reg[0], IN.reg[1])) \
+    H(ORI, _core_ori(core, IN.reg[0], IN.reg[1])) \
+    H(XORI, _core_xori(core, IN.reg[0], IN.reg[1])) \
+    H(SHLI, _core_shli(core, IN.reg[0], IN.reg[1])) \
+    H(SHRI, _core_shri(core, IN.reg[0], IN.reg[1])) \
+    H(ROTL, _core_rotl(core, IN.reg[0], IN.reg[1]))
+
+
+/* Superinstructions from the instruction cache. Each entry is the record kind,
+   the number of records it covers and the statement that executes it from 
+   the records at u (setting rpc itself). */
+#define CMP_EQ (1 << EQ)
+#define CMP_GT (1 << GT)
+#define CMP_LT (1 << LT)
+#define FUSED_CMPMOV(mask) \
+    core->iregs[RPC] = u[1].in.next; \
+    fused_cmpmov(core, u->in.reg[0], u->in.reg[1], u[1].in.reg[0], u[1].in.reg[1], mask)
+#define FUSED_HANDLERS(H) \
+    H(UOP_CMPMEQI, 2, FUSED_CMPMOV(CMP_EQ)) \
+    H(UOP_CMPMNEI, 2, FUSED_CMPMOV(CMP_GT | CMP_LT)) \
+    H(UOP_CMPMGTI, 2, FUSED_CMPMOV(CMP_GT)) \
+    H(UOP_CMPMGEI, 2, FUSED_CMPMOV(CMP_GT | CMP_EQ)) \
+    H(UOP_CMPMLTI, 2, FUSED_CMPMOV(CMP_LT)) \
+    H(UOP_CMPMLEI, 2, FUSED_CMPMOV(CMP_LT | CMP_EQ)) \
+    H(UOP_SETADDI, 2, \
+        core->iregs[RPC] = u->in.next; \
+        _core_seti(core, u->in.reg[0], u->in.imm.u); \
+        if (core->stc == NO_ERR) { \
+            core->iregs[RPC] = u[1].in.next; \
+            _core_addi(core, u[1].in.reg[0], u[1].in.reg[1]); \
+        })
+
+
+/* Handlers for verified records (UOP_VERIFIED, see icache.h), in the same 
+   form as CORE_HANDLERS. Only the instructions that operands_valid in 
+   icache.c verifies are listed. */
+#define VR(i) core->iregs[IN.reg[i]]
+#define VF(i) core->fregs[IN.reg[i]]
+#define VERIFIED_HANDLERS(H) \
+    H(CALL, verified_call(core, IN.imm.u)) \
+    H(LCAL, verified_lcal(core, IN.imm.u)) \
+    H(CALM, verified_calm(core, IN.reg[0], IN.imm.u); rets[n_rets++ % RETS] = u - cache->ops + 1) \
+    H(RETM, verified_retm(core)) \
+    H(LRET, _core_lret(core)) \
+    H(LODI, VR(0) = mem_get_uint16(core->smem, IN.imm.u)) \
+    H(LODF, VF(0) = mem_get_float(core->smem, IN.imm.u)) \
+    H(INCI, VR(0)++) \
+    H(DECI, verified_deci(core, IN.reg[0])) \
+    H(SETF, VF(0) = IN.imm.f) \
+    H(LEAI, VR(3) = VR(0) + (VR(1) << (IN.reg[2] / 2))) \
+    H(PSHI, verified_pshi(core, IN.reg[0])) \
+    H(POPI, verified_popi(core, IN.reg[0])) \
+    H(SETI, VR(0) = IN.imm.u) \
+    H(CMPI, core->rcmp = VR(0) == VR(1) ? EQ : (VR(0) < VR(1) ? LT : GT)) \
+    H(STOI, mem_set_uint16(core->smem, IN.imm.u, VR(0))) \
+    H(STOF, mem_set_float(core->smem, IN.imm.u, VF(0))) \
+    H(MOVI, VR(1) = VR(0)) \
+    H(MOVF, VF(1) = VF(0)) \
+    H(MEQI, verified_cmov(core, IN.reg[0], IN.reg[1], CMP_EQ)) \
+    H(MNEI, verified_cmov(core, IN.reg[0], IN.reg[1], CMP_GT | CMP_LT)) \
+    H(ADDI, verified_addi(core, IN.reg[0], IN.reg[1])) \
+    H(SUBI, verified_subi(core, IN.reg[0], IN.reg[1])) \
+    H(MGTI, verified_cmov(core, IN.reg[0], IN.reg[1], CMP_GT)) \
+    H(MGEI, verified_cmov(core, IN.reg[0], IN.reg[1], CMP_GT | CMP_EQ)) \
+    H(MLTI, verified_cmov(core, IN.reg[0], IN.reg[1], CMP_LT)) \
+    H(MLEI, verified_cmov(core, IN.reg[0], IN.reg[1], CMP_LT | CMP_EQ)) \
+    H(ADDF, VF(1) = VF(0) + VF(1)) \
+    H(SUBF, VF(1) = VF(1) - VF(0)) \
+    H(MULF, VF(1) = VF(0) * VF(1)) \
+    H(DIVF, VF(1) = VF(1) / VF(0)) \
+    H(JMPA, core->iregs[RPC] = IN.imm.u) \
+    H(JMPR, core->iregs[RPC] += IN.imm.u) \
+    H(JEQ, verified_jump_if(core, IN.imm.u, CMP_EQ)) \
+    H(JNE, verified_jump_if(core, IN.imm.u, CMP_GT | CMP_LT)) \
+    H(JGT, verified_jump_if(core, IN.imm.u, CMP_GT)) \
+    H(JGE, verified_jump_if(core, IN.imm.u, CMP_GT | CMP_EQ)) \
+    H(JLT, verified_jump_if(core, IN.imm.u, CMP_LT)) \
+    H(JLE, verified_jump_if(core, IN.imm.u, CMP_LT | CMP_EQ)) \
+    H(LOOP, verified_loop(core, IN.reg[0], IN.imm.u)) \
+    H(MULI, verified_muli(core, IN.reg[0], IN.reg[1])) \
+    H(ANDI, VR(1) &= VR(0)) \
+    H(ORI, VR(1) |= VR(0)) \
+    H(XORI, VR(1) ^= VR(0)) \
+    H(SHLI, VR(1) = VR(0) < 16 ? (uint16_t) (VR(1) << VR(0)) : 0) \
+    H(SHRI, VR(1) = VR(0) < 16 ? VR(1) >> VR(0) : 0) \
+    H(ROTL, VR(1) = (uint16_t) ((VR(1) << (VR(0) & 15)) | (VR(1) >> (16 - (VR(0) & 15)))))
+
+
+/* Superinstructions whose records are verified (both instructions are, see 
+   fuse_run), in the same form as FUSED_HANDLERS. */
+#define VFUSED_CMPMOV(mask) \
+    core->iregs[RPC] = u[1].in.next; \
+    verified_cmpmov(core, u->in.reg[0], u->in.reg[1], u[1].in.reg[0], u[1].in.reg[1], mask)
+#define VERIFIED_FUSED_HANDLERS(H) \
+    H(UOP_CMPMEQI, 2, VFUSED_CMPMOV(CMP_EQ)) \
+    H(UOP_CMPMNEI, 2, VFUSED_CMPMOV(CMP_GT | CMP_LT)) \
+    H(UOP_CMPMGTI, 2, VFUSED_CMPMOV(CMP_GT)) \
+    H(UOP_CMPMGEI, 2, VFUSED_CMPMOV(CMP_GT | CMP_EQ)) \
+    H(UOP_CMPMLTI, 2, VFUSED_CMPMOV(CMP_LT)) \
+    H(UOP_CMPMLEI, 2, VFUSED_CMPMOV(CMP_LT | CMP_EQ)) \
+    H(UOP_SETADDI, 2, \
+        core->iregs[RPC] = u[1].in.next; \
+        core->iregs[u->in.reg[0]] = u->in.imm.u; \
+        verified_addi(core, u[1].in.reg[0], u[1].in.reg[1]))
+
+
+// Fetch and decode the instruction at rpc (address in pc), leaving rpc 
+// pointing at the next one. Ends the run if the status code has been set by
+// the instruction at pc or rpc has left the read only block.
+#define CORE_FETCH() \
+    if (core->stc != NO_ERR) { \
+        core->fault_pc = pc; \
+        return; \
+    } \
+    if (core->iregs[RPC] >= INSTR_ROMBITS) { \
+        core->stc = ERR_EXECOUTOFROBLK; \
+        core->fault_pc = core->iregs[RPC]; \
+        return; \
+    } \
+    pc = core->iregs[RPC]; \
+    core->iregs[RPC] = instr_fetch(itab, mem, pc, &in)
+
+
+// Runs the fetch-decode-execute loop dispatching through a switch.
+void core_run_switch(core_t *core) {
+    const instr_table_t *itab = core->itab;
+    const uint8_t *mem = core->smem->mem;
+    trace_t *tr = core->trace;
+    instr_t in;
+    uint16_t pc;
+    if (core->stc != NO_ERR) {
+        return;
+    }
+#define IN in
+    for (;;) {
+        CORE_FETCH();
+        switch (in.opcode) {
+#define CASE(op, stmt) case op: stmt; break;
+            CORE_HANDLERS(CASE)
+#undef CASE
+            default:
+                // ERROR -- not an instruction
+                core->stc = ERR_INSTRUNREC;
+                break;
+        }
+        if (tr) {
+            trace_put(tr, pc, core->stc);
+        }
+    }
+#undef IN
+}
+
+
+// Runs the fetch-decode-execute loop like core_run_switch, counting each
+// opcode executed and each pair of consecutive opcodes.
+void core_run_profile(core_t *core, uint64_t *counts, uint64_t *pairs) {
+    instr_t in;
+    opcode_t prev = NONE;
+    uint16_t prev_next = 0;
+    while (core->stc == NO_ERR) {
+        if (core->iregs[RPC] >= INSTR_ROMBITS) {
+            // ERROR -- execute code from outside of RO memory block
+            core->stc = ERR_EXECOUTOFROBLK;
+            return;
+        }
+        // only count pairs that follow each other in memory
+        uint8_t follows = prev != NONE && core->iregs[RPC] == prev_next;
+        core->iregs[RPC] = instr_fetch(core->itab, core->smem->mem, core->iregs[RPC], &in);
+        counts[in.opcode]++;
+        if (follows) {
+            pairs[prev * N_OPCODES + in.opcode]++;
+        }
+        prev = in.opcode;
+        prev_next = in.next;
+        execute_instr(core, &in);
+    }
+}
+
+
+// Records the n instructions of the records at u in the trace (a 
+// superinstruction covers several), the status code is added by STOP_UOPS.
+#define TRACE_UOPS(n) \
+    for (uint32_t t_ = 0; t_ < (n); t_++) { \
+        trace_write(tr, &tw, u[t_].pc, NO_ERR); \
+    }
+#define NO_TRACE(n)
+
+
+// Leaves the run, handing the trace writer back.
+#define RETURN_UOPS() \
+    if (tr) { \
+        trace_end(tr, &tw); \
+    } \
+    return
+
+
+// Ends the run if the status code has been set by the records at u (a 
+// superinstruction only fails at its last instruction, see fuse_run).
+#define STOP_UOPS(n) \
+    if (core->stc != NO_ERR) { \
+        core->fault_pc = u[(n) - 1].pc; \
+        if (tr) { \
+            trace_stop(&tw, (uint8_t) core->stc); \
+        } \
+        RETURN_UOPS(); \
+    }
+
+
+// Runs the pre-decoded records of a core's instruction cache. Straight line
+// code steps to the next record, anything that may change rpc looks the next
+// record up by address, except for jumps with a fixed target which keep the
+// record they jump to, and retm which goes back to the record after its calm
+// when that is where rpc points. Records that can not fail skip the status 
+// code check (see icache.h), verified records run the handlers without 
+// operand checks.
+// Every handler has a second copy that records the instruction in the trace,
+// the records are linked to one set or the other depending on whether the 
+// run is traced, so neither checks for a trace per instruction.
+#if defined(__GNUC__)
+void run_cached(core_t *core) {
+    icache_t *cache = core->icache;
+    trace_t *tr = core->trace;
+    trace_writer_t tw = {0};
+    uop_t *u;
+    uint32_t at, from = 0;
+    uint16_t target;
+    // records after the last calls made by calm, the most recent at 
+    // n_rets - 1 (deeper ones are overwritten, their retm looks rpc up)
+#define RETS 16
+    uint32_t rets[RETS];
+    uint32_t n_rets = 0;
+#define IN u->in
+    // threaded code addresses for each kind of record, sequential or branch,
+    // untraced [0] and traced [1]
+#define LABEL(op, stmt) [op] = &&do_##op,
+#define BRLABEL(op, stmt) [op] = &&br_##op,
+#define NFLABEL(op, stmt) [op] = &&nf_##op,
+#define FLABEL(kind, n, stmt) [kind] = &&do_##kind,
+#define FBRLABEL(kind, n, stmt) [kind] = &&br_##kind,
+#define VLABEL(op, stmt) [op] = &&vdo_##op,
+#define VBRLABEL(op, stmt) [op] = &&vbr_##op,
+#define VNFLABEL(op, stmt) [op] = &&vnf_##op,
+#define TLABEL(op, stmt) [op] = &&tdo_##op,
+#define TBRLABEL(op, stmt) [op] = &&tbr_##op,
+#define TNFLABEL(op, stmt) [op] = &&tnf_##op,
+#define TFLABEL(kind, n, stmt) [kind] = &&tdo_##kind,
+#define TFBRLABEL(kind, n, stmt) [kind] = &&tbr_##kind,
+#define TVLABEL(op, stmt) [op] = &&tvdo_##op,
+#define TVBRLABEL(op, stmt) [op] = &&tvbr_##op,
+#define TVNFLABEL(op, stmt) [op] = &&tvnf_##op,
+#define VFLABEL(kind, n, stmt) [kind] = &&vdo_##kind,
+#define VFBRLABEL(kind, n, stmt) [kind] = &&vbr_##kind,
+#define TVFLABEL(kind, n, stmt) [kind] = &&tvdo_##kind,
+#define TVFBRLABEL(kind, n, stmt) [kind] = &&tvbr_##kind,
+    static void *seq[2][N_UOPS] = {
+        { [NONE] = &&do_NONE, [UOP_END] = &&do_END, [UOP_LINK] = &&do_LINK,
+          CORE_HANDLERS(LABEL) FUSED_HANDLERS(FLABEL) },
+        { [NONE] = &&do_NONE, [UOP_END] = &&do_END, [UOP_LINK] = &&do_LINK,
+          CORE_HANDLERS(TLABEL) FUSED_HANDLERS(TFLABEL) }
+    };
+    static void *br[2][N_UOPS] = {
+        { [NONE] = &&do_NONE, [UOP_END] = &&do_END, [UOP_LINK] = &&do_LINK,
+          CORE_HANDLERS(BRLABEL) FUSED_HANDLERS(FBRLABEL) },
+        { [NONE] = &&do_NONE, [UOP_END] = &&do_END, [UOP_LINK] = &&do_LINK,
+          CORE_HANDLERS(TBRLABEL) FUSED_HANDLERS(TFBRLABEL) }
+    };
+    static void *nf[2][N_UOPS] = {
+        { [NONE] = &&do_NONE, [UOP_END] = &&do_END, [UOP_LINK] = &&do_LINK,
+          CORE_HANDLERS(NFLABEL) FUSED_HANDLERS(FLABEL) },
+        { [NONE] = &&do_NONE, [UOP_END] = &&do_END, [UOP_LINK] = &&do_LINK,
+          CORE_HANDLERS(TNFLABEL) FUSED_HANDLERS(TFLABEL) }
+    };
+    // the same for verified records (NULL if the kind has no verified form)
+    static void *vseq[2][N_UOPS] = {
+        { VERIFIED_HANDLERS(VLABEL) VERIFIED_FUSED_HANDLERS(VFLABEL) },
+        { VERIFIED_HANDLERS(TVLABEL) VERIFIED_FUSED_HANDLERS(TVFLABEL) }
+    };
+    static void *vbr[2][N_UOPS] = {
+        { VERIFIED_HANDLERS(VBRLABEL) VERIFIED_FUSED_HANDLERS(VFBRLABEL) },
+        { VERIFIED_HANDLERS(TVBRLABEL) VERIFIED_FUSED_HANDLERS(TVFBRLABEL) }
+    };
+    static void *vnf[2][N_UOPS] = {
+        { VERIFIED_HANDLERS(VNFLABEL) VERIFIED_FUSED_HANDLERS(VFLABEL) },
+        { VERIFIED_HANDLERS(TVNFLABEL) VERIFIED_FUSED_HANDLERS(TVFLABEL) }
+    };
+#undef VFLABEL
+#undef VFBRLABEL
+#undef TVFLABEL
+#undef TVFBRLABEL
+#undef TVLABEL
+#undef TVBRLABEL
+#undef TVNFLABEL
+#undef TLABEL
+#undef TBRLABEL
+#undef TNFLABEL
+#undef TFLABEL
+#undef TFBRLABEL
+#undef VLABEL
+#undef VBRLABEL
+#undef VNFLABEL
+#undef LABEL
+#undef BRLABEL
+#undef NFLABEL
+#undef FLABEL
+#undef FBRLABEL
+#define JUMP_TO(pc) \
+    target = pc; \
+    goto lookup
+    // Continue after a record that may have changed rpc. A jump with a fixed
+    // target goes straight to the next record or to the record its target
+    // was found at the first time it was taken, a retm to the record after 
+    // the latest calm (unless the JIT has to see every block entry).
+#define BRANCH() \
+    if ((u->flags & UOP_JUMP) && !cache->jit) { \
+        if (core->iregs[RPC] == IN.next) { \
+            u++; \
+            goto *u->handler; \
+        } \
+        if (u->target) { \
+            u = &cache->ops[u->target]; \
+            goto *u->handler; \
+        } \
+        from = u - cache->ops; \
+    } \
+    if ((u->flags & UOP_RETURN) && n_rets && !cache->jit) { \
+        uop_t *r = &cache->ops[rets[--n_rets % RETS]]; \
+        if (r->pc == core->iregs[RPC]) { \
+            u = r; \
+            goto *u->handler; \
+        } \
+    } \
+    JUMP_TO(core->iregs[RPC])
+
+    if (core->stc != NO_ERR) {
+        return;
+    }
+    // records linked for the other kind of run get their handlers again
+    uint8_t traced = tr != NULL;
+    if (cache->traced != traced) {
+        cache->traced = traced;
+        cache->n_linked = 0;
+    }
+    if (tr) {
+        trace_begin(tr, &tw);
+    }
+    JUMP_TO(core->iregs[RPC]);
+lookup:
+    // records that have been decoded are found without a call
+    at = target < INSTR_ROMBITS && cache->index[target] ? cache->index[target] : icache_lookup(cache, target);
+    // remember the target of a jump taken for the first time (record 0 
+    // takes the store otherwise)
+    cache->ops[from].target = at;
+    from = 0;
+    // hot blocks run as native code while it keeps making progress, if it
+    // stops at its own first instruction that one is left to the interpreter
+    if (cache->jit && !tr) {
+        jit_fn_t native = jit_enter(cache->jit, cache, at);
+        if (native) {
+            native(core);
+            if (core->iregs[RPC] != target) {
+                JUMP_TO(core->iregs[RPC]);
+            }
+        }
+    }
+    u = &cache->ops[at];
+    // fill in the handler of any record that does not have one yet (the
+    // cache grows when execution reaches code it has not decoded)
+    while (cache->n_linked < cache->n_ops) {
+        uop_t *l = &cache->ops[cache->n_linked++];
+        void **h = l->flags & UOP_BRANCH ? br[traced] : (l->flags & UOP_NOFAULT ? nf[traced] : seq[traced]);
+        void **v = l->flags & UOP_BRANCH ? vbr[traced] : (l->flags & UOP_NOFAULT ? vnf[traced] : vseq[traced]);
+        l->handler = (l->flags & UOP_VERIFIED) && v[l->kind] ? v[l->kind] : h[l->kind];
+    }
+    goto *u->handler;
+#define HANDLER_COPY(t, op, stmt, TRACE) \
+t##do_##op: \
+    core->iregs[RPC] = IN.next; \
+    stmt; \
+    TRACE(1); \
+    STOP_UOPS(1); \
+    u++; \
+    goto *u->handler; \
+t##nf_##op: \
+    core->iregs[RPC] = IN.next; \
+    stmt; \
+    TRACE(1); \
+    u++; \
+    goto *u->handler; \
+t##br_##op: \
+    core->iregs[RPC] = IN.next; \
+    stmt; \
+    TRACE(1); \
+    STOP_UOPS(1); \
+    BRANCH();
+#define HANDLER(op, stmt) HANDLER_COPY(, op, stmt, NO_TRACE)
+#define THANDLER(op, stmt) HANDLER_COPY(t, op, stmt, TRACE_UOPS)
+    CORE_HANDLERS(HANDLER)
+    CORE_HANDLERS(THANDLER)
+#define VHANDLER(op, stmt) HANDLER_COPY(v, op, stmt, NO_TRACE)
+#define TVHANDLER(op, stmt) HANDLER_COPY(tv, op, stmt, TRACE_UOPS)
+    VERIFIED_HANDLERS(VHANDLER)
+    VERIFIED_HANDLERS(TVHANDLER)
+#undef HANDLER
+#undef THANDLER
+#undef VHANDLER
+#undef TVHANDLER
+#undef HANDLER_COPY
+#define FHANDLER_COPY(t, kind, n, stmt, TRACE) \
+t##do_##kind: \
+    stmt; \
+    TRACE(n); \
+    STOP_UOPS(n); \
+    u += n; \
+    goto *u->handler; \
+t##br_##kind: \
+    stmt; \
+    TRACE(n); \
+    STOP_UOPS(n); \
+    JUMP_TO(core->iregs[RPC]);
+#define FHANDLER(kind, n, stmt) FHANDLER_COPY(, kind, n, stmt, NO_TRACE)
+#define TFHANDLER(kind, n, stmt) FHANDLER_COPY(t, kind, n, stmt, TRACE_UOPS)
+    FUSED_HANDLERS(FHANDLER)
+    FUSED_HANDLERS(TFHANDLER)
+#define VFHANDLER(kind, n, stmt) FHANDLER_COPY(v, kind, n, stmt, NO_TRACE)
+#define TVFHANDLER(kind, n, stmt) FHANDLER_COPY(tv, kind, n, stmt, TRACE_UOPS)
+    VERIFIED_FUSED_HANDLERS(VFHANDLER)
+    VERIFIED_FUSED_HANDLERS(TVFHANDLER)
+#undef FHANDLER
+#undef TFHANDLER
+#undef VFHANDLER
+#undef TVFHANDLER
+#undef FHANDLER_COPY
+do_LINK:
+    JUMP_TO(u->pc);
+do_END:
+    // ERROR -- execute code from outside of RO memory block
+    core->stc = ERR_EXECOUTOFROBLK;
+    core->fault_pc = core->iregs[RPC];
+    RETURN_UOPS();
+do_NONE:
+    // ERROR -- not an instruction
+    core->stc = ERR_INSTRUNREC;
+    core->fault_pc = u->pc;
+    RETURN_UOPS();
+#undef JUMP_TO
+#undef BRANCH
+#undef RETS
+#undef IN
 }
+#else
+void run_cached(core_t *core) {
+    icache_t *cache = core->icache;
+    trace_t *tr = core->trace;
+    trace_writer_t tw = {0};
+    if (tr) {
+        trace_begin(tr, &tw);
+    }
+    uint32_t i = icache_lookup(cache, core->iregs[RPC]);
+    while (core->stc == NO_ERR) {
+        uop_t *u = &cache->ops[i];
+        uint32_t n = 1;
+#define IN u->in
+        core->iregs[RPC] = IN.next;
+        switch (u->kind) {
+#define CASE(op, stmt) case op: stmt; break;
+            CORE_HANDLERS(CASE)
+#undef CASE
+#define FCASE(kind, len, stmt) case kind: stmt; n = len; break;
+            FUSED_HANDLERS(FCASE)
+#undef FCASE
+            case UOP_LINK:
+                i = icache_lookup(cache, u->pc);
+                continue;
+            case UOP_END:
+                // ERROR -- execute code from outside of RO memory block
+                core->stc = ERR_EXECOUTOFROBLK;
+                core->fault_pc = core->iregs[RPC];
+                RETURN_UOPS();
+            default:
+                // ERROR -- not an instruction
+                core->stc = ERR_INSTRUNREC;
+                core->fault_pc = u->pc;
+                RETURN_UOPS();
+        }
+#undef IN
+        if (tr) {
+            TRACE_UOPS(n);
+        }
+        STOP_UOPS(n);
+        i = u->flags & UOP_BRANCH ? icache_lookup(cache, core->iregs[RPC]) : i + n;
+    }
+    RETURN_UOPS();
+}
+#endif
+#undef STOP_UOPS
+#undef RETURN_UOPS
+#undef TRACE_UOPS
+#undef NO_TRACE
+
+
+// Runs the fetch-decode-execute loop with threaded dispatch: every handler 
+// ends by fetching the next instruction and jumping straight to its handler,
+// so there is one indirect jump per instruction (and one jump site per 
+// handler for the branch predictor) instead of the shared switch.
+#if defined(__GNUC__)
+void run_decoded(core_t *core) {
+    const instr_table_t *itab = core->itab;
+    const uint8_t *mem = core->smem->mem;
+    trace_t *tr = core->trace;
+    instr_t in;
+    uint16_t pc;
+#define IN in
+#define LABEL(op, stmt) [op] = &&do_##op,
+    static void *dispatch[N_OPCODES] = {
+        [NONE] = &&do_NONE,
+        CORE_HANDLERS(LABEL)
+    };
+#undef LABEL
+#define DISPATCH() \
+    if (tr) { \
+        trace_put(tr, pc, core->stc); \
+    } \
+    CORE_FETCH(); \
+    goto *dispatch[in.opcode]
+
+    if (core->stc != NO_ERR) {
+        return;
+    }
+    CORE_FETCH();
+    goto *dispatch[in.opcode];
+#define HANDLER(op, stmt) do_##op: stmt; DISPATCH();
+    CORE_HANDLERS(HANDLER)
+#undef HANDLER
+do_NONE:
+    // ERROR -- not an instruction
+    core->stc = ERR_INSTRUNREC;
+    DISPATCH();
+#undef DISPATCH
+#undef IN
+}
+#else
+void run_decoded(core_t *core) {
+    core_run_switch(core);
+}
+#endif
+
 
+// Runs a core until its status code is set (see cpu.h).
+void core_run(core_t *core) {
+    if (core->trace) {
+        core->trace->mem = core->smem->mem;
+        core->trace->itab = core->itab;
+    }
+#if CORE_STATS
+    if (core->stats) {
+        core_run_stats(core);
+    } else
+#endif
+    if (core->icache) {
+        run_cached(core);
+    } else {
+        run_decoded(core);
+    }
+    if (core->trace) {
+        trace_flush(core->trace);
+    }
+    // leave the last instructions behind if the program failed
+    if (core->trace && core->trace->dump && core->stc != ERR_HALT) {
+        trace_dump(core->trace, core->cid, core->trace->dump);
+    }
+}
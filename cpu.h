@@ -17,6 +17,7 @@
 #include <stdlib.h>
 #include "memory.h"
 #include "instruction.h"
+#include "icache.h"
 #include "error.h"
 
 
@@ -49,41 +50,17 @@ typedef enum {
 } cmpres_t;
 
 
-// CPU core data structure
-//      registers:
-//          rpc -- program counter
-//          rsp -- stack pointer                     
-//          rbp -- base pointer                      (callee-saved)
-//          ir0, ir1, ir2, ir3 -- integer arguments  (callee-saved)
-//          irv -- integer return value             (*caller-saved*)
-//          fr0, fr1, fr2, fr3 -- float arguments    (callee-saved)
-//          frv -- float return value               (*caller-saved*)
-typedef struct core {
-    
-    // miscellaneous CPU core data
-    uint8_t     cid;    // core ID (for multiple cores in one VM)
-    sysmem_t    *smem;  // pointer to system memory data structure
-    cmpres_t    rcmp;   // register for comparisons
-    errcode_t   stc;    // status code
-    
-    // integer registers (stored as unsigned 16-bit)
-    uint16_t    rpc;    // program counter
-    uint16_t    rsp;    // stack pointer
-    uint16_t    rbp;    // base pointer
-    uint16_t    ir0;    // general purpose integer register 0
-    uint16_t    ir1;    // general purpose integer register 1 
-    uint16_t    ir2;    // general purpose integer register 2 
-    uint16_t    ir3;    // general purpose integer register 3
-    uint16_t    irv;    // integer return value
-    
-    // floating point registers (stored as 32-bit floats)
-    float       fr0;    // general purpose floating point register 0
-    float       fr1;    // general purpose floating point register 1
-    float       fr2;    // general purpose floating point register 2
-    float       fr3;    // general purpose floating point register 3
-    float       frv;    // floating point return value
-    
-    // function pointers
+// write permission masks for integer registers, bit (1 << reg) set if the
+// register may be written
+#define CORE_WR_GP  ((1 << IR0) | (1 << IR1) | (1 << IR2) | (1 << IR3))
+#define CORE_WR_GPR (CORE_WR_GP | (1 << RPC) | (1 << RBP) | (1 << IRV))
+
+
+struct core;
+
+
+// instruction handlers, one table is shared by every core
+typedef struct core_ops {
     // no operation
     void (*noop) (struct core*);
     // halt execution
@@ -133,11 +110,115 @@ typedef struct core {
     // add/subtract values from integer registers A, B result in B
     void (*addi) (struct core*, ireg_t, ireg_t);
     void (*subi) (struct core*, ireg_t, ireg_t);
+    // multiply/divide/remainder of integer registers B by A, result in B
+    void (*muli) (struct core*, ireg_t, ireg_t);
+    void (*divi) (struct core*, ireg_t, ireg_t);
+    void (*modi) (struct core*, ireg_t, ireg_t);
+    // bitwise and/or/xor of integer registers A, B result in B
+    void (*andi) (struct core*, ireg_t, ireg_t);
+    void (*ori) (struct core*, ireg_t, ireg_t);
+    void (*xori) (struct core*, ireg_t, ireg_t);
+    // shift left/shift right/rotate left integer register B by A bits
+    void (*shli) (struct core*, ireg_t, ireg_t);
+    void (*shri) (struct core*, ireg_t, ireg_t);
+    void (*rotl) (struct core*, ireg_t, ireg_t);
     // add/subtract/multiply/divide float registers A, B result in B
     void (*addf) (struct core*, freg_t, freg_t);
     void (*subf) (struct core*, freg_t, freg_t);
     void (*mulf) (struct core*, freg_t, freg_t);
     void (*divf) (struct core*, freg_t, freg_t);
+    // block copy/fill/compare over the read/write block, the last register
+    // holds the length in bytes (copy: src, dst; fill: value, dst; compare: 
+    // a, b with the result in rcmp)
+    void (*bcpy) (struct core*, ireg_t, ireg_t, ireg_t);
+    void (*bfil) (struct core*, ireg_t, ireg_t, ireg_t);
+    void (*bcmp) (struct core*, ireg_t, ireg_t, ireg_t);
+    // atomic operations on the word at the address in the first register:
+    // compare-and-swap (expected, new), fetch-and-add and exchange (value, 
+    // register that receives the old word)
+    void (*casi) (struct core*, ireg_t, ireg_t, ireg_t);
+    void (*fadi) (struct core*, ireg_t, ireg_t, ireg_t);
+    void (*xchi) (struct core*, ireg_t, ireg_t, ireg_t);
+    // packed vector operations on arrays in the read/write block, the length
+    // register holds the number of elements: elementwise float add, multiply,
+    // min, max (src, dst, len), dst += scale * src (src, dst, len, scale), 
+    // sum (addr, len, float dst) and dot product (a, b, len, float dst)
+    void (*vadf) (struct core*, ireg_t, ireg_t, ireg_t);
+    void (*vmlf) (struct core*, ireg_t, ireg_t, ireg_t);
+    void (*vmnf) (struct core*, ireg_t, ireg_t, ireg_t);
+    void (*vmxf) (struct core*, ireg_t, ireg_t, ireg_t);
+    void (*vfmf) (struct core*, ireg_t, ireg_t, ireg_t, freg_t);
+    void (*vrdf) (struct core*, ireg_t, ireg_t, freg_t);
+    void (*vdtf) (struct core*, ireg_t, ireg_t, ireg_t, freg_t);
+    // the same for words, wrapping around (the sum goes to an integer register)
+    void (*vadi) (struct core*, ireg_t, ireg_t, ireg_t);
+    void (*vmli) (struct core*, ireg_t, ireg_t, ireg_t);
+    void (*vmni) (struct core*, ireg_t, ireg_t, ireg_t);
+    void (*vmxi) (struct core*, ireg_t, ireg_t, ireg_t);
+    void (*vrdi) (struct core*, ireg_t, ireg_t, ireg_t);
+    // jump to a bit address in the read only block, or by an offset in bits
+    // from the next instruction
+    void (*jmpa) (struct core*, uint16_t);
+    void (*jmpr) (struct core*, uint16_t);
+    // jump by an offset if rcmp is EQ, GT or LT, GT, GT or EQ, LT, LT or EQ
+    // (must follow cmpi, rcmp is reset like for the conditional moves)
+    void (*jeq) (struct core*, uint16_t);
+    void (*jne) (struct core*, uint16_t);
+    void (*jgt) (struct core*, uint16_t);
+    void (*jge) (struct core*, uint16_t);
+    void (*jlt) (struct core*, uint16_t);
+    void (*jle) (struct core*, uint16_t);
+    // decrement a register and jump by an offset unless it has reached 0
+    void (*loop) (struct core*, ireg_t, uint16_t);
+    // leaf call (pushes only rpc) and its return
+    void (*lcal) (struct core*, uint16_t);
+    void (*lret) (struct core*);
+    // call that saves rpc, rbp and the registers in a mask (bit i for 
+    // ir0 + i, bit 4 + i for fr0 + i), and its return
+    void (*calm) (struct core*, uint8_t, uint16_t);
+    void (*retm) (struct core*);
+} core_ops_t;
+
+extern const core_ops_t core_ops;
+
+
+// alignment of core_t (host cache line size)
+#define CORE_ALIGN 64
+
+
+// CPU core data structure
+//      registers (iregs indexed by ireg_t, fregs by freg_t):
+//          rpc -- program counter (bit address in the read only block)
+//          rsp -- stack pointer                     
+//          rbp -- base pointer                      (callee-saved)
+//          ir0, ir1, ir2, ir3 -- integer arguments  (callee-saved)
+//          irv -- integer return value             (*caller-saved*)
+//          fr0, fr1, fr2, fr3 -- float arguments    (callee-saved)
+//          frv -- float return value               (*caller-saved*)
+// Everything an instruction touches fits in the first cache line, the fields
+// after it are only used to set up and start a run.
+typedef struct core {
+    
+    // integer registers (stored as unsigned 16-bit)
+    _Alignas(CORE_ALIGN) uint16_t iregs[8];
+    
+    // floating point registers (stored as 32-bit floats)
+    float       fregs[5];
+    
+    cmpres_t    rcmp;   // register for comparisons
+    errcode_t   stc;    // status code
+    uint16_t    stack_base;     // stack space of this core: rsp starts at
+    uint16_t    stack_limit;    // stack_base and stays below stack_limit
+    sysmem_t    *smem;  // pointer to system memory data structure
+    const core_ops_t *ops;      // instruction handlers
+    
+    // miscellaneous CPU core data
+    uint8_t     cid;    // core ID (for multiple cores in one VM)
+    uint16_t    fault_pc;       // bit address of the instruction that set stc
+    const instr_table_t *itab;  // decode table for the loaded program
+    icache_t    *icache;        // pre-decoded program (optional)
+    struct core_stats *stats;   // execution counters (optional, see stats.h)
+    struct trace *trace;        // execution trace (optional, see trace.h)
     
 } core_t;
 
@@ -146,12 +227,51 @@ typedef struct core {
 core_t* core_init(uint8_t, sysmem_t*);
 
 
+// Initializes a CPU core structure in place (memory aligned to CORE_ALIGN, 
+// e.g. in an arena of cores).
+void core_setup(core_t*, uint8_t, sysmem_t*);
+
+
+// Clears the registers and status of a core so it runs a program from the
+// start of the read only block with an empty stack.
+void core_reset(core_t*);
+
+
 // Frees memory associated with CPU core structure to de-initialize.
 void core_delete(core_t*);
 
 
-// decodes an instruction at a specified memory address and executes it
+// Executes a decoded instruction through the core's function pointers (rpc 
+// must already point at the following instruction).
+void execute_instr(core_t*, const instr_t*);
+
+
+// decodes an instruction at a specified memory address (and bit offset within
+// that byte) and executes it
 void core_execute(core_t*, sysmem_t*, uint16_t, uint8_t);
 
 
+// Runs the fetch-decode-execute loop starting at rpc until the status code is
+// set (halt or any error). core->itab must be set to the program's decode
+// table. If core->icache is set, instructions are dispatched from the 
+// pre-decoded records instead of being decoded from memory. Uses threaded 
+// dispatch where the compiler supports computed goto. Goes through the 
+// counting loop if core->stats is set and records each instruction if 
+// core->trace is set. When the run stops, core->fault_pc holds the address of
+// the instruction that set the status code (or the address outside the read
+// only block that execution reached).
+void core_run(core_t*);
+
+
+// Same as core_run but always decodes from memory and dispatches through a 
+// switch.
+void core_run_switch(core_t*);
+
+
+// Profiling run: same as core_run_switch, but adds up the number of times
+// each opcode executes (counts[opcode]) and each pair of opcodes that follow
+// each other in memory executes (pairs[first * N_OPCODES + second]).
+void core_run_profile(core_t*, uint64_t*, uint64_t*);
+
+
 #endif
@@ -27,7 +27,11 @@ typedef enum {
     ERR_EXECOUTOFROBLK, // execute code from outside of RO memory block
     ERR_DECRZERO,       // decrement 0
     ERR_IREGOVERFLOW,   // integer register overflow
-    ERR_IREGUNDERFLOW   // integer register underflow
+    ERR_IREGUNDERFLOW,  // integer register underflow
+    ERR_INSTRUNREC,     // instruction unrecognized
+    ERR_MEMALIGN,       // atomic access to an odd address
+    ERR_DIVZERO,        // integer divide by zero
+    N_ERRCODES          // number of status codes (not a status code itself)
 } errcode_t;
 
 
@@ -0,0 +1,410 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    icache.c
+*/
+
+
+#include "icache.h"
+#include "cpu.h"
+#include "jit.h"
+
+
+// longest run decoded on a miss before linking back to the lookup
+#define ICACHE_MAXRUN 64
+
+
+// superinstruction patterns
+const fusion_t icache_fusions[] = {
+    { CMPI, MEQI, UOP_CMPMEQI },
+    { CMPI, MNEI, UOP_CMPMNEI },
+    { CMPI, MGTI, UOP_CMPMGTI },
+    { CMPI, MGEI, UOP_CMPMGEI },
+    { CMPI, MLTI, UOP_CMPMLTI },
+    { CMPI, MLEI, UOP_CMPMLEI },
+    { SETI, ADDI, UOP_SETADDI }
+};
+const uint8_t icache_n_fusions = sizeof(icache_fusions) / sizeof(icache_fusions[0]);
+
+
+// Determine whether an instruction can change rpc.
+uint8_t writes_rpc(const instr_t *in) {
+    switch (in->opcode) {
+        case CALL:
+        case RETN:
+        case JMPA:
+        case JMPR:
+        case JEQ:
+        case JNE:
+        case JGT:
+        case JGE:
+        case JLT:
+        case JLE:
+        case LOOP:
+        case LCAL:
+        case LRET:
+        case CALM:
+        case RETM:
+            return 1;
+        case LODI:
+        case INCI:
+        case DECI:
+        case POPI:
+            return in->reg[0] == RPC;
+        case LEAI:
+            return in->reg[3] == RPC;
+        case MOVI:
+        case MEQI:
+        case MNEI:
+        case MGTI:
+        case MGEI:
+        case MLTI:
+        case MLEI:
+        case ADDI:
+        case SUBI:
+        case CASI:
+        case MULI:
+        case DIVI:
+        case MODI:
+        case ANDI:
+        case ORI:
+        case XORI:
+        case SHLI:
+        case SHRI:
+        case ROTL:
+            return in->reg[1] == RPC;
+        case FADI:
+        case XCHI:
+        case VRDI:
+            return in->reg[2] == RPC;
+        default:
+            return 0;
+    }
+}
+
+
+// Determine whether an instruction is a jump whose target does not depend on
+// any register, so it only ever continues at one of two addresses (calls 
+// reach their target or stop the run with an error).
+uint8_t jumps_direct(const instr_t *in) {
+    switch (in->opcode) {
+        case CALL:
+        case LCAL:
+        case CALM:
+        case JMPA:
+        case JMPR:
+        case JEQ:
+        case JNE:
+        case JGT:
+        case JGE:
+        case JLT:
+        case JLE:
+            return 1;
+        case LOOP:
+            return in->reg[0] != RPC;
+        default:
+            return 0;
+    }
+}
+
+
+// Determine whether an instruction passes every check of its handler that 
+// depends only on its operands and the memory layout (see cpu.c): registers 
+// exist and may be written, the leai multiplier is 1, 2 or 4, and fixed
+// addresses and jump targets are in memory with the right permission. Only
+// the instructions that have verified handlers in cpu.c are considered.
+uint8_t operands_valid(const icache_t *cache, const instr_t *in) {
+    const uint8_t *r = in->reg;
+    switch (in->opcode) {
+        case SETI:
+            return r[0] <= IRV && (CORE_WR_GP & (1 << r[0]));
+        case INCI:
+        case DECI:
+        case POPI:
+            return r[0] <= IRV && (CORE_WR_GPR & (1 << r[0]));
+        case PSHI:
+            return r[0] <= IRV;
+        case MOVI:
+        case MEQI:
+        case MNEI:
+        case MGTI:
+        case MGEI:
+        case MLTI:
+        case MLEI:
+        case ADDI:
+        case SUBI:
+        case MULI:
+        case ANDI:
+        case ORI:
+        case XORI:
+        case SHLI:
+        case SHRI:
+        case ROTL:
+            return r[0] <= IRV && r[1] <= IRV && (CORE_WR_GPR & (1 << r[1]));
+        case CMPI:
+            return r[0] <= IRV && r[1] <= IRV;
+        case LEAI:
+            return r[0] <= IRV && r[1] <= IRV && (r[2] == 1 || r[2] == 2 || r[2] == 4)
+                   && r[3] <= IRV && (CORE_WR_GPR & (1 << r[3]));
+        case LODI:
+            return mem_check(cache->smem, in->imm.u, 2, MEM_R) && r[0] <= IRV && (CORE_WR_GPR & (1 << r[0]));
+        case STOI:
+            return mem_check(cache->smem, in->imm.u, 2, MEM_W) && r[0] <= IRV;
+        case LODF:
+            return mem_check(cache->smem, in->imm.u, 4, MEM_R) && r[0] <= FRV;
+        case STOF:
+            return mem_check(cache->smem, in->imm.u, 4, MEM_W) && r[0] <= FRV;
+        case SETF:
+            return r[0] <= FRV;
+        case MOVF:
+        case ADDF:
+        case SUBF:
+        case MULF:
+        case DIVF:
+            return r[0] <= FRV && r[1] <= FRV;
+        case LRET:
+        case RETM:
+            return 1;
+        case CALL:
+        case LCAL:
+        case CALM:
+        case JMPA:
+            return mem_check(cache->smem, in->imm.u >> 3, 1, MEM_X);
+        case JMPR:
+        case JEQ:
+        case JNE:
+        case JGT:
+        case JGE:
+        case JLT:
+        case JLE:
+            return mem_check(cache->smem, (uint16_t) (in->next + in->imm.u) >> 3, 1, MEM_X);
+        case LOOP:
+            // a count in rpc would jump to wherever the decrement leaves it
+            return r[0] <= IRV && r[0] != RPC && (CORE_WR_GPR & (1 << r[0]))
+                   && mem_check(cache->smem, (uint16_t) (in->next + in->imm.u) >> 3, 1, MEM_X);
+        default:
+            return 0;
+    }
+}
+
+
+// Determine whether an instruction can never set the status code, judging by
+// its operands and the memory layout alone: the handlers of these make no 
+// checks other than those of operands_valid.
+uint8_t never_faults(const icache_t *cache, const instr_t *in) {
+    switch (in->opcode) {
+        case NOOP:
+            return 1;
+        case SETI:
+        case INCI:
+        case MOVI:
+        case ANDI:
+        case ORI:
+        case XORI:
+        case SHLI:
+        case SHRI:
+        case ROTL:
+        case CMPI:
+        case LEAI:
+        case LODI:
+        case STOI:
+        case LODF:
+        case STOF:
+        case SETF:
+        case MOVF:
+        case ADDF:
+        case SUBF:
+        case MULF:
+        case DIVF:
+            return operands_valid(cache, in);
+        default:
+            return 0;
+    }
+}
+
+
+// Flags for a decoded instruction.
+uint8_t uop_flags(const icache_t *cache, const instr_t *in) {
+    return (writes_rpc(in) ? UOP_BRANCH : 0) | (never_faults(cache, in) ? UOP_NOFAULT : 0)
+           | (jumps_direct(in) ? UOP_JUMP : 0) | (operands_valid(cache, in) ? UOP_VERIFIED : 0)
+           | (in->opcode == RETM ? UOP_RETURN : 0);
+}
+
+
+// Append a record to the cache, returns it.
+uop_t* append_uop(icache_t *cache, uint8_t kind, uint16_t pc) {
+    if (cache->n_ops == cache->cap) {
+        cache->cap *= 2;
+        cache->ops = realloc(cache->ops, cache->cap * sizeof(uop_t));
+    }
+    uop_t *u = &cache->ops[cache->n_ops++];
+    memset(u, 0, sizeof(uop_t));
+    u->kind = kind;
+    u->pc = pc;
+    return u;
+}
+
+
+// Replace the records of a freshly decoded run with superinstructions where
+// an enabled pattern matches. A fused pair takes the flags of its second 
+// instruction, since that is the one that finishes last, but is only verified
+// if both instructions are. Pairs are only fused if the first instruction can
+// not fail, so that an error always stops the pair at the same instruction as
+// it would unfused.
+void fuse_run(icache_t *cache, uint32_t first, uint32_t end) {
+    for (uint32_t i = first; i < end; i++) {
+        uop_t *u = &cache->ops[i];
+        for (uint8_t f = 0; f < icache_n_fusions; f++) {
+            const fusion_t *p = &icache_fusions[f];
+            if (!(cache->fusions & (1u << f)) || u->kind != p->first) {
+                continue;
+            }
+            if (p->second == NONE) {
+                u->kind = p->kind;
+                break;
+            }
+            if (i + 1 < end && u[1].kind == p->second && (u->flags & UOP_NOFAULT)) {
+                u->kind = p->kind;
+                u->flags = u[1].flags & (u->flags | ~UOP_VERIFIED);
+                i++;
+                break;
+            }
+        }
+    }
+}
+
+
+// Decode up to max instructions starting at pc, stopping early at an address
+// that is already cached or at the end of the read only block, then link to
+// whatever comes next.
+void decode_run(icache_t *cache, uint16_t pc, uint32_t max) {
+    uint32_t first = cache->n_ops;
+    for (uint32_t n = 0; n < max && pc < INSTR_ROMBITS && !cache->index[pc]; n++) {
+        cache->index[pc] = cache->n_ops;
+        uop_t *u = append_uop(cache, 0, pc);
+        pc = instr_fetch(cache->itab, cache->mem, pc, &u->in);
+        u->kind = u->in.opcode;
+        u->flags = uop_flags(cache, &u->in);
+    }
+    fuse_run(cache, first, cache->n_ops);
+    append_uop(cache, UOP_LINK, pc);
+}
+
+
+// Allocate an empty cache for the read only block of a system memory.
+icache_t* icache_alloc(const instr_table_t *itab, const sysmem_t *smem, uint32_t fusions) {
+    icache_t *cache = calloc(1, sizeof(icache_t));
+    cache->itab = itab;
+    cache->fusions = fusions;
+    cache->smem = smem;
+    cache->mem = smem->mem;
+    cache->index = calloc(INSTR_ROMBITS, sizeof(uint32_t));
+    cache->cap = 4096;
+    cache->ops = malloc(cache->cap * sizeof(uop_t));
+    // record 0 is where execution ends up once rpc leaves the block
+    append_uop(cache, UOP_END, INSTR_ROMBITS);
+    return cache;
+}
+
+
+// Decodes the whole read only block of a system memory into a new cache, 
+// fusing the enabled superinstruction patterns.
+icache_t* icache_build(const instr_table_t *itab, const sysmem_t *smem, uint32_t fusions) {
+    icache_t *cache = icache_alloc(itab, smem, fusions);
+    decode_run(cache, 0, INSTR_ROMBITS);
+    return cache;
+}
+
+
+// Whether an instruction said to be decoded at a bit address is one the 
+// decoder could have produced: an opcode the table encodes, register, 
+// multiplier and mask operands that fit their fields, and the next 
+// instruction right after its code and operands.
+uint8_t decoded_valid(const instr_table_t *itab, const instr_t *in, uint16_t pc) {
+    if (in->opcode == NONE || in->opcode >= N_OPCODES || !itab->code[in->opcode].len) {
+        return 0;
+    }
+    uint32_t end = pc + itab->code[in->opcode].len;
+    uint8_t n = 0;
+    for (const uint8_t *k = instr_operands[in->opcode]; *k != OPND_NONE; k++) {
+        if (*k != OPND_IMM && *k != OPND_IMMF && in->reg[n++] >> instr_opnd_bits[*k]) {
+            return 0;
+        }
+        end += instr_opnd_bits[*k];
+    }
+    return end == in->next;
+}
+
+
+// Builds a cache from instructions that were already decoded in program 
+// order starting at bit address 0 (e.g. stored in a program image). Anything
+// after them is decoded lazily. Returns NULL if the instructions do not 
+// follow each other inside the read only block or are not what the decoder
+// would have produced (see decoded_valid).
+icache_t* icache_build_decoded(const instr_table_t *itab, const sysmem_t *smem, uint32_t fusions, 
+                               const instr_t *ins, uint32_t n) {
+    icache_t *cache = icache_alloc(itab, smem, fusions);
+    uint16_t pc = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (pc >= INSTR_ROMBITS || !decoded_valid(itab, &ins[i], pc)) {
+            icache_delete(cache);
+            return NULL;
+        }
+        cache->index[pc] = cache->n_ops;
+        uop_t *u = append_uop(cache, ins[i].opcode, pc);
+        u->in = ins[i];
+        u->flags = uop_flags(cache, &u->in);
+        pc = ins[i].next;
+    }
+    fuse_run(cache, 1, cache->n_ops);
+    append_uop(cache, UOP_LINK, pc);
+    return cache;
+}
+
+
+// Frees memory associated with an instruction cache.
+void icache_delete(icache_t *cache) {
+    if (!cache) {
+        return;
+    }
+    jit_delete(cache->jit);
+    free(cache->index);
+    free(cache->ops);
+    free(cache);
+}
+
+
+// Returns the index of the record for the instruction at a bit address,
+// decoding it first if it is not in the cache yet.
+uint32_t icache_lookup(icache_t *cache, uint16_t pc) {
+    if (pc >= INSTR_ROMBITS) {
+        return 0;
+    }
+    if (!cache->index[pc]) {
+        decode_run(cache, pc, ICACHE_MAXRUN);
+    }
+    return cache->index[pc];
+}
+
+
+// Chooses the superinstruction patterns worth fusing from the opcode counts
+// and opcode pair counts of a profiling run.
+uint32_t icache_choose_fusions(const uint64_t *counts, const uint64_t *pairs, double min_share) {
+    uint64_t total = 0;
+    for (opcode_t op = NOOP; op < N_OPCODES; op++) {
+        total += counts[op];
+    }
+    uint32_t fusions = 0;
+    for (uint8_t f = 0; f < icache_n_fusions && total; f++) {
+        const fusion_t *p = &icache_fusions[f];
+        uint64_t n = p->second == NONE ? counts[p->first] : pairs[p->first * N_OPCODES + p->second];
+        if ((double) n / total >= min_share) {
+            fusions |= 1u << f;
+        }
+    }
+    return fusions;
+}
@@ -0,0 +1,154 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    icache.h
+*/
+
+
+#ifndef ICACHE_H
+#define ICACHE_H
+
+
+#include <stdlib.h>
+#include <stdint.h>
+
+
+#include "memory.h"
+#include "instruction.h"
+
+
+/*
+The read only block never changes while a program runs, so it only has to be
+decoded once. The instruction cache holds every instruction of the block as a
+fixed size micro-op record, laid out in program order so that straight line
+code is executed by stepping to the next record. A table indexed by bit
+address maps the target of any control transfer back to its record.
+
+Instructions that are only reached by jumping into the middle of what the
+linear pass decoded are decoded the first time they are reached and appended
+as a run that ends in a link back to the rest of the program.
+
+Common instruction sequences can be fused into superinstructions: the record
+of the first instruction gets a kind that executes the whole sequence, and the
+records that follow it are left in place (so that jumps into the middle of a
+sequence still work) and skipped over.
+
+Most instructions can only fail because of their operands (a register that
+does not exist or may not be written, an address outside the read/write
+block), which are known once they are decoded. Records for instructions that
+pass those checks are flagged so that the run loop does not look at the
+status code after them: the check is deferred to the next record that can
+fail at run time or changes rpc, and since nothing before it could have set
+the status code, the result and the faulting address are the same.
+
+The same checks are verified for every record as it is decoded (for the 
+whole block when the cache is built): register operands that exist and may
+be written, leai multipliers, and load/store addresses and jump or call 
+targets in memory with the right permission. The run loop gives verified
+records handlers with those checks left out, which only keep the ones that
+depend on values at run time (overflow, rcmp, stack bounds). Since the
+checks left out could not have failed, a verified record does exactly what
+the checked handler would.
+*/
+
+
+// micro-op kinds, the first N_OPCODES are the instructions themselves
+typedef enum {
+    UOP_END = N_OPCODES,    // rpc has left the read only block
+    UOP_LINK,               // continue at the record for pc
+    // superinstructions
+    UOP_CMPMEQI,            // cmpi + meqi
+    UOP_CMPMNEI,            // cmpi + mnei
+    UOP_CMPMGTI,            // cmpi + mgti
+    UOP_CMPMGEI,            // cmpi + mgei
+    UOP_CMPMLTI,            // cmpi + mlti
+    UOP_CMPMLEI,            // cmpi + mlei
+    UOP_SETADDI,            // seti + addi
+    N_UOPS
+} uopkind_t;
+
+
+// Superinstruction patterns: an opcode, the opcode that has to follow it (or 
+// NONE) and the kind that replaces them. Patterns are enabled by bit (1 << i)
+// of a mask.
+typedef struct fusion {
+    uint8_t first;
+    uint8_t second;
+    uint8_t kind;
+} fusion_t;
+
+extern const fusion_t icache_fusions[];
+extern const uint8_t icache_n_fusions;
+
+#define ICACHE_ALLFUSIONS 0xFFFFFFFF
+
+
+// micro-op flags
+#define UOP_BRANCH  0x01    // may change rpc, next record found by lookup
+#define UOP_NOFAULT 0x02    // can not set the status code
+#define UOP_JUMP    0x04    // only changes rpc by jumping to a fixed target
+#define UOP_VERIFIED 0x08   // operands proven valid, runs without their checks
+#define UOP_RETURN  0x10    // retm, may go back to the record after its calm
+
+
+// micro-op record
+typedef struct uop {
+    const void *handler;    // threaded code address (filled in by the run loop)
+    instr_t in;             // decoded instruction, in.next is the next rpc
+    uint16_t pc;            // bit address of the instruction
+    uint8_t kind;           // uopkind_t
+    uint8_t flags;
+    uint32_t target;        // record of the target of a UOP_JUMP record (0 
+                            // until the run loop has looked it up)
+} uop_t;
+
+
+// pre-decoded instruction cache for the read only block
+typedef struct icache {
+    const instr_table_t *itab;  // decode table the program was encoded with
+    const sysmem_t *smem;       // memory the program was decoded from, its
+    const uint8_t *mem;         // layout must not change while the cache is used
+    uop_t *ops;                 // micro-op records, ops[0] is UOP_END
+    uint32_t n_ops;
+    uint32_t cap;
+    uint32_t n_linked;          // records with handler filled in
+    uint8_t traced;             // handlers were filled in for a traced run
+    uint32_t *index;            // bit address -> record (0 if not decoded)
+    uint32_t fusions;           // enabled superinstruction patterns
+    struct jit *jit;            // native code for hot blocks (optional)
+} icache_t;
+
+
+// Decodes the whole read only block of a system memory into a new cache, 
+// fusing the enabled superinstruction patterns.
+icache_t* icache_build(const instr_table_t*, const sysmem_t*, uint32_t);
+
+
+// Builds a cache from instructions that were already decoded in program 
+// order starting at bit address 0 (e.g. stored in a program image), the rest
+// of the block is decoded lazily. Returns NULL if the instructions do not 
+// follow each other inside the read only block.
+icache_t* icache_build_decoded(const instr_table_t*, const sysmem_t*, uint32_t, const instr_t*, uint32_t);
+
+
+// Chooses the superinstruction patterns worth fusing from the opcode counts
+// and opcode pair counts (pairs[first * N_OPCODES + second]) of a profiling 
+// run: a pattern is enabled if it covers at least a given fraction of the
+// instructions executed.
+uint32_t icache_choose_fusions(const uint64_t*, const uint64_t*, double);
+
+
+// Frees memory associated with an instruction cache.
+void icache_delete(icache_t*);
+
+
+// Returns the index of the record for the instruction at a bit address,
+// decoding it first if it is not in the cache yet.
+uint32_t icache_lookup(icache_t*, uint16_t);
+
+
+#endif
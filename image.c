@@ -0,0 +1,328 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    image.c
+*/
+
+
+#define _DEFAULT_SOURCE
+
+
+#include <stdio.h>
+#include <string.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define IMAGE_HAVE_MMAP
+#endif
+
+
+#include "image.h"
+
+
+// little-endian field access
+uint16_t image_get16(const uint8_t *p) {
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+uint32_t image_get32(const uint8_t *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+void image_put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+}
+
+void image_put32(uint8_t *p, uint32_t v) {
+    image_put16(p, (uint16_t) v);
+    image_put16(p + 2, (uint16_t) (v >> 16));
+}
+
+
+// Bytes of the memory image for the sizes of the read only block and data.
+uint32_t image_data_len(uint16_t rom_size, uint16_t rw_size) {
+    return rw_size ? (uint32_t) MEMORY_RWBLKMIN + rw_size : rom_size;
+}
+
+
+// Map (or read) a whole file, returns the number of bytes or 0 on failure.
+size_t image_map_file(const char *path, const uint8_t **map, int *fd) {
+    *fd = -1;
+#if defined(IMAGE_HAVE_MMAP)
+    int f = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (f < 0) {
+        return 0;
+    }
+    if (fstat(f, &st) || st.st_size <= 0) {
+        close(f);
+        return 0;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, f, 0);
+    if (p == MAP_FAILED) {
+        close(f);
+        return 0;
+    }
+    *map = p;
+    *fd = f;
+    return st.st_size;
+#else
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return 0;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *buf = size > 0 ? malloc(size) : NULL;
+    if (!buf || fread(buf, 1, size, f) != (size_t) size) {
+        free(buf);
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+    *map = buf;
+    return size;
+#endif
+}
+
+
+// Closes a program image. Memories it was loaded into stay valid, but a 
+// mapped one still reads the file: it has to be replaced (image_write does),
+// not truncated or rewritten in place.
+void image_close(image_t *img) {
+    if (!img) {
+        return;
+    }
+#if defined(IMAGE_HAVE_MMAP)
+    if (img->fd >= 0) {
+        munmap((void*) img->map, img->size);
+        close(img->fd);
+    }
+#else
+    free((void*) img->map);
+#endif
+    instr_delete_table(img->itab);
+    instr_delete_tree(img->tree);
+    free(img);
+}
+
+
+// Opens and validates a program image (NULL if it cannot be read or is not a
+// valid image of a supported version).
+image_t* image_open(const char *path) {
+    image_t *img = calloc(1, sizeof(image_t));
+    img->size = image_map_file(path, &img->map, &img->fd);
+    const uint8_t *h = img->map;
+    if (img->size < IMAGE_HEADERSIZE || memcmp(h, IMAGE_MAGIC, 4) || image_get16(h + 0x04) != IMAGE_VERSION) {
+        image_close(img);
+        return NULL;
+    }
+    img->entry = image_get16(h + 0x08);
+    img->rom_size = image_get16(h + 0x0A);
+    img->rw_size = image_get16(h + 0x0C);
+    uint16_t tree_len = image_get16(h + 0x0E);
+    img->n_decoded = image_get32(h + 0x10);
+    uint32_t decoded_offset = image_get32(h + 0x14);
+    img->data_offset = image_get32(h + 0x18);
+    uint64_t data_end = (uint64_t) img->data_offset + image_data_len(img->rom_size, img->rw_size);
+    uint64_t decoded_end = (uint64_t) decoded_offset + (uint64_t) img->n_decoded * IMAGE_DECODEDSIZE;
+    if (img->entry >= INSTR_ROMBITS || img->rom_size > MEMORY_RWBLKMIN 
+        || img->rw_size > MEMORY_RWBLKMAX - MEMORY_RWBLKMIN || tree_len > INSTR_TREEDESC_MAX
+        || (size_t) IMAGE_HEADERSIZE + tree_len > img->size || img->data_offset % IMAGE_DATAALIGN 
+        || data_end > img->size || (img->n_decoded && decoded_end > img->size)) {
+        image_close(img);
+        return NULL;
+    }
+    img->data = img->map + img->data_offset;
+    img->decoded = img->n_decoded ? img->map + decoded_offset : NULL;
+    // encoding of the program
+    img->tree = tree_len ? instr_read_tree(h + IMAGE_HEADERSIZE, tree_len) : instr_build_tree();
+    img->itab = img->tree ? instr_build_table(img->tree) : NULL;
+    if (!img->itab) {
+        image_close(img);
+        return NULL;
+    }
+    return img;
+}
+
+
+// Loads the program into a freshly allocated (zeroed) system memory, mapping 
+// it where possible and copying otherwise. Returns 1 if it was mapped.
+int image_load(const image_t *img, sysmem_t *smem) {
+    uint32_t len = image_data_len(img->rom_size, img->rw_size);
+#if defined(IMAGE_HAVE_MMAP)
+    // the memory image has to be page aligned in the file and run to its end
+    // (the rest of the last page reads as zeros)
+    long page = sysconf(_SC_PAGESIZE);
+    if (img->fd >= 0 && smem->mem_kind == SYSMEM_MAPPED && len && page > 0 
+        && img->data_offset % page == 0 && img->data_offset + len == img->size) {
+        size_t maplen = (len + page - 1) / page * page;
+        // private, but pages not yet written still come from the file
+        void *p = mmap(smem->mem, maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, img->fd, img->data_offset);
+        if (p != MAP_FAILED) {
+            // pages that hold nothing but the read only block, up to the 
+            // first one the layout lets cores store to (sysmem_protect makes
+            // pages writable again)
+            size_t ro = 0;
+            while (ro < MEMORY_RWBLKMIN && !(smem->pages[ro >> MEMORY_PAGEBITS] & (MEM_W | MEM_S))) {
+                ro += MEMORY_PAGESIZE;
+            }
+            ro = ro / page * page;
+            if (ro) {
+                mprotect(smem->mem, ro < maplen ? ro : maplen, PROT_READ);
+            }
+            return 1;
+        }
+    }
+    if (smem->mem_kind == SYSMEM_MAPPED && page > 0) {
+        // an earlier load may have left the read only block read only
+        mprotect(smem->mem, (MEMORY_RWBLKMIN + page - 1) / page * page, PROT_READ | PROT_WRITE);
+    }
+#endif
+    memcpy(smem->mem, img->data, len);
+    return 0;
+}
+
+
+// Points a core at the program: its decode table and the entry point.
+void image_start(const image_t *img, core_t *core) {
+    core->itab = img->itab;
+    core->iregs[RPC] = img->entry;
+}
+
+
+// Builds an instruction cache for the loaded program, from the pre-decoded
+// instructions if the image has them.
+icache_t* image_icache(const image_t *img, const sysmem_t *smem, uint32_t fusions) {
+    icache_t *cache = NULL;
+    if (img->decoded) {
+        instr_t *ins = calloc(img->n_decoded, sizeof(instr_t));
+        for (uint32_t i = 0; i < img->n_decoded; i++) {
+            const uint8_t *r = img->decoded + (size_t) i * IMAGE_DECODEDSIZE;
+            ins[i].opcode = r[0] < N_OPCODES ? (opcode_t) r[0] : NONE;
+            memcpy(ins[i].reg, r + 1, 4);
+            ins[i].next = image_get16(r + 6);
+            uint32_t v = image_get32(r + 8);
+            int immf = 0;
+            for (const uint8_t *k = instr_operands[ins[i].opcode]; *k != OPND_NONE; k++) {
+                immf |= *k == OPND_IMMF;
+            }
+            if (immf) {
+                memcpy(&ins[i].imm.f, &v, sizeof(float));
+            } else {
+                ins[i].imm.u = (uint16_t) v;
+            }
+        }
+        cache = icache_build_decoded(img->itab, smem, fusions, ins, img->n_decoded);
+        free(ins);
+    }
+    return cache ? cache : icache_build(img->itab, smem, fusions);
+}
+
+
+// Writes an image of the program in a system memory: the read only block up 
+// to a given size and a given amount of read/write data, encoded with a tree.
+// Optionally stores the pre-decoded instructions. Returns 0 on success.
+int image_write(const char *path, instr_node_t *tree, const sysmem_t *smem, uint16_t entry, 
+                uint16_t rom_size, uint16_t rw_size, int with_decoded) {
+    if (rom_size > MEMORY_RWBLKMIN || rw_size > MEMORY_RWBLKMAX - MEMORY_RWBLKMIN) {
+        return -1;
+    }
+    uint8_t h[IMAGE_HEADERSIZE + INSTR_TREEDESC_MAX] = {0};
+    uint16_t tree_len = tree ? instr_write_tree(tree, h + IMAGE_HEADERSIZE) : 0;
+
+    // pre-decoded instructions, linear sweep over the read only block
+    uint8_t *decoded = NULL;
+    uint32_t n_decoded = 0;
+    if (with_decoded) {
+        instr_node_t *t = tree ? tree : instr_build_tree();
+        instr_table_t *itab = instr_build_table(t);
+        decoded = malloc((size_t) rom_size * 8 * IMAGE_DECODEDSIZE);
+        for (uint32_t pc = 0; itab && pc < (uint32_t) rom_size * 8; n_decoded++) {
+            instr_t in = {0};
+            uint16_t next = instr_fetch(itab, smem->mem, (uint16_t) pc, &in);
+            uint8_t *r = decoded + (size_t) n_decoded * IMAGE_DECODEDSIZE;
+            uint32_t v = in.imm.u;
+            for (const uint8_t *k = instr_operands[in.opcode]; *k != OPND_NONE; k++) {
+                if (*k == OPND_IMMF) {
+                    memcpy(&v, &in.imm.f, sizeof(float));
+                }
+            }
+            r[0] = (uint8_t) in.opcode;
+            memcpy(r + 1, in.reg, 4);
+            r[5] = 0;
+            image_put16(r + 6, next);
+            image_put32(r + 8, v);
+            if (next <= pc) {
+                break;
+            }
+            pc = next;
+        }
+        instr_delete_table(itab);
+        if (!tree) {
+            instr_delete_tree(t);
+        }
+    }
+
+    // layout: header and tree, pre-decoded instructions, memory image last
+    uint32_t decoded_offset = (IMAGE_HEADERSIZE + tree_len + 3) & ~3u;
+    uint32_t data_offset = decoded_offset + n_decoded * IMAGE_DECODEDSIZE;
+    data_offset = (data_offset + IMAGE_DATAALIGN - 1) / IMAGE_DATAALIGN * IMAGE_DATAALIGN;
+    memcpy(h, IMAGE_MAGIC, 4);
+    image_put16(h + 0x04, IMAGE_VERSION);
+    image_put16(h + 0x06, 0);
+    image_put16(h + 0x08, entry);
+    image_put16(h + 0x0A, rom_size);
+    image_put16(h + 0x0C, rw_size);
+    image_put16(h + 0x0E, tree_len);
+    image_put32(h + 0x10, n_decoded);
+    image_put32(h + 0x14, n_decoded ? decoded_offset : 0);
+    image_put32(h + 0x18, data_offset);
+
+    // written next to the target and renamed over it, so that memories the 
+    // old file is mapped into keep their pages
+    size_t path_len = strlen(path);
+    char *tmp = malloc(path_len + 5);
+    if (tmp) {
+        memcpy(tmp, path, path_len);
+        memcpy(tmp + path_len, ".tmp", 5);
+    }
+    FILE *f = tmp ? fopen(tmp, "wb") : NULL;
+    if (!f) {
+        free(tmp);
+        free(decoded);
+        return -1;
+    }
+    uint8_t zero[IMAGE_DATAALIGN] = {0};
+    uint32_t at = IMAGE_HEADERSIZE + tree_len;
+    int ok = fwrite(h, 1, at, f) == at;
+    ok = ok && fwrite(zero, 1, decoded_offset - at, f) == decoded_offset - at;
+    at = decoded_offset + n_decoded * IMAGE_DECODEDSIZE;
+    ok = ok && fwrite(decoded, IMAGE_DECODEDSIZE, n_decoded, f) == n_decoded;
+    ok = ok && fwrite(zero, 1, data_offset - at, f) == data_offset - at;
+    uint32_t len = image_data_len(rom_size, rw_size);
+    // the read only block up to its size, zeros up to the data, the data
+    ok = ok && fwrite(smem->mem, 1, rom_size, f) == rom_size;
+    for (uint32_t i = rom_size; ok && i < len && i < MEMORY_RWBLKMIN; i++) {
+        ok = fputc(0, f) != EOF;
+    }
+    if (rw_size) {
+        ok = ok && fwrite(smem->mem + MEMORY_RWBLKMIN, 1, rw_size, f) == rw_size;
+    }
+    ok = fclose(f) == 0 && ok;
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok) {
+        remove(tmp);
+    }
+    free(tmp);
+    free(decoded);
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,109 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    image.h
+*/
+
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+
+#include <stdlib.h>
+#include <stdint.h>
+
+
+#include "memory.h"
+#include "instruction.h"
+#include "icache.h"
+#include "cpu.h"
+
+
+/*
+Program image file (version 1, all fields little-endian):
+    0x00  magic "C16I"
+    0x04  u16 version
+    0x06  u16 flags (reserved, 0)
+    0x08  u16 entry point (bit address)
+    0x0A  u16 bytes of the read only block in the image
+    0x0C  u16 bytes of initial data for the read/write block
+    0x0E  u16 bytes of encoding tree descriptor (0: default tree)
+    0x10  u32 number of pre-decoded instructions (0: none)
+    0x14  u32 file offset of the pre-decoded instructions
+    0x18  u32 file offset of the memory image (multiple of IMAGE_DATAALIGN)
+    0x1C  encoding tree descriptor (see instr_write_tree)
+The memory image holds the read only block from address 0 followed, if there
+is initial data, by zeros up to MEMORY_RWBLKMIN and the data. Pre-decoded
+instructions are the instructions of the read only block in program order 
+from address 0, IMAGE_DECODEDSIZE bytes each:
+    u8 opcode, u8 reg[4], u8 0, u16 next, u32 immediate (raw bits)
+
+Because the memory image sits at a page aligned offset, loading maps it 
+straight into the memory of a machine (private, so writes stay local) instead 
+of reading it, and the pages that hold nothing but the read only block are
+mapped read only.
+*/
+#define IMAGE_MAGIC         "C16I"
+#define IMAGE_VERSION       1
+#define IMAGE_HEADERSIZE    0x1C
+#define IMAGE_DECODEDSIZE   12
+#define IMAGE_DATAALIGN     4096
+
+
+// an open program image
+typedef struct image {
+    const uint8_t *map;         // the whole file (read only mapping or copy)
+    size_t size;
+    int fd;                     // -1 if the file was read instead of mapped
+    uint16_t entry;
+    uint16_t rom_size;
+    uint16_t rw_size;
+    uint32_t n_decoded;
+    const uint8_t *decoded;     // pre-decoded instructions (NULL if none)
+    const uint8_t *data;        // memory image
+    uint32_t data_offset;
+    instr_node_t *tree;         // encoding of the program
+    instr_table_t *itab;
+} image_t;
+
+
+// Opens and validates a program image (NULL if it cannot be read or is not a
+// valid image of a supported version).
+image_t* image_open(const char*);
+
+
+// Closes a program image. Memories it was loaded into stay valid, but a 
+// mapped one still reads the file: it has to be replaced (image_write does),
+// not truncated or rewritten in place.
+void image_close(image_t*);
+
+
+// Loads the program into a freshly allocated (zeroed) system memory, mapping 
+// it where possible and copying otherwise. Returns 1 if it was mapped. The 
+// pages of a mapped memory that hold only the read only block are read only
+// on the host too: the host may store there again once sysmem_protect gives 
+// them MEM_W or the memory is loaded again, not before.
+int image_load(const image_t*, sysmem_t*);
+
+
+// Points a core at the program: its decode table and the entry point.
+void image_start(const image_t*, core_t*);
+
+
+// Builds an instruction cache for the loaded program, from the pre-decoded
+// instructions if the image has them.
+icache_t* image_icache(const image_t*, const sysmem_t*, uint32_t);
+
+
+// Writes an image of the program in a system memory: the read only block up 
+// to a given size and a given amount of read/write data, encoded with a tree.
+// Optionally stores the pre-decoded instructions. An existing file is 
+// replaced by renaming a new one over it. Returns 0 on success.
+int image_write(const char*, instr_node_t*, const sysmem_t*, uint16_t, uint16_t, uint16_t, int);
+
+
+#endif
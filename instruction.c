@@ -11,7 +11,76 @@
 
 #include "instruction.h"
 
-#include <stdio.h>
+
+// operand kinds for each opcode
+#define R OPND_IREG
+#define F OPND_FREG
+#define M OPND_MULT
+#define I OPND_IMM
+#define FI OPND_IMMF
+#define K OPND_MASK
+const uint8_t instr_operands[N_OPCODES][5] = {
+    [NOOP] = {0},       [HALT] = {0},       [RETN] = {0},
+    [CALL] = {I},
+    [LODI] = {I, R},    [LODF] = {I, F},
+    [INCI] = {R},       [DECI] = {R},
+    [SETF] = {F, FI},   [LEAI] = {R, R, M, R},
+    [PSHI] = {R},       [POPI] = {R},       [PSHF] = {F},   [POPF] = {F},
+    [SETI] = {R, I},    [CMPI] = {R, R},
+    [STOI] = {R, I},    [STOF] = {F, I},
+    [MOVI] = {R, R},    [MOVF] = {F, F},
+    [MEQI] = {R, R},    [MNEI] = {R, R},    [ADDI] = {R, R},    [SUBI] = {R, R},
+    [MGTI] = {R, R},    [MGEI] = {R, R},    [MLTI] = {R, R},    [MLEI] = {R, R},
+    [ADDF] = {F, F},    [SUBF] = {F, F},    [MULF] = {F, F},    [DIVF] = {F, F},
+    [BCPY] = {R, R, R}, [BFIL] = {R, R, R}, [BCMP] = {R, R, R},
+    [CASI] = {R, R, R}, [FADI] = {R, R, R}, [XCHI] = {R, R, R},
+    [VADF] = {R, R, R}, [VMLF] = {R, R, R}, [VMNF] = {R, R, R}, [VMXF] = {R, R, R},
+    [VFMF] = {R, R, R, F}, [VRDF] = {R, R, F}, [VDTF] = {R, R, R, F},
+    [VADI] = {R, R, R}, [VMLI] = {R, R, R}, [VMNI] = {R, R, R}, [VMXI] = {R, R, R},
+    [VRDI] = {R, R, R},
+    [JMPA] = {I},       [JMPR] = {I},
+    [JEQ] = {I},        [JNE] = {I},        [JGT] = {I},        [JGE] = {I},
+    [JLT] = {I},        [JLE] = {I},        [LOOP] = {R, I},
+    [LCAL] = {I},       [LRET] = {0},       [CALM] = {K, I},    [RETM] = {0},
+    [MULI] = {R, R},    [DIVI] = {R, R},    [MODI] = {R, R},
+    [ANDI] = {R, R},    [ORI] = {R, R},     [XORI] = {R, R},
+    [SHLI] = {R, R},    [SHRI] = {R, R},    [ROTL] = {R, R}
+};
+#undef R
+#undef F
+#undef M
+#undef I
+#undef FI
+#undef K
+
+
+// operand widths in bits, indexed by opnd_t
+const uint8_t instr_opnd_bits[] = { 0, 3, 3, 3, 16, 32, 8 };
+
+
+// mnemonic of each opcode
+const char *const instr_names[N_OPCODES] = {
+    [NONE] = "none",
+    [NOOP] = "noop", [HALT] = "halt", [RETN] = "retn", [CALL] = "call",
+    [LODI] = "lodi", [LODF] = "lodf", [INCI] = "inci", [DECI] = "deci",
+    [SETF] = "setf", [LEAI] = "leai", [PSHI] = "pshi", [POPI] = "popi",
+    [PSHF] = "pshf", [POPF] = "popf", [SETI] = "seti", [CMPI] = "cmpi",
+    [STOI] = "stoi", [STOF] = "stof", [MOVI] = "movi", [MOVF] = "movf",
+    [MEQI] = "meqi", [MNEI] = "mnei", [ADDI] = "addi", [SUBI] = "subi",
+    [MGTI] = "mgti", [MGEI] = "mgei", [MLTI] = "mlti", [MLEI] = "mlei",
+    [ADDF] = "addf", [SUBF] = "subf", [MULF] = "mulf", [DIVF] = "divf",
+    [BCPY] = "bcpy", [BFIL] = "bfil", [BCMP] = "bcmp", [CASI] = "casi",
+    [FADI] = "fadi", [XCHI] = "xchi", [VADF] = "vadf", [VMLF] = "vmlf",
+    [VMNF] = "vmnf", [VMXF] = "vmxf", [VFMF] = "vfmf", [VRDF] = "vrdf",
+    [VDTF] = "vdtf", [VADI] = "vadi", [VMLI] = "vmli", [VMNI] = "vmni",
+    [VMXI] = "vmxi", [VRDI] = "vrdi", [JMPA] = "jmpa", [JMPR] = "jmpr",
+    [JEQ] = "jeq",   [JNE] = "jne",   [JGT] = "jgt",   [JGE] = "jge",
+    [JLT] = "jlt",   [JLE] = "jle",   [LOOP] = "loop", [LCAL] = "lcal",
+    [LRET] = "lret", [CALM] = "calm", [RETM] = "retm", [MULI] = "muli",
+    [DIVI] = "divi", [MODI] = "modi", [ANDI] = "andi", [ORI] = "ori",
+    [XORI] = "xori", [SHLI] = "shli", [SHRI] = "shri", [ROTL] = "rotl"
+};
+
 
 // initialize a new inst_node
 instr_node_t* instr_node_init(opcode_t opcode) {
@@ -49,27 +118,35 @@ uint16_t min_tree_depth(instr_node_t *root) {
     return left < right ? left : right;
 }
 
+
+// find the first leaf (searching left before right) at a given depth, returns
+// the link that points to it so that it can be replaced
+instr_node_t** find_leaf_at_depth(instr_node_t **link, uint16_t depth) {
+    instr_node_t *node = *link;
+    if (!node) {
+        return NULL;
+    }
+    if (!node->left && !node->right) {
+        return depth == 1 ? link : NULL;
+    }
+    instr_node_t **found = find_leaf_at_depth(&node->left, depth - 1);
+    return found ? found : find_leaf_at_depth(&node->right, depth - 1);
+}
+
+
 // initialize/delete the instruction tree
 instr_node_t* instr_build_tree() {
     instr_node_t *root = NULL;
-    instr_node_t *current = root;
     instr_node_t *temp = NULL;
 
-    // loop from the first defined opcode (NOOP) to the last defined opcode (DIVF)
-    for (opcode_t op = NOOP; op <= DIVF; op++) {
-        // set the current pointer back to the root
-        printf("%u\n", op);
-        
+    // loop from the first defined opcode (NOOP) to the last defined opcode
+    for (opcode_t op = NOOP; op < N_OPCODES; op++) {
         if (!root) {
-            printf("root is NULL\n");
             root = instr_node_init(op);
         } else {
-            // set the current pointer back to the root
-            current = root;
             // find min/max tree depth
             uint16_t max_depth = max_tree_depth(root);
             uint16_t min_depth = min_tree_depth(root);
-            printf("max depth: %u min depth: %u\n", max_depth, min_depth);
             // if min == max then the tree is full
             if (max_depth == min_depth) {
                 // replace the root node with new nodes
@@ -78,29 +155,291 @@ instr_node_t* instr_build_tree() {
                 temp = root;
                 root = new;
                 new->left = temp;
+            } else {
+                // otherwise split the shallowest leaf, the opcode that was 
+                // there goes left and the new one goes right
+                instr_node_t **link = find_leaf_at_depth(&root, min_depth);
+                instr_node_t *new = instr_node_init(NONE);
+                new->left = *link;
+                new->right = instr_node_init(op);
+                *link = new;
             }
+        }
+    }
+    return root;
+}
 
-            /*
-            if (current->left || current->right) {
 
-            } else {
+void instr_delete_tree(instr_node_t *root) {
+    if (!root) {
+        return;
+    }
+    instr_delete_tree(root->left);
+    instr_delete_tree(root->right);
+    instr_node_delete(root);
+}
 
+
+// build a Huffman tree for a set of counts, ties go to the lowest opcode
+instr_node_t* huffman_tree(const uint64_t *counts) {
+    instr_node_t *nodes[N_OPCODES];
+    uint64_t weights[N_OPCODES];
+    uint16_t n = 0;
+    for (opcode_t op = NOOP; op < N_OPCODES; op++) {
+        nodes[n] = instr_node_init(op);
+        weights[n] = counts[op];
+        n++;
+    }
+    // repeatedly merge the two lightest subtrees
+    while (n > 1) {
+        uint16_t a = 0, b = 1;
+        if (weights[b] < weights[a]) {
+            a = 1;
+            b = 0;
+        }
+        for (uint16_t i = 2; i < n; i++) {
+            if (weights[i] < weights[a]) {
+                b = a;
+                a = i;
+            } else if (weights[i] < weights[b]) {
+                b = i;
             }
-            */
+        }
+        instr_node_t *new = instr_node_init(NONE);
+        new->left = nodes[a];
+        new->right = nodes[b];
+        // merged node takes the lower slot, the last node fills the other
+        uint16_t lo = a < b ? a : b, hi = a < b ? b : a;
+        nodes[lo] = new;
+        weights[lo] = weights[a] + weights[b];
+        nodes[hi] = nodes[n - 1];
+        weights[hi] = weights[n - 1];
+        n--;
+    }
+    return nodes[0];
+}
+
+
+// build an instruction tree with Huffman-optimal code lengths for a set of
+// per-opcode execution counts
+instr_node_t* instr_build_tree_counts(const uint64_t *counts) {
+    // every opcode has to stay encodable, so unseen opcodes count once
+    uint64_t c[N_OPCODES] = {0};
+    for (opcode_t op = NOOP; op < N_OPCODES; op++) {
+        c[op] = counts[op] + 1;
+    }
+    // very skewed counts can make codes longer than the decode table handles,
+    // flatten the counts until they fit
+    for (;;) {
+        instr_node_t *root = huffman_tree(c);
+        if (max_tree_depth(root) - 1 <= INSTR_MAXCODELEN) {
+            return root;
+        }
+        instr_delete_tree(root);
+        for (opcode_t op = NOOP; op < N_OPCODES; op++) {
+            c[op] = c[op] / 2 + 1;
         }
     }
-    return root;
 }
 
 
-void instr_delete_tree() {
+// write the descriptor for the subtree at a node, returns the bytes written
+uint16_t write_subtree(instr_node_t *node, uint8_t *buf) {
+    buf[0] = node->left ? NONE : node->opcode;
+    if (!node->left) {
+        return 1;
+    }
+    uint16_t n = 1 + write_subtree(node->left, buf + 1);
+    return n + write_subtree(node->right, buf + n);
+}
+
+
+// write the descriptor for a tree, returns its length in bytes
+uint16_t instr_write_tree(instr_node_t *root, uint8_t *buf) {
+    return write_subtree(root, buf);
+}
+
+
+// read the subtree starting at position pos of a descriptor, NULL on error
+instr_node_t* read_subtree(const uint8_t *buf, uint16_t len, uint16_t *pos, uint8_t *seen) {
+    if (*pos >= len || buf[*pos] >= N_OPCODES) {
+        return NULL;
+    }
+    opcode_t op = buf[(*pos)++];
+    if (op != NONE) {
+        // each opcode can only appear once
+        if (seen[op]) {
+            return NULL;
+        }
+        seen[op] = 1;
+        return instr_node_init(op);
+    }
+    instr_node_t *node = instr_node_init(NONE);
+    node->left = read_subtree(buf, len, pos, seen);
+    node->right = node->left ? read_subtree(buf, len, pos, seen) : NULL;
+    if (!node->right) {
+        instr_delete_tree(node);
+        return NULL;
+    }
+    return node;
+}
+
 
+// rebuild a tree from a descriptor (NULL if the descriptor is malformed or 
+// is a single leaf, which would give its opcode an empty code)
+instr_node_t* instr_read_tree(const uint8_t *buf, uint16_t len) {
+    uint8_t seen[N_OPCODES] = {0};
+    uint16_t pos = 0;
+    instr_node_t *root = read_subtree(buf, len, &pos, seen);
+    if (root && (pos != len || !root->left)) {
+        instr_delete_tree(root);
+        return NULL;
+    }
+    return root;
 }
 
 
-// decode an instruction at a given memory address, returning the opcode
+// decode an instruction at a given bit address, returning the opcode
 opcode_t instr_decode(instr_node_t *instr_tree, sysmem_t *smem, uint16_t addr) {
+    instr_node_t *node = instr_tree;
+    // walk the tree one bit at a time until reaching a leaf
+    while (node->left) {
+        uint8_t bit = (smem->mem[addr >> 3] >> (7 - (addr & 7))) & 1;
+        node = bit ? node->right : node->left;
+        addr++;
+    }
+    return node->opcode;
+}
 
+
+// record the code of every leaf below a node in the code table
+void collect_codes(instr_node_t *node, uint32_t bits, uint8_t len, instr_code_t *code) {
+    if (!node->left) {
+        code[node->opcode].bits = bits;
+        code[node->opcode].len = len;
+        return;
+    }
+    collect_codes(node->left, bits << 1, len + 1, code);
+    collect_codes(node->right, (bits << 1) | 1, len + 1, code);
 }
 
 
+// build the decode table for an instruction tree
+instr_table_t* instr_build_table(instr_node_t *instr_tree) {
+    if (!instr_tree->left) {
+        // a single leaf has no code to decode
+        return NULL;
+    }
+    instr_table_t *itab = calloc(1, sizeof(instr_table_t));
+    collect_codes(instr_tree, 0, 0, itab->code);
+
+    // first pass: short codes fill every first level entry they prefix, long
+    // codes record the widest second level index needed under their prefix
+    for (opcode_t op = NOOP; op < N_OPCODES; op++) {
+        instr_code_t c = itab->code[op];
+        if (!c.len) {
+            // opcode not in the tree
+            continue;
+        }
+        if (c.len > INSTR_MAXCODELEN) {
+            // cannot be represented, caller has to use a shallower tree
+            instr_delete_table(itab);
+            return NULL;
+        }
+        if (c.len <= INSTR_PEEKBITS) {
+            uint32_t first = c.bits << (INSTR_PEEKBITS - c.len);
+            for (uint32_t i = 0; i < (1u << (INSTR_PEEKBITS - c.len)); i++) {
+                itab->l1[first + i].opcode = op;
+                itab->l1[first + i].len = c.len;
+            }
+        } else {
+            instr_entry_t *e = &itab->l1[c.bits >> (c.len - INSTR_PEEKBITS)];
+            if (e->len < c.len - INSTR_PEEKBITS) {
+                e->len = c.len - INSTR_PEEKBITS;
+            }
+        }
+    }
+
+    // lay out the second level tables
+    uint32_t n_l2 = 0;
+    for (uint32_t i = 0; i < (1u << INSTR_PEEKBITS); i++) {
+        if (itab->l1[i].opcode == NONE && itab->l1[i].len) {
+            itab->l1[i].sub = n_l2;
+            n_l2 += 1u << itab->l1[i].len;
+        }
+    }
+    itab->n_l2 = n_l2;
+    itab->l2 = calloc(n_l2 ? n_l2 : 1, sizeof(instr_entry_t));
+
+    // second pass: fill the second level entries for long codes
+    for (opcode_t op = NOOP; op < N_OPCODES; op++) {
+        instr_code_t c = itab->code[op];
+        if (c.len <= INSTR_PEEKBITS) {
+            continue;
+        }
+        instr_entry_t *e = &itab->l1[c.bits >> (c.len - INSTR_PEEKBITS)];
+        uint8_t rest = c.len - INSTR_PEEKBITS;
+        uint32_t suffix = c.bits & ((1u << rest) - 1);
+        uint32_t first = e->sub + (suffix << (e->len - rest));
+        for (uint32_t i = 0; i < (1u << (e->len - rest)); i++) {
+            itab->l2[first + i].opcode = op;
+            itab->l2[first + i].len = c.len;
+        }
+    }
+    return itab;
+}
+
+
+void instr_delete_table(instr_table_t *itab) {
+    if (!itab) {
+        return;
+    }
+    free(itab->l2);
+    free(itab);
+}
+
+
+// average code length (bits) of the opcodes in a table weighted by counts
+double instr_mean_code_len(const instr_table_t *itab, const uint64_t *counts) {
+    uint64_t total = 0, bits = 0;
+    for (opcode_t op = NOOP; op < N_OPCODES; op++) {
+        total += counts[op];
+        bits += counts[op] * itab->code[op].len;
+    }
+    return total ? (double) bits / total : 0.0;
+}
+
+
+// write the low len bits of a value (MSB first) starting at a bit address
+void instr_put_bits(uint8_t *mem, uint16_t addr, uint32_t bits, uint8_t len) {
+    for (uint8_t i = 0; i < len; i++, addr++) {
+        uint8_t mask = 0x80 >> (addr & 7);
+        if ((bits >> (len - 1 - i)) & 1) {
+            mem[addr >> 3] |= mask;
+        } else {
+            mem[addr >> 3] &= ~mask;
+        }
+    }
+}
+
+
+// encode an instruction at a bit address, returns the bit address following it
+uint16_t instr_encode(const instr_table_t *itab, uint8_t *mem, uint16_t addr, const instr_t *in) {
+    instr_code_t c = itab->code[in->opcode];
+    instr_put_bits(mem, addr, c.bits, c.len);
+    addr += c.len;
+    uint8_t n = 0;
+    for (const uint8_t *k = instr_operands[in->opcode]; *k != OPND_NONE; k++) {
+        uint32_t v;
+        if (*k == OPND_IMM) {
+            v = in->imm.u;
+        } else if (*k == OPND_IMMF) {
+            memcpy(&v, &in->imm.f, sizeof(float));
+        } else {
+            v = in->reg[n++];
+        }
+        instr_put_bits(mem, addr, v, instr_opnd_bits[*k]);
+        addr += instr_opnd_bits[*k];
+    }
+    return addr;
+}
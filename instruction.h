@@ -15,6 +15,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 
 #include "memory.h"
@@ -31,7 +32,15 @@ typedef enum {
     STOI, STOF,
     MOVI, MOVF,
     MEQI, MNEI, ADDI, SUBI,
-    MGTI, MGEI, MLTI, MLEI, ADDF, SUBF, MULF, DIVF
+    MGTI, MGEI, MLTI, MLEI, ADDF, SUBF, MULF, DIVF,
+    BCPY, BFIL, BCMP,
+    CASI, FADI, XCHI,
+    VADF, VMLF, VMNF, VMXF, VFMF, VRDF, VDTF,
+    VADI, VMLI, VMNI, VMXI, VRDI,
+    JMPA, JMPR, JEQ, JNE, JGT, JGE, JLT, JLE, LOOP,
+    LCAL, LRET, CALM, RETM,
+    MULI, DIVI, MODI, ANDI, ORI, XORI, SHLI, SHRI, ROTL,
+    N_OPCODES       // number of opcodes (not an opcode itself)
 } opcode_t;
 
 
@@ -45,13 +54,245 @@ typedef struct instr_node {
 } instr_node_t;
 
 
+/*
+Instructions are bit-packed into the read only memory block and addressed by
+bit: bit address n refers to bit (7 - n % 8) of the byte at n / 8, so the
+64000 bits of the read only block are all reachable with a uint16_t. The
+opcode is read from the tree one bit at a time (0 -> left, 1 -> right) until
+a leaf is reached.
+
+Walking the tree costs a dependent load and a branch per bit, so decoding is
+normally done with a table built from the tree instead: the next
+INSTR_PEEKBITS bits index a flat table that gives the opcode and its code
+length directly. Codes longer than that resolve through a second level table
+indexed by the bits that follow.
+*/
+#define INSTR_PEEKBITS      10
+#define INSTR_MAXCODELEN    20
+#define INSTR_ROMBITS       (MEMORY_RWBLKMIN * 8)
+
+
+/*
+Operands follow the opcode in the same order as the arguments of the matching
+core_t function, e.g. lodi is <opcode> <addr> <reg>:
+    integer register   3 bits (ireg_t)
+    float register     3 bits (freg_t, values above FRV are invalid)
+    leai multiplier    3 bits
+    register save mask 8 bits (calm: bit i for ir0 + i, bit 4 + i for fr0 + i)
+    immediate/address 16 bits (addresses used by call and jmpa are bit 
+                               addresses, the other jumps take an offset in
+                               bits from the following instruction)
+    float immediate   32 bits (IEEE 754 single)
+Every opcode has at most one 16 or 32 bit operand.
+*/
+typedef enum {
+    OPND_NONE,
+    OPND_IREG,
+    OPND_FREG,
+    OPND_MULT,
+    OPND_IMM,
+    OPND_IMMF,
+    OPND_MASK
+} opnd_t;
+
+
+// operand kinds for each opcode (up to 4, terminated by OPND_NONE) and the
+// width in bits of each kind
+extern const uint8_t instr_operands[N_OPCODES][5];
+extern const uint8_t instr_opnd_bits[];
+
+
+// mnemonic of each opcode (lower case)
+extern const char *const instr_names[N_OPCODES];
+
+
+// decoded instruction
+typedef struct instr {
+    opcode_t opcode;
+    uint8_t reg[4];     // register, multiplier and mask operands, in order
+    union {
+        uint16_t u;     // address or 16 bit immediate
+        float f;        // float immediate
+    } imm;
+    uint16_t next;      // bit address of the following instruction
+} instr_t;
+
+
+// code for encoding a single opcode (the low len bits of bits, MSB first)
+typedef struct instr_code {
+    uint32_t bits;
+    uint8_t len;
+} instr_code_t;
+
+
+// decode table entry
+//      opcode != NONE -- opcode and the full length of its code
+//      opcode == NONE -- long code, the next len bits index the second level
+//                        table starting at sub
+typedef struct instr_entry {
+    uint8_t opcode;
+    uint8_t len;
+    uint16_t sub;
+} instr_entry_t;
+
+
+// decode table for an instruction tree
+typedef struct instr_table {
+    // opcode -> code (for encoding)
+    instr_code_t code[N_OPCODES];
+    // first and second level decode tables
+    instr_entry_t l1[1 << INSTR_PEEKBITS];
+    instr_entry_t *l2;
+    uint16_t n_l2;
+} instr_table_t;
+
+
+// buffered reader over bit-addressed memory
+typedef struct instr_reader {
+    const uint8_t *mem;
+    uint16_t pos;       // bit address of the next unread bit
+    uint8_t avail;      // number of valid bits in buf
+    uint64_t buf;       // next bits, left aligned
+} instr_reader_t;
+
+
 // initialize/delete the instruction tree
 instr_node_t* instr_build_tree();
 void instr_delete_tree(instr_node_t*);
 
 
-// decode an instruction at a given memory address, returning the opcode
+// build an instruction tree with Huffman-optimal code lengths for a set of
+// per-opcode execution counts (e.g. from a profiling run)
+instr_node_t* instr_build_tree_counts(const uint64_t*);
+
+
+/*
+Each program can ship with its own tree, stored in the program image header as
+a descriptor: the opcodes of the tree nodes in preorder, with NONE marking an
+internal node (left subtree follows, then right). That takes 2n - 1 bytes for
+n opcodes.
+*/
+#define INSTR_TREEDESC_MAX (2 * N_OPCODES - 1)
+
+
+// write the descriptor for a tree, returns its length in bytes
+uint16_t instr_write_tree(instr_node_t*, uint8_t*);
+
+
+// rebuild a tree from a descriptor (NULL if the descriptor is malformed or 
+// a single leaf)
+instr_node_t* instr_read_tree(const uint8_t*, uint16_t);
+
+
+// decode an instruction at a given bit address, returning the opcode
 opcode_t instr_decode(instr_node_t*, sysmem_t*, uint16_t);
 
 
+// build/delete the decode table for an instruction tree (build returns NULL
+// for a tree too deep for the table or that is a single leaf)
+instr_table_t* instr_build_table(instr_node_t*);
+void instr_delete_table(instr_table_t*);
+
+
+// average code length (bits) of the opcodes in a table weighted by counts
+double instr_mean_code_len(const instr_table_t*, const uint64_t*);
+
+
+// write the low len bits of a value (MSB first) starting at a bit address
+void instr_put_bits(uint8_t*, uint16_t, uint32_t, uint8_t);
+
+
+// encode an instruction at a bit address, returns the bit address following it
+uint16_t instr_encode(const instr_table_t*, uint8_t*, uint16_t, const instr_t*);
+
+
+// read 8 bytes starting at an address as a big-endian value
+static inline uint64_t instr_load_be64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap64(v);
+#elif !defined(__GNUC__) || __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+    v = 0;
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | p[i];
+    }
+#endif
+    return v;
+}
+
+
+// set up a reader at a bit address
+static inline void instr_reader_init(instr_reader_t *r, const uint8_t *mem, uint16_t pos) {
+    r->mem = mem;
+    r->pos = pos;
+    r->avail = 0;
+    r->buf = 0;
+}
+
+
+// refill the buffer from the current position (leaves at least 57 bits)
+static inline void instr_reader_fill(instr_reader_t *r) {
+    r->buf = instr_load_be64(r->mem + (r->pos >> 3)) << (r->pos & 7);
+    r->avail = 64 - (r->pos & 7);
+}
+
+
+// look at the next n (1 to 32) bits without consuming them
+static inline uint32_t instr_reader_peek(instr_reader_t *r, uint8_t n) {
+    if (r->avail < n) {
+        instr_reader_fill(r);
+    }
+    return (uint32_t) (r->buf >> (64 - n));
+}
+
+
+// consume n bits (must already be buffered by a peek)
+static inline void instr_reader_skip(instr_reader_t *r, uint8_t n) {
+    r->buf <<= n;
+    r->avail -= n;
+    r->pos += n;
+}
+
+
+// decode the opcode at the reader position using a decode table, consuming
+// its code
+static inline opcode_t instr_reader_opcode(const instr_table_t *itab, instr_reader_t *r) {
+    if (r->avail < INSTR_MAXCODELEN) {
+        instr_reader_fill(r);
+    }
+    const instr_entry_t *e = &itab->l1[r->buf >> (64 - INSTR_PEEKBITS)];
+    if (e->opcode == NONE) {
+        // long code, index the second level table with the bits that follow
+        e = &itab->l2[e->sub + ((r->buf << INSTR_PEEKBITS) >> (64 - e->len))];
+    }
+    instr_reader_skip(r, e->len);
+    return (opcode_t) e->opcode;
+}
+
+
+// decode the complete instruction (opcode and operands) at a bit address,
+// returns the bit address of the following instruction
+static inline uint16_t instr_fetch(const instr_table_t *itab, const uint8_t *mem, uint16_t addr, instr_t *in) {
+    instr_reader_t r;
+    instr_reader_init(&r, mem, addr);
+    in->opcode = instr_reader_opcode(itab, &r);
+    uint8_t n = 0;
+    for (const uint8_t *k = instr_operands[in->opcode]; *k != OPND_NONE; k++) {
+        uint8_t w = instr_opnd_bits[*k];
+        uint32_t v = instr_reader_peek(&r, w);
+        instr_reader_skip(&r, w);
+        if (*k == OPND_IMM) {
+            in->imm.u = (uint16_t) v;
+        } else if (*k == OPND_IMMF) {
+            memcpy(&in->imm.f, &v, sizeof(float));
+        } else {
+            in->reg[n++] = (uint8_t) v;
+        }
+    }
+    in->next = r.pos;
+    return r.pos;
+}
+
+
 #endif
@@ -0,0 +1,901 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    jit.c
+*/
+
+
+#define _DEFAULT_SOURCE
+
+
+#include "jit.h"
+#include <stddef.h>
+#include <string.h>
+
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+
+#include <sys/mman.h>
+
+
+#define JIT_CODESIZE    (1 << 20)   // bytes of native code per cache
+#define JIT_BLOCKSPACE  (1 << 16)   // space that has to be left to start a block
+#define JIT_MAXBLOCK    256         // instructions per block
+#define JIT_FAILED      0xFFFF      // hits value of blocks that cannot be compiled
+
+
+// host registers
+enum { RAX, RCX, RDX, RBX, RSPH, RBPH, RSI, RDI, R8, R9, R10, R11 };
+#define NOREG -1
+
+
+// host register holding each integer register (NOREG if it stays in the core)
+const int8_t jit_ireg_host[8] = {
+    [RPC] = NOREG, [RSP] = RDX, [RBP] = NOREG,
+    [IR0] = R8, [IR1] = R9, [IR2] = R10, [IR3] = R11, [IRV] = RSI
+};
+
+
+// Offset of an integer register in core_t.
+int32_t ireg_offset(ireg_t reg) {
+    return offsetof(core_t, iregs) + reg * sizeof(uint16_t);
+}
+
+
+// Offset of a float register (fr0-fr3, frv are held in xmm0-xmm4) in core_t.
+int32_t freg_offset(freg_t reg) {
+    return offsetof(core_t, fregs) + reg * sizeof(float);
+}
+
+
+/* x86-64 encoding. Integer registers are kept zero extended in 32-bit host 
+   registers so 32-bit operations are used throughout; carries out of the 
+   low 16 bits are how overflow is detected. */
+
+// code being written
+typedef struct x86 {
+    uint8_t *p;
+    uint8_t *end;
+    uint8_t full;   // ran out of space, the code is unusable
+} x86_t;
+
+
+void x86_byte(x86_t *a, uint8_t b) {
+    if (a->p < a->end) {
+        *a->p++ = b;
+    } else {
+        a->full = 1;
+    }
+}
+
+
+void x86_imm16(x86_t *a, uint16_t v) {
+    x86_byte(a, v & 0xFF);
+    x86_byte(a, v >> 8);
+}
+
+
+void x86_imm32(x86_t *a, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        x86_byte(a, (v >> (8 * i)) & 0xFF);
+    }
+}
+
+
+// REX prefix for a reg field and an r/m (or base) register, if one is needed
+void x86_rex(x86_t *a, int w, int reg, int rm) {
+    uint8_t rex = 0x40 | (w << 3) | (((reg >> 3) & 1) << 2) | ((rm >> 3) & 1);
+    if (rex != 0x40) {
+        x86_byte(a, rex);
+    }
+}
+
+
+// ModRM for a register operand and [base + disp32]
+void x86_mem(x86_t *a, int reg, int base, int32_t disp) {
+    x86_byte(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+    x86_imm32(a, (uint32_t) disp);
+}
+
+
+// ModRM and SIB for a register operand and [rcx + rdx]
+void x86_mem_rcx_rdx(x86_t *a, int reg) {
+    x86_byte(a, 0x04 | ((reg & 7) << 3));
+    x86_byte(a, (RDX << 3) | RCX);
+}
+
+
+// op r/m32, r32 with both operands registers
+void x86_rr(x86_t *a, uint8_t op, int rm, int reg) {
+    x86_rex(a, 0, reg, rm);
+    x86_byte(a, op);
+    x86_byte(a, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+
+#define x86_mov(a, dst, src)    x86_rr(a, 0x89, dst, src)
+#define x86_add(a, dst, src)    x86_rr(a, 0x01, dst, src)
+#define x86_sub(a, dst, src)    x86_rr(a, 0x29, dst, src)
+#define x86_cmp(a, x, y)        x86_rr(a, 0x39, x, y)       // flags of x - y
+#define x86_test(a, x, y)       x86_rr(a, 0x85, x, y)
+
+
+// mov r32, imm32
+void x86_mov_imm(x86_t *a, int dst, uint32_t imm) {
+    x86_rex(a, 0, 0, dst);
+    x86_byte(a, 0xB8 + (dst & 7));
+    x86_imm32(a, imm);
+}
+
+
+// group 1 operation with an immediate (0 add, 4 and, 5 sub, 7 cmp)
+void x86_alu_imm(x86_t *a, int ext, int rm, uint32_t imm) {
+    x86_rex(a, 0, 0, rm);
+    x86_byte(a, 0x81);
+    x86_byte(a, 0xC0 | (ext << 3) | (rm & 7));
+    x86_imm32(a, imm);
+}
+#define ALU_ADD 0
+#define ALU_AND 4
+#define ALU_SUB 5
+#define ALU_CMP 7
+
+
+// imul r32, r/m32 with both operands registers
+void x86_imul(x86_t *a, int dst, int src) {
+    x86_rex(a, 0, dst, src);
+    x86_byte(a, 0x0F);
+    x86_byte(a, 0xAF);
+    x86_byte(a, 0xC0 | ((dst & 7) << 3) | (src & 7));
+}
+
+
+// group 2 operation on r/m32 (or r/m16 if word is set) by cl (0 rol, 4 shl,
+// 5 shr)
+void x86_shift_cl(x86_t *a, int ext, int rm, int word) {
+    if (word) {
+        x86_byte(a, 0x66);
+    }
+    x86_rex(a, 0, 0, rm);
+    x86_byte(a, 0xD3);
+    x86_byte(a, 0xC0 | (ext << 3) | (rm & 7));
+}
+#define SHIFT_ROL 0
+#define SHIFT_SHL 4
+#define SHIFT_SHR 5
+
+
+// inc/dec r32
+void x86_incdec(x86_t *a, int dec, int rm) {
+    x86_rex(a, 0, 0, rm);
+    x86_byte(a, 0xFF);
+    x86_byte(a, 0xC0 | (dec << 3) | (rm & 7));
+}
+
+
+// movzx r32, word [base + disp]
+void x86_load16(x86_t *a, int dst, int base, int32_t disp) {
+    x86_rex(a, 0, dst, base);
+    x86_byte(a, 0x0F);
+    x86_byte(a, 0xB7);
+    x86_mem(a, dst, base, disp);
+}
+
+
+// mov word [base + disp], r16
+void x86_store16(x86_t *a, int base, int32_t disp, int src) {
+    x86_byte(a, 0x66);
+    x86_rex(a, 0, src, base);
+    x86_byte(a, 0x89);
+    x86_mem(a, src, base, disp);
+}
+
+
+// mov word [base + disp], imm16
+void x86_store16_imm(x86_t *a, int base, int32_t disp, uint16_t imm) {
+    x86_byte(a, 0x66);
+    x86_rex(a, 0, 0, base);
+    x86_byte(a, 0xC7);
+    x86_mem(a, 0, base, disp);
+    x86_imm16(a, imm);
+}
+
+
+// mov r32, dword [base + disp] / mov dword [base + disp], r32
+void x86_load32(x86_t *a, int dst, int base, int32_t disp) {
+    x86_rex(a, 0, dst, base);
+    x86_byte(a, 0x8B);
+    x86_mem(a, dst, base, disp);
+}
+
+void x86_store32(x86_t *a, int base, int32_t disp, int src) {
+    x86_rex(a, 0, src, base);
+    x86_byte(a, 0x89);
+    x86_mem(a, src, base, disp);
+}
+
+
+// mov dword [base + disp], imm32
+void x86_store32_imm(x86_t *a, int base, int32_t disp, uint32_t imm) {
+    x86_rex(a, 0, 0, base);
+    x86_byte(a, 0xC7);
+    x86_mem(a, 0, base, disp);
+    x86_imm32(a, imm);
+}
+
+
+// mov r64, qword [base + disp]
+void x86_load64(x86_t *a, int dst, int base, int32_t disp) {
+    x86_rex(a, 1, dst, base);
+    x86_byte(a, 0x8B);
+    x86_mem(a, dst, base, disp);
+}
+
+
+// movzx r32, word [rcx + rdx] / mov word [rcx + rdx], r16
+void x86_load16_stack(x86_t *a, int dst) {
+    x86_rex(a, 0, dst, 0);
+    x86_byte(a, 0x0F);
+    x86_byte(a, 0xB7);
+    x86_mem_rcx_rdx(a, dst);
+}
+
+void x86_store16_stack(x86_t *a, int src) {
+    x86_byte(a, 0x66);
+    x86_rex(a, 0, src, 0);
+    x86_byte(a, 0x89);
+    x86_mem_rcx_rdx(a, src);
+}
+
+
+// scalar single precision operation with memory (movss load 0x10, store 
+// 0x11) or register (movss 0x10, addss 0x58, mulss 0x59, subss 0x5C, 
+// divss 0x5E) operand
+void x86_sse_mem(x86_t *a, uint8_t op, int xmm, int base, int32_t disp) {
+    x86_byte(a, 0xF3);
+    x86_rex(a, 0, xmm, base);
+    x86_byte(a, 0x0F);
+    x86_byte(a, op);
+    x86_mem(a, xmm, base, disp);
+}
+
+void x86_sse_rr(x86_t *a, uint8_t op, int dst, int src) {
+    x86_byte(a, 0xF3);
+    x86_byte(a, 0x0F);
+    x86_byte(a, op);
+    x86_byte(a, 0xC0 | (dst << 3) | src);
+}
+
+
+// movd xmm, r32
+void x86_movd(x86_t *a, int xmm, int src) {
+    x86_byte(a, 0x66);
+    x86_rex(a, 0, xmm, src);
+    x86_byte(a, 0x0F);
+    x86_byte(a, 0x6E);
+    x86_byte(a, 0xC0 | ((xmm & 7) << 3) | (src & 7));
+}
+
+
+// jcc/jmp with a 32-bit displacement to be patched, returns the location of
+// the displacement
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A  0x7
+uint8_t* x86_jcc(x86_t *a, uint8_t cc) {
+    x86_byte(a, 0x0F);
+    x86_byte(a, 0x80 | cc);
+    uint8_t *at = a->p;
+    x86_imm32(a, 0);
+    return at;
+}
+
+uint8_t* x86_jmp(x86_t *a) {
+    x86_byte(a, 0xE9);
+    uint8_t *at = a->p;
+    x86_imm32(a, 0);
+    return at;
+}
+
+
+// point a patched jump at a location
+void x86_patch(x86_t *a, uint8_t *at, uint8_t *target) {
+    if (a->full) {
+        return;
+    }
+    int32_t disp = (int32_t) (target - (at + 4));
+    memcpy(at, &disp, 4);
+}
+
+
+/* Block translation */
+
+// side exit: a jump to be pointed at a stub that leaves the block at pc
+typedef struct exit {
+    uint8_t *at;
+    uint16_t pc;
+} exit_t;
+
+
+// translation state for one block
+typedef struct block {
+    x86_t a;
+    uint16_t leader;        // pc of the first instruction
+    const sysmem_t *smem;   // memory layout the addresses are checked against
+    uint8_t *body;          // code after the register loads
+    exit_t exits[JIT_MAXBLOCK * 2];
+    uint16_t n_exits;
+    uint8_t *ends[JIT_MAXBLOCK];    // jumps to the epilogue
+    uint16_t n_ends;
+} block_t;
+
+
+// Leave the block at pc (to execute the instruction there in the interpreter)
+// if the condition holds.
+void exit_if(block_t *b, uint8_t cc, uint16_t pc) {
+    exit_t *e = &b->exits[b->n_exits++];
+    e->at = x86_jcc(&b->a, cc);
+    e->pc = pc;
+}
+
+
+// Host register holding an integer register, NOREG if it stays in the core 
+// or is not a register at all.
+int host_ireg(uint8_t reg) {
+    return reg < sizeof(jit_ireg_host) ? jit_ireg_host[reg] : NOREG;
+}
+
+
+// Host register an integer register can be read from, loading rpc (which is
+// the address of the next instruction while an instruction runs) into tmp if
+// needed. NOREG if it cannot be read in a block.
+int read_ireg(block_t *b, uint8_t reg, uint16_t next, int tmp) {
+    if (reg == RPC) {
+        x86_mov_imm(&b->a, tmp, next);
+        return tmp;
+    }
+    return host_ireg(reg);
+}
+
+
+// Host register for a destination register, NOREG unless it is one of the
+// registers any instruction may write (ir0-ir3, irv).
+int write_ireg(uint8_t reg) {
+    return reg >= IR0 && reg <= IRV ? jit_ireg_host[reg] : NOREG;
+}
+
+
+// Load rcx with the address of system memory.
+void load_mem_base(block_t *b) {
+    x86_load64(&b->a, RCX, RDI, offsetof(core_t, smem));
+    x86_load64(&b->a, RCX, RCX, offsetof(sysmem_t, mem));
+}
+
+
+// Leave the block with the new rpc in eax, looping straight back into the
+// block if it jumps to its own start.
+void end_with_eax(block_t *b) {
+    x86_t *a = &b->a;
+    x86_alu_imm(a, ALU_CMP, RAX, b->leader);
+    x86_patch(a, x86_jcc(a, CC_E), b->body);
+    x86_store16(a, RDI, ireg_offset(RPC), RAX);
+    b->ends[b->n_ends++] = x86_jmp(a);
+}
+
+
+// Translate a conditional move (cmask: bit 1 << cmpres_t for each result
+// that moves), returns 2 if it writes rpc and so ends the block.
+int translate_cmov(block_t *b, const instr_t *in, uint16_t pc, uint8_t cmask) {
+    x86_t *a = &b->a;
+    int to_rpc = in->reg[1] == RPC;
+    int dst = to_rpc ? RAX : write_ireg(in->reg[1]);
+    if (dst == NOREG || (in->reg[0] != RPC && host_ireg(in->reg[0]) == NOREG)) {
+        return 0;
+    }
+    // rcmp must have been set, and is reset whether or not the move happens
+    x86_load32(a, RCX, RDI, offsetof(core_t, rcmp));
+    x86_test(a, RCX, RCX);
+    exit_if(b, CC_E, pc);
+    x86_store32_imm(a, RDI, offsetof(core_t, rcmp), NA);
+    int src;
+    if (to_rpc) {
+        // rpc stays at the next instruction unless the move happens
+        x86_mov_imm(a, RAX, in->next);
+        src = in->reg[0] == RPC ? RAX : host_ireg(in->reg[0]);
+    } else {
+        src = read_ireg(b, in->reg[0], in->next, RAX);
+    }
+    uint8_t *take[3];
+    int n = 0;
+    for (cmpres_t c = EQ; c <= LT; c++) {
+        if (cmask & (1 << c)) {
+            x86_alu_imm(a, ALU_CMP, RCX, c);
+            take[n++] = x86_jcc(a, CC_E);
+        }
+    }
+    uint8_t *skip = x86_jmp(a);
+    for (int i = 0; i < n; i++) {
+        x86_patch(a, take[i], a->p);
+    }
+    if (src != dst) {
+        x86_mov(a, dst, src);
+    }
+    x86_patch(a, skip, a->p);
+    if (to_rpc) {
+        end_with_eax(b);
+        return 2;
+    }
+    return 1;
+}
+
+
+// Translate a jump to a target (cmask: bit 1 << cmpres_t for each result 
+// that jumps, 0 if it always jumps), which ends the block. Targets that are
+// not executable are left to the interpreter to report.
+int translate_jump(block_t *b, const instr_t *in, uint16_t pc, uint16_t target, uint8_t cmask) {
+    x86_t *a = &b->a;
+    if (!mem_check(b->smem, target >> 3, 1, MEM_X)) {
+        return 0;
+    }
+    if (cmask) {
+        // rcmp must have been set, and is reset whether or not the jump is
+        // taken
+        x86_load32(a, RCX, RDI, offsetof(core_t, rcmp));
+        x86_test(a, RCX, RCX);
+        exit_if(b, CC_E, pc);
+        x86_store32_imm(a, RDI, offsetof(core_t, rcmp), NA);
+        x86_mov_imm(a, RAX, in->next);
+        uint8_t *take[3];
+        int n = 0;
+        for (cmpres_t c = EQ; c <= LT; c++) {
+            if (cmask & (1 << c)) {
+                x86_alu_imm(a, ALU_CMP, RCX, c);
+                take[n++] = x86_jcc(a, CC_E);
+            }
+        }
+        uint8_t *skip = x86_jmp(a);
+        for (int i = 0; i < n; i++) {
+            x86_patch(a, take[i], a->p);
+        }
+        x86_mov_imm(a, RAX, target);
+        x86_patch(a, skip, a->p);
+    } else {
+        x86_mov_imm(a, RAX, target);
+    }
+    end_with_eax(b);
+    return 2;
+}
+
+
+// Translate one instruction at pc. Returns 1 if it was translated, 2 if it
+// was translated and ends the block, 0 if the block has to end before it.
+int translate_instr(block_t *b, const instr_t *in, uint16_t pc) {
+    x86_t *a = &b->a;
+    int d, s, t;
+    switch (in->opcode) {
+        case NOOP:
+            return 1;
+        case SETI:
+            // only the general purpose registers can be set
+            if (in->reg[0] < IR0 || in->reg[0] > IR3) {
+                return 0;
+            }
+            x86_mov_imm(a, jit_ireg_host[in->reg[0]], in->imm.u);
+            return 1;
+        case MOVI:
+            s = read_ireg(b, in->reg[0], in->next, RAX);
+            if (s == NOREG) {
+                return 0;
+            }
+            if (in->reg[1] == RPC) {
+                if (s != RAX) {
+                    x86_mov(a, RAX, s);
+                }
+                end_with_eax(b);
+                return 2;
+            }
+            if ((d = write_ireg(in->reg[1])) == NOREG) {
+                return 0;
+            }
+            if (d != s) {
+                x86_mov(a, d, s);
+            }
+            return 1;
+        case MEQI: return translate_cmov(b, in, pc, 1 << EQ);
+        case MNEI: return translate_cmov(b, in, pc, (1 << GT) | (1 << LT));
+        case MGTI: return translate_cmov(b, in, pc, 1 << GT);
+        case MGEI: return translate_cmov(b, in, pc, (1 << GT) | (1 << EQ));
+        case MLTI: return translate_cmov(b, in, pc, 1 << LT);
+        case MLEI: return translate_cmov(b, in, pc, (1 << LT) | (1 << EQ));
+        case JMPA: return translate_jump(b, in, pc, in->imm.u, 0);
+        case JMPR: return translate_jump(b, in, pc, in->next + in->imm.u, 0);
+        case JEQ: return translate_jump(b, in, pc, in->next + in->imm.u, 1 << EQ);
+        case JNE: return translate_jump(b, in, pc, in->next + in->imm.u, (1 << GT) | (1 << LT));
+        case JGT: return translate_jump(b, in, pc, in->next + in->imm.u, 1 << GT);
+        case JGE: return translate_jump(b, in, pc, in->next + in->imm.u, (1 << GT) | (1 << EQ));
+        case JLT: return translate_jump(b, in, pc, in->next + in->imm.u, 1 << LT);
+        case JLE: return translate_jump(b, in, pc, in->next + in->imm.u, (1 << LT) | (1 << EQ));
+        case LOOP: {
+            uint16_t target = in->next + in->imm.u;
+            if ((d = write_ireg(in->reg[0])) == NOREG || !mem_check(b->smem, target >> 3, 1, MEM_X)) {
+                return 0;
+            }
+            // decrement of 0 exits like deci, otherwise jump unless it reaches 0
+            x86_test(a, d, d);
+            exit_if(b, CC_E, pc);
+            x86_incdec(a, 1, d);
+            x86_mov_imm(a, RAX, in->next);
+            uint8_t *done = x86_jcc(a, CC_E);
+            x86_mov_imm(a, RAX, target);
+            x86_patch(a, done, a->p);
+            end_with_eax(b);
+            return 2;
+        }
+        case INCI:
+            // wraps around like the interpreter
+            if ((d = write_ireg(in->reg[0])) == NOREG) {
+                return 0;
+            }
+            x86_incdec(a, 0, d);
+            x86_alu_imm(a, ALU_AND, d, 0xFFFF);
+            return 1;
+        case DECI:
+            if ((d = write_ireg(in->reg[0])) == NOREG) {
+                return 0;
+            }
+            x86_test(a, d, d);
+            exit_if(b, CC_E, pc);
+            x86_incdec(a, 1, d);
+            return 1;
+        case ADDI:
+            s = host_ireg(in->reg[0]);
+            if (s == NOREG || (d = write_ireg(in->reg[1])) == NOREG) {
+                return 0;
+            }
+            x86_mov(a, RAX, d);
+            x86_add(a, RAX, s);
+            x86_alu_imm(a, ALU_CMP, RAX, 0xFFFF);
+            exit_if(b, CC_A, pc);
+            x86_mov(a, d, RAX);
+            return 1;
+        case SUBI:
+            s = host_ireg(in->reg[0]);
+            if (s == NOREG || (d = write_ireg(in->reg[1])) == NOREG) {
+                return 0;
+            }
+            x86_cmp(a, d, s);
+            exit_if(b, CC_B, pc);
+            x86_sub(a, d, s);
+            return 1;
+        case MULI:
+            // the product of two 16-bit values fits in 32 bits
+            s = host_ireg(in->reg[0]);
+            if (s == NOREG || (d = write_ireg(in->reg[1])) == NOREG) {
+                return 0;
+            }
+            x86_mov(a, RAX, d);
+            x86_imul(a, RAX, s);
+            x86_alu_imm(a, ALU_CMP, RAX, 0xFFFF);
+            exit_if(b, CC_A, pc);
+            x86_mov(a, d, RAX);
+            return 1;
+        case ANDI:
+        case ORI:
+        case XORI: {
+            static const uint8_t alu_op[] = { [ANDI] = 0x21, [ORI] = 0x09, [XORI] = 0x31 };
+            s = read_ireg(b, in->reg[0], in->next, RAX);
+            if (s == NOREG || (d = write_ireg(in->reg[1])) == NOREG) {
+                return 0;
+            }
+            x86_rr(a, alu_op[in->opcode], d, s);
+            return 1;
+        }
+        case SHLI:
+        case SHRI: {
+            // 32-bit shifts only look at the low 5 bits of the count, so 
+            // counts of 16 or more are handled apart (the result is 0)
+            s = read_ireg(b, in->reg[0], in->next, RCX);
+            if (s == NOREG || (d = write_ireg(in->reg[1])) == NOREG) {
+                return 0;
+            }
+            if (s != RCX) {
+                x86_mov(a, RCX, s);
+            }
+            x86_mov_imm(a, RAX, 0);
+            x86_alu_imm(a, ALU_CMP, RCX, 16);
+            uint8_t *done = x86_jcc(a, CC_AE);
+            x86_mov(a, RAX, d);
+            x86_shift_cl(a, in->opcode == SHLI ? SHIFT_SHL : SHIFT_SHR, RAX, 0);
+            x86_alu_imm(a, ALU_AND, RAX, 0xFFFF);
+            x86_patch(a, done, a->p);
+            x86_mov(a, d, RAX);
+            return 1;
+        }
+        case ROTL:
+            // a 16-bit rotate leaves the (zero) upper bits alone
+            s = read_ireg(b, in->reg[0], in->next, RCX);
+            if (s == NOREG || (d = write_ireg(in->reg[1])) == NOREG) {
+                return 0;
+            }
+            if (s != RCX) {
+                x86_mov(a, RCX, s);
+            }
+            x86_shift_cl(a, SHIFT_ROL, d, 1);
+            return 1;
+        case CMPI: {
+            s = read_ireg(b, in->reg[0], in->next, RAX);
+            t = read_ireg(b, in->reg[1], in->next, RCX);
+            if (s == NOREG || t == NOREG) {
+                return 0;
+            }
+            // mov does not change the flags of the compare
+            x86_cmp(a, s, t);
+            x86_mov_imm(a, RAX, EQ);
+            uint8_t *done_eq = x86_jcc(a, CC_E);
+            x86_mov_imm(a, RAX, LT);
+            uint8_t *done_lt = x86_jcc(a, CC_B);
+            x86_mov_imm(a, RAX, GT);
+            x86_patch(a, done_eq, a->p);
+            x86_patch(a, done_lt, a->p);
+            x86_store32(a, RDI, offsetof(core_t, rcmp), RAX);
+            return 1;
+        }
+        case PSHI:
+            if ((s = read_ireg(b, in->reg[0], in->next, RAX)) == NOREG) {
+                return 0;
+            }
+            x86_load16(a, RCX, RDI, offsetof(core_t, stack_limit));
+            x86_alu_imm(a, ALU_SUB, RCX, 2);
+            x86_cmp(a, RDX, RCX);
+            exit_if(b, CC_AE, pc);
+            load_mem_base(b);
+            x86_store16_stack(a, s);
+            x86_alu_imm(a, ALU_ADD, RDX, 2);
+            return 1;
+        case POPI:
+            if ((d = write_ireg(in->reg[0])) == NOREG) {
+                return 0;
+            }
+            x86_load16(a, RCX, RDI, offsetof(core_t, stack_base));
+            x86_cmp(a, RDX, RCX);
+            exit_if(b, CC_BE, pc);
+            x86_alu_imm(a, ALU_SUB, RDX, 2);
+            load_mem_base(b);
+            x86_load16_stack(a, d);
+            return 1;
+        case LODI:
+            // out of range addresses are left to the interpreter to report
+            if (!mem_check(b->smem, in->imm.u, 2, MEM_R) || (d = write_ireg(in->reg[0])) == NOREG) {
+                return 0;
+            }
+            load_mem_base(b);
+            x86_load16(a, d, RCX, in->imm.u);
+            return 1;
+        case STOI:
+            if (!mem_check(b->smem, in->imm.u, 2, MEM_W) || (s = read_ireg(b, in->reg[0], in->next, RAX)) == NOREG) {
+                return 0;
+            }
+            load_mem_base(b);
+            x86_store16(a, RCX, in->imm.u, s);
+            return 1;
+        case LODF:
+            if (in->reg[0] > FRV || !mem_check(b->smem, in->imm.u, 4, MEM_R)) {
+                return 0;
+            }
+            load_mem_base(b);
+            x86_sse_mem(a, 0x10, in->reg[0], RCX, in->imm.u);
+            return 1;
+        case STOF:
+            if (in->reg[0] > FRV || !mem_check(b->smem, in->imm.u, 4, MEM_W)) {
+                return 0;
+            }
+            load_mem_base(b);
+            x86_sse_mem(a, 0x11, in->reg[0], RCX, in->imm.u);
+            return 1;
+        case SETF: {
+            if (in->reg[0] > FRV) {
+                return 0;
+            }
+            uint32_t bits;
+            memcpy(&bits, &in->imm.f, sizeof(bits));
+            x86_mov_imm(a, RAX, bits);
+            x86_movd(a, in->reg[0], RAX);
+            return 1;
+        }
+        case MOVF:
+        case ADDF:
+        case SUBF:
+        case MULF:
+        case DIVF: {
+            // B = B op A, the register operand order is A, B
+            static const uint8_t sse_op[] = { 
+                [MOVF] = 0x10, [ADDF] = 0x58, [SUBF] = 0x5C, [MULF] = 0x59, [DIVF] = 0x5E 
+            };
+            if (in->reg[0] > FRV || in->reg[1] > FRV) {
+                return 0;
+            }
+            x86_sse_rr(a, sse_op[in->opcode], in->reg[1], in->reg[0]);
+            return 1;
+        }
+        default:
+            return 0;
+    }
+}
+
+
+// Load (or store) every register that lives in a host register.
+void move_regs(block_t *b, int store) {
+    for (ireg_t r = RPC; r <= IRV; r++) {
+        if (jit_ireg_host[r] == NOREG) {
+            continue;
+        }
+        if (store) {
+            x86_store16(&b->a, RDI, ireg_offset(r), jit_ireg_host[r]);
+        } else {
+            x86_load16(&b->a, jit_ireg_host[r], RDI, ireg_offset(r));
+        }
+    }
+    for (freg_t f = FR0; f <= FRV; f++) {
+        x86_sse_mem(&b->a, store ? 0x11 : 0x10, f, RDI, freg_offset(f));
+    }
+}
+
+
+// Compile the block starting at a record of an instruction cache into the
+// code buffer, NULL if its first instruction cannot be translated.
+jit_fn_t compile_block(jit_t *jit, icache_t *cache, uint32_t at) {
+    block_t *b = jit->block;
+    b->a.p = jit->code + jit->used;
+    b->a.end = jit->code + jit->size;
+    b->a.full = 0;
+    b->n_exits = 0;
+    b->n_ends = 0;
+    b->leader = cache->ops[at].pc;
+    b->smem = cache->smem;
+
+    uint8_t *start = b->a.p;
+    move_regs(b, 0);
+    b->body = b->a.p;
+
+    uint32_t n = 0;
+    int ended = 0;
+    for (uop_t *u = &cache->ops[at]; n < JIT_MAXBLOCK; u++, n++) {
+        int r = u->in.opcode == NONE ? 0 : translate_instr(b, &u->in, u->pc);
+        if (r == 0) {
+            if (n == 0) {
+                return NULL;
+            }
+            // continue in the interpreter at this instruction
+            x86_store16_imm(&b->a, RDI, ireg_offset(RPC), u->pc);
+            ended = 1;
+            break;
+        }
+        if (r == 2) {
+            ended = 1;
+            break;
+        }
+    }
+    if (!ended) {
+        // block length limit, continue after the last instruction
+        x86_store16_imm(&b->a, RDI, ireg_offset(RPC), cache->ops[at + n - 1].in.next);
+    }
+
+    // epilogue: write the registers back
+    uint8_t *epilogue = b->a.p;
+    move_regs(b, 1);
+    x86_byte(&b->a, 0xC3);
+    for (uint16_t i = 0; i < b->n_ends; i++) {
+        x86_patch(&b->a, b->ends[i], epilogue);
+    }
+
+    // side exit stubs: set rpc to the instruction that exits and write back
+    for (uint16_t i = 0; i < b->n_exits; i++) {
+        x86_patch(&b->a, b->exits[i].at, b->a.p);
+        x86_store16_imm(&b->a, RDI, ireg_offset(RPC), b->exits[i].pc);
+        x86_patch(&b->a, x86_jmp(&b->a), epilogue);
+    }
+
+    if (b->a.full) {
+        return NULL;
+    }
+    jit->used = b->a.p - jit->code;
+    jit->n_blocks++;
+    return (jit_fn_t) start;
+}
+
+
+// Allocates JIT state for compiling blocks once they have been entered a
+// number of times.
+jit_t* jit_init(uint16_t threshold) {
+    void *code = mmap(NULL, JIT_CODESIZE, PROT_READ | PROT_WRITE | PROT_EXEC, 
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        return NULL;
+    }
+    jit_t *jit = calloc(1, sizeof(jit_t));
+    jit->block = jit ? malloc(sizeof(block_t)) : NULL;
+    if (!jit || !jit->block) {
+        free(jit);
+        munmap(code, JIT_CODESIZE);
+        return NULL;
+    }
+    jit->code = code;
+    jit->size = JIT_CODESIZE;
+    jit->threshold = threshold ? threshold : 1;
+    return jit;
+}
+
+
+// Frees the JIT state and its code.
+void jit_delete(jit_t *jit) {
+    if (!jit) {
+        return;
+    }
+    munmap(jit->code, jit->size);
+    free(jit->block);
+    free(jit->native);
+    free(jit->hits);
+    free(jit);
+}
+
+
+// Counts an entry into the block starting at a record of an instruction
+// cache, compiling it once it is hot.
+jit_fn_t jit_enter(jit_t *jit, icache_t *cache, uint32_t at) {
+    if (at >= jit->n) {
+        // the cache has grown, cover all of it
+        uint32_t n = cache->cap;
+        jit->native = realloc(jit->native, n * sizeof(jit_fn_t));
+        jit->hits = realloc(jit->hits, n * sizeof(uint16_t));
+        memset(jit->native + jit->n, 0, (n - jit->n) * sizeof(jit_fn_t));
+        memset(jit->hits + jit->n, 0, (n - jit->n) * sizeof(uint16_t));
+        jit->n = n;
+    }
+    if (jit->native[at] || jit->hits[at] == JIT_FAILED) {
+        return jit->native[at];
+    }
+    if (++jit->hits[at] < jit->threshold) {
+        return NULL;
+    }
+    if (jit->size - jit->used >= JIT_BLOCKSPACE) {
+        jit->native[at] = compile_block(jit, cache, at);
+    }
+    if (!jit->native[at]) {
+        jit->hits[at] = JIT_FAILED;
+    }
+    return jit->native[at];
+}
+
+
+#else
+
+
+// JIT is not available on this host.
+jit_t* jit_init(uint16_t threshold) {
+    (void) threshold;
+    return NULL;
+}
+
+
+void jit_delete(jit_t *jit) {
+    (void) jit;
+}
+
+
+jit_fn_t jit_enter(jit_t *jit, icache_t *cache, uint32_t at) {
+    (void) jit;
+    (void) cache;
+    (void) at;
+    return NULL;
+}
+
+
+#endif
@@ -0,0 +1,76 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    jit.h
+*/
+
+
+#ifndef JIT_H
+#define JIT_H
+
+
+#include <stdlib.h>
+#include <stdint.h>
+
+
+#include "cpu.h"
+#include "icache.h"
+
+
+/*
+Second tier for the instruction cache: basic blocks that are entered often
+enough are translated into native x86-64 code. Inside a block ir0-ir3, irv and
+rsp live in host general purpose registers and fr0-fr3, frv in xmm registers,
+and are only written back to the core when the block is left.
+
+Any instruction that could set the status code (overflow, decrement of 0,
+stack bounds, rcmp not initialized) checks for that condition before it
+changes anything and leaves the block with rpc pointing at itself (a side
+exit), so the interpreter executes it again and raises the error exactly as
+it would have without the JIT. Instructions the translator does not handle
+end the block the same way.
+
+Only built for x86-64 hosts with mmap, elsewhere jit_init returns NULL and
+everything stays interpreted.
+*/
+
+
+// native code for a block, runs it and leaves rpc at the next instruction
+typedef void (*jit_fn_t)(core_t*);
+
+
+// JIT state for an instruction cache
+typedef struct jit {
+    uint8_t *code;          // executable code buffer
+    size_t size;
+    size_t used;
+    jit_fn_t *native;       // record -> native code for the block it starts
+    uint16_t *hits;         // record -> times the block has been entered
+    uint32_t n;             // records covered by native/hits
+    uint16_t threshold;     // entries before a block is compiled
+    uint32_t n_blocks;      // blocks compiled
+    struct block *block;    // translation state (per cache, so that cores 
+                            // on different threads can compile at once)
+} jit_t;
+
+
+// Allocates JIT state for compiling blocks once they have been entered a
+// number of times (NULL if the host is not supported).
+jit_t* jit_init(uint16_t);
+
+
+// Frees the JIT state and its code.
+void jit_delete(jit_t*);
+
+
+// Counts an entry into the block starting at a record of an instruction
+// cache, compiling it once it is hot. Returns its native code, or NULL if
+// the block is not (or cannot be) compiled.
+jit_fn_t jit_enter(jit_t*, icache_t*, uint32_t);
+
+
+#endif
@@ -9,49 +9,118 @@
 */
 
 
+#define _GNU_SOURCE
+
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <sys/mman.h>
+#define SYSMEM_HAVE_MMAP
+#endif
+
+
 #include "memory.h"
 
 
 // Set the address in memory to a uint8_t value.
 void _set_uint8(sysmem_t *smem, uint16_t addr, uint8_t val) {
-    *(smem->mem + addr) = val;
+    mem_set_uint8(smem, addr, val);
 }
 
 
-// Set the address in memory to a uint8_t value.
+// Set the address in memory to a uint16_t value.
 void _set_uint16(sysmem_t *smem, uint16_t addr, uint16_t val) {
-    *((uint16_t*) (smem->mem + addr)) = val;
+    mem_set_uint16(smem, addr, val);
 }
 
 
 // Set the address in memory to a float value.
 void _set_float(sysmem_t *smem, uint16_t addr, float val) {
-    *((float*) (smem->mem + addr)) = val;
+    mem_set_float(smem, addr, val);
 }
 
 
 // Get a uint8_t value from an address in memory.
 uint8_t _get_uint8(sysmem_t *smem, uint16_t addr) {
-    return *((uint8_t*) (smem->mem + addr));
+    return mem_get_uint8(smem, addr);
 }
 
 
 // Get a uint16_t value from an address in memory.
 uint16_t _get_uint16(sysmem_t *smem, uint16_t addr) {
-    return *((uint16_t*) (smem->mem + addr));
+    return mem_get_uint16(smem, addr);
 }
 
 
 // Get a float value from an address in memory.
 float _get_float(sysmem_t *smem, uint16_t addr) {
-    return *((float*) (smem->mem + addr));
+    return mem_get_float(smem, addr);
 }
 
 
-// Allocates space for a new sysmem structure and returns a pointer to it.
-sysmem_t* sysmem_init(uint8_t n_cores) {
-    // allocate memory
-    sysmem_t *smem = calloc(1, sizeof(sysmem_t));
+// Check the permissions of every page of a range (see mem_check).
+int mem_check_range(const sysmem_t *smem, uint16_t addr, uint32_t len, uint8_t perm) {
+    uint32_t last = (uint32_t) addr + (len ? len - 1 : 0);
+    if (last > MEMORY_MAXADDR) {
+        return 0;
+    }
+    for (uint32_t p = addr >> MEMORY_PAGEBITS; p <= last >> MEMORY_PAGEBITS; p++) {
+        if ((smem->pages[p] & perm) != perm) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+// Copy a block of memory (overlapping ranges behave as if copied through a
+// temporary buffer). libc memmove already moves 16-64 bytes per instruction.
+void mem_copy(sysmem_t *smem, uint16_t src, uint16_t dst, uint16_t len) {
+    memmove(smem->mem + dst, smem->mem + src, len);
+}
+
+
+// Fill a block of memory with a byte value.
+void mem_fill(sysmem_t *smem, uint16_t dst, uint8_t val, uint16_t len) {
+    memset(smem->mem + dst, val, len);
+}
+
+
+// Compare two blocks of memory, 16 bytes at a time where SSE2 is available.
+int mem_compare(const sysmem_t *smem, uint16_t a, uint16_t b, uint16_t len) {
+    const uint8_t *pa = smem->mem + a;
+    const uint8_t *pb = smem->mem + b;
+    uint32_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*) (pa + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*) (pb + i));
+        unsigned eq = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+        if (eq != 0xFFFF) {
+            // first byte that differs
+            i += __builtin_ctz(~eq);
+            return (int) pa[i] - (int) pb[i];
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (pa[i] != pb[i]) {
+            return (int) pa[i] - (int) pb[i];
+        }
+    }
+    return 0;
+}
+
+
+// Initializes a sysmem structure in place over MEMORY_MAPSIZE zeroed bytes
+// owned by the caller (e.g. in an arena of memories).
+void sysmem_setup(sysmem_t *smem, uint8_t n_cores, uint8_t *mem) {
+    memset(smem, 0, sizeof(sysmem_t));
+    smem->mem = mem;
+    smem->mem_kind = SYSMEM_EXTERNAL;
     // set all of the function pointers
     smem->set_uint8 = &_set_uint8;
     smem->set_uint16 = &_set_uint16;
@@ -59,13 +128,176 @@ sysmem_t* sysmem_init(uint8_t n_cores) {
     smem->get_uint8 = &_get_uint8;
     smem->get_uint16 = &_get_uint16;
     smem->get_float = &_get_float;
-    // set the number of cpu cores
+    // default layout (see memory.h), which also splits the stack space
     smem->n_cores = n_cores;
+    sysmem_protect(smem, 0, MEMORY_RWBLKMIN, MEM_X);
+    sysmem_protect(smem, MEMORY_RWBLKMIN, MEMORY_RWBLKMAX - MEMORY_RWBLKMIN, MEM_R | MEM_W);
+    sysmem_protect(smem, MEMORY_RWBLKMAX, MEMORY_SIZE - MEMORY_RWBLKMAX, MEM_S);
+}
+
+
+// Split the stack space (the first run of MEM_S pages) between the cpu cores,
+// evenly and keeping every slice a whole number of 2 byte words.
+void sysmem_split_stack(sysmem_t *smem) {
+    uint32_t p = 0;
+    while (p < MEMORY_NPAGES && !(smem->pages[p] & MEM_S)) {
+        p++;
+    }
+    uint32_t end = p;
+    while (end < MEMORY_NPAGES && (smem->pages[end] & MEM_S)) {
+        end++;
+    }
+    uint32_t start = p << MEMORY_PAGEBITS;
+    uint32_t top = end << MEMORY_PAGEBITS;
+    // stack pointers are uint16_t, a stack at the end of memory stops short
+    top = top > MEMORY_MAXADDR ? MEMORY_MAXADDR : top;
+    smem->stack_start = start > MEMORY_MAXADDR ? MEMORY_MAXADDR : start;
+    smem->stack_size = top > start ? ((top - start) / (smem->n_cores ? smem->n_cores : 1)) & ~1 : 0;
+}
+
+
+// Sets the permissions of the pages overlapping a range of addresses.
+void sysmem_protect(sysmem_t *smem, uint32_t addr, uint32_t len, uint8_t perm) {
+    const uint16_t mask = (1 << MEM_PERMBITS) - 1;
+    uint32_t end = addr + len > MEMORY_SIZE ? MEMORY_SIZE : addr + len;
+    for (uint32_t p = addr >> MEMORY_PAGEBITS; p << MEMORY_PAGEBITS < end; p++) {
+        smem->pages[p] = perm & mask;
+    }
+#if defined(SYSMEM_HAVE_MMAP)
+    // image_load maps the read only block read only, pages of it that cores
+    // may now store to have to be writable on the host again
+    long page = 0;
+    if ((perm & (MEM_W | MEM_S)) && smem->mem_kind == SYSMEM_MAPPED && addr < MEMORY_RWBLKMIN 
+        && (page = sysconf(_SC_PAGESIZE)) > 0) {
+        uint32_t lo = addr / page * page;
+        uint32_t hi = end < MEMORY_RWBLKMIN ? end : MEMORY_RWBLKMIN;
+        hi = (hi + page - 1) / page * page;
+        mprotect(smem->mem + lo, hi - lo, PROT_READ | PROT_WRITE);
+    }
+#endif
+    sysmem_find_runs(smem);
+}
+
+
+// Recomputes the run end of every page table entry from the permissions and
+// splits the stack space between the cores again.
+void sysmem_find_runs(sysmem_t *smem) {
+    const uint16_t mask = (1 << MEM_PERMBITS) - 1;
+    // find the end of every run, from the top down
+    uint16_t run_end = MEMORY_NPAGES - 1;
+    for (uint32_t p = MEMORY_NPAGES; p-- > 0; ) {
+        if (p + 1 < MEMORY_NPAGES && (smem->pages[p] & mask) != (smem->pages[p + 1] & mask)) {
+            run_end = p;
+        }
+        smem->pages[p] = (uint16_t) (run_end << MEM_PERMBITS) | (smem->pages[p] & mask);
+    }
+    sysmem_split_stack(smem);
+}
+
+
+// Allocate a sysmem structure over bytes allocated in some way (freed along 
+// with the structure unless external).
+sysmem_t* sysmem_wrap(uint8_t n_cores, uint8_t *mem, uint8_t kind) {
+    sysmem_t *smem = malloc(sizeof(sysmem_t));
+    if (!smem) {
+        return NULL;
+    }
+    sysmem_setup(smem, n_cores, mem);
+    smem->mem_kind = kind;
     return smem;
 }
 
 
+// Allocates space for a new sysmem structure and returns a pointer to it.
+sysmem_t* sysmem_init(uint8_t n_cores) {
+    // allocate (zeroed) memory
+#if defined(SYSMEM_HAVE_MMAP)
+    uint8_t *mem = mmap(NULL, MEMORY_MAPSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED) {
+        return sysmem_wrap(n_cores, mem, SYSMEM_MAPPED);
+    }
+#endif
+    uint8_t *heap = calloc(1, MEMORY_MAPSIZE);
+    return heap ? sysmem_wrap(n_cores, heap, SYSMEM_HEAP) : NULL;
+}
+
+
 // Frees memory associated with sysmem structure to de-initialize.
 void sysmem_delete(sysmem_t *smem) {
+    if (!smem) {
+        return;
+    }
+#if defined(SYSMEM_HAVE_MMAP)
+    if (smem->mem_kind == SYSMEM_MAPPED) {
+        munmap(smem->mem, MEMORY_MAPSIZE);
+    }
+#endif
+    if (smem->mem_kind == SYSMEM_HEAP) {
+        free(smem->mem);
+    }
     free(smem);
 }
+
+
+// Takes a snapshot of the contents of a memory (NULL on failure).
+sysmem_snap_t* sysmem_snapshot(const sysmem_t *smem) {
+    sysmem_snap_t *snap = malloc(sizeof(sysmem_snap_t));
+    if (!snap) {
+        return NULL;
+    }
+    snap->fd = -1;
+    snap->copy = NULL;
+    memcpy(snap->pages, smem->pages, sizeof(snap->pages));
+#if defined(__linux__)
+    snap->fd = memfd_create("c16-snapshot", MFD_CLOEXEC);
+    if (snap->fd >= 0) {
+        if (pwrite(snap->fd, smem->mem, MEMORY_MAPSIZE, 0) == MEMORY_MAPSIZE) {
+            return snap;
+        }
+        close(snap->fd);
+        snap->fd = -1;
+    }
+#endif
+    snap->copy = malloc(MEMORY_MAPSIZE);
+    if (!snap->copy) {
+        free(snap);
+        return NULL;
+    }
+    memcpy(snap->copy, smem->mem, MEMORY_MAPSIZE);
+    return snap;
+}
+
+
+// Allocates a new sysmem structure starting from a snapshot.
+sysmem_t* sysmem_clone(const sysmem_snap_t *snap, uint8_t n_cores) {
+    sysmem_t *smem = NULL;
+#if defined(SYSMEM_HAVE_MMAP)
+    if (snap->fd >= 0) {
+        uint8_t *mem = mmap(NULL, MEMORY_MAPSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, snap->fd, 0);
+        smem = mem != MAP_FAILED ? sysmem_wrap(n_cores, mem, SYSMEM_MAPPED) : NULL;
+    } else
+#endif
+    if ((smem = sysmem_init(n_cores))) {
+        memcpy(smem->mem, snap->copy, MEMORY_MAPSIZE);
+    }
+    if (smem) {
+        memcpy(smem->pages, snap->pages, sizeof(smem->pages));
+        sysmem_split_stack(smem);
+    }
+    return smem;
+}
+
+
+// Frees a snapshot (clones are not affected).
+void sysmem_snapshot_delete(sysmem_snap_t *snap) {
+    if (!snap) {
+        return;
+    }
+#if defined(SYSMEM_HAVE_MMAP)
+    if (snap->fd >= 0) {
+        close(snap->fd);
+    }
+#endif
+    free(snap->copy);
+    free(snap);
+}
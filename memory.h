@@ -14,6 +14,9 @@
 
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
 
 /* 
 Actually, isn't the memory map a bit more of an OS thing? Maybe at the hardware level it makes more sense just to 
@@ -24,7 +27,7 @@ memory map:
         |
         |   <-- stack space (4 kB), each core gets its own stack space divided evenly from this space
         |
-    0xF05F -- initial stack pointer address, stack grows toward larger addresses
+    0xF060 -- initial stack pointer address, stack grows toward larger addresses
         |
         |   <-- general purpose read/write memory block
         |
@@ -36,20 +39,66 @@ memory map:
     
 */
 #define MEMORY_MAXADDR  0xFFFF
-#define MEMORY_RWBLKMAX 0xF05F 
+#define MEMORY_RWBLKMAX 0xF060 
 #define MEMORY_RWBLKMIN 0x1F40
+#define MEMORY_SIZE     0x10000
+// bytes allocated for the memory, the slack keeps a word access at the top
+// address inside the allocation
+#define MEMORY_MAPSIZE  (MEMORY_SIZE + 64)
+
+
+// how the bytes of a sysmem_t were allocated (who frees them)
+#define SYSMEM_EXTERNAL 0   // by the caller
+#define SYSMEM_HEAP     1   // calloc
+#define SYSMEM_MAPPED   2   // mmap, anonymous or a private mapping of a snapshot
+
+
+/*
+The map above is only the default layout. What an address may be used for is
+looked up in a table of permissions per page of MEMORY_PAGESIZE bytes, and a
+VM can be given a different layout by changing its table. Each entry also 
+holds the last page of the run of pages with the same permissions, so an 
+access of any length is validated with one table lookup instead of 
+comparisons against the bounds of each block. Pages are 32 bytes so that the 
+bounds of the default layout fall on page boundaries.
+    MEM_R -- loads (lodi, lodf, block and vector sources)
+    MEM_W -- stores (stoi, stof, block and vector destinations, atomics)
+    MEM_X -- subroutine entry points (call, by the byte holding the bit 
+             address; code still has to be in the read only block)
+    MEM_S -- stack space, split between the cores of a VM
+*/
+#define MEMORY_PAGEBITS 5
+#define MEMORY_PAGESIZE (1 << MEMORY_PAGEBITS)
+#define MEMORY_NPAGES   (MEMORY_SIZE >> MEMORY_PAGEBITS)
+
+#define MEM_R   0x01
+#define MEM_W   0x02
+#define MEM_X   0x04
+#define MEM_S   0x08
+#define MEM_PERMBITS    4   // page table entry: run end << 4 | permissions
 
 
 // Main system memory data structure.
 typedef struct sysmem {
     
     // 65536 bytes map to "physical" address space of 0x0000 to 0xFFFF, 
-    // inclusive. Addressing is done using uint16_t values.
-    uint8_t mem[65536];
+    // inclusive. Addressing is done using uint16_t values. The bytes are a
+    // separate allocation so that forked machines can share them 
+    // copy-on-write.
+    uint8_t *mem;
+    uint8_t mem_kind;   // SYSMEM_*
+
+    // page table: permissions (MEM_*) of each page and the last page of the
+    // run of pages that have the same permissions (set with sysmem_protect),
+    // the entry after the last page is always 0
+    uint16_t pages[MEMORY_NPAGES + 1];
 
-    // define number of cores (for separate stacks)
+    // define number of cores (for separate stacks), each one gets stack_size
+    // bytes of the stack space (the first run of MEM_S pages) starting at 
+    // stack_start + cid * stack_size
     uint8_t n_cores;
-    uint8_t *core_stacks;
+    uint16_t stack_start;
+    uint16_t stack_size;
     
     // function pointers
     // Set the address in memory to a value of a specified type.
@@ -65,10 +114,145 @@ typedef struct sysmem {
 } sysmem_t;
 
 
+/*
+Inline accessors for the hot paths of the cpu (same layout as the function 
+pointers above, host byte order). They go through memcpy so the compiler emits
+plain unaligned loads and stores, which is safe for any address.
+*/
+static inline uint8_t mem_get_uint8(const sysmem_t *smem, uint16_t addr) {
+    return smem->mem[addr];
+}
+
+static inline uint16_t mem_get_uint16(const sysmem_t *smem, uint16_t addr) {
+    uint16_t val;
+    memcpy(&val, smem->mem + addr, sizeof(val));
+    return val;
+}
+
+static inline float mem_get_float(const sysmem_t *smem, uint16_t addr) {
+    float val;
+    memcpy(&val, smem->mem + addr, sizeof(val));
+    return val;
+}
+
+static inline void mem_set_uint8(sysmem_t *smem, uint16_t addr, uint8_t val) {
+    smem->mem[addr] = val;
+}
+
+static inline void mem_set_uint16(sysmem_t *smem, uint16_t addr, uint16_t val) {
+    memcpy(smem->mem + addr, &val, sizeof(val));
+}
+
+static inline void mem_set_float(sysmem_t *smem, uint16_t addr, float val) {
+    memcpy(smem->mem + addr, &val, sizeof(val));
+}
+
+
+// Returns 1 if the pages of the len bytes starting at an address all have 
+// every permission in perm (an empty range checks the page of its address).
+// Ranges that run into pages with other permissions are checked page by page.
+int mem_check_range(const sysmem_t*, uint16_t, uint32_t, uint8_t);
+
+static inline int mem_check(const sysmem_t *smem, uint16_t addr, uint32_t len, uint8_t perm) {
+    uint16_t e = smem->pages[addr >> MEMORY_PAGEBITS];
+    uint32_t last = ((uint32_t) addr + (len ? len - 1 : 0)) >> MEMORY_PAGEBITS;
+    if (len <= MEMORY_PAGESIZE) {
+        // words and floats: the first and last byte are at most one page apart
+        return (e & smem->pages[last] & perm) == perm;
+    }
+    if ((e & perm) == perm && last <= (uint32_t) (e >> MEM_PERMBITS)) {
+        return 1;
+    }
+    return mem_check_range(smem, addr, len, perm);
+}
+
+
+/*
+Atomic read-modify-write on 16-bit words, for cores sharing one system memory.
+The address must be even. All of them are sequentially consistent: they are 
+seen by every core in one total order, and plain loads and stores before 
+(after) one in a core's program stay before (after) it.
+*/
+static inline _Atomic uint16_t* mem_atomic_uint16(sysmem_t *smem, uint16_t addr) {
+    return (_Atomic uint16_t*) (smem->mem + addr);
+}
+
+// if the word equals *expected replace it with val and return 1, otherwise
+// store the word in *expected and return 0
+static inline int mem_cas_uint16(sysmem_t *smem, uint16_t addr, uint16_t *expected, uint16_t val) {
+    return atomic_compare_exchange_strong(mem_atomic_uint16(smem, addr), expected, val);
+}
+
+// add val to the word (wrapping), returns the old value
+static inline uint16_t mem_fetch_add_uint16(sysmem_t *smem, uint16_t addr, uint16_t val) {
+    return atomic_fetch_add(mem_atomic_uint16(smem, addr), val);
+}
+
+// replace the word with val, returns the old value
+static inline uint16_t mem_exchange_uint16(sysmem_t *smem, uint16_t addr, uint16_t val) {
+    return atomic_exchange(mem_atomic_uint16(smem, addr), val);
+}
+
+
+// Block operations on len bytes of memory (ranges must already be checked):
+//      mem_copy    -- copy from src to dst (ranges may overlap)
+//      mem_fill    -- set every byte to a value
+//      mem_compare -- compare two ranges byte by byte (unsigned), returns <0, 
+//                     0 or >0 like memcmp
+void mem_copy(sysmem_t*, uint16_t, uint16_t, uint16_t);
+void mem_fill(sysmem_t*, uint16_t, uint8_t, uint16_t);
+int mem_compare(const sysmem_t*, uint16_t, uint16_t, uint16_t);
+
+
 // Allocates space for a new sysmem structure and returns a pointer to it.
 sysmem_t* sysmem_init(uint8_t);
 
 
+// Initializes a sysmem structure in place over MEMORY_MAPSIZE zeroed bytes
+// owned by the caller (e.g. in an arena of memories), with the default 
+// layout.
+void sysmem_setup(sysmem_t*, uint8_t, uint8_t*);
+
+
+// Sets the permissions of every page overlapping the len bytes starting at an
+// address and splits the stack space between the cores again. Cores that are
+// already set up keep their stacks (see vm_wrap). Pages cores may store to
+// are made writable on the host if image_load mapped them read only.
+void sysmem_protect(sysmem_t*, uint32_t, uint32_t, uint8_t);
+
+
+// Recomputes the run end of every page table entry from the permissions alone
+// (e.g. after the table was copied from a file) and splits the stack space 
+// between the cores again.
+void sysmem_find_runs(sysmem_t*);
+
+
+/*
+A snapshot freezes the contents of a memory so that any number of new memories
+can start from it. Where the host supports it (Linux memfd) the contents are
+written once to an anonymous file and every clone is a private mapping of 
+that file: cloning costs a mmap call and a page is only copied when a clone 
+writes to it. Elsewhere clones copy the snapshot.
+*/
+typedef struct sysmem_snap {
+    int fd;             // file holding the contents, -1 if not supported
+    uint8_t *copy;      // contents when there is no file
+    uint16_t pages[MEMORY_NPAGES + 1];  // layout
+} sysmem_snap_t;
+
+
+// Takes a snapshot of the contents of a memory (NULL on failure).
+sysmem_snap_t* sysmem_snapshot(const sysmem_t*);
+
+
+// Allocates a new sysmem structure starting from a snapshot.
+sysmem_t* sysmem_clone(const sysmem_snap_t*, uint8_t);
+
+
+// Frees a snapshot (clones are not affected).
+void sysmem_snapshot_delete(sysmem_snap_t*);
+
+
 // Frees memory associated with sysmem structure to de-initialize.
 void sysmem_delete(sysmem_t*);
 
@@ -0,0 +1,273 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    pool.c
+*/
+
+
+#define _POSIX_C_SOURCE 200809L
+
+
+#include <string.h>
+#include <time.h>
+
+
+#include "pool.h"
+
+
+#define POOL_DEQUE_CAP 64
+
+
+// Current time in nanoseconds (monotonic clock).
+uint64_t pool_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+
+// Add a job at the tail of a deque, growing it if it is full.
+void deque_push(pool_deque_t *dq, pool_job_t *job) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->n == dq->cap) {
+        pool_job_t **jobs = malloc(2 * dq->cap * sizeof(pool_job_t*));
+        for (uint32_t i = 0; i < dq->n; i++) {
+            jobs[i] = dq->jobs[(dq->head + i) % dq->cap];
+        }
+        free(dq->jobs);
+        dq->jobs = jobs;
+        dq->cap *= 2;
+        dq->head = 0;
+    }
+    dq->jobs[(dq->head + dq->n) % dq->cap] = job;
+    dq->n++;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+
+// Take the job at the tail (owner) or head (thief) of a deque, NULL if empty.
+pool_job_t* deque_take(pool_deque_t *dq, int steal) {
+    pool_job_t *job = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->n) {
+        if (steal) {
+            job = dq->jobs[dq->head];
+            dq->head = (dq->head + 1) % dq->cap;
+        } else {
+            job = dq->jobs[(dq->head + dq->n - 1) % dq->cap];
+        }
+        dq->n--;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return job;
+}
+
+
+// Find a job for a worker: its own newest, or else the oldest of the first
+// other worker that has one (starting after itself). NULL if there is none.
+pool_job_t* pool_find_job(pool_worker_t *w) {
+    pool_t *pool = w->pool;
+    pool_job_t *job = deque_take(&w->deque, 0);
+    for (uint32_t i = 1; !job && i < pool->n_workers; i++) {
+        job = deque_take(&pool->workers[(w->id + i) % pool->n_workers].deque, 1);
+        w->n_steals += job != NULL;
+    }
+    if (job) {
+        atomic_fetch_sub(&pool->n_queued, 1);
+    }
+    return job;
+}
+
+
+// Run a job on a worker's memory and core.
+void pool_run_job(pool_worker_t *w, pool_job_t *job) {
+    // recycle the memory and core: same state as freshly allocated ones
+    memset(w->smem->mem, 0, MEMORY_MAPSIZE);
+    memcpy(w->smem->mem, job->image, job->size <= MEMORY_RWBLKMIN ? job->size : MEMORY_RWBLKMIN);
+    core_reset(w->core);
+    w->core->itab = job->itab;
+    core_run(w->core);
+    job->stc = w->core->stc;
+    job->irv = w->core->iregs[IRV];
+    job->frv = w->core->fregs[FRV];
+    job->latency_ns = pool_now_ns() - job->submit_ns;
+    w->n_jobs++;
+}
+
+
+// Worker thread: run jobs until the pool stops, sleeping while there are none.
+void* pool_worker(void *arg) {
+    pool_worker_t *w = arg;
+    pool_t *pool = w->pool;
+    while (1) {
+        pool_job_t *job = pool_find_job(w);
+        if (job) {
+            pool_run_job(w, job);
+            if (atomic_fetch_add(&pool->n_done, 1) + 1 == atomic_load(&pool->n_submitted)) {
+                pthread_mutex_lock(&pool->lock);
+                pthread_cond_broadcast(&pool->done);
+                pthread_mutex_unlock(&pool->lock);
+            }
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (!atomic_load(&pool->n_queued) && !atomic_load(&pool->stop)) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (atomic_load(&pool->stop) && !atomic_load(&pool->n_queued)) {
+            return NULL;
+        }
+    }
+}
+
+
+// Starts a pool with a number of worker threads (NULL if the arena cannot be
+// allocated or a thread cannot be started).
+pool_t* pool_init(uint32_t n_workers) {
+    if (n_workers == 0) {
+        return NULL;
+    }
+    pool_t *pool = calloc(1, sizeof(pool_t));
+    pool->n_workers = n_workers;
+    pool->workers = calloc(n_workers, sizeof(pool_worker_t));
+    pool->smem_arena = malloc(n_workers * sizeof(sysmem_t));
+    pool->mem_arena = calloc(n_workers, MEMORY_MAPSIZE);
+    pool->core_arena = aligned_alloc(CORE_ALIGN, n_workers * sizeof(core_t));
+    if (!pool->workers || !pool->smem_arena || !pool->mem_arena || !pool->core_arena) {
+        free(pool->workers);
+        free(pool->smem_arena);
+        free(pool->mem_arena);
+        free(pool->core_arena);
+        free(pool);
+        return NULL;
+    }
+    atomic_init(&pool->next, 0);
+    atomic_init(&pool->n_queued, 0);
+    atomic_init(&pool->n_submitted, 0);
+    atomic_init(&pool->n_done, 0);
+    atomic_init(&pool->stop, 0);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (uint32_t i = 0; i < n_workers; i++) {
+        pool_worker_t *w = &pool->workers[i];
+        w->pool = pool;
+        w->id = i;
+        pthread_mutex_init(&w->deque.lock, NULL);
+        w->deque.cap = POOL_DEQUE_CAP;
+        w->deque.jobs = malloc(POOL_DEQUE_CAP * sizeof(pool_job_t*));
+        w->smem = &pool->smem_arena[i];
+        w->core = &pool->core_arena[i];
+        sysmem_setup(w->smem, 1, pool->mem_arena + (size_t) i * MEMORY_MAPSIZE);
+        core_setup(w->core, 0, w->smem);
+    }
+    for (uint32_t i = 0; i < n_workers; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, &pool_worker, &pool->workers[i])) {
+            // stop the ones that did start
+            for (uint32_t j = i; j < n_workers; j++) {
+                pthread_mutex_destroy(&pool->workers[j].deque.lock);
+                free(pool->workers[j].deque.jobs);
+            }
+            pool->n_workers = i;
+            pool_delete(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+
+// Waits for the submitted jobs, stops the workers and frees the pool.
+void pool_delete(pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+    pool_wait(pool);
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->stop, 1);
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (uint32_t i = 0; i < pool->n_workers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (uint32_t i = 0; i < pool->n_workers; i++) {
+        pthread_mutex_destroy(&pool->workers[i].deque.lock);
+        free(pool->workers[i].deque.jobs);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool->workers);
+    free(pool->smem_arena);
+    free(pool->mem_arena);
+    free(pool->core_arena);
+    free(pool);
+}
+
+
+// Queues a job (from one thread at a time). The job must stay valid until 
+// pool_wait returns.
+void pool_submit(pool_t *pool, pool_job_t *job) {
+    job->submit_ns = pool_now_ns();
+    atomic_fetch_add(&pool->n_submitted, 1);
+    uint32_t i = atomic_fetch_add(&pool->next, 1) % pool->n_workers;
+    deque_push(&pool->workers[i].deque, job);
+    atomic_fetch_add(&pool->n_queued, 1);
+    // take the lock so a worker that just found nothing is already waiting
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+// Waits until every submitted job has finished.
+void pool_wait(pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->n_done) != atomic_load(&pool->n_submitted)) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+// qsort comparison for latencies
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+
+// Computes statistics over a set of completed jobs (steals are counted since
+// the previous call).
+void pool_stats(pool_t *pool, const pool_job_t *jobs, uint32_t n, pool_stats_t *st) {
+    memset(st, 0, sizeof(pool_stats_t));
+    for (uint32_t i = 0; i < pool->n_workers; i++) {
+        st->n_steals += pool->workers[i].n_steals;
+        pool->workers[i].n_steals = 0;
+    }
+    if (n == 0) {
+        return;
+    }
+    uint64_t *lat = malloc(n * sizeof(uint64_t));
+    uint64_t start = UINT64_MAX, end = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        lat[i] = jobs[i].latency_ns;
+        start = jobs[i].submit_ns < start ? jobs[i].submit_ns : start;
+        end = jobs[i].submit_ns + lat[i] > end ? jobs[i].submit_ns + lat[i] : end;
+    }
+    qsort(lat, n, sizeof(uint64_t), &compare_u64);
+    st->n_jobs = n;
+    st->secs = (end - start) / 1e9;
+    st->jobs_per_sec = st->secs > 0 ? n / st->secs : 0.0;
+    st->p50_ns = lat[(uint64_t) n * 50 / 100];
+    st->p90_ns = lat[(uint64_t) n * 90 / 100];
+    st->p99_ns = lat[(uint64_t) n * 99 / 100];
+    st->p999_ns = lat[(uint64_t) n * 999 / 1000];
+    st->max_ns = lat[n - 1];
+    free(lat);
+}
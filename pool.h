@@ -0,0 +1,129 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    pool.h
+*/
+
+
+#ifndef POOL_H
+#define POOL_H
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+
+#include "memory.h"
+#include "cpu.h"
+
+
+/*
+A pool runs large numbers of small, independent programs on a fixed set of 
+host worker threads. Each worker owns one system memory and core, allocated 
+up front from a single arena and reset for every job instead of being 
+allocated and freed per program.
+
+Jobs are spread over per-worker deques. A worker takes its own newest job 
+first and, when its deque is empty, steals the oldest job of another worker.
+*/
+
+
+// a program to run, filled in with its results once it has finished
+typedef struct pool_job {
+    const instr_table_t *itab;  // decode table the program is encoded with
+    const uint8_t *image;       // contents of the start of the read only block
+    uint16_t size;              // bytes in image (at most MEMORY_RWBLKMIN)
+    // results
+    errcode_t stc;              // status code the core stopped with
+    uint16_t irv;               // return value registers
+    float frv;
+    uint64_t submit_ns;         // when the job was submitted
+    uint64_t latency_ns;        // from submission to completion
+} pool_job_t;
+
+
+// double ended queue of jobs (owner end is the tail, thieves take the head)
+typedef struct pool_deque {
+    pthread_mutex_t lock;
+    pool_job_t **jobs;          // ring buffer
+    uint32_t cap;
+    uint32_t head;
+    uint32_t n;
+} pool_deque_t;
+
+
+// worker thread with its own memory and core
+typedef struct pool_worker {
+    struct pool *pool;
+    uint32_t id;
+    pthread_t thread;
+    pool_deque_t deque;
+    sysmem_t *smem;
+    core_t *core;
+    uint64_t n_jobs;            // jobs run by this worker
+    uint64_t n_steals;          // of which taken from another worker
+} pool_worker_t;
+
+
+// worker pool
+typedef struct pool {
+    uint32_t n_workers;
+    pool_worker_t *workers;
+    sysmem_t *smem_arena;       // one sysmem_t per worker
+    uint8_t *mem_arena;         // and its MEMORY_MAPSIZE bytes of memory
+    core_t *core_arena;         // one core_t per worker
+    atomic_uint next;           // deque the next job is submitted to
+    atomic_uint n_queued;       // jobs waiting in deques
+    atomic_ulong n_submitted;
+    atomic_ulong n_done;
+    atomic_int stop;
+    pthread_mutex_t lock;       // protects the sleeping and waiting below
+    pthread_cond_t work;        // signaled when a job is queued
+    pthread_cond_t done;        // signaled when all submitted jobs are done
+} pool_t;
+
+
+// latency and throughput of a set of completed jobs
+typedef struct pool_stats {
+    uint64_t n_jobs;
+    double secs;                // first submission to last completion
+    double jobs_per_sec;
+    uint64_t p50_ns;            // latency percentiles
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+    uint64_t n_steals;
+} pool_stats_t;
+
+
+// Starts a pool with a number of worker threads (NULL if the arena cannot be
+// allocated or a thread cannot be started).
+pool_t* pool_init(uint32_t);
+
+
+// Waits for the submitted jobs, stops the workers and frees the pool.
+void pool_delete(pool_t*);
+
+
+// Queues a job (from one thread at a time). The job must stay valid until 
+// pool_wait returns.
+void pool_submit(pool_t*, pool_job_t*);
+
+
+// Waits until every submitted job has finished.
+void pool_wait(pool_t*);
+
+
+// Computes statistics over a set of completed jobs (steals are counted since
+// the previous call).
+void pool_stats(pool_t*, const pool_job_t*, uint32_t, pool_stats_t*);
+
+
+#endif
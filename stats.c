@@ -0,0 +1,256 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    stats.c
+*/
+
+
+#include <string.h>
+
+
+#include "stats.h"
+#include "trace.h"
+
+
+// memory reads and writes of each opcode
+const uint8_t stats_mem_ops[N_OPCODES][2] = {
+    [RETN] = {10, 0},   [CALL] = {0, 10},   [LRET] = {1, 0},    [LCAL] = {0, 1},
+    [RETM] = {3, 0},    [CALM] = {0, 3},
+    [LODI] = {1, 0},    [LODF] = {1, 0},    [STOI] = {0, 1},    [STOF] = {0, 1},
+    [PSHI] = {0, 1},    [POPI] = {1, 0},    [PSHF] = {0, 1},    [POPF] = {1, 0},
+    [BCPY] = {1, 1},    [BFIL] = {0, 1},    [BCMP] = {2, 0},
+    [CASI] = {1, 1},    [FADI] = {1, 1},    [XCHI] = {1, 1},
+    [VADF] = {2, 1},    [VMLF] = {2, 1},    [VMNF] = {2, 1},    [VMXF] = {2, 1},
+    [VFMF] = {2, 1},    [VRDF] = {1, 0},    [VDTF] = {2, 0},
+    [VADI] = {2, 1},    [VMLI] = {2, 1},    [VMNI] = {2, 1},    [VMXI] = {2, 1},
+    [VRDI] = {1, 0}
+};
+
+
+// names of the status codes
+const char *const stats_errcode_names[N_ERRCODES] = {
+    [NO_ERR] = "none",                  [ERR_HALT] = "halt",
+    [ERR_REGUNREC] = "regunrec",        [ERR_REGNOTALWD] = "regnotalwd",
+    [ERR_RCMPNOTINIT] = "rcmpnotinit",  [ERR_STACKOVERFLOW] = "stackoverflow",
+    [ERR_STACKUNDERFLOW] = "stackunderflow", [ERR_MEMACCRWBLK] = "memaccrwblk",
+    [ERR_LEAIMULTNOT124] = "leaimultnot124", [ERR_EXECOUTOFROBLK] = "execoutofroblk",
+    [ERR_DECRZERO] = "decrzero",        [ERR_IREGOVERFLOW] = "iregoverflow",
+    [ERR_IREGUNDERFLOW] = "iregunderflow", [ERR_INSTRUNREC] = "instrunrec",
+    [ERR_MEMALIGN] = "memalign",        [ERR_DIVZERO] = "divzero"
+};
+
+
+// single writer counters: a relaxed load and store instead of a locked add
+#define STATS_ADD(ctr, n) \
+    atomic_store_explicit(&(ctr), atomic_load_explicit(&(ctr), memory_order_relaxed) + (n), \
+                          memory_order_relaxed)
+#define STATS_GET(ctr) atomic_load_explicit(&(ctr), memory_order_relaxed)
+
+
+// Allocates zeroed counters for a core and attaches them (counting starts with
+// the next core_run). Returns 0, or -1 if they could not be allocated.
+int stats_enable(core_t *core) {
+    if (!core->stats) {
+        core->stats = calloc(1, sizeof(core_stats_t));
+    }
+    return core->stats ? 0 : -1;
+}
+
+
+// Detaches the counters of a core and frees them.
+void stats_disable(core_t *core) {
+    free(core->stats);
+    core->stats = NULL;
+}
+
+
+// Sets every counter of a core back to 0.
+void stats_clear(core_t *core) {
+    core_stats_t *st = core->stats;
+    if (!st) {
+        return;
+    }
+    for (int op = 0; op < N_OPCODES; op++) {
+        atomic_store_explicit(&st->retired[op], 0, memory_order_relaxed);
+    }
+    for (int e = 0; e < N_ERRCODES; e++) {
+        atomic_store_explicit(&st->errors[e], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&st->loads, 0, memory_order_relaxed);
+    atomic_store_explicit(&st->stores, 0, memory_order_relaxed);
+    atomic_store_explicit(&st->stack_hwm, 0, memory_order_relaxed);
+}
+
+
+// Runs a core like core_run, counting everything it executes in core->stats.
+// Instructions come from the instruction cache if the core has one (without
+// superinstructions or native code), otherwise they are decoded from memory.
+void core_run_stats(core_t *core) {
+    core_stats_t *st = core->stats;
+    uint16_t hwm = STATS_GET(st->stack_hwm);
+    instr_t in;
+    while (core->stc == NO_ERR) {
+        uint16_t pc = core->iregs[RPC];
+        if (pc >= INSTR_ROMBITS) {
+            // ERROR -- execute code from outside of RO memory block
+            core->stc = ERR_EXECOUTOFROBLK;
+            core->fault_pc = pc;
+            break;
+        }
+        if (core->icache) {
+            in = core->icache->ops[icache_lookup(core->icache, pc)].in;
+        } else {
+            instr_fetch(core->itab, core->smem->mem, pc, &in);
+        }
+        // rpc already points at the next instruction while this one executes
+        core->iregs[RPC] = in.next;
+        execute_instr(core, &in);
+        if (core->trace) {
+            trace_put(core->trace, pc, core->stc);
+        }
+        if (core->stc != NO_ERR) {
+            core->fault_pc = pc;
+        }
+        if (core->stc == NO_ERR || core->stc == ERR_HALT) {
+            STATS_ADD(st->retired[in.opcode], 1);
+            if (stats_mem_ops[in.opcode][0]) {
+                STATS_ADD(st->loads, stats_mem_ops[in.opcode][0]);
+            }
+            if (stats_mem_ops[in.opcode][1]) {
+                STATS_ADD(st->stores, stats_mem_ops[in.opcode][1]);
+            }
+        }
+        uint16_t used = core->iregs[RSP] - core->stack_base;
+        if (used > hwm) {
+            hwm = used;
+            atomic_store_explicit(&st->stack_hwm, hwm, memory_order_relaxed);
+        }
+    }
+    STATS_ADD(st->errors[core->stc], 1);
+}
+
+
+// Copy of the counters of a core, read one at a time.
+typedef struct stats_view {
+    uint64_t retired[N_OPCODES];
+    uint64_t errors[N_ERRCODES];
+    uint64_t instructions;
+    uint64_t calls;     // call, lcal and calm
+    uint64_t returns;   // retn, lret and retm
+    uint64_t loads;
+    uint64_t stores;
+    uint16_t stack_hwm;
+} stats_view_t;
+
+
+void stats_read(const core_stats_t *st, stats_view_t *v) {
+    memset(v, 0, sizeof(stats_view_t));
+    for (int op = 0; op < N_OPCODES; op++) {
+        v->retired[op] = STATS_GET(st->retired[op]);
+        v->instructions += v->retired[op];
+    }
+    for (int e = 0; e < N_ERRCODES; e++) {
+        v->errors[e] = STATS_GET(st->errors[e]);
+    }
+    v->calls = v->retired[CALL] + v->retired[LCAL] + v->retired[CALM];
+    v->returns = v->retired[RETN] + v->retired[LRET] + v->retired[RETM];
+    v->loads = STATS_GET(st->loads);
+    v->stores = STATS_GET(st->stores);
+    v->stack_hwm = STATS_GET(st->stack_hwm);
+}
+
+
+// Writes the counters of a number of cores as a JSON object (see stats.h).
+int stats_write_json(FILE *f, core_t *const *cores, uint8_t n) {
+    stats_view_t v;
+    const char *sep = "";
+    fprintf(f, "{\"cores\": [");
+    for (uint8_t i = 0; i < n; i++) {
+        if (!cores[i]->stats) {
+            continue;
+        }
+        stats_read(cores[i]->stats, &v);
+        fprintf(f, "%s\n  {\"cid\": %u, \"instructions\": %llu, \"calls\": %llu, \"returns\": %llu, "
+                "\"loads\": %llu, \"stores\": %llu, \"stack_hwm\": %u,\n   \"retired\": {",
+                sep, cores[i]->cid, (unsigned long long) v.instructions,
+                (unsigned long long) v.calls, (unsigned long long) v.returns,
+                (unsigned long long) v.loads, (unsigned long long) v.stores, v.stack_hwm);
+        const char *s = "";
+        for (int op = NOOP; op < N_OPCODES; op++) {
+            if (v.retired[op]) {
+                fprintf(f, "%s\"%s\": %llu", s, instr_names[op], (unsigned long long) v.retired[op]);
+                s = ", ";
+            }
+        }
+        fprintf(f, "},\n   \"errors\": {");
+        s = "";
+        for (int e = ERR_HALT; e < N_ERRCODES; e++) {
+            if (v.errors[e]) {
+                fprintf(f, "%s\"%s\": %llu", s, stats_errcode_names[e], (unsigned long long) v.errors[e]);
+                s = ", ";
+            }
+        }
+        fprintf(f, "}}");
+        sep = ",";
+    }
+    fprintf(f, "\n]}\n");
+    return ferror(f) ? -1 : 0;
+}
+
+
+// Writes the counters of a number of cores in the Prometheus text format.
+int stats_write_prometheus(FILE *f, core_t *const *cores, uint8_t n) {
+    static const struct {
+        const char *name;
+        const char *type;
+        const char *help;
+    } metrics[] = {
+        { "c16_instructions_retired_total", "counter", "Instructions retired by opcode." },
+        { "c16_calls_total", "counter", "Subroutine calls." },
+        { "c16_returns_total", "counter", "Subroutine returns." },
+        { "c16_memory_loads_total", "counter", "Memory reads by instructions." },
+        { "c16_memory_stores_total", "counter", "Memory writes by instructions." },
+        { "c16_stack_high_water_bytes", "gauge", "Most stack space used." },
+        { "c16_status_total", "counter", "Status codes raised." },
+    };
+    stats_view_t v;
+    for (size_t m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++) {
+        fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", metrics[m].name, metrics[m].help, 
+                metrics[m].name, metrics[m].type);
+        for (uint8_t i = 0; i < n; i++) {
+            if (!cores[i]->stats) {
+                continue;
+            }
+            stats_read(cores[i]->stats, &v);
+            unsigned cid = cores[i]->cid;
+            switch (m) {
+                case 0:
+                    for (int op = NOOP; op < N_OPCODES; op++) {
+                        if (v.retired[op]) {
+                            fprintf(f, "%s{core=\"%u\",opcode=\"%s\"} %llu\n", metrics[m].name, cid,
+                                    instr_names[op], (unsigned long long) v.retired[op]);
+                        }
+                    }
+                    break;
+                case 1: fprintf(f, "%s{core=\"%u\"} %llu\n", metrics[m].name, cid, (unsigned long long) v.calls); break;
+                case 2: fprintf(f, "%s{core=\"%u\"} %llu\n", metrics[m].name, cid, (unsigned long long) v.returns); break;
+                case 3: fprintf(f, "%s{core=\"%u\"} %llu\n", metrics[m].name, cid, (unsigned long long) v.loads); break;
+                case 4: fprintf(f, "%s{core=\"%u\"} %llu\n", metrics[m].name, cid, (unsigned long long) v.stores); break;
+                case 5: fprintf(f, "%s{core=\"%u\"} %u\n", metrics[m].name, cid, v.stack_hwm); break;
+                default:
+                    for (int e = ERR_HALT; e < N_ERRCODES; e++) {
+                        if (v.errors[e]) {
+                            fprintf(f, "%s{core=\"%u\",status=\"%s\"} %llu\n", metrics[m].name, cid,
+                                    stats_errcode_names[e], (unsigned long long) v.errors[e]);
+                        }
+                    }
+                    break;
+            }
+        }
+    }
+    return ferror(f) ? -1 : 0;
+}
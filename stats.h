@@ -0,0 +1,94 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    stats.h
+*/
+
+
+#ifndef STATS_H
+#define STATS_H
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+
+#include "cpu.h"
+
+
+/*
+Execution counters for a core. A core counts while core->stats is set: 
+core_run then goes through a separate counting run loop, so the normal run 
+loops do not change at all and a core without counters pays one check per 
+core_run call. Building with -DCORE_STATS=0 leaves the counting loop out 
+entirely.
+
+The counters are only written by the thread running the core (relaxed atomic
+stores), so they can be read and exported from another thread while the 
+machine is running. A snapshot is consistent per counter, not across 
+counters.
+*/
+#ifndef CORE_STATS
+#define CORE_STATS 1
+#endif
+
+
+// per-core execution counters
+typedef struct core_stats {
+    _Atomic uint64_t retired[N_OPCODES];    // instructions retired per opcode
+    _Atomic uint64_t loads;                 // memory reads by instructions
+    _Atomic uint64_t stores;                // memory writes by instructions
+    _Atomic uint64_t errors[N_ERRCODES];    // status codes raised (incl. halt)
+    _Atomic uint16_t stack_hwm;             // most stack space used (bytes)
+} core_stats_t;
+
+
+// Memory accesses of each opcode (reads, writes): a block or vector counts 
+// once per array it touches, call and retn once per register saved/restored
+// (calm and retm only count rpc, rbp and the mask).
+extern const uint8_t stats_mem_ops[N_OPCODES][2];
+
+
+// names of the status codes
+extern const char *const stats_errcode_names[N_ERRCODES];
+
+
+// Allocates zeroed counters for a core and attaches them (counting starts with
+// the next core_run). Returns 0, or -1 if they could not be allocated.
+int stats_enable(core_t*);
+
+
+// Detaches the counters of a core and frees them.
+void stats_disable(core_t*);
+
+
+// Sets every counter of a core back to 0.
+void stats_clear(core_t*);
+
+
+// Runs a core like core_run, counting everything it executes in core->stats.
+void core_run_stats(core_t*);
+
+
+// Writes the counters of a number of cores (cores without counters are 
+// skipped) as a JSON object:
+//  {"cores": [{"cid": 0, "retired": {"seti": 12, ...}, "instructions": ...,
+//    "calls": ..., "returns": ..., "loads": ..., "stores": ..., 
+//    "stack_hwm": ..., "errors": {"halt": 1, ...}}, ...]}
+// Opcodes and status codes that were never counted are left out. Returns 0, or
+// -1 if writing failed.
+int stats_write_json(FILE*, core_t *const*, uint8_t);
+
+
+// Writes the same counters in the Prometheus text exposition format, labelled
+// by core ID (c16_instructions_retired_total{core="0",opcode="seti"} 12 ...).
+int stats_write_prometheus(FILE*, core_t *const*, uint8_t);
+
+
+#endif
@@ -27,32 +27,32 @@ int main() {
     instr_node_t *instr_tree =  instr_build_tree();
     
     /*
-    core0->seti(core0, IR0, 0x0001);
-    core0->seti(core0, IR1, 0x0010);
-    core0->seti(core0, IR2, 0x0100);
-    core0->seti(core0, IR3, 0x1000);
-    core0->setf(core0, FR0, 0.1);
-    core0->setf(core0, FR1, 0.01);
-    core0->setf(core0, FR2, 0.001);
-    core0->setf(core0, FR3, 0.0001);
+    core0->ops->seti(core0, IR0, 0x0001);
+    core0->ops->seti(core0, IR1, 0x0010);
+    core0->ops->seti(core0, IR2, 0x0100);
+    core0->ops->seti(core0, IR3, 0x1000);
+    core0->ops->setf(core0, FR0, 0.1);
+    core0->ops->setf(core0, FR1, 0.01);
+    core0->ops->setf(core0, FR2, 0.001);
+    core0->ops->setf(core0, FR3, 0.0001);
     
     
-    core0->leai(core0, IR0, IR1, 4, IRV);
+    core0->ops->leai(core0, IR0, IR1, 4, IRV);
 
     printf("--------------------------------------------------------\n");
     print_cpuregs(core0);
     print_memrange(smem, 0xF05F, 0xF0AF);
     printf("\n");
 
-    core0->call(core0, 0x1111);
-    core0->seti(core0, IR0, 0x0001);
-    core0->seti(core0, IR1, 0x0002);
-    core0->seti(core0, IR2, 0x0003);
-    core0->seti(core0, IR3, 0x0004);
-    core0->addi(core0, IR0, IR1);
-    core0->addi(core0, IR2, IR3);
-    core0->subi(core0, IR1, IR3);
-    core0->movi(core0, IR3, IRV);
+    core0->ops->call(core0, 0x1111);
+    core0->ops->seti(core0, IR0, 0x0001);
+    core0->ops->seti(core0, IR1, 0x0002);
+    core0->ops->seti(core0, IR2, 0x0003);
+    core0->ops->seti(core0, IR3, 0x0004);
+    core0->ops->addi(core0, IR0, IR1);
+    core0->ops->addi(core0, IR2, IR3);
+    core0->ops->subi(core0, IR1, IR3);
+    core0->ops->movi(core0, IR3, IRV);
     
 
     
@@ -61,7 +61,7 @@ int main() {
     print_memrange(smem, 0xF05F, 0xF0AF);
     printf("\n");
     
-    core0->retn(core0);
+    core0->ops->retn(core0);
     
     printf("--------------------------------------------------------\n");
     print_cpuregs(core0);
@@ -70,6 +70,7 @@ int main() {
     */
     
     /* FINISH */
+    instr_delete_tree(instr_tree);
     core_delete(core0);
     sysmem_delete(smem);
 
@@ -97,14 +98,14 @@ void print_memrange(sysmem_t *smem, uint16_t start, uint16_t end) {
 
 void print_cpuregs(core_t *core) {
     printf("! STC: %d !\n", core->stc);
-    printf("RPC: 0x%04X\n", core->rpc);
-    printf("RSP: 0x%04X\n", core->rsp);
-    printf("RBP: 0x%04X\n", core->rbp);
+    printf("RPC: 0x%04X\n", core->iregs[RPC]);
+    printf("RSP: 0x%04X\n", core->iregs[RSP]);
+    printf("RBP: 0x%04X\n", core->iregs[RBP]);
     printf("     IR0     IR1     IR2     IR3     IRV\n");
-    printf("   %5d   %5d   %5d   %5d   %5d\n", core->ir0, core->ir1, core->ir2, core->ir3, core->irv);
-    printf("  0x%04X  0x%04X  0x%04X  0x%04X  0x%04X\n", core->ir0, core->ir1, core->ir2, core->ir3, core->irv);
+    printf("   %5d   %5d   %5d   %5d   %5d\n", core->iregs[IR0], core->iregs[IR1], core->iregs[IR2], core->iregs[IR3], core->iregs[IRV]);
+    printf("  0x%04X  0x%04X  0x%04X  0x%04X  0x%04X\n", core->iregs[IR0], core->iregs[IR1], core->iregs[IR2], core->iregs[IR3], core->iregs[IRV]);
     printf("     FR0      FR1      FR2      FR3      FRV\n");
-    printf("  %7.4f  %7.4f  %7.4f  %7.4f  %7.4f\n", core->fr0, core->fr1, core->fr2, core->fr3, core->frv);
+    printf("  %7.4f  %7.4f  %7.4f  %7.4f  %7.4f\n", core->fregs[FR0], core->fregs[FR1], core->fregs[FR2], core->fregs[FR3], core->fregs[FRV]);
 }
 
 void print_instr_tree(instr_node_t *root) {
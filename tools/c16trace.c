@@ -0,0 +1,94 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    tools/c16trace.c -- decodes trace dumps (see trace.h)
+        c16trace dump...          one line per instruction
+        c16trace -json dump...    Chrome trace event JSON (chrome://tracing, 
+                                  Perfetto), one thread per core and one 
+                                  microsecond per instruction
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+
+
+#include "trace.h"
+#include "stats.h"
+
+
+// Writes the records of a dump as text.
+void print_text(const trace_rec_t *recs, uint32_t n, uint8_t cid, uint64_t first) {
+    char buf[64];
+    printf("# core %u, %u records\n", cid, n);
+    for (uint32_t i = 0; i < n; i++) {
+        trace_format(&recs[i], buf, sizeof(buf));
+        printf("%10llu  %04X  %-28s", (unsigned long long) (first + i), recs[i].pc, buf);
+        if (recs[i].stc != NO_ERR && recs[i].stc < N_ERRCODES) {
+            printf("  ; %s", stats_errcode_names[recs[i].stc]);
+        }
+        printf("\n");
+    }
+}
+
+
+// Writes the records of a dump as Chrome trace events.
+void print_json(const trace_rec_t *recs, uint32_t n, uint8_t cid, uint64_t first, const char **sep) {
+    char buf[64];
+    for (uint32_t i = 0; i < n; i++) {
+        uint8_t stc = recs[i].stc < N_ERRCODES ? recs[i].stc : NO_ERR;
+        trace_format(&recs[i], buf, sizeof(buf));
+        printf("%s\n{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %llu, \"dur\": 1, \"pid\": 0, \"tid\": %u, "
+               "\"args\": {\"pc\": %u, \"asm\": \"%s\", \"stc\": \"%s\"}}", 
+               *sep, instr_names[recs[i].opcode], (unsigned long long) (first + i), cid, 
+               recs[i].pc, buf, stats_errcode_names[stc]);
+        *sep = ",";
+        if (stc != NO_ERR) {
+            printf(",\n{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %llu, \"pid\": 0, \"tid\": %u}",
+                   stats_errcode_names[stc], (unsigned long long) (first + i + 1), cid);
+        }
+    }
+}
+
+
+int main(int argc, char **argv) {
+    int json = argc > 1 && !strcmp(argv[1], "-json");
+    if (argc < 2 + json) {
+        fprintf(stderr, "usage: %s [-json] dump...\n", argv[0]);
+        return 2;
+    }
+    const char *sep = "";
+    if (json) {
+        printf("{\"traceEvents\": [");
+    }
+    int status = 0;
+    for (int a = 1 + json; a < argc; a++) {
+        FILE *f = fopen(argv[a], "rb");
+        uint8_t cid;
+        uint64_t first;
+        uint32_t n;
+        trace_rec_t *recs = f ? trace_load(f, &cid, &first, &n) : NULL;
+        if (f) {
+            fclose(f);
+        }
+        if (!recs) {
+            fprintf(stderr, "%s: not a trace dump\n", argv[a]);
+            status = 1;
+            continue;
+        }
+        if (json) {
+            print_json(recs, n, cid, first, &sep);
+        } else {
+            print_text(recs, n, cid, first);
+        }
+        free(recs);
+    }
+    if (json) {
+        printf("\n]}\n");
+    }
+    return status;
+}
@@ -0,0 +1,195 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    trace.c
+*/
+
+
+#include "trace.h"
+
+
+// Allocates a trace ring that keeps at least a number of records.
+trace_t* trace_init(uint32_t n) {
+    n = n ? n : 1;
+    n = n < (1u << 31) - TRACE_BATCH ? n : (1u << 31) - TRACE_BATCH;
+    uint32_t cap = 1;
+    while (cap < n + TRACE_BATCH) {
+        cap <<= 1;
+    }
+    trace_t *tr = calloc(1, sizeof(trace_t));
+    if (!tr) {
+        return NULL;
+    }
+    tr->ring = calloc(cap, sizeof(trace_slot_t));
+    if (!tr->ring) {
+        free(tr);
+        return NULL;
+    }
+    tr->mask = cap - 1;
+    tr->keep = n;
+    atomic_init(&tr->head, 0);
+    return tr;
+}
+
+
+// Frees a trace ring.
+void trace_delete(trace_t *tr) {
+    if (tr) {
+        free(tr->ring);
+        free(tr);
+    }
+}
+
+
+// Copies up to max of the most recent records, oldest first. Records the 
+// writer may have overwritten while they were being copied are dropped.
+uint32_t trace_snapshot(const trace_t *tr, trace_rec_t *out, uint32_t max, uint64_t *first) {
+    uint64_t cap = (uint64_t) tr->mask + 1;
+    uint64_t end = atomic_load_explicit(&tr->head, memory_order_acquire);
+    uint64_t n = end < tr->keep ? end : tr->keep;
+    n = n < max ? n : max;
+    uint64_t start = end - n;
+    for (uint64_t i = start; i < end; i++) {
+        trace_slot_t slot = tr->ring[i & tr->mask];
+        out[i - start].pc = (uint16_t) slot;
+        out[i - start].stc = (uint8_t) (slot >> 16);
+    }
+    // the writer can be filling record head + TRACE_BATCH - 1, which 
+    // overwrites the slot of record head + TRACE_BATCH - 1 - capacity, so 
+    // anything up to that may be torn
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t now = atomic_load_explicit(&tr->head, memory_order_relaxed);
+    if (now + TRACE_BATCH >= start + cap + 1) {
+        uint64_t lost = now + TRACE_BATCH - cap - start;
+        lost = lost < n ? lost : n;
+        memmove(out, out + lost, (n - lost) * sizeof(trace_rec_t));
+        start += lost;
+        n -= lost;
+    }
+    // the instructions themselves, from the read only block
+    for (uint64_t i = 0; i < n; i++) {
+        instr_t in = {0};
+        if (tr->itab) {
+            instr_fetch(tr->itab, tr->mem, out[i].pc, &in);
+        }
+        out[i].opcode = (uint8_t) in.opcode;
+        memcpy(out[i].reg, in.reg, sizeof(out[i].reg));
+        memcpy(&out[i].imm, &in.imm, sizeof(out[i].imm));
+    }
+    *first = start;
+    return (uint32_t) n;
+}
+
+
+// little-endian field access
+void trace_put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+}
+
+void trace_put32(uint8_t *p, uint32_t v) {
+    trace_put16(p, (uint16_t) v);
+    trace_put16(p + 2, (uint16_t) (v >> 16));
+}
+
+uint16_t trace_get16(const uint8_t *p) {
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+uint32_t trace_get32(const uint8_t *p) {
+    return (uint32_t) trace_get16(p) | ((uint32_t) trace_get16(p + 2) << 16);
+}
+
+
+// Writes the records in the ring to a dump file for a core.
+int trace_dump(const trace_t *tr, uint8_t cid, FILE *f) {
+    uint32_t cap = tr->mask + 1;
+    trace_rec_t *recs = malloc(sizeof(trace_rec_t) * cap);
+    if (!recs) {
+        return -1;
+    }
+    uint64_t first;
+    uint32_t n = trace_snapshot(tr, recs, cap, &first);
+    uint8_t buf[TRACE_HEADERSIZE];
+    memcpy(buf, TRACE_MAGIC, 4);
+    trace_put16(buf + 0x04, TRACE_VERSION);
+    buf[0x06] = cid;
+    buf[0x07] = TRACE_RECSIZE;
+    trace_put32(buf + 0x08, (uint32_t) first);
+    trace_put32(buf + 0x0C, n);
+    int ok = fwrite(buf, TRACE_HEADERSIZE, 1, f) == 1;
+    for (uint32_t i = 0; ok && i < n; i++) {
+        uint8_t r[TRACE_RECSIZE];
+        trace_put16(r, recs[i].pc);
+        r[2] = recs[i].opcode;
+        r[3] = recs[i].stc;
+        memcpy(r + 4, recs[i].reg, 4);
+        trace_put32(r + 8, recs[i].imm);
+        ok = fwrite(r, TRACE_RECSIZE, 1, f) == 1;
+    }
+    free(recs);
+    return ok && fflush(f) == 0 ? 0 : -1;
+}
+
+
+// Reads a dump file, returns its records or NULL if it is not a trace dump.
+trace_rec_t* trace_load(FILE *f, uint8_t *cid, uint64_t *first, uint32_t *n) {
+    uint8_t buf[TRACE_HEADERSIZE];
+    if (fread(buf, TRACE_HEADERSIZE, 1, f) != 1 || memcmp(buf, TRACE_MAGIC, 4)
+        || trace_get16(buf + 0x04) != TRACE_VERSION || buf[0x07] != TRACE_RECSIZE) {
+        return NULL;
+    }
+    *cid = buf[0x06];
+    *first = trace_get32(buf + 0x08);
+    *n = trace_get32(buf + 0x0C);
+    trace_rec_t *recs = malloc(sizeof(trace_rec_t) * (*n ? *n : 1));
+    if (!recs) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < *n; i++) {
+        uint8_t r[TRACE_RECSIZE];
+        if (fread(r, TRACE_RECSIZE, 1, f) != 1 || r[2] >= N_OPCODES) {
+            free(recs);
+            return NULL;
+        }
+        recs[i].pc = trace_get16(r);
+        recs[i].opcode = r[2];
+        recs[i].stc = r[3];
+        memcpy(recs[i].reg, r + 4, 4);
+        recs[i].imm = trace_get32(r + 8);
+    }
+    return recs;
+}
+
+
+// Writes a record as assembly text, operands in encoding order.
+int trace_format(const trace_rec_t *rec, char *buf, size_t size) {
+    static const char *const iregs[] = { "rpc", "rsp", "rbp", "ir0", "ir1", "ir2", "ir3", "irv" };
+    static const char *const fregs[] = { "fr0", "fr1", "fr2", "fr3", "frv", "f5?", "f6?", "f7?" };
+    int len = snprintf(buf, size, "%s", instr_names[rec->opcode]);
+    uint8_t n = 0;
+    for (const uint8_t *k = instr_operands[rec->opcode]; *k != OPND_NONE && len >= 0 && (size_t) len < size; k++) {
+        const char *sep = k == instr_operands[rec->opcode] ? " " : ", ";
+        char *p = buf + len;
+        size_t left = size - len;
+        int w;
+        float f;
+        switch (*k) {
+            case OPND_IREG: w = snprintf(p, left, "%s%s", sep, iregs[rec->reg[n++] & 7]); break;
+            case OPND_FREG: w = snprintf(p, left, "%s%s", sep, fregs[rec->reg[n++] & 7]); break;
+            case OPND_MULT: w = snprintf(p, left, "%s%u", sep, rec->reg[n++]); break;
+            case OPND_MASK: w = snprintf(p, left, "%s0x%02X", sep, rec->reg[n++]); break;
+            case OPND_IMM: w = snprintf(p, left, "%s0x%04X", sep, (unsigned) (rec->imm & 0xFFFF)); break;
+            default:
+                memcpy(&f, &rec->imm, sizeof(f));
+                w = snprintf(p, left, "%s%g", sep, f);
+                break;
+        }
+        len = w < 0 ? w : len + w;
+    }
+    return len;
+}
@@ -0,0 +1,176 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    trace.h
+*/
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+
+#include "instruction.h"
+
+
+/*
+Execution trace: while core->trace is set, core_run records every instruction
+it executes (bit address, opcode, operands and the status code after it) in a
+ring buffer that keeps the most recent ones. Blocks of native code are not 
+entered while a core is being traced, so every instruction is recorded.
+
+The read only block does not change while a program runs, so the ring only 
+holds the bit address and status code of each instruction (4 bytes) and the
+instruction is decoded again from the block when the records are copied out.
+A trace has to be read before a different program is loaded into the memory 
+it was recorded from.
+
+The ring has a single writer (the thread running the core) and no locks: the
+writer fills in records and publishes them by advancing head, once every 
+TRACE_BATCH records and at the end of each run, so recording an instruction
+does not store to the shared head. A reader copies the records and checks 
+head again afterwards, dropping the ones the writer may have overwritten 
+meanwhile (it can be up to TRACE_BATCH records past head), so a trace can be
+dumped while the core is running. The ring has room for TRACE_BATCH records
+more than it keeps so that a stopped writer leaves all of them intact.
+
+Dump file (all fields little-endian):
+    0x00  magic "C16T"
+    0x04  u16 version
+    0x06  u8  core ID
+    0x07  u8  record size (TRACE_RECSIZE)
+    0x08  u32 index of the first record (low 32 bits)
+    0x0C  u32 number of records
+    0x10  records, oldest first:
+            u16 bit address, u8 opcode, u8 status code, u8 reg[4], 
+            u32 immediate (raw bits)
+*/
+#define TRACE_MAGIC         "C16T"
+#define TRACE_VERSION       1
+#define TRACE_HEADERSIZE    0x10
+#define TRACE_RECSIZE       12
+#define TRACE_BATCH         64  // records written per publish (power of 2)
+
+
+// trace record
+typedef struct trace_rec {
+    uint16_t pc;
+    uint8_t opcode;
+    uint8_t stc;
+    uint8_t reg[4];
+    uint32_t imm;
+} trace_rec_t;
+
+
+// what the ring holds for each instruction: bit address | status code << 16
+typedef uint32_t trace_slot_t;
+
+
+// ring buffer of trace records for a core
+typedef struct trace {
+    trace_slot_t *ring;
+    uint32_t mask;              // capacity - 1 (capacity is a power of 2)
+    uint32_t keep;              // records kept (at most capacity - TRACE_BATCH)
+    uint64_t next;              // records written so far (writer only)
+    _Atomic uint64_t head;      // records published so far
+    const uint8_t *mem;         // memory and decode table of the program 
+    const instr_table_t *itab;  // (set by core_run when a run starts)
+    FILE *dump;                 // the ring is dumped here if the core stops 
+                                // with an error (optional)
+} trace_t;
+
+
+// Allocates a trace ring that keeps at least a number of records.
+trace_t* trace_init(uint32_t);
+
+
+// Frees a trace ring.
+void trace_delete(trace_t*);
+
+
+// Publishes the records written so far (called by the thread running the 
+// core, core_run does at the end of every run).
+static inline void trace_flush(trace_t *tr) {
+    atomic_store_explicit(&tr->head, tr->next, memory_order_release);
+}
+
+
+// Writer side of a ring held in locals by a run loop, so that the count of 
+// records is not stored and loaded again for every instruction (that chain 
+// through memory costs more than writing the record).
+typedef struct trace_writer {
+    trace_slot_t *ring;
+    uint32_t mask;
+    uint64_t next;
+} trace_writer_t;
+
+static inline void trace_begin(const trace_t *tr, trace_writer_t *w) {
+    w->ring = tr->ring;
+    w->mask = tr->mask;
+    w->next = tr->next;
+}
+
+// sets the status code of the last record written
+static inline void trace_stop(trace_writer_t *w, uint8_t stc) {
+    w->ring[(w->next - 1) & w->mask] |= (trace_slot_t) stc << 16;
+}
+
+// hands the count back to the ring at the end of a run (core_run publishes)
+static inline void trace_end(trace_t *tr, const trace_writer_t *w) {
+    tr->next = w->next;
+}
+
+
+// Appends a record for the instruction at a bit address through a writer. A 
+// run stops at the first instruction that sets the status code, so the 
+// others all have NO_ERR and the status code of the last one is filled in 
+// with trace_stop.
+static inline void trace_write(trace_t *tr, trace_writer_t *w, uint16_t pc, uint8_t stc) {
+    w->ring[w->next & w->mask] = pc | (trace_slot_t) stc << 16;
+    if ((++w->next & (TRACE_BATCH - 1)) == 0) {
+        atomic_store_explicit(&tr->head, w->next, memory_order_release);
+    }
+}
+
+
+// Appends a record for the instruction at a bit address (called by the thread
+// running the core).
+static inline void trace_put(trace_t *tr, uint16_t pc, uint8_t stc) {
+    trace_writer_t w;
+    trace_begin(tr, &w);
+    trace_write(tr, &w, pc, stc);
+    trace_end(tr, &w);
+}
+
+
+// Copies up to a number of the most recent records, oldest first, and the 
+// index of the first one copied. Returns the number of records copied.
+uint32_t trace_snapshot(const trace_t*, trace_rec_t*, uint32_t, uint64_t*);
+
+
+// Writes the records in the ring to a dump file for a core. Returns 0, or -1
+// if writing failed.
+int trace_dump(const trace_t*, uint8_t, FILE*);
+
+
+// Reads a dump file: the core ID, the index of the first record and the number
+// of records. Returns the records (to be freed) or NULL if the file is not a 
+// trace dump.
+trace_rec_t* trace_load(FILE*, uint8_t*, uint64_t*, uint32_t*);
+
+
+// Writes a record as assembly text (e.g. "addi ir0, ir1"), returns the length.
+int trace_format(const trace_rec_t*, char*, size_t);
+
+
+#endif
@@ -0,0 +1,179 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    vector.c
+*/
+
+
+#include <string.h>
+
+
+#include "vector.h"
+
+
+#if defined(__GNUC__)
+// one block of lanes in host registers (GCC vector extensions)
+typedef float vf_t __attribute__((vector_size(VEC_LANES * sizeof(float))));
+typedef int32_t vfmask_t __attribute__((vector_size(VEC_LANES * sizeof(float))));
+typedef uint16_t vu_t __attribute__((vector_size(VEC_LANES * sizeof(uint16_t))));
+#define VEC_SIMD 1
+#else
+#define VEC_SIMD 0
+#endif
+
+// kernels built for AVX2 and the baseline, chosen at load time
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__) && !defined(__clang__)
+#define VEC_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define VEC_CLONES
+#endif
+
+
+// Scalar element access (any alignment).
+static inline float get_f32(const uint8_t *p, uint32_t i) {
+    float v;
+    memcpy(&v, p + i * sizeof(float), sizeof(float));
+    return v;
+}
+
+static inline void put_f32(uint8_t *p, uint32_t i, float v) {
+    memcpy(p + i * sizeof(float), &v, sizeof(float));
+}
+
+static inline uint16_t get_u16(const uint8_t *p, uint32_t i) {
+    uint16_t v;
+    memcpy(&v, p + i * sizeof(uint16_t), sizeof(uint16_t));
+    return v;
+}
+
+static inline void put_u16(uint8_t *p, uint32_t i, uint16_t v) {
+    memcpy(p + i * sizeof(uint16_t), &v, sizeof(uint16_t));
+}
+
+
+/* Elementwise kernels: NAME, element type (f32/u16), block statement on the 
+   vectors a (src) and b (dst), scalar statement on the elements a and b. */
+#if VEC_SIMD
+#define VEC_BLOCKS(T, VT, STMT) \
+    for (; i + VEC_LANES <= n; i += VEC_LANES) { \
+        VT a, b; \
+        memcpy(&a, src + i * sizeof(T), sizeof(VT)); \
+        memcpy(&b, dst + i * sizeof(T), sizeof(VT)); \
+        STMT; \
+        memcpy(dst + i * sizeof(T), &b, sizeof(VT)); \
+    }
+#else
+#define VEC_BLOCKS(T, VT, STMT)
+#endif
+
+#define VEC_ELEMENTWISE(NAME, SFX, T, VT, VSTMT, SSTMT) \
+    VEC_CLONES void NAME(uint8_t *dst, const uint8_t *src, uint16_t n) { \
+        uint32_t i = 0; \
+        VEC_BLOCKS(T, VT, VSTMT) \
+        for (; i < n; i++) { \
+            T a = get_##SFX(src, i), b = get_##SFX(dst, i); \
+            SSTMT; \
+            put_##SFX(dst, i, b); \
+        } \
+    }
+
+// lane masks select a where the mask is set and b elsewhere
+#define VEC_SELECT_F(m, a, b) \
+    ((vf_t) (((vfmask_t) (a) & (m)) | ((vfmask_t) (b) & ~(m))))
+#define VEC_SELECT_U(m, a, b) (((a) & (m)) | ((b) & ~(m)))
+
+VEC_ELEMENTWISE(vec_add_f32, f32, float, vf_t, b = b + a, b = b + a)
+VEC_ELEMENTWISE(vec_mul_f32, f32, float, vf_t, b = b * a, b = b * a)
+VEC_ELEMENTWISE(vec_min_f32, f32, float, vf_t, b = VEC_SELECT_F(a < b, a, b), b = a < b ? a : b)
+VEC_ELEMENTWISE(vec_max_f32, f32, float, vf_t, b = VEC_SELECT_F(a > b, a, b), b = a > b ? a : b)
+VEC_ELEMENTWISE(vec_add_u16, u16, uint16_t, vu_t, b = b + a, b = (uint16_t) (b + a))
+VEC_ELEMENTWISE(vec_mul_u16, u16, uint16_t, vu_t, b = b * a, b = (uint16_t) (b * a))
+VEC_ELEMENTWISE(vec_min_u16, u16, uint16_t, vu_t, b = VEC_SELECT_U((vu_t) (a < b), a, b), b = a < b ? a : b)
+VEC_ELEMENTWISE(vec_max_u16, u16, uint16_t, vu_t, b = VEC_SELECT_U((vu_t) (a > b), a, b), b = a > b ? a : b)
+
+
+// dst[i] = dst[i] + scale * src[i]
+VEC_CLONES void vec_madd_f32(uint8_t *dst, const uint8_t *src, uint16_t n, float scale) {
+    uint32_t i = 0;
+#if VEC_SIMD
+    vf_t s = { 0 };
+    s += scale;
+    VEC_BLOCKS(float, vf_t, b = b + s * a)
+#endif
+    for (; i < n; i++) {
+        put_f32(dst, i, get_f32(dst, i) + scale * get_f32(src, i));
+    }
+}
+
+
+// Add up the partial sums of the lanes pairwise.
+float sum_lanes(const float *acc) {
+    return ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+}
+
+
+// sum of a[i] * b[i] (b == NULL: sum of a[i])
+VEC_CLONES float vec_dot_sum_f32(const uint8_t *pa, const uint8_t *pb, uint16_t n) {
+    float acc[VEC_LANES] = { 0 };
+    uint32_t i = 0;
+#if VEC_SIMD
+    vf_t vacc = { 0 };
+    for (; i + VEC_LANES <= n; i += VEC_LANES) {
+        vf_t a, b;
+        memcpy(&a, pa + i * sizeof(float), sizeof(vf_t));
+        if (pb) {
+            memcpy(&b, pb + i * sizeof(float), sizeof(vf_t));
+            a = a * b;
+        }
+        vacc += a;
+    }
+    memcpy(acc, &vacc, sizeof(acc));
+#else
+    for (; i + VEC_LANES <= n; i += VEC_LANES) {
+        for (uint32_t l = 0; l < VEC_LANES; l++) {
+            acc[l] += pb ? get_f32(pa, i + l) * get_f32(pb, i + l) : get_f32(pa, i + l);
+        }
+    }
+#endif
+    float s = sum_lanes(acc);
+    for (; i < n; i++) {
+        s += pb ? get_f32(pa, i) * get_f32(pb, i) : get_f32(pa, i);
+    }
+    return s;
+}
+
+
+float vec_sum_f32(const uint8_t *a, uint16_t n) {
+    return vec_dot_sum_f32(a, NULL, n);
+}
+
+
+float vec_dot_f32(const uint8_t *a, const uint8_t *b, uint16_t n) {
+    return vec_dot_sum_f32(a, b, n);
+}
+
+
+// sum of a[i] (wrapping, so the order does not matter)
+VEC_CLONES uint16_t vec_sum_u16(const uint8_t *pa, uint16_t n) {
+    uint16_t s = 0;
+    uint32_t i = 0;
+#if VEC_SIMD
+    vu_t vacc = { 0 };
+    for (; i + VEC_LANES <= n; i += VEC_LANES) {
+        vu_t a;
+        memcpy(&a, pa + i * sizeof(uint16_t), sizeof(vu_t));
+        vacc += a;
+    }
+    for (uint32_t l = 0; l < VEC_LANES; l++) {
+        s += vacc[l];
+    }
+#endif
+    for (; i < n; i++) {
+        s += get_u16(pa, i);
+    }
+    return s;
+}
@@ -0,0 +1,59 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    vector.h
+*/
+
+
+#ifndef VECTOR_H
+#define VECTOR_H
+
+
+#include <stdlib.h>
+#include <stdint.h>
+
+
+/*
+Kernels for the packed vector instructions: arrays of n floats or uint16 values
+at any alignment in system memory (the caller checks the bounds). Elements are
+processed in blocks of VEC_LANES, each block read in full before it is 
+written, so ranges may be identical or disjoint (partial overlap gives 
+unspecified results). Integer arithmetic wraps around.
+
+Sums are kept in VEC_LANES partial sums (element i goes to lane i % VEC_LANES
+for the whole blocks), added up pairwise, and then the remaining elements are
+added in order. Multiply-add rounds after the multiply and after the add. 
+Results are therefore the same on every host.
+
+With GCC on x86-64 every kernel is compiled for AVX2 as well as the SSE2 
+baseline and the best one is picked when the program is loaded.
+*/
+#define VEC_LANES 8
+
+
+// dst[i] = dst[i] + src[i], dst[i] * src[i], dst[i] + scale * src[i]
+void vec_add_f32(uint8_t*, const uint8_t*, uint16_t);
+void vec_mul_f32(uint8_t*, const uint8_t*, uint16_t);
+void vec_madd_f32(uint8_t*, const uint8_t*, uint16_t, float);
+
+// dst[i] = src[i] < dst[i] ? src[i] : dst[i] (and > for max)
+void vec_min_f32(uint8_t*, const uint8_t*, uint16_t);
+void vec_max_f32(uint8_t*, const uint8_t*, uint16_t);
+
+// sum of a[i], sum of a[i] * b[i]
+float vec_sum_f32(const uint8_t*, uint16_t);
+float vec_dot_f32(const uint8_t*, const uint8_t*, uint16_t);
+
+// the same for uint16 arrays
+void vec_add_u16(uint8_t*, const uint8_t*, uint16_t);
+void vec_mul_u16(uint8_t*, const uint8_t*, uint16_t);
+void vec_min_u16(uint8_t*, const uint8_t*, uint16_t);
+void vec_max_u16(uint8_t*, const uint8_t*, uint16_t);
+uint16_t vec_sum_u16(const uint8_t*, uint16_t);
+
+
+#endif
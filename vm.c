@@ -0,0 +1,478 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    vm.c
+*/
+
+
+#define _GNU_SOURCE
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define VM_HAVE_MMAP
+#endif
+
+
+#include "vm.h"
+#include "trace.h"
+
+
+// Allocate a virtual machine around a system memory, with a core for each of
+// its stack slices.
+vm_t* vm_wrap(sysmem_t *smem, const instr_table_t *itab) {
+    uint8_t n_cores = smem->n_cores;
+    vm_t *vm = calloc(1, sizeof(vm_t));
+    vm->smem = smem;
+    vm->n_cores = n_cores;
+    vm->cores = calloc(n_cores, sizeof(core_t*));
+    vm->threads = calloc(n_cores, sizeof(pthread_t));
+    for (uint8_t i = 0; i < n_cores; i++) {
+        core_t *core = core_init(i, vm->smem);
+        core->itab = itab;
+        // carve this core's slice out of the stack space
+        core->stack_base = vm->smem->stack_start + i * vm->smem->stack_size;
+        core->stack_limit = core->stack_base + vm->smem->stack_size;
+        core->iregs[RSP] = core->stack_base;
+        vm->cores[i] = core;
+    }
+    return vm;
+}
+
+
+// Allocates a virtual machine with a number of cores that run programs 
+// encoded with a decode table.
+vm_t* vm_init(uint8_t n_cores, const instr_table_t *itab) {
+    if (n_cores == 0) {
+        return NULL;
+    }
+    sysmem_t *smem = sysmem_init(n_cores);
+    return smem ? vm_wrap(smem, itab) : NULL;
+}
+
+
+// Frees the virtual machine, its memory, its cores and their instruction 
+// caches, counters and traces.
+void vm_delete(vm_t *vm) {
+    if (!vm) {
+        return;
+    }
+    for (uint8_t i = 0; i < vm->n_cores; i++) {
+        icache_delete(vm->cores[i]->icache);
+        free(vm->cores[i]->stats);
+        trace_delete(vm->cores[i]->trace);
+        core_delete(vm->cores[i]);
+    }
+    free(vm->cores);
+    free(vm->threads);
+    sysmem_delete(vm->smem);
+    free(vm);
+}
+
+
+// Puts every core back at the start of the read only block with cleared 
+// registers, an empty stack and no status.
+void vm_reset(vm_t *vm) {
+    for (uint8_t i = 0; i < vm->n_cores; i++) {
+        core_reset(vm->cores[i]);
+    }
+}
+
+
+// Thread entry point, runs one core to completion.
+void* vm_thread(void *arg) {
+    core_run((core_t*) arg);
+    return NULL;
+}
+
+
+// Pins a thread to a host CPU (only supported on Linux, ignored elsewhere).
+void vm_pin_thread(pthread_t thread, uint8_t cid) {
+#if defined(__linux__)
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_cpus > 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cid % n_cpus, &set);
+        pthread_setaffinity_np(thread, sizeof(set), &set);
+    }
+#else
+    (void) thread;
+    (void) cid;
+#endif
+}
+
+
+// Runs every core on its own host thread until all of them have set their
+// status code. Returns 0, or -1 if a thread could not be started (the cores 
+// that were started have finished by the time it returns).
+int vm_run(vm_t *vm) {
+    uint8_t started = 0;
+    for (; started < vm->n_cores; started++) {
+        if (pthread_create(&vm->threads[started], NULL, &vm_thread, vm->cores[started])) {
+            break;
+        }
+        if (vm->pin) {
+            vm_pin_thread(vm->threads[started], started);
+        }
+    }
+    for (uint8_t i = 0; i < started; i++) {
+        pthread_join(vm->threads[i], NULL);
+    }
+    return started == vm->n_cores ? 0 : -1;
+}
+
+
+// Freezes the memory and core states of a virtual machine (which should not be
+// running) so that it can be forked.
+vm_snapshot_t* vm_snapshot(const vm_t *vm) {
+    vm_snapshot_t *snap = calloc(1, sizeof(vm_snapshot_t));
+    snap->mem = sysmem_snapshot(vm->smem);
+    snap->cores = aligned_alloc(CORE_ALIGN, vm->n_cores * sizeof(core_t));
+    if (!snap->mem || !snap->cores) {
+        vm_snapshot_delete(snap);
+        return NULL;
+    }
+    snap->n_cores = vm->n_cores;
+    for (uint8_t i = 0; i < vm->n_cores; i++) {
+        snap->cores[i] = *vm->cores[i];
+        snap->cores[i].smem = NULL;
+        snap->cores[i].icache = NULL;
+        snap->cores[i].stats = NULL;
+        snap->cores[i].trace = NULL;
+    }
+    return snap;
+}
+
+
+// Frees a snapshot (machines forked from it are not affected).
+void vm_snapshot_delete(vm_snapshot_t *snap) {
+    if (!snap) {
+        return;
+    }
+    sysmem_snapshot_delete(snap->mem);
+    free(snap->cores);
+    free(snap);
+}
+
+
+// Creates a virtual machine from a snapshot. Its memory starts out shared 
+// with the snapshot and a page is copied the first time the new machine 
+// writes to it. The cores continue from where the snapshot left them, without
+// instruction caches, counters or traces.
+vm_t* vm_fork(const vm_snapshot_t *snap) {
+    sysmem_t *smem = sysmem_clone(snap->mem, snap->n_cores);
+    if (!smem) {
+        return NULL;
+    }
+    vm_t *vm = vm_wrap(smem, snap->cores[0].itab);
+    for (uint8_t i = 0; i < vm->n_cores; i++) {
+        *vm->cores[i] = snap->cores[i];
+        vm->cores[i]->smem = smem;
+    }
+    return vm;
+}
+
+
+// Run-length encodes (PackBits) n bytes, returns the encoded length or 0 if 
+// it would not be smaller than n.
+uint32_t vm_pack(const uint8_t *src, uint32_t n, uint8_t *dst) {
+    uint32_t i = 0, o = 0;
+    while (i < n) {
+        uint32_t run = 1;
+        while (i + run < n && run < 130 && src[i + run] == src[i]) {
+            run++;
+        }
+        if (run >= 3) {
+            if (o + 2 >= n) {
+                return 0;
+            }
+            dst[o++] = (uint8_t) (run + 125);
+            dst[o++] = src[i];
+            i += run;
+            continue;
+        }
+        // literals up to the start of the next run of 3 or more
+        uint32_t lit = 1;
+        while (i + lit < n && lit < 128 
+               && !(i + lit + 2 < n && src[i + lit] == src[i + lit + 1] && src[i + lit] == src[i + lit + 2])) {
+            lit++;
+        }
+        if (o + 1 + lit >= n) {
+            return 0;
+        }
+        dst[o++] = (uint8_t) (lit - 1);
+        memcpy(dst + o, src + i, lit);
+        o += lit;
+        i += lit;
+    }
+    return o;
+}
+
+
+// Expands len bytes of run-length encoded data into exactly n bytes, returns
+// 0 on success or -1 if the data is malformed.
+int vm_unpack(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t n) {
+    uint32_t i = 0, o = 0;
+    while (i < len) {
+        uint8_t c = src[i++];
+        if (c < 128) {
+            if (i + c + 1 > len || o + c + 1 > n) {
+                return -1;
+            }
+            memcpy(dst + o, src + i, c + 1);
+            i += c + 1;
+            o += c + 1;
+        } else {
+            if (i >= len || o + c - 125 > n) {
+                return -1;
+            }
+            memset(dst + o, src[i++], c - 125);
+            o += c - 125;
+        }
+    }
+    return o == n ? 0 : -1;
+}
+
+
+// Bytes of memory in a checkpoint block.
+uint32_t vm_block_len(uint32_t block) {
+    uint32_t start = block * VM_CKPT_BLOCKSIZE;
+    return MEMORY_MAPSIZE - start < VM_CKPT_BLOCKSIZE ? MEMORY_MAPSIZE - start : VM_CKPT_BLOCKSIZE;
+}
+
+
+// Saves the state of a virtual machine (which should not be running) to a 
+// checkpoint file, optionally compressing its memory. Returns 0 on success.
+int vm_save(const vm_t *vm, const char *path, int compress) {
+    static const uint8_t zero[VM_CKPT_BLOCKSIZE];
+    const sysmem_t *smem = vm->smem;
+    uint16_t blocks[VM_CKPT_NBLOCKS];
+    uint32_t lens[VM_CKPT_NBLOCKS], offsets[VM_CKPT_NBLOCKS];
+    uint8_t kinds[VM_CKPT_NBLOCKS];
+    uint8_t *packed = compress ? malloc((size_t) VM_CKPT_NBLOCKS * VM_CKPT_BLOCKSIZE) : NULL;
+    if (compress && !packed) {
+        return -1;
+    }
+
+    // blocks that are not all zero, compressed where that makes them smaller
+    uint16_t n_blocks = 0;
+    for (uint32_t b = 0; b < VM_CKPT_NBLOCKS; b++) {
+        const uint8_t *p = smem->mem + b * VM_CKPT_BLOCKSIZE;
+        uint32_t len = vm_block_len(b);
+        if (!memcmp(p, zero, len)) {
+            continue;
+        }
+        uint32_t plen = compress ? vm_pack(p, len, packed + (size_t) n_blocks * VM_CKPT_BLOCKSIZE) : 0;
+        blocks[n_blocks] = (uint16_t) b;
+        kinds[n_blocks] = plen ? VM_CKPT_PACKED : VM_CKPT_RAW;
+        lens[n_blocks] = plen ? plen : VM_CKPT_BLOCKSIZE;
+        n_blocks++;
+    }
+
+    // layout: header, cores, block table, compressed blocks, raw blocks last
+    uint32_t head = VM_CKPT_HEADERSIZE + vm->n_cores * VM_CKPT_CORESIZE + n_blocks * VM_CKPT_ENTRYSIZE;
+    uint32_t pos = head;
+    for (uint16_t i = 0; i < n_blocks; i++) {
+        if (kinds[i] == VM_CKPT_PACKED) {
+            offsets[i] = pos;
+            pos += lens[i];
+        }
+    }
+    uint32_t raw_offset = (pos + VM_CKPT_BLOCKSIZE - 1) / VM_CKPT_BLOCKSIZE * VM_CKPT_BLOCKSIZE;
+    pos = raw_offset;
+    for (uint16_t i = 0; i < n_blocks; i++) {
+        if (kinds[i] == VM_CKPT_RAW) {
+            offsets[i] = pos;
+            pos += VM_CKPT_BLOCKSIZE;
+        }
+    }
+
+    uint8_t *h = calloc(1, head);
+    if (!h) {
+        free(packed);
+        return -1;
+    }
+    uint16_t version = VM_CKPT_VERSION;
+    memcpy(h, VM_CKPT_MAGIC, 4);
+    memcpy(h + 0x04, &version, 2);
+    h[0x08] = vm->n_cores;
+    memcpy(h + 0x0A, &n_blocks, 2);
+    memcpy(h + 0x0C, &smem->stack_start, 2);
+    memcpy(h + 0x0E, &smem->stack_size, 2);
+    memcpy(h + 0x10, smem->pages, sizeof(smem->pages));
+    for (uint8_t i = 0; i < vm->n_cores; i++) {
+        const core_t *core = vm->cores[i];
+        uint8_t *r = h + VM_CKPT_HEADERSIZE + i * VM_CKPT_CORESIZE;
+        memcpy(r, core->iregs, 16);
+        memcpy(r + 0x10, core->fregs, 20);
+        r[0x24] = (uint8_t) core->rcmp;
+        r[0x25] = (uint8_t) core->stc;
+        memcpy(r + 0x26, &core->fault_pc, 2);
+        memcpy(r + 0x28, &core->stack_base, 2);
+        memcpy(r + 0x2A, &core->stack_limit, 2);
+    }
+    for (uint16_t i = 0; i < n_blocks; i++) {
+        uint8_t *e = h + VM_CKPT_HEADERSIZE + vm->n_cores * VM_CKPT_CORESIZE + i * VM_CKPT_ENTRYSIZE;
+        uint16_t kind = kinds[i];
+        memcpy(e, &blocks[i], 2);
+        memcpy(e + 2, &kind, 2);
+        memcpy(e + 4, &offsets[i], 4);
+        memcpy(e + 8, &lens[i], 4);
+    }
+
+    // written next to the target and renamed over it, so that a machine 
+    // restored from (and still mapping) the old file keeps its memory
+    size_t path_len = strlen(path);
+    char *tmp = malloc(path_len + 5);
+    if (tmp) {
+        memcpy(tmp, path, path_len);
+        memcpy(tmp + path_len, ".tmp", 5);
+    }
+    FILE *f = tmp ? fopen(tmp, "wb") : NULL;
+    int ok = f != NULL;
+    ok = ok && fwrite(h, 1, head, f) == head;
+    pos = head;
+    for (uint16_t i = 0; ok && i < n_blocks; i++) {
+        if (kinds[i] == VM_CKPT_PACKED) {
+            ok = fwrite(packed + (size_t) i * VM_CKPT_BLOCKSIZE, 1, lens[i], f) == lens[i];
+            pos += lens[i];
+        }
+    }
+    ok = ok && fwrite(zero, 1, raw_offset - pos, f) == raw_offset - pos;
+    for (uint16_t i = 0; ok && i < n_blocks; i++) {
+        if (kinds[i] == VM_CKPT_RAW) {
+            // a short last block is padded so that every raw block is whole
+            const uint8_t *p = smem->mem + blocks[i] * VM_CKPT_BLOCKSIZE;
+            uint32_t len = vm_block_len(blocks[i]);
+            ok = fwrite(p, 1, len, f) == len;
+            ok = ok && fwrite(zero, 1, VM_CKPT_BLOCKSIZE - len, f) == VM_CKPT_BLOCKSIZE - len;
+        }
+    }
+    ok = f && fclose(f) == 0 && ok;
+    ok = ok && rename(tmp, path) == 0;
+    if (f && !ok) {
+        remove(tmp);
+    }
+    free(tmp);
+    free(h);
+    free(packed);
+    return ok ? 0 : -1;
+}
+
+
+// Loads a raw block of a checkpoint into memory, mapping it where possible
+// and reading it otherwise.
+int vm_load_block(sysmem_t *smem, FILE *f, uint32_t block, uint32_t offset) {
+    uint8_t *p = smem->mem + block * VM_CKPT_BLOCKSIZE;
+    uint32_t len = vm_block_len(block);
+#if defined(VM_HAVE_MMAP)
+    long page = sysconf(_SC_PAGESIZE);
+    if (smem->mem_kind == SYSMEM_MAPPED && len == VM_CKPT_BLOCKSIZE && page > 0
+        && VM_CKPT_BLOCKSIZE % page == 0 && offset % page == 0) {
+        void *m = mmap(p, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno(f), offset);
+        if (m != MAP_FAILED) {
+            return 0;
+        }
+    }
+#endif
+    if (fseek(f, offset, SEEK_SET) || fread(p, 1, len, f) != len) {
+        return -1;
+    }
+    return 0;
+}
+
+
+// Creates a virtual machine from a checkpoint file, with cores that run 
+// programs encoded with a decode table. Returns NULL if the file cannot be 
+// read or is not a valid checkpoint of a supported version.
+vm_t* vm_restore(const char *path, const instr_table_t *itab) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return NULL;
+    }
+    uint8_t h[VM_CKPT_HEADERSIZE];
+    uint16_t version, n_blocks;
+    if (fread(h, 1, VM_CKPT_HEADERSIZE, f) != VM_CKPT_HEADERSIZE || memcmp(h, VM_CKPT_MAGIC, 4)) {
+        fclose(f);
+        return NULL;
+    }
+    memcpy(&version, h + 0x04, 2);
+    memcpy(&n_blocks, h + 0x0A, 2);
+    uint8_t n_cores = h[0x08];
+    uint32_t rest = n_cores * VM_CKPT_CORESIZE + n_blocks * VM_CKPT_ENTRYSIZE;
+    uint8_t *r = version == VM_CKPT_VERSION && n_cores && n_blocks <= VM_CKPT_NBLOCKS ? malloc(rest) : NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, VM_CKPT_HEADERSIZE, SEEK_SET);
+    sysmem_t *smem = r && fread(r, 1, rest, f) == rest ? sysmem_init(n_cores) : NULL;
+    if (!smem) {
+        free(r);
+        fclose(f);
+        return NULL;
+    }
+    // the memory checks trust the run ends of the page table, so they are 
+    // recomputed rather than taken from the file, and the stack layout has 
+    // to be the one they give
+    uint16_t stack_start, stack_size;
+    memcpy(smem->pages, h + 0x10, sizeof(smem->pages));
+    memcpy(&stack_start, h + 0x0C, 2);
+    memcpy(&stack_size, h + 0x0E, 2);
+    int ok = smem->pages[MEMORY_NPAGES] == 0;
+    sysmem_find_runs(smem);
+    ok = ok && smem->stack_start == stack_start && smem->stack_size == stack_size;
+    uint32_t stack_top = (uint32_t) stack_start + n_cores * stack_size;
+    vm_t *vm = vm_wrap(smem, itab);
+
+    for (uint8_t i = 0; i < n_cores; i++) {
+        core_t *core = vm->cores[i];
+        const uint8_t *c = r + i * VM_CKPT_CORESIZE;
+        memcpy(core->iregs, c, 16);
+        memcpy(core->fregs, c + 0x10, 20);
+        core->rcmp = (cmpres_t) c[0x24];
+        core->stc = (errcode_t) c[0x25];
+        memcpy(&core->fault_pc, c + 0x26, 2);
+        memcpy(&core->stack_base, c + 0x28, 2);
+        memcpy(&core->stack_limit, c + 0x2A, 2);
+        ok = ok && c[0x24] <= LT && c[0x25] < N_ERRCODES && core->stack_base >= stack_start 
+             && core->stack_base <= core->stack_limit && core->stack_limit <= stack_top
+             && core->iregs[RSP] >= core->stack_base && core->iregs[RSP] <= core->stack_limit;
+    }
+    uint8_t *packed = malloc(VM_CKPT_BLOCKSIZE);
+    for (uint16_t i = 0; ok && i < n_blocks; i++) {
+        const uint8_t *e = r + n_cores * VM_CKPT_CORESIZE + i * VM_CKPT_ENTRYSIZE;
+        uint16_t block, kind;
+        uint32_t offset, len;
+        memcpy(&block, e, 2);
+        memcpy(&kind, e + 2, 2);
+        memcpy(&offset, e + 4, 4);
+        memcpy(&len, e + 8, 4);
+        ok = block < VM_CKPT_NBLOCKS && len <= VM_CKPT_BLOCKSIZE && (long) offset <= size && len <= size - offset;
+        if (ok && kind == VM_CKPT_RAW) {
+            ok = len == VM_CKPT_BLOCKSIZE && vm_load_block(smem, f, block, offset) == 0;
+        } else if (ok && kind == VM_CKPT_PACKED) {
+            ok = packed && fseek(f, offset, SEEK_SET) == 0 && fread(packed, 1, len, f) == len
+                 && vm_unpack(packed, len, smem->mem + block * VM_CKPT_BLOCKSIZE, vm_block_len(block)) == 0;
+        } else {
+            ok = 0;
+        }
+    }
+    free(packed);
+    free(r);
+    fclose(f);
+    if (!ok) {
+        vm_delete(vm);
+        return NULL;
+    }
+    return vm;
+}
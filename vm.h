@@ -0,0 +1,156 @@
+/*
+    C16_VM_v3
+    Dylan H. Ross
+    2018/03/25
+    
+    The third (and I pray final) iteration of my toy 16-bit virtual machine.
+    
+    vm.h
+*/
+
+
+#ifndef VM_H
+#define VM_H
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+
+#include "memory.h"
+#include "cpu.h"
+
+
+/*
+A virtual machine is one system memory shared by a number of cores, each of
+which runs on its own host thread. Every core gets its own slice of the stack
+space (sysmem_t.stack_size bytes, in order of core ID) and pushes, pops, calls
+and returns are checked against the bounds of that slice.
+
+Cores only share the memory itself. An instruction cache fills in lazily as it
+runs, so a core that uses one needs its own.
+*/
+
+
+// virtual machine data structure
+typedef struct vm {
+    sysmem_t *smem;         // shared system memory
+    uint8_t n_cores;
+    core_t **cores;         // cores[cid]
+    pthread_t *threads;     // host thread running each core
+    uint8_t pin;            // pin core i to host CPU i (mod number of CPUs)
+} vm_t;
+
+
+// Allocates a virtual machine with a number of cores that run programs 
+// encoded with a decode table.
+vm_t* vm_init(uint8_t, const instr_table_t*);
+
+
+// Allocates a virtual machine around a system memory (which it takes over), 
+// with a core for each of its stack slices. This is how a VM gets a layout 
+// other than the default one (see sysmem_protect).
+vm_t* vm_wrap(sysmem_t*, const instr_table_t*);
+
+
+// Frees the virtual machine, its memory, its cores and their instruction 
+// caches, counters and traces.
+void vm_delete(vm_t*);
+
+
+// Puts every core back at the start of the read only block with cleared 
+// registers, an empty stack and no status.
+void vm_reset(vm_t*);
+
+
+// Runs every core on its own host thread until all of them have set their
+// status code. Returns 0, or -1 if a thread could not be started (the cores 
+// that were started have finished by the time it returns).
+int vm_run(vm_t*);
+
+
+/*
+Forking: a snapshot freezes the memory and core states of a machine, and any 
+number of new machines can be forked from it. A forked machine's memory is a
+copy-on-write clone of the snapshot (see sysmem_snapshot), so forking costs a
+mapping rather than a copy, and only the pages a child writes get duplicated.
+*/
+typedef struct vm_snapshot {
+    sysmem_snap_t *mem;
+    uint8_t n_cores;
+    core_t *cores;          // core states (without memory or caches)
+} vm_snapshot_t;
+
+
+// Freezes the memory and core states of a virtual machine (which should not be
+// running) so that it can be forked.
+vm_snapshot_t* vm_snapshot(const vm_t*);
+
+
+// Frees a snapshot (machines forked from it are not affected).
+void vm_snapshot_delete(vm_snapshot_t*);
+
+
+// Creates a virtual machine from a snapshot. The cores continue from where the
+// snapshot left them, without instruction caches, counters or traces.
+vm_t* vm_fork(const vm_snapshot_t*);
+
+
+/*
+Checkpoints: the state of a machine that is not running (memory, page table,
+stack layout and the registers, rcmp, status and fault address of every core)
+saved to a file it can be restored from later, e.g. to resume a long run in 
+another process. Format (version 1, host byte order like the memory itself, so
+a checkpoint is restored on a host of the same byte order):
+    0x00  magic "C16S"
+    0x04  u16 version
+    0x06  u16 flags (reserved, 0)
+    0x08  u8 number of cores, u8 0
+    0x0A  u16 number of saved blocks
+    0x0C  u16 stack_start
+    0x0E  u16 stack_size
+    0x10  page table (MEMORY_NPAGES + 1 u16, see sysmem_t)
+followed by a record of VM_CKPT_CORESIZE bytes for each core:
+    u16 iregs[8], f32 fregs[5], u8 rcmp, u8 stc, u16 fault_pc, 
+    u16 stack_base, u16 stack_limit
+and a table entry of VM_CKPT_ENTRYSIZE bytes for each saved block:
+    u16 block, u16 encoding (0: raw, 1: run-length), u32 file offset, 
+    u32 bytes in the file
+Memory (MEMORY_MAPSIZE bytes) is saved in blocks of VM_CKPT_BLOCKSIZE bytes, 
+and blocks that are all zero are left out since a restored memory starts out 
+zeroed. Raw blocks sit at block aligned offsets after everything else, so 
+restoring maps them straight into the memory of the new machine (private, so 
+writes stay local). With compression, a block is run-length encoded if that 
+makes it smaller (PackBits: a control byte c < 128 is followed by c + 1 
+literal bytes, c >= 128 by one byte repeated c - 125 times); those blocks are
+read and expanded instead.
+*/
+#define VM_CKPT_MAGIC       "C16S"
+#define VM_CKPT_VERSION     1
+#define VM_CKPT_HEADERSIZE  (0x10 + 2 * (MEMORY_NPAGES + 1))
+#define VM_CKPT_CORESIZE    44
+#define VM_CKPT_ENTRYSIZE   12
+#define VM_CKPT_BLOCKSIZE   4096
+#define VM_CKPT_NBLOCKS     ((MEMORY_MAPSIZE + VM_CKPT_BLOCKSIZE - 1) / VM_CKPT_BLOCKSIZE)
+#define VM_CKPT_RAW         0
+#define VM_CKPT_PACKED      1
+
+
+// Saves the state of a virtual machine (which should not be running) to a 
+// checkpoint file, optionally compressing its memory. The file is replaced
+// (written as <path>.tmp and renamed), never rewritten in place, so machines
+// restored from an earlier checkpoint at the same path are not affected.
+// Returns 0 on success.
+int vm_save(const vm_t*, const char*, int);
+
+
+// Creates a virtual machine from a checkpoint file, with cores that run 
+// programs encoded with a decode table (the one the saved machine used). The
+// cores continue from where they were saved, without instruction caches, 
+// counters or traces. Returns NULL if the file cannot be read or is not a 
+// valid checkpoint of a supported version.
+vm_t* vm_restore(const char*, const instr_table_t*);
+
+
+#endif